@@ -1,134 +1,381 @@
 #pragma once
 
 #include <windows.h> // For Windows API functions and types
+#include <immintrin.h> // _mm_popcnt_u64
+#include <vector>
+#include <algorithm>
 #include "types.h"
 #include "memory_pool.h"
 
 #include "tracy\public\tracy\Tracy.hpp"
 #include "tracy\public\tracy\TracyOpenGL.hpp"
+
+#pragma comment(lib, "Synchronization.lib") // WaitOnAddress
 namespace thread_pool
 {
     // Function signature for the thread function
     typedef void (*thread_work_func)(void *data, u32 thread_id, mpool::memory_pool *thread_memory);
 
+    // Lanes, most urgent first. Workers always drain a lane before looking at the next, so the frame
+    // chain (hash rebuild, force pass, matrices) runs ahead of whatever background work is queued.
+    enum PRIORITY
+    {
+        PRIORITY_FRAME,      // On the frame's critical path, the default
+        PRIORITY_NORMAL,     // Needed soon but not by this frame
+        PRIORITY_BACKGROUND, // Compression, baking, IO. At most a quarter of the workers run it at once
+        PRIORITY_LEVELS
+    };
+
+    // Completion counter for a batch of work. add_work bumps it, the worker that finishes an item drops
+    // it, and wait() returns once it reaches zero. Batches are independent, so several can be in flight
+    // at once and a task can add and wait on a sub-batch of its own. Items go to the batch's lane, and a
+    // sub-batch never outranks the item that queues it: a job{} added from a background item runs in
+    // the background lane.
+    struct job
+    {
+        volatile LONG pending; // Items added and not yet finished
+        u32 priority;          // PRIORITY lane of the batch's items
+    };
+
     struct work_data
     {
         thread_work_func func; // Function to be executed by the thread
         void *data;            // Data to be passed to the function
-        u32 priority;          // Priority of the work item (higher values = higher priority)
+        job *owner;            // Counter to drop when the item finishes
+    };
+
+    // Slot of the ring. sequence == position when the slot is free for the producer claiming that
+    // position, position + 1 once the item is published for the consumer at that position.
+    struct work_slot
+    {
+        volatile LONG sequence;
+        work_data item;
     };
 
-    // Lock-free work queue - much more efficient than critical section
+    // Bounded lock-free MPMC ring (Vyukov). Positions only ever grow, so the ring never needs resetting
+    // between batches.
     struct work_queue
     {
         volatile LONG head; // Head index for producers (adding work)
         volatile LONG tail; // Tail index for consumers (getting work)
         volatile u32 size;  // Size of the queue
         volatile u32 mask;  // Bit mask for wrapping indices
-        work_data *items;   // Array of work items
+        work_slot *items;   // Array of work items
 
         // Statistics
         volatile LONG items_processed; // Total items processed
         volatile LONG items_added;     // Total items added
     };
 
+#define POOL_MAX_NODES 16
+
     struct thread_pool
     {
         HANDLE *threads;                             // Array of thread handles
         mpool::memory_pool *thread_transient_memory; // Memory pool for thread data
-        work_queue queue;                            // Lock-free work queue
+        work_queue lanes[PRIORITY_LEVELS];           // Lock-free work queues, one per PRIORITY
+        u32 queue_size;                              // Slots in each queue
         u32 num_threads;                             // Number of threads in the pool
         u32 max_threads;                             // Maximum number of threads allowed in the pool
         volatile u32 shutdown;                       // Flag to indicate if the pool is shutting down
 
+        // NUMA: workers are split into contiguous runs of thread ids per node. Work added for a node
+        // goes to its queue, which that node's workers drain before the shared queue and other nodes.
+        u32 num_nodes;                            // NUMA nodes with processors, 1 on most desktops
+        USHORT node_numbers[POOL_MAX_NODES];      // OS node number of each pool node
+        GROUP_AFFINITY node_affinity[POOL_MAX_NODES];
+        work_queue node_queues[POOL_MAX_NODES];   // Only allocated when num_nodes > 1
+        u32 *thread_nodes;                        // Pool node of each worker
+
         // Synchronization primitives
-        HANDLE workCompleteEvent;     // Event signaled when all work is complete
-        HANDLE workAvailableEvent;    // Event signaled when work is available
-        volatile LONG spinlock;       // Simple atomic spinlock for rare contention cases
+        HANDLE workAvailableEvent;    // Event signaled when work is available, polling mode only
         volatile LONG active_threads; // Count of actively working threads
+        volatile LONG background_running; // Items of the background lane currently running
+        LONG max_background;              // Cap on background_running
+
+        // Parking lot. Idle workers sleep in WaitOnAddress on work_epoch, which every queued item bumps,
+        // and each item wakes at most one of them. Clear parking to fall back to the old event polling.
+        volatile LONG work_epoch;
+        volatile LONG parked; // Workers asleep on work_epoch
+        volatile u32 parking;
+        LONGLONG spin_limit;  // Longest spin before parking, in performance counter ticks
+        LONGLONG min_spin;    // Spin every idle worker does first, catches back to back batches
     };
 
     thread_pool *g_thread_pool = nullptr;
 
-    // Fast spinlock implementation for infrequent contention cases
-    static void acquire_spinlock(volatile LONG *lock)
+    // Pool worker id of the calling thread, THREAD_ID_MAIN for threads outside the pool
+#define THREAD_ID_MAIN 0xFFFFFFFF
+    static thread_local u32 t_thread_id = THREAD_ID_MAIN;
+    // PRIORITY of the item the calling thread is running, PRIORITY_FRAME outside of one
+    static thread_local u32 t_priority = PRIORITY_FRAME;
+
+    // Signed distance between two ring positions, correct across wraparound
+    static inline LONG position_diff(LONG a, LONG b)
+    {
+        return (LONG)((ULONG)a - (ULONG)b);
+    }
+
+    static LONGLONG ticks()
     {
-        while (InterlockedExchange(lock, 1) != 0)
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        return now.QuadPart;
+    }
+
+    // Wakes up to count parked workers, one per newly runnable item
+    static void notify_workers(u32 count)
+    {
+        if (!g_thread_pool->parking)
+        {
+            SetEvent(g_thread_pool->workAvailableEvent);
+            return;
+        }
+        InterlockedIncrement(&g_thread_pool->work_epoch);
+        const LONG parked = g_thread_pool->parked;
+        for (LONG i = 0; i < (LONG)count && i < parked; ++i)
         {
-            // Use pause instruction to improve spinning efficiency
-            YieldProcessor();
+            WakeByAddressSingle((PVOID)&g_thread_pool->work_epoch);
         }
     }
 
-    static void release_spinlock(volatile LONG *lock)
+    // Wakes every worker whichever way it is waiting, for shutdown and mode changes
+    static void wake_all_workers()
     {
-        InterlockedExchange(lock, 0);
+        SetEvent(g_thread_pool->workAvailableEvent);
+        InterlockedIncrement(&g_thread_pool->work_epoch);
+        WakeByAddressAll((PVOID)&g_thread_pool->work_epoch);
     }
 
-    static bool queue_try_add(work_queue *q, thread_work_func func, void *data, u32 priority = 0)
+    static void queue_init(work_queue *q, u32 size)
     {
-        // Use InterlockedIncrement to atomically get the next head position
-        LONG index = InterlockedIncrement(&q->head) - 1;
-        u32 slot = index & q->mask;
+        *q = {};
+        q->size = size;
+        q->mask = size - 1;
+        q->items = (work_slot *)malloc(sizeof(work_slot) * size);
+        for (u32 i = 0; q->items && i < size; ++i)
+        {
+            q->items[i].sequence = (LONG)i;
+        }
+    }
 
-        // Set up the work item
-        q->items[slot].func = func;
-        q->items[slot].data = data;
-        q->items[slot].priority = priority;
+    // Returns false when the ring is full
+    static bool queue_try_add(work_queue *q, const work_data *item)
+    {
+        LONG position = q->head;
+        work_slot *slot;
+        for (;;)
+        {
+            slot = &q->items[position & q->mask];
+            const LONG diff = position_diff(slot->sequence, position);
+            if (diff == 0)
+            {
+                const LONG seen = InterlockedCompareExchange(&q->head, position + 1, position);
+                if (seen == position)
+                {
+                    break;
+                }
+                position = seen;
+            }
+            else if (diff < 0)
+            {
+                return false; // The consumer a lap behind has not freed this slot yet
+            }
+            else
+            {
+                position = q->head;
+            }
+        }
+        slot->item = *item;
+        InterlockedExchange(&slot->sequence, position + 1); // Publish
 
         // Track statistics
         InterlockedIncrement(&q->items_added);
 
         // Signal that work is available
-        SetEvent(g_thread_pool->workAvailableEvent);
+        notify_workers(1);
 
         return true;
     }
-    // Try to get work using atomic operations
-    static work_data *queue_try_get(work_queue *q)
+
+    // Copies the oldest item out, the slot is handed back to producers straight away
+    static bool queue_try_get(work_queue *q, work_data *out)
     {
-        // Check if any work is available (compare head and tail)
-        if (q->tail >= q->head)
+        LONG position = q->tail;
+        work_slot *slot;
+        for (;;)
         {
-            return nullptr; // No work available
+            slot = &q->items[position & q->mask];
+            const LONG diff = position_diff(slot->sequence, position + 1);
+            if (diff == 0)
+            {
+                const LONG seen = InterlockedCompareExchange(&q->tail, position + 1, position);
+                if (seen == position)
+                {
+                    break;
+                }
+                position = seen;
+            }
+            else if (diff < 0)
+            {
+                return false; // Empty, or the producer of this slot has not published yet
+            }
+            else
+            {
+                position = q->tail;
+            }
         }
+        *out = slot->item;
+        InterlockedExchange(&slot->sequence, position + (LONG)q->mask + 1);
+
+        // Track statistics
+        InterlockedIncrement(&q->items_processed);
+
+        return true;
+    }
+
+    static bool work_in_lane(u32 lane)
+    {
+        const work_queue *q = &g_thread_pool->lanes[lane];
+        return position_diff(q->head, q->tail) > 0;
+    }
 
-        // Use InterlockedIncrement to atomically claim the next work item
-        LONG index = InterlockedIncrement(&q->tail) - 1;
+    // Frame work, preferring work placed on the caller's NUMA node
+    static bool get_frame_work(u32 node, work_data *out)
+    {
+        const u32 num_nodes = g_thread_pool->num_nodes;
+        if (num_nodes > 1 && queue_try_get(&g_thread_pool->node_queues[node], out))
+        {
+            return true;
+        }
+        if (queue_try_get(&g_thread_pool->lanes[PRIORITY_FRAME], out))
+        {
+            return true;
+        }
+        // Steal from other nodes once local work runs out, remote memory beats idling
+        for (u32 k = 1; k < num_nodes; ++k)
+        {
+            if (queue_try_get(&g_thread_pool->node_queues[(node + k) % num_nodes], out))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
 
-        // Verify we didn't race past the head
-        if (index >= q->head)
+    // Most urgent queued item in lanes up to and including lowest. A background item is only taken
+    // while fewer than max_background are running; the taker releases the slot in run_item. A thread
+    // already inside a background item runs more on the slot it holds, so a background item waiting on
+    // its own sub-batch can always drain it.
+    static bool get_work_data(u32 node, u32 lowest, work_data *out)
+    {
+        if (get_frame_work(node, out))
+        {
+            return true;
+        }
+        if (lowest >= PRIORITY_NORMAL && queue_try_get(&g_thread_pool->lanes[PRIORITY_NORMAL], out))
+        {
+            return true;
+        }
+        if (lowest >= PRIORITY_BACKGROUND && work_in_lane(PRIORITY_BACKGROUND))
         {
-            InterlockedDecrement(&q->tail); // Undo our increment
-            return nullptr;
+            if (InterlockedIncrement(&g_thread_pool->background_running) <= g_thread_pool->max_background ||
+                t_priority == PRIORITY_BACKGROUND)
+            {
+                if (queue_try_get(&g_thread_pool->lanes[PRIORITY_BACKGROUND], out))
+                {
+                    return true;
+                }
+            }
+            InterlockedDecrement(&g_thread_pool->background_running);
         }
+        return false;
+    }
 
-        u32 slot = index & q->mask;
+    // Check if any work a worker could take remains - optimized to avoid locking. Background work
+    // waiting on the cap does not count, so idle workers park instead of spinning on it.
+    static u32 work_remaining()
+    {
+        ZoneScoped;
+        if (work_in_lane(PRIORITY_FRAME) || work_in_lane(PRIORITY_NORMAL))
+        {
+            return 1;
+        }
+        if (work_in_lane(PRIORITY_BACKGROUND) && g_thread_pool->background_running < g_thread_pool->max_background)
+        {
+            return 1;
+        }
+        for (u32 n = 0; n < g_thread_pool->num_nodes && g_thread_pool->num_nodes > 1; ++n)
+        {
+            if (position_diff(g_thread_pool->node_queues[n].head, g_thread_pool->node_queues[n].tail) > 0)
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
 
-        // Track statistics
-        InterlockedIncrement(&q->items_processed);
+    // Memory for work run by threads outside the pool
+    static mpool::memory_pool *main_thread_memory()
+    {
+        static mpool::memory_pool pool = mpool::allocate(MEGABYTES(1));
+        return &pool;
+    }
 
-        return &q->items[slot];
+    // The calling thread's transient pool. Helpers that queue a batch take its task array here between
+    // mpool::get_mark and mpool::rewind, so concurrent and nested callers each get their own; items run
+    // while the helper waits allocate above the array and rewind before it does.
+    static mpool::memory_pool *transient_memory()
+    {
+        return t_thread_id == THREAD_ID_MAIN ? main_thread_memory() : &g_thread_pool->thread_transient_memory[t_thread_id];
     }
 
-    // Get work from the queue
-    static work_data *get_work_data()
+    // Runs one item on the calling thread. The transient pool is rewound to where it was afterwards
+    // rather than reset first, so an item run while its thread waits inside another keeps the outer
+    // item's allocations intact.
+    static void run_item(const work_data *item)
     {
-        work_data *item = queue_try_get(&g_thread_pool->queue);
-        if (item)
+        const u32 thread_id = t_thread_id;
+        mpool::memory_pool *memory = transient_memory();
+        const mpool::pool_mark mark = mpool::get_mark(memory);
+        const u32 outer_priority = t_priority;
+        t_priority = item->owner ? item->owner->priority : outer_priority;
+        item->func(item->data, thread_id, memory);
+        t_priority = outer_priority;
+        mpool::rewind(memory, mark);
+        const bool background = item->owner && item->owner->priority == PRIORITY_BACKGROUND;
+        if (item->owner && InterlockedDecrement(&item->owner->pending) == 0)
         {
-            // Mark thread as active when it gets work
-            return item;
+            // Only the address is used, so this is safe even if the waiter has already returned and
+            // the job is gone
+            WakeByAddressAll((PVOID)&item->owner->pending);
         }
+        if (background)
+        {
+            InterlockedDecrement(&g_thread_pool->background_running);
+            if (work_in_lane(PRIORITY_BACKGROUND))
+            {
+                notify_workers(1); // A parked worker can take the freed slot
+            }
+        }
+    }
 
-        return nullptr; // No work available
+    // Node whose queue the calling thread drains first
+    static u32 current_node()
+    {
+        return t_thread_id == THREAD_ID_MAIN ? 0 : g_thread_pool->thread_nodes[t_thread_id];
     }
 
-    // Check if any work remains - optimized to avoid locking
-    static u32 work_remaining()
+    // Execute the next work item in lanes up to lowest (for main thread participation)
+    static bool execute_next_work_item(u32 lowest = PRIORITY_BACKGROUND)
     {
-        ZoneScoped;
-        return g_thread_pool->queue.tail < g_thread_pool->queue.head;
+        work_data item;
+        if (get_work_data(current_node(), lowest, &item))
+        {
+            run_item(&item);
+            return true;
+        }
+        return false;
     }
 
     // Thread function that continuously checks for work and executes it
@@ -171,36 +418,61 @@ namespace thread_pool
         }
     }
 
+    // Sleeps until work is queued. parked is raised before work is checked, so an item queued after
+    // the check either changes the epoch first or sees the worker parked and wakes it.
+    static void park_worker()
+    {
+        const LONG epoch = g_thread_pool->work_epoch;
+        InterlockedIncrement(&g_thread_pool->parked);
+        if (!work_remaining() && !g_thread_pool->shutdown)
+        {
+            LONG seen = epoch;
+            WaitOnAddress(&g_thread_pool->work_epoch, &seen, sizeof(LONG), INFINITE);
+        }
+        InterlockedDecrement(&g_thread_pool->parked);
+    }
+
+    // Spin budget learned from how long this worker has recently waited for work. Within a frame
+    // batches arrive microseconds apart and spinning catches them; between frames the gap is a whole
+    // frame and the worker parks straight away.
+    static LONGLONG spin_budget(LONGLONG expected_gap)
+    {
+        const LONGLONG budget = expected_gap * 2;
+        return budget <= g_thread_pool->spin_limit ? max(budget, g_thread_pool->min_spin) : g_thread_pool->min_spin;
+    }
+
     static DWORD WINAPI thread_function(LPVOID param)
     {
         ZoneScoped;
-        u32 thread_id = (u32)param; // Get the thread ID from the parameter
+        u32 thread_id = (u32)(uintptr_t)param; // Get the thread ID from the parameter
+        t_thread_id = thread_id;
+        const u32 node = g_thread_pool->thread_nodes[thread_id];
 
         // Thread-local variables for efficiency
         u32 spin_count = 0;
         const u32 SPIN_THRESHOLD = 1000; // How many spins before yielding
+        LONGLONG idle_since = 0;   // When the worker ran out of work, 0 while it has some
+        LONGLONG expected_gap = 0; // Moving average of recent waits for work
 
         while (!g_thread_pool->shutdown)
         {
             // Try to get work from the queue
-            work_data *curr = get_work_data();
+            work_data curr;
 
-            if (curr)
+            if (get_work_data(node, PRIORITY_BACKGROUND, &curr))
             {
                 // Reset spin count when we get work
                 spin_count = 0;
+                if (idle_since)
+                {
+                    expected_gap += (ticks() - idle_since - expected_gap) / 4;
+                    idle_since = 0;
+                }
 
                 InterlockedIncrement(&g_thread_pool->active_threads);
                 // Execute the task with thread-local memory
-                mpool::reset(&g_thread_pool->thread_transient_memory[thread_id]);
-                curr->func(curr->data, thread_id, &g_thread_pool->thread_transient_memory[thread_id]);
-
-                // Decrement active threads counter when work is complete
-                if (InterlockedDecrement(&g_thread_pool->active_threads) == 0 && !work_remaining())
-                {
-                    // Signal completion when the last thread finishes work and no work remains
-                    SetEvent(g_thread_pool->workCompleteEvent);
-                }
+                run_item(&curr);
+                InterlockedDecrement(&g_thread_pool->active_threads);
             }
             else
             {
@@ -233,14 +505,112 @@ namespace thread_pool
                     }
                 }
 #else
-                try_wait(&spin_count, SPIN_THRESHOLD); // Call to try_wait function for adaptive waiting
+                if (!g_thread_pool->parking)
+                {
+                    try_wait(&spin_count, SPIN_THRESHOLD); // Call to try_wait function for adaptive waiting
+                    continue;
+                }
+                const LONGLONG now = ticks();
+                if (!idle_since)
+                {
+                    idle_since = now;
+                }
+                if (now - idle_since < spin_budget(expected_gap))
+                {
+                    YieldProcessor();
+                }
+                else
+                {
+                    park_worker();
+                }
 #endif
             }
         }
         return 0;
     }
 
-    static u32 start_thread_pool(u32 num_threads, u32 max_work_orders)
+    // Finds the NUMA nodes that have processors. Falls back to a single node covering the process.
+    static void discover_nodes(thread_pool *pool)
+    {
+        pool->num_nodes = 0;
+        ULONG highest = 0;
+        if (GetNumaHighestNodeNumber(&highest))
+        {
+            for (ULONG n = 0; n <= highest && pool->num_nodes < POOL_MAX_NODES; ++n)
+            {
+                GROUP_AFFINITY affinity = {};
+                if (GetNumaNodeProcessorMaskEx((USHORT)n, &affinity) && affinity.Mask != 0)
+                {
+                    pool->node_numbers[pool->num_nodes] = (USHORT)n;
+                    pool->node_affinity[pool->num_nodes] = affinity;
+                    pool->num_nodes++;
+                }
+            }
+        }
+        if (pool->num_nodes == 0)
+        {
+            pool->num_nodes = 1;
+            pool->node_numbers[0] = 0;
+            pool->node_affinity[0] = {};
+        }
+    }
+
+    // Splits workers across nodes in proportion to their processors, as contiguous runs of thread ids
+    static void assign_nodes(thread_pool *pool, u32 num_threads)
+    {
+        u32 total_processors = 0;
+        for (u32 n = 0; n < pool->num_nodes; ++n)
+        {
+            total_processors += (u32)_mm_popcnt_u64((u64)pool->node_affinity[n].Mask);
+        }
+        u32 processors_before = 0;
+        for (u32 n = 0; n < pool->num_nodes; ++n)
+        {
+            const u32 processors = (u32)_mm_popcnt_u64((u64)pool->node_affinity[n].Mask);
+            const u32 first = total_processors ? (u32)((u64)num_threads * processors_before / total_processors) : 0;
+            processors_before += processors;
+            const u32 last = total_processors ? (u32)((u64)num_threads * processors_before / total_processors) : num_threads;
+            for (u32 t = first; t < last; ++t)
+            {
+                pool->thread_nodes[t] = n;
+            }
+        }
+    }
+
+    // Pins a worker to one logical processor of its node, the k-th worker of a node to its k-th
+    // processor, wrapping if the node has more workers than processors
+    static void pin_thread(thread_pool *pool, u32 thread_id)
+    {
+        const u32 node = pool->thread_nodes[thread_id];
+        const GROUP_AFFINITY *node_affinity = &pool->node_affinity[node];
+        if (node_affinity->Mask == 0)
+        {
+            return;
+        }
+        u32 index_in_node = 0;
+        while (index_in_node < thread_id && pool->thread_nodes[thread_id - index_in_node - 1] == node)
+        {
+            index_in_node++;
+        }
+        index_in_node %= (u32)_mm_popcnt_u64((u64)node_affinity->Mask);
+
+        u64 mask = (u64)node_affinity->Mask;
+        for (u32 i = 0; i < index_in_node; ++i)
+        {
+            mask &= mask - 1; // Drop the lowest processor
+        }
+        GROUP_AFFINITY affinity = {};
+        affinity.Group = node_affinity->Group;
+        affinity.Mask = (KAFFINITY)(mask & (~mask + 1)); // Lowest remaining processor
+        if (!SetThreadGroupAffinity(pool->threads[thread_id], &affinity, NULL))
+        {
+            fprintf(stderr, "Thread pool: could not pin worker %u\n", thread_id);
+        }
+    }
+
+    // Starts num_threads workers. With pin_threads each worker is bound to one logical processor of the
+    // NUMA node it serves.
+    static u32 start_thread_pool(u32 num_threads, u32 max_work_orders, bool pin_threads = true)
     {
         ZoneScoped;
         g_thread_pool = (thread_pool *)malloc(sizeof(thread_pool));
@@ -254,17 +624,18 @@ namespace thread_pool
         g_thread_pool->num_threads = num_threads;
         g_thread_pool->max_threads = num_threads;
         g_thread_pool->shutdown = 0;
-        g_thread_pool->spinlock = 0;
         g_thread_pool->active_threads = 0;
+        g_thread_pool->background_running = 0;
+        g_thread_pool->max_background = (LONG)max(num_threads / 4, (u32)1);
+        g_thread_pool->work_epoch = 0;
+        g_thread_pool->parked = 0;
+        g_thread_pool->parking = 1;
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        g_thread_pool->spin_limit = frequency.QuadPart / 10000; // 100 us
+        g_thread_pool->min_spin = frequency.QuadPart / 500000;  // 2 us
 
         // Create synchronization events
-        g_thread_pool->workCompleteEvent = CreateEvent(
-            NULL, // Default security attributes
-            TRUE, // Manual reset - stays signaled until reset
-            TRUE, // Initially signaled (no work pending)
-            NULL  // No name
-        );
-
         g_thread_pool->workAvailableEvent = CreateEvent(
             NULL,  // Default security attributes
             TRUE,  // Manual reset - stays signaled until reset
@@ -272,19 +643,18 @@ namespace thread_pool
             NULL   // No name
         );
 
-        if (!g_thread_pool->workCompleteEvent || !g_thread_pool->workAvailableEvent)
+        if (!g_thread_pool->workAvailableEvent)
         {
             // Handle event creation failure
-            if (g_thread_pool->workCompleteEvent)
-                CloseHandle(g_thread_pool->workCompleteEvent);
-            if (g_thread_pool->workAvailableEvent)
-                CloseHandle(g_thread_pool->workAvailableEvent);
             free(g_thread_pool);
+            g_thread_pool = nullptr;
             return -1;
         }
 
         // Allocate memory for thread handles
         g_thread_pool->threads = (HANDLE *)malloc(sizeof(HANDLE) * num_threads);
+        g_thread_pool->thread_nodes = (u32 *)calloc(num_threads, sizeof(u32));
+        discover_nodes(g_thread_pool);
 
         // Initialize lock-free queue (use power of 2 size for efficient masking)
         u32 queue_size = 1;
@@ -293,26 +663,44 @@ namespace thread_pool
             queue_size *= 2;
         }
 
-        g_thread_pool->queue.size = queue_size;
-        g_thread_pool->queue.mask = queue_size - 1;
-        g_thread_pool->queue.head = 0;
-        g_thread_pool->queue.tail = 0;
-        g_thread_pool->queue.items_processed = 0;
-        g_thread_pool->queue.items_added = 0;
-        g_thread_pool->queue.items = (work_data *)malloc(sizeof(work_data) * queue_size);
+        g_thread_pool->queue_size = queue_size;
+        for (u32 lane = 0; lane < PRIORITY_LEVELS; ++lane)
+        {
+            queue_init(&g_thread_pool->lanes[lane], queue_size);
+        }
+        for (u32 n = 0; n < g_thread_pool->num_nodes && g_thread_pool->num_nodes > 1; ++n)
+        {
+            queue_init(&g_thread_pool->node_queues[n], queue_size);
+        }
 
-        if (!g_thread_pool->threads || !g_thread_pool->queue.items)
+        bool allocated = g_thread_pool->threads && g_thread_pool->thread_nodes;
+        for (u32 lane = 0; lane < PRIORITY_LEVELS; ++lane)
+        {
+            allocated = allocated && g_thread_pool->lanes[lane].items;
+        }
+        for (u32 n = 0; n < g_thread_pool->num_nodes && g_thread_pool->num_nodes > 1; ++n)
         {
-            // Handle memory allocation failure
-            if (g_thread_pool->threads)
-                free(g_thread_pool->threads);
-            if (g_thread_pool->queue.items)
-                free(g_thread_pool->queue.items);
-            CloseHandle(g_thread_pool->workCompleteEvent);
+            allocated = allocated && g_thread_pool->node_queues[n].items;
+        }
+        if (!allocated)
+        {
+            // Handle memory allocation failure, free(NULL) is a no-op for whatever did not allocate
+            free(g_thread_pool->threads);
+            free(g_thread_pool->thread_nodes);
+            for (u32 lane = 0; lane < PRIORITY_LEVELS; ++lane)
+            {
+                free(g_thread_pool->lanes[lane].items);
+            }
+            for (u32 n = 0; n < g_thread_pool->num_nodes && g_thread_pool->num_nodes > 1; ++n)
+            {
+                free(g_thread_pool->node_queues[n].items);
+            }
             CloseHandle(g_thread_pool->workAvailableEvent);
             free(g_thread_pool);
+            g_thread_pool = nullptr;
             return -1; // Return -1 to indicate failure
         }
+        assign_nodes(g_thread_pool, num_threads);
 
         g_thread_pool->thread_transient_memory = (mpool::memory_pool *)malloc(sizeof(mpool::memory_pool) * num_threads);
 
@@ -326,7 +714,7 @@ namespace thread_pool
                 NULL,            // Default security attributes
                 0,               // Default stack size
                 thread_function, // Thread function
-                (LPVOID)i,       // Parameter to thread function
+                (LPVOID)(uintptr_t)i, // Parameter to thread function
                 0,               // Run immediately
                 NULL             // Thread identifier (not needed)
             );
@@ -337,130 +725,185 @@ namespace thread_pool
                 g_thread_pool->num_threads = i; // Set actual number of threads created
                 // Could add cleanup here if needed for partial failure
             }
+            else if (pin_threads)
+            {
+                pin_thread(g_thread_pool, i);
+            }
+        }
+        if (g_thread_pool->num_nodes > 1)
+        {
+            printf("Thread pool: %u workers over %u NUMA nodes\n", g_thread_pool->num_threads, g_thread_pool->num_nodes);
         }
 
         return 0;
     }
 
-    // Add work to the lock-free queue
-    static u32 add_work(thread_work_func func, void *data)
+    // Queues an item under batch, helping with queued work while the ring is full
+    static void push_work(work_queue *q, thread_work_func func, void *data, job *batch)
     {
-        ZoneScoped;
-        if (queue_try_add(&g_thread_pool->queue, func, data))
+        const work_data item = {func, data, batch};
+        if (batch)
         {
-
-            // Reset the workCompleteEvent since we have new work
-            ResetEvent(g_thread_pool->workCompleteEvent);
-            return 0;
+            InterlockedIncrement(&batch->pending);
         }
-        assert(0 && "Failed to add work to thread pool"); // This should never happen
-        return -1;                                        // Couldn't add work
-    }
-
-    // Add prioritized work - higher priority work will be processed first
-    static u32 add_prioritized_work(thread_work_func func, void *data, u32 priority)
-    {
-        ZoneScoped;
-        if (queue_try_add(&g_thread_pool->queue, func, data, priority))
+        while (!queue_try_add(q, &item))
         {
-
-            // Reset the workCompleteEvent since we have new work
-            ResetEvent(g_thread_pool->workCompleteEvent);
-            return 0;
+            if (!execute_next_work_item(batch ? batch->priority : PRIORITY_BACKGROUND))
+            {
+                YieldProcessor();
+            }
         }
-
-        return -1; // Couldn't add work
     }
 
-    static u32 reset_work()
+    // Add work to the lock-free queue of the batch's lane. Returns batch, the handle to wait on.
+    static job *add_work(thread_work_func func, void *data, job *batch)
     {
         ZoneScoped;
-        // Reset the lock-free queue
-        acquire_spinlock(&g_thread_pool->spinlock);
-        g_thread_pool->queue.head = 0;
-        g_thread_pool->queue.tail = 0;
-        g_thread_pool->queue.items_processed = 0;
-        g_thread_pool->queue.items_added = 0;
-        g_thread_pool->active_threads = 0;
-        release_spinlock(&g_thread_pool->spinlock);
-
-        // Reset events to appropriate state
-        SetEvent(g_thread_pool->workCompleteEvent);    // No work to do
-        ResetEvent(g_thread_pool->workAvailableEvent); // No work available
-
-        return 0; // Reset successful
+        batch->priority = max(batch->priority, t_priority);
+        push_work(&g_thread_pool->lanes[batch->priority], func, data, batch);
+        return batch;
     }
 
-    // Execute the next work item (for main thread participation)
-    static bool execute_next_work_item()
+    // Add work for the workers of one NUMA node, typically because it touches memory placed there.
+    // Other nodes steal it once they run out of work. Node queues belong to the frame lane, other
+    // lanes ignore the node.
+    static job *add_work_on_node(thread_work_func func, void *data, job *batch, u32 node)
     {
-        work_data *work = get_work_data();
-        if (work)
+        batch->priority = max(batch->priority, t_priority);
+        if (g_thread_pool->num_nodes <= 1 || batch->priority != PRIORITY_FRAME)
         {
-            // We have work to do in the main thread
-            static mpool::memory_pool main_thread_memory = mpool::allocate(MEGABYTES(1));
-            mpool::reset(&main_thread_memory);
-            work->func(work->data, 0xFFFFFFFF, &main_thread_memory); // Special ID for main thread
-            return true;
+            return add_work(func, data, batch);
         }
-        return false;
+        push_work(&g_thread_pool->node_queues[node % g_thread_pool->num_nodes], func, data, batch);
+        return batch;
     }
 
-    // Wait efficiently for all work to complete with active participation
-    static void wait_for_completion(DWORD timeout_ms = 500)
+    static bool done(const job *batch)
     {
-        ZoneScoped;
-        // First check if we're already done without waiting
-        if (!work_remaining() && g_thread_pool->active_threads == 0)
-        {
-            return;
-        }
-
-        // Time-based approach to balance responsiveness and CPU usage
-        DWORD start_time = GetTickCount();
+        return batch->pending == 0;
+    }
 
-        while (true)
+    // Waits for every item of batch, running queued work of the batch's lane or more urgent ones on the
+    // calling thread in the meantime, so a frame wait never picks up a long background item. Safe to
+    // call from inside a task: the waiting worker keeps draining the queues, so a sub-batch cannot
+    // deadlock the pool.
+    //
+    // Once nothing is left to help with it spins briefly, then sleeps on the counter until the item
+    // that drops it to zero wakes it. The sleep is capped at 1 ms so that work queued meanwhile, which
+    // only wakes parked workers, is still picked up if every worker is busy.
+    static void wait(job *batch)
+    {
+        ZoneScoped;
+        u32 idle = 0;
+        LONGLONG idle_since = 0;
+        while (!done(batch))
         {
-            // Try to do some work in the calling thread to help process the queue
-            if (!execute_next_work_item())
+            if (execute_next_work_item(batch->priority))
             {
-                // Check if all work is complete
-                if (!work_remaining() && g_thread_pool->active_threads == 0)
-                {
-                    break;
-                }
-
-                // No work available right now, use adaptive waiting strategy
-                DWORD elapsed = GetTickCount() - start_time;
-
-                if (elapsed < 10)
+                idle = 0;
+                idle_since = 0;
+            }
+            else if (g_thread_pool->parking)
+            {
+                const LONGLONG now = ticks();
+                if (!idle_since)
                 {
-                    // Aggressive spinning for first 10ms
-                    YieldProcessor();
+                    idle_since = now;
                 }
-                else if (elapsed < 50)
+                if (now - idle_since < g_thread_pool->spin_limit)
                 {
-                    // Yield to other threads but stay ready
-                    SwitchToThread();
+                    YieldProcessor(); // Last items of the batch are still running on workers
                 }
                 else
                 {
-                    // Wait on workCompleteEvent
-                    DWORD wait_result = WaitForSingleObject(g_thread_pool->workCompleteEvent, 1);
-                    if (wait_result == WAIT_OBJECT_0)
+                    LONG seen = batch->pending;
+                    if (seen != 0)
                     {
-                        // Work is complete, exit loop
-                        break;
+                        WaitOnAddress(&batch->pending, &seen, sizeof(LONG), 1);
                     }
+                }
+            }
+            else if (++idle < 64)
+            {
+                YieldProcessor(); // Last items of the batch are still running on workers
+            }
+            else
+            {
+                SwitchToThread();
+            }
+        }
+        MemoryBarrier(); // The batch's writes are visible once its counter reads zero
+    }
 
-                    // Check timeout condition
-                    if (timeout_ms != INFINITE && elapsed > timeout_ms)
-                    {
-                        break;
-                    }
+    /*---- Wake report ----*/
+    struct wake_probe
+    {
+        LONGLONG queued;
+        volatile LONGLONG started;
+    };
+
+    static void wake_probe_worker(void *data, u32 thread_id, mpool::memory_pool *thread_memory)
+    {
+        wake_probe *probe = (wake_probe *)data;
+        probe->started = ticks();
+    }
+
+    static double process_cpu_seconds()
+    {
+        FILETIME creation, exit, kernel, user;
+        GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+        const ULONGLONG k = ((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+        const ULONGLONG u = ((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime;
+        return (double)(k + u) * 1e-7;
+    }
+
+    // Measures, for the parking lot and the old event polling, how long an item queued on an idle pool
+    // waits for a worker to start it, and how many cores the idle pool burns. Restores the parking
+    // mode. Call between steps, from the main thread.
+    static void wake_report(u32 samples)
+    {
+        samples = max(samples, (u32)1);
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        const double us_per_tick = 1e6 / (double)frequency.QuadPart;
+        const u32 saved = g_thread_pool->parking;
+        const char *names[2] = {"event polling", "parking lot"};
+        std::vector<double> latencies(samples);
+        for (u32 mode = 0; mode < 2; ++mode)
+        {
+            g_thread_pool->parking = mode;
+            wake_all_workers(); // Move every worker into the new mode
+            Sleep(50);
+
+            const double cpu_start = process_cpu_seconds();
+            const LONGLONG idle_start = ticks();
+            Sleep(250);
+            const double idle_cores = (process_cpu_seconds() - cpu_start) / ((double)(ticks() - idle_start) * us_per_tick * 1e-6);
+
+            for (u32 i = 0; i < samples; ++i)
+            {
+                Sleep(2); // Long enough for workers to give up spinning
+                wake_probe probe = {ticks(), 0};
+                job batch = {};
+                add_work(wake_probe_worker, &probe, &batch);
+                while (!done(&batch)) // Not wait(), which would run the probe itself
+                {
+                    YieldProcessor();
                 }
+                latencies[i] = (double)(probe.started - probe.queued) * us_per_tick;
+            }
+            std::sort(latencies.begin(), latencies.end());
+            double mean = 0.0;
+            for (double l : latencies)
+            {
+                mean += l;
             }
+            mean /= samples;
+            printf("Wake report: %-13s wake mean %.1f us p50 %.1f us p99 %.1f us max %.1f us, idle %.2f cores\n",
+                   names[mode], mean, latencies[samples / 2], latencies[samples * 99 / 100], latencies[samples - 1], idle_cores);
         }
+        g_thread_pool->parking = saved;
+        wake_all_workers();
     }
 
     // Clean shutdown of thread pool
@@ -473,7 +916,7 @@ namespace thread_pool
         g_thread_pool->shutdown = 1;
 
         // Wake up all waiting threads
-        SetEvent(g_thread_pool->workAvailableEvent);
+        wake_all_workers();
 
         // Wait for all threads to exit (with timeout)
         WaitForMultipleObjects(g_thread_pool->num_threads, g_thread_pool->threads, TRUE, 1000);
@@ -487,9 +930,16 @@ namespace thread_pool
 
         // Clean up resources
         free(g_thread_pool->threads);
-        free(g_thread_pool->queue.items);
+        for (u32 lane = 0; lane < PRIORITY_LEVELS; ++lane)
+        {
+            free(g_thread_pool->lanes[lane].items);
+        }
+        for (u32 n = 0; n < g_thread_pool->num_nodes && g_thread_pool->num_nodes > 1; ++n)
+        {
+            free(g_thread_pool->node_queues[n].items);
+        }
+        free(g_thread_pool->thread_nodes);
         free(g_thread_pool->thread_transient_memory);
-        CloseHandle(g_thread_pool->workCompleteEvent);
         CloseHandle(g_thread_pool->workAvailableEvent);
 
         free(g_thread_pool);
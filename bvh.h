@@ -0,0 +1,735 @@
+#pragma once
+#include <immintrin.h>
+#include <vector>
+#include <algorithm>
+#include <float.h>
+#include "math.h"
+#include "string.h"
+#include "types.h"
+#include "math_linear.h"
+#include "io.h"
+#include "memory_pool.h"
+#include "boid_thread.h"
+#include "tracy\public\tracy\Tracy.hpp"
+
+// Bounding volume hierarchy over the triangles of a Mesh, used as collision geometry for the flock.
+//
+// Built with binned SAH. The top of the tree is split serially until the work divides into enough
+// subtrees to occupy the thread pool; the subtrees are built in parallel and spliced into one flat
+// node array. Children are stored as adjacent pairs, so a node needs only one child index.
+//
+// Queries run on packets of 8 boids with AVX: sphere queries find the closest point on the mesh within
+// a radius, ray queries find the first hit along a segment. A coarse occupancy grid over the mesh
+// bounds tells callers which boids are close enough to the geometry to need a query at all.
+namespace bvh
+{
+#define BVH_BINS 16
+#define BVH_MAX_LEAF 4         // Leaves are split down to this size unless SAH says a bigger leaf is cheaper
+#define BVH_MAX_SAH_LEAF 16    // Largest leaf SAH may keep
+#define BVH_TRAVERSAL_COST 1.0f // Relative to one triangle test
+#define BVH_MIN_TASK_TRIS 2048 // Subtrees below this are not worth a task of their own
+#define BVH_STACK_SIZE 64       // Traversal stack of the queries, build rejects trees deeper than it holds
+#define BVH_GRID_MAX_DIM 64    // Cells per axis of the occupancy grid
+
+    struct node
+    {
+        float bmin[3];
+        u32 first; // Leaf: first triangle. Internal: left child, the right child follows it
+        float bmax[3];
+        u32 count; // Triangles in a leaf, 0 for internal nodes
+    };
+
+    // Triangle laid out for the queries: a vertex, two edges, the third edge and the unit normal,
+    // plus the reciprocal terms the closest point test needs.
+    struct triangle
+    {
+        vec3 a;
+        vec3 e1; // b - a
+        vec3 e2; // c - a
+        vec3 e3; // c - b
+        vec3 n;
+        float inv_e1_sq;
+        float inv_e2_sq;
+        float inv_e3_sq;
+        float d01; // dot(e1, e2)
+        float inv_den;
+    };
+
+    struct bvh
+    {
+        std::vector<node> nodes;
+        std::vector<triangle> tris; // In leaf order
+        u32 depth;                  // Levels below the root, a traversal holds at most depth + 1 nodes
+        float bmin[3];
+        float bmax[3];
+
+        // Occupancy grid: a cell is set if some leaf box, grown by margin, touches it
+        float margin;
+        float grid_min[3];
+        float inv_cell_size;
+        u32 grid_dim[3];
+        std::vector<u8> near_cells;
+    };
+
+    /*---- Build ----*/
+    struct aabb
+    {
+        __m128 min;
+        __m128 max;
+    };
+
+    static inline aabb empty_box()
+    {
+        return {_mm_set1_ps(FLT_MAX), _mm_set1_ps(-FLT_MAX)};
+    }
+
+    static inline void grow(aabb *box, __m128 p)
+    {
+        box->min = _mm_min_ps(box->min, p);
+        box->max = _mm_max_ps(box->max, p);
+    }
+
+    static inline void grow(aabb *box, const aabb *other)
+    {
+        box->min = _mm_min_ps(box->min, other->min);
+        box->max = _mm_max_ps(box->max, other->max);
+    }
+
+    static inline float half_area(const aabb *box)
+    {
+        float e[4];
+        _mm_storeu_ps(e, _mm_max_ps(_mm_sub_ps(box->max, box->min), _mm_setzero_ps()));
+        return e[0] * e[1] + e[1] * e[2] + e[2] * e[0];
+    }
+
+    static inline float axis_of(__m128 v, u32 axis)
+    {
+        float e[4];
+        _mm_storeu_ps(e, v);
+        return e[axis];
+    }
+
+    struct builder
+    {
+        const aabb *boxes;      // Per source triangle
+        const __m128 *centroids; // Per source triangle
+        u32 *indices;           // Source triangle of each slot, partitioned in place
+        u32 task_tris;          // Ranges at or below this size are handed to tasks during the top build
+    };
+
+    struct subtree_task
+    {
+        const builder *b;
+        u32 placeholder; // Node in the top tree the subtree replaces
+        u32 first;
+        u32 count;
+        std::vector<node> nodes; // Built subtree, root at 0
+    };
+
+    static void set_node_bounds(node *n, const aabb *box)
+    {
+        float lo[4], hi[4];
+        _mm_storeu_ps(lo, box->min);
+        _mm_storeu_ps(hi, box->max);
+        memcpy(n->bmin, lo, sizeof(n->bmin));
+        memcpy(n->bmax, hi, sizeof(n->bmax));
+    }
+
+    // Finds the cheapest binned SAH split of a range. Returns false if the centroids cannot be separated.
+    static bool find_split(const builder *b, u32 first, u32 count, const aabb *centroid_box, u32 *out_axis, float *out_pos, float *out_cost)
+    {
+        float best_cost = FLT_MAX;
+        for (u32 axis = 0; axis < 3; ++axis)
+        {
+            float lo = axis_of(centroid_box->min, axis);
+            float hi = axis_of(centroid_box->max, axis);
+            if (hi - lo < 1e-9f)
+            {
+                continue;
+            }
+            aabb bin_box[BVH_BINS];
+            u32 bin_count[BVH_BINS] = {};
+            for (u32 i = 0; i < BVH_BINS; ++i)
+            {
+                bin_box[i] = empty_box();
+            }
+            const float scale = BVH_BINS / (hi - lo);
+            for (u32 i = first; i < first + count; ++i)
+            {
+                u32 t = b->indices[i];
+                u32 bin = min((u32)((axis_of(b->centroids[t], axis) - lo) * scale), (u32)(BVH_BINS - 1));
+                bin_count[bin]++;
+                grow(&bin_box[bin], &b->boxes[t]);
+            }
+
+            // Sweep from both ends to get the area and count on each side of every bin boundary
+            float left_area[BVH_BINS - 1], right_area[BVH_BINS - 1];
+            u32 left_count[BVH_BINS - 1], right_count[BVH_BINS - 1];
+            aabb left = empty_box(), right = empty_box();
+            u32 left_sum = 0, right_sum = 0;
+            for (u32 i = 0; i < BVH_BINS - 1; ++i)
+            {
+                left_sum += bin_count[i];
+                grow(&left, &bin_box[i]);
+                left_count[i] = left_sum;
+                left_area[i] = half_area(&left);
+
+                right_sum += bin_count[BVH_BINS - 1 - i];
+                grow(&right, &bin_box[BVH_BINS - 1 - i]);
+                right_count[BVH_BINS - 2 - i] = right_sum;
+                right_area[BVH_BINS - 2 - i] = half_area(&right);
+            }
+            for (u32 i = 0; i < BVH_BINS - 1; ++i)
+            {
+                if (left_count[i] == 0 || right_count[i] == 0)
+                {
+                    continue;
+                }
+                float cost = left_count[i] * left_area[i] + right_count[i] * right_area[i];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    *out_axis = axis;
+                    *out_pos = lo + (i + 1) / scale;
+                }
+            }
+        }
+        *out_cost = best_cost;
+        return best_cost < FLT_MAX;
+    }
+
+    // Splits the range at node ni, or makes it a leaf. With tasks set, ranges small enough for a task
+    // are left as placeholders and queued instead of being built here.
+    static void subdivide(const builder *b, std::vector<node> *nodes, u32 ni, u32 first, u32 count, std::vector<subtree_task> *tasks)
+    {
+        aabb box = empty_box(), centroid_box = empty_box();
+        for (u32 i = first; i < first + count; ++i)
+        {
+            grow(&box, &b->boxes[b->indices[i]]);
+            grow(&centroid_box, b->centroids[b->indices[i]]);
+        }
+        set_node_bounds(&(*nodes)[ni], &box);
+        (*nodes)[ni].first = first;
+        (*nodes)[ni].count = count;
+
+        if (tasks && count <= b->task_tris)
+        {
+            subtree_task task = {b, ni, first, count};
+            tasks->push_back(task);
+            return;
+        }
+        if (count <= BVH_MAX_LEAF)
+        {
+            return;
+        }
+
+        u32 axis = 0;
+        float pos = 0.0f, cost = 0.0f;
+        u32 mid = first + count / 2;
+        if (find_split(b, first, count, &centroid_box, &axis, &pos, &cost))
+        {
+            // SAH cost of the split against intersecting every triangle of a leaf
+            float split_cost = BVH_TRAVERSAL_COST + cost / half_area(&box);
+            if (count <= BVH_MAX_SAH_LEAF && split_cost >= (float)count)
+            {
+                return;
+            }
+            u32 *split = std::partition(b->indices + first, b->indices + first + count,
+                                        [&](u32 t)
+                                        { return axis_of(b->centroids[t], axis) < pos; });
+            mid = (u32)(split - b->indices);
+        }
+        else
+        {
+            // Every centroid coincides: split the range in half
+            axis = 0;
+        }
+        if (mid == first || mid == first + count)
+        {
+            mid = first + count / 2;
+        }
+
+        u32 left = (u32)nodes->size();
+        nodes->resize(left + 2);
+        (*nodes)[ni].first = left;
+        (*nodes)[ni].count = 0;
+        subdivide(b, nodes, left, first, mid - first, tasks);
+        subdivide(b, nodes, left + 1, mid, first + count - mid, tasks);
+    }
+
+    static void build_subtree_worker(void *data, u32 thread_id, mpool::memory_pool *thread_memory)
+    {
+        ZoneScoped;
+        subtree_task *task = (subtree_task *)data;
+        task->nodes.reserve(2 * task->count / BVH_MAX_LEAF + 1);
+        task->nodes.resize(1);
+        subdivide(task->b, &task->nodes, 0, task->first, task->count, nullptr);
+    }
+
+    static inline triangle make_triangle(vec3 a, vec3 b, vec3 c)
+    {
+        triangle t;
+        t.a = a;
+        t.e1 = b - a;
+        t.e2 = c - a;
+        t.e3 = c - b;
+        // v3::normalize leaves short vectors alone, small triangles need the exact length
+        const vec3 n = v3::cross(t.e1, t.e2);
+        t.n = n * (1.0f / sqrtf(v3::sq_mag(n)));
+        const float d00 = v3::dot(t.e1, t.e1);
+        const float d11 = v3::dot(t.e2, t.e2);
+        t.d01 = v3::dot(t.e1, t.e2);
+        t.inv_e1_sq = 1.0f / fmaxf(d00, 1e-20f);
+        t.inv_e2_sq = 1.0f / fmaxf(d11, 1e-20f);
+        t.inv_e3_sq = 1.0f / fmaxf(v3::dot(t.e3, t.e3), 1e-20f);
+        t.inv_den = 1.0f / (d00 * d11 - t.d01 * t.d01);
+        return t;
+    }
+
+    // Levels below the root of the finished tree
+    static u32 tree_depth(const bvh *tree)
+    {
+        u32 deepest = 0;
+        std::vector<std::pair<u32, u32>> pending = {{0, 0}}; // Node, its depth
+        while (!pending.empty())
+        {
+            const std::pair<u32, u32> item = pending.back();
+            pending.pop_back();
+            const node *n = &tree->nodes[item.first];
+            deepest = max(deepest, item.second);
+            if (n->count == 0)
+            {
+                pending.push_back({n->first, item.second + 1});
+                pending.push_back({n->first + 1, item.second + 1});
+            }
+        }
+        return deepest;
+    }
+
+    // Marks the occupancy cells within margin of any leaf
+    static void build_grid(bvh *tree, float margin)
+    {
+        ZoneScoped;
+        tree->margin = margin;
+        float extent = 0.0f;
+        for (u32 a = 0; a < 3; ++a)
+        {
+            tree->grid_min[a] = tree->bmin[a] - margin;
+            extent = fmaxf(extent, tree->bmax[a] - tree->bmin[a] + 2.0f * margin);
+        }
+        float cell = fmaxf(extent / BVH_GRID_MAX_DIM, 1e-6f);
+        tree->inv_cell_size = 1.0f / cell;
+        for (u32 a = 0; a < 3; ++a)
+        {
+            tree->grid_dim[a] = max(1u, (u32)ceilf((tree->bmax[a] - tree->bmin[a] + 2.0f * margin) * tree->inv_cell_size));
+        }
+        tree->near_cells.assign((size_t)tree->grid_dim[0] * tree->grid_dim[1] * tree->grid_dim[2], 0);
+
+        for (const node &n : tree->nodes)
+        {
+            if (n.count == 0)
+            {
+                continue;
+            }
+            u32 lo[3], hi[3];
+            for (u32 a = 0; a < 3; ++a)
+            {
+                lo[a] = (u32)fmaxf((n.bmin[a] - margin - tree->grid_min[a]) * tree->inv_cell_size, 0.0f);
+                hi[a] = min((u32)fmaxf((n.bmax[a] + margin - tree->grid_min[a]) * tree->inv_cell_size, 0.0f), tree->grid_dim[a] - 1);
+            }
+            for (u32 z = lo[2]; z <= hi[2]; ++z)
+            {
+                for (u32 y = lo[1]; y <= hi[1]; ++y)
+                {
+                    memset(&tree->near_cells[((size_t)z * tree->grid_dim[1] + y) * tree->grid_dim[0] + lo[0]], 1, hi[0] - lo[0] + 1);
+                }
+            }
+        }
+    }
+
+    // Builds the hierarchy over mesh's triangles. margin is the largest query distance callers will use;
+    // near_geometry is only exact up to it. Degenerate triangles are skipped.
+    bool build(bvh *tree, const Mesh *mesh, float margin)
+    {
+        ZoneScoped;
+        *tree = {};
+        const u32 num_source = mesh->indices ? mesh->indexCount / 3 : mesh->vertexCount / 3;
+        std::vector<aabb> boxes;
+        std::vector<__m128> centroids;
+        std::vector<triangle> source;
+        boxes.reserve(num_source);
+        centroids.reserve(num_source);
+        source.reserve(num_source);
+        for (u32 t = 0; t < num_source; ++t)
+        {
+            u32 i0 = mesh->indices ? mesh->indices[3 * t] : 3 * t;
+            u32 i1 = mesh->indices ? mesh->indices[3 * t + 1] : 3 * t + 1;
+            u32 i2 = mesh->indices ? mesh->indices[3 * t + 2] : 3 * t + 2;
+            if (i0 >= mesh->vertexCount || i1 >= mesh->vertexCount || i2 >= mesh->vertexCount)
+            {
+                continue;
+            }
+            vec3 a = mesh->vertices[i0].position.xyz;
+            vec3 b = mesh->vertices[i1].position.xyz;
+            vec3 c = mesh->vertices[i2].position.xyz;
+            if (v3::sq_mag(v3::cross(b - a, c - a)) < 1e-24f)
+            {
+                continue;
+            }
+            __m128 pa = _mm_setr_ps(a.x, a.y, a.z, 0.0f);
+            __m128 pb = _mm_setr_ps(b.x, b.y, b.z, 0.0f);
+            __m128 pc = _mm_setr_ps(c.x, c.y, c.z, 0.0f);
+            aabb box = {_mm_min_ps(pa, _mm_min_ps(pb, pc)), _mm_max_ps(pa, _mm_max_ps(pb, pc))};
+            boxes.push_back(box);
+            centroids.push_back(_mm_mul_ps(_mm_add_ps(box.min, box.max), _mm_set1_ps(0.5f)));
+            source.push_back(make_triangle(a, b, c));
+        }
+        const u32 num_tris = (u32)source.size();
+        if (num_tris == 0)
+        {
+            fprintf(stderr, "Mesh has no triangles to build a BVH from\n");
+            return false;
+        }
+
+        std::vector<u32> indices(num_tris);
+        for (u32 i = 0; i < num_tris; ++i)
+        {
+            indices[i] = i;
+        }
+        builder b = {boxes.data(), centroids.data(), indices.data(), num_tris};
+        if (thread_pool::g_thread_pool)
+        {
+            // A few subtrees per thread balances uneven splits
+            u32 target_tasks = thread_pool::g_thread_pool->num_threads * 4;
+            b.task_tris = max((u32)BVH_MIN_TASK_TRIS, num_tris / max(target_tasks, 1u));
+        }
+
+        // Top of the tree, serially, down to task sized ranges
+        std::vector<subtree_task> tasks;
+        tree->nodes.reserve(2 * num_tris / BVH_MAX_LEAF + 1);
+        tree->nodes.resize(1);
+        subdivide(&b, &tree->nodes, 0, 0, num_tris, &tasks);
+
+        // Subtrees in parallel, in batches the work queue can hold
+        if (tasks.size() > 1 && thread_pool::g_thread_pool)
+        {
+            const u32 batch = (u32)thread_pool::g_thread_pool->queue_size;
+            for (u32 start = 0; start < tasks.size(); start += batch)
+            {
+                thread_pool::job job = {};
+                for (u32 i = start; i < min(start + batch, (u32)tasks.size()); ++i)
+                {
+                    thread_pool::add_work(build_subtree_worker, &tasks[i], &job);
+                }
+                thread_pool::wait(&job);
+            }
+        }
+        else
+        {
+            for (subtree_task &task : tasks)
+            {
+                build_subtree_worker(&task, 0, nullptr);
+            }
+        }
+
+        // Splice: each subtree root replaces its placeholder, the rest is appended with child indices
+        // shifted from subtree-local to global
+        for (subtree_task &task : tasks)
+        {
+            const u32 base = (u32)tree->nodes.size() - 1; // Subtree index k >= 1 lands at base + k
+            for (u32 k = 1; k < task.nodes.size(); ++k)
+            {
+                node n = task.nodes[k];
+                if (n.count == 0)
+                {
+                    n.first += base;
+                }
+                tree->nodes.push_back(n);
+            }
+            node root = task.nodes[0];
+            if (root.count == 0)
+            {
+                root.first += base;
+            }
+            tree->nodes[task.placeholder] = root;
+        }
+
+        // The queries' fixed stack must hold every path, a deeper tree would silently lose subtrees
+        tree->depth = tree_depth(tree);
+        if (tree->depth + 1 > BVH_STACK_SIZE)
+        {
+            fprintf(stderr, "BVH is %u levels deep, queries support %u\n", tree->depth, BVH_STACK_SIZE - 1);
+            *tree = {};
+            return false;
+        }
+
+        tree->tris.resize(num_tris);
+        for (u32 i = 0; i < num_tris; ++i)
+        {
+            tree->tris[i] = source[indices[i]];
+        }
+        memcpy(tree->bmin, tree->nodes[0].bmin, sizeof(tree->bmin));
+        memcpy(tree->bmax, tree->nodes[0].bmax, sizeof(tree->bmax));
+        build_grid(tree, margin);
+        return true;
+    }
+
+    // True if p may be within margin of the mesh. Cheap enough to call for every boid.
+    static inline bool near_geometry(const bvh *tree, vec3 p)
+    {
+        if (tree->near_cells.empty())
+        {
+            return false;
+        }
+        const float c[3] = {(p.x - tree->grid_min[0]) * tree->inv_cell_size,
+                            (p.y - tree->grid_min[1]) * tree->inv_cell_size,
+                            (p.z - tree->grid_min[2]) * tree->inv_cell_size};
+        if (c[0] < 0.0f || c[1] < 0.0f || c[2] < 0.0f ||
+            c[0] >= (float)tree->grid_dim[0] || c[1] >= (float)tree->grid_dim[1] || c[2] >= (float)tree->grid_dim[2])
+        {
+            return false;
+        }
+        return tree->near_cells[((size_t)(u32)c[2] * tree->grid_dim[1] + (u32)c[1]) * tree->grid_dim[0] + (u32)c[0]] != 0;
+    }
+
+    /*---- Packet queries ----*/
+    // 8 query points or rays in SoA form. Lanes past count are inactive.
+    struct packet
+    {
+        alignas(32) float x[8];
+        alignas(32) float y[8];
+        alignas(32) float z[8];
+        alignas(32) float dx[8]; // Ray direction, need not be normalised
+        alignas(32) float dy[8];
+        alignas(32) float dz[8];
+        alignas(32) float limit[8]; // Sphere radius, or ray length in units of the direction
+        u32 count;
+    };
+
+    struct sphere_hits
+    {
+        alignas(32) float dist_sq[8]; // limit^2 if nothing is closer
+        alignas(32) float cx[8];      // Closest point on the mesh
+        alignas(32) float cy[8];
+        alignas(32) float cz[8];
+        u32 hit_mask;
+    };
+
+    struct ray_hits
+    {
+        alignas(32) float t[8]; // limit if nothing was hit
+        alignas(32) float nx[8]; // Unit normal of the hit triangle, facing the ray
+        alignas(32) float ny[8];
+        alignas(32) float nz[8];
+        u32 hit_mask;
+        u32 backface_mask; // Hits on the back of a triangle, i.e. rays leaving a closed mesh
+    };
+
+    static inline __m256 active_lanes(u32 count)
+    {
+        const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32((int)count), lane));
+    }
+
+    static inline __m256 clamp01(__m256 v)
+    {
+        return _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+    }
+
+    // Closest point on the mesh to each active lane within its limit
+    void query_spheres(const bvh *tree, const packet *q, sphere_hits *out)
+    {
+        ZoneScoped;
+        const __m256 px = _mm256_load_ps(q->x), py = _mm256_load_ps(q->y), pz = _mm256_load_ps(q->z);
+        const __m256 active = active_lanes(q->count);
+        const __m256 zero = _mm256_setzero_ps();
+        __m256 limit = _mm256_load_ps(q->limit);
+        __m256 best = _mm256_and_ps(_mm256_mul_ps(limit, limit), active); // Inactive lanes never hit
+        __m256 best_x = px, best_y = py, best_z = pz;
+        __m256 hit = zero;
+
+        u32 stack[BVH_STACK_SIZE];
+        u32 top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const node *n = &tree->nodes[stack[--top]];
+            // Squared distance from each point to the node box
+            __m256 ex = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(n->bmin[0]), px), _mm256_sub_ps(px, _mm256_set1_ps(n->bmax[0]))), zero);
+            __m256 ey = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(n->bmin[1]), py), _mm256_sub_ps(py, _mm256_set1_ps(n->bmax[1]))), zero);
+            __m256 ez = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(n->bmin[2]), pz), _mm256_sub_ps(pz, _mm256_set1_ps(n->bmax[2]))), zero);
+            __m256 box_d2 = _mm256_fmadd_ps(ex, ex, _mm256_fmadd_ps(ey, ey, _mm256_mul_ps(ez, ez)));
+            if (!_mm256_movemask_ps(_mm256_cmp_ps(box_d2, best, _CMP_LT_OQ)))
+            {
+                continue;
+            }
+            if (n->count == 0)
+            {
+                // Holds: build rejects trees deeper than the stack
+                stack[top++] = n->first + 1;
+                stack[top++] = n->first;
+                continue;
+            }
+
+            for (u32 i = n->first; i < n->first + n->count; ++i)
+            {
+                const triangle *t = &tree->tris[i];
+                const __m256 wx = _mm256_sub_ps(px, _mm256_set1_ps(t->a.x));
+                const __m256 wy = _mm256_sub_ps(py, _mm256_set1_ps(t->a.y));
+                const __m256 wz = _mm256_sub_ps(pz, _mm256_set1_ps(t->a.z));
+                const __m256 d20 = _mm256_fmadd_ps(wx, _mm256_set1_ps(t->e1.x), _mm256_fmadd_ps(wy, _mm256_set1_ps(t->e1.y), _mm256_mul_ps(wz, _mm256_set1_ps(t->e1.z))));
+                const __m256 d21 = _mm256_fmadd_ps(wx, _mm256_set1_ps(t->e2.x), _mm256_fmadd_ps(wy, _mm256_set1_ps(t->e2.y), _mm256_mul_ps(wz, _mm256_set1_ps(t->e2.z))));
+
+                // Interior: project onto the plane if the barycentrics are inside the triangle
+                const __m256 d00 = _mm256_set1_ps(1.0f / t->inv_e1_sq), d11 = _mm256_set1_ps(1.0f / t->inv_e2_sq), d01 = _mm256_set1_ps(t->d01);
+                const __m256 inv_den = _mm256_set1_ps(t->inv_den);
+                const __m256 bv = _mm256_mul_ps(_mm256_fmsub_ps(d11, d20, _mm256_mul_ps(d01, d21)), inv_den);
+                const __m256 bw = _mm256_mul_ps(_mm256_fmsub_ps(d00, d21, _mm256_mul_ps(d01, d20)), inv_den);
+                const __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(bv, zero, _CMP_GE_OQ), _mm256_cmp_ps(bw, zero, _CMP_GE_OQ)),
+                                                    _mm256_cmp_ps(_mm256_add_ps(bv, bw), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+                const __m256 s = _mm256_fmadd_ps(wx, _mm256_set1_ps(t->n.x), _mm256_fmadd_ps(wy, _mm256_set1_ps(t->n.y), _mm256_mul_ps(wz, _mm256_set1_ps(t->n.z))));
+                __m256 cx = _mm256_fnmadd_ps(s, _mm256_set1_ps(t->n.x), px);
+                __m256 cy = _mm256_fnmadd_ps(s, _mm256_set1_ps(t->n.y), py);
+                __m256 cz = _mm256_fnmadd_ps(s, _mm256_set1_ps(t->n.z), pz);
+                __m256 d2 = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), _mm256_mul_ps(s, s), inside);
+
+                // Edges: keep the nearest of the three clamped segment projections when outside
+                auto edge = [&](vec3 origin, vec3 e, float inv_len_sq, __m256 proj)
+                {
+                    const __m256 k = clamp01(_mm256_mul_ps(proj, _mm256_set1_ps(inv_len_sq)));
+                    const __m256 qx = _mm256_fmadd_ps(k, _mm256_set1_ps(e.x), _mm256_set1_ps(origin.x));
+                    const __m256 qy = _mm256_fmadd_ps(k, _mm256_set1_ps(e.y), _mm256_set1_ps(origin.y));
+                    const __m256 qz = _mm256_fmadd_ps(k, _mm256_set1_ps(e.z), _mm256_set1_ps(origin.z));
+                    const __m256 rx = _mm256_sub_ps(px, qx), ry = _mm256_sub_ps(py, qy), rz = _mm256_sub_ps(pz, qz);
+                    const __m256 e_d2 = _mm256_fmadd_ps(rx, rx, _mm256_fmadd_ps(ry, ry, _mm256_mul_ps(rz, rz)));
+                    const __m256 closer = _mm256_cmp_ps(e_d2, d2, _CMP_LT_OQ);
+                    d2 = _mm256_blendv_ps(d2, e_d2, closer);
+                    cx = _mm256_blendv_ps(cx, qx, closer);
+                    cy = _mm256_blendv_ps(cy, qy, closer);
+                    cz = _mm256_blendv_ps(cz, qz, closer);
+                };
+                const vec3 b = t->a + t->e1;
+                const __m256 bx = _mm256_sub_ps(px, _mm256_set1_ps(b.x)), by = _mm256_sub_ps(py, _mm256_set1_ps(b.y)), bz = _mm256_sub_ps(pz, _mm256_set1_ps(b.z));
+                const __m256 d3 = _mm256_fmadd_ps(bx, _mm256_set1_ps(t->e3.x), _mm256_fmadd_ps(by, _mm256_set1_ps(t->e3.y), _mm256_mul_ps(bz, _mm256_set1_ps(t->e3.z))));
+                const __m256 outside = _mm256_cmp_ps(d2, _mm256_set1_ps(FLT_MAX), _CMP_EQ_OQ);
+                if (_mm256_movemask_ps(outside))
+                {
+                    edge(t->a, t->e1, t->inv_e1_sq, d20);
+                    edge(t->a, t->e2, t->inv_e2_sq, d21);
+                    edge(b, t->e3, t->inv_e3_sq, d3);
+                }
+
+                const __m256 closer = _mm256_cmp_ps(d2, best, _CMP_LT_OQ);
+                best = _mm256_blendv_ps(best, d2, closer);
+                best_x = _mm256_blendv_ps(best_x, cx, closer);
+                best_y = _mm256_blendv_ps(best_y, cy, closer);
+                best_z = _mm256_blendv_ps(best_z, cz, closer);
+                hit = _mm256_or_ps(hit, closer);
+            }
+        }
+        _mm256_store_ps(out->dist_sq, best);
+        _mm256_store_ps(out->cx, best_x);
+        _mm256_store_ps(out->cy, best_y);
+        _mm256_store_ps(out->cz, best_z);
+        out->hit_mask = (u32)_mm256_movemask_ps(_mm256_and_ps(hit, active));
+    }
+
+    // First hit along each active lane's ray, within limit
+    void query_rays(const bvh *tree, const packet *q, ray_hits *out)
+    {
+        ZoneScoped;
+        const __m256 ox = _mm256_load_ps(q->x), oy = _mm256_load_ps(q->y), oz = _mm256_load_ps(q->z);
+        const __m256 dx = _mm256_load_ps(q->dx), dy = _mm256_load_ps(q->dy), dz = _mm256_load_ps(q->dz);
+        const __m256 active = active_lanes(q->count);
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 one = _mm256_set1_ps(1.0f);
+        // Zero components give infinities, which the slab test handles
+        const __m256 ix = _mm256_div_ps(one, dx), iy = _mm256_div_ps(one, dy), iz = _mm256_div_ps(one, dz);
+        __m256 best = _mm256_and_ps(_mm256_load_ps(q->limit), active);
+        __m256 nx = zero, ny = zero, nz = zero;
+        __m256 hit = zero, backface = zero;
+
+        u32 stack[BVH_STACK_SIZE];
+        u32 top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const node *n = &tree->nodes[stack[--top]];
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(n->bmin[0]), ox), ix);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(n->bmax[0]), ox), ix);
+            __m256 t_near = _mm256_min_ps(t0, t1), t_far = _mm256_max_ps(t0, t1);
+            t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(n->bmin[1]), oy), iy);
+            t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(n->bmax[1]), oy), iy);
+            t_near = _mm256_max_ps(t_near, _mm256_min_ps(t0, t1));
+            t_far = _mm256_min_ps(t_far, _mm256_max_ps(t0, t1));
+            t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(n->bmin[2]), oz), iz);
+            t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(n->bmax[2]), oz), iz);
+            t_near = _mm256_max_ps(t_near, _mm256_min_ps(t0, t1));
+            t_far = _mm256_min_ps(t_far, _mm256_max_ps(t0, t1));
+            __m256 overlap = _mm256_and_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ),
+                                           _mm256_and_ps(_mm256_cmp_ps(t_far, zero, _CMP_GE_OQ), _mm256_cmp_ps(t_near, best, _CMP_LT_OQ)));
+            if (!_mm256_movemask_ps(overlap))
+            {
+                continue;
+            }
+            if (n->count == 0)
+            {
+                // Holds: build rejects trees deeper than the stack
+                stack[top++] = n->first + 1;
+                stack[top++] = n->first;
+                continue;
+            }
+
+            for (u32 i = n->first; i < n->first + n->count; ++i)
+            {
+                // Moller-Trumbore, one triangle against 8 rays
+                const triangle *t = &tree->tris[i];
+                const __m256 e1x = _mm256_set1_ps(t->e1.x), e1y = _mm256_set1_ps(t->e1.y), e1z = _mm256_set1_ps(t->e1.z);
+                const __m256 e2x = _mm256_set1_ps(t->e2.x), e2y = _mm256_set1_ps(t->e2.y), e2z = _mm256_set1_ps(t->e2.z);
+                const __m256 pvx = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+                const __m256 pvy = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+                const __m256 pvz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+                const __m256 det = _mm256_fmadd_ps(e1x, pvx, _mm256_fmadd_ps(e1y, pvy, _mm256_mul_ps(e1z, pvz)));
+                const __m256 inv_det = _mm256_div_ps(one, det);
+                const __m256 tvx = _mm256_sub_ps(ox, _mm256_set1_ps(t->a.x));
+                const __m256 tvy = _mm256_sub_ps(oy, _mm256_set1_ps(t->a.y));
+                const __m256 tvz = _mm256_sub_ps(oz, _mm256_set1_ps(t->a.z));
+                const __m256 u = _mm256_mul_ps(_mm256_fmadd_ps(tvx, pvx, _mm256_fmadd_ps(tvy, pvy, _mm256_mul_ps(tvz, pvz))), inv_det);
+                const __m256 qvx = _mm256_fmsub_ps(tvy, e1z, _mm256_mul_ps(tvz, e1y));
+                const __m256 qvy = _mm256_fmsub_ps(tvz, e1x, _mm256_mul_ps(tvx, e1z));
+                const __m256 qvz = _mm256_fmsub_ps(tvx, e1y, _mm256_mul_ps(tvy, e1x));
+                const __m256 v = _mm256_mul_ps(_mm256_fmadd_ps(dx, qvx, _mm256_fmadd_ps(dy, qvy, _mm256_mul_ps(dz, qvz))), inv_det);
+                const __m256 th = _mm256_mul_ps(_mm256_fmadd_ps(e2x, qvx, _mm256_fmadd_ps(e2y, qvy, _mm256_mul_ps(e2z, qvz))), inv_det);
+
+                const __m256 abs_det = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+                __m256 valid = _mm256_cmp_ps(abs_det, _mm256_set1_ps(1e-12f), _CMP_GT_OQ);
+                valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+                valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+                valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+                valid = _mm256_and_ps(valid, _mm256_cmp_ps(th, zero, _CMP_GT_OQ));
+                valid = _mm256_and_ps(valid, _mm256_cmp_ps(th, best, _CMP_LT_OQ));
+                if (!_mm256_movemask_ps(valid))
+                {
+                    continue;
+                }
+
+                // Normal flipped to face the ray
+                const __m256 tnx = _mm256_set1_ps(t->n.x), tny = _mm256_set1_ps(t->n.y), tnz = _mm256_set1_ps(t->n.z);
+                const __m256 facing = _mm256_fmadd_ps(dx, tnx, _mm256_fmadd_ps(dy, tny, _mm256_mul_ps(dz, tnz)));
+                const __m256 sign = _mm256_and_ps(facing, _mm256_set1_ps(-0.0f));
+                best = _mm256_blendv_ps(best, th, valid);
+                nx = _mm256_blendv_ps(nx, _mm256_xor_ps(_mm256_xor_ps(tnx, sign), _mm256_set1_ps(-0.0f)), valid);
+                ny = _mm256_blendv_ps(ny, _mm256_xor_ps(_mm256_xor_ps(tny, sign), _mm256_set1_ps(-0.0f)), valid);
+                nz = _mm256_blendv_ps(nz, _mm256_xor_ps(_mm256_xor_ps(tnz, sign), _mm256_set1_ps(-0.0f)), valid);
+                hit = _mm256_or_ps(hit, valid);
+                backface = _mm256_blendv_ps(backface, _mm256_cmp_ps(facing, zero, _CMP_GT_OQ), valid);
+            }
+        }
+        _mm256_store_ps(out->t, best);
+        _mm256_store_ps(out->nx, nx);
+        _mm256_store_ps(out->ny, ny);
+        _mm256_store_ps(out->nz, nz);
+        out->hit_mask = (u32)_mm256_movemask_ps(_mm256_and_ps(hit, active));
+        out->backface_mask = (u32)_mm256_movemask_ps(_mm256_and_ps(backface, active));
+    }
+}
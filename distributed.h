@@ -0,0 +1,1024 @@
+#pragma once
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <vector>
+#include "types.h"
+#include "simulation.h"
+#ifdef BOIDNODE_MPI
+#include <mpi.h>
+#endif
+#include "tracy\public\tracy\Tracy.hpp"
+
+#pragma comment(lib, "ws2_32.lib")
+
+// Distributed mode: the domain is cut into slabs along x, one per process (rank). Slab boundaries sit
+// on the spatial hash's cell grid. Each step a rank
+//  - migrates boids that left its slab to the neighbour that now owns them,
+//  - sends copies (ghosts) of the boids within one search radius of each boundary, so the neighbour's
+//    kernel sees every boid its own boids can reach,
+//  - then runs the usual update_sim over its own boids and the ghosts it received.
+// Ghosts carry BOID_TYPE_GHOST only, so the kernel reads them as neighbours but never steers them, and
+// they are replaced every step. Only neighbouring ranks talk, through a pluggable transport:
+// shared memory, TCP on localhost, or MPI when built with BOIDNODE_MPI.
+//
+// Launch one process per rank, e.g. for two ranks over TCP:
+//   boids.exe --ranks 2 --rank 0 --transport tcp
+//   boids.exe --ranks 2 --rank 1 --transport tcp
+namespace distributed
+{
+    enum TRANSPORT_KIND
+    {
+        TRANSPORT_SHARED_MEMORY,
+        TRANSPORT_TCP,
+        TRANSPORT_MPI,
+    };
+
+    struct config
+    {
+        u32 rank;
+        u32 num_ranks;      // 0 = distributed mode off
+        TRANSPORT_KIND kind;
+        char session[64];   // Names the shared memory channels, ranks of one run must agree on it
+        u32 base_port;      // Rank r listens on base_port + r for TCP
+        u32 report_steps;   // Steps between scaling reports, 0 = never
+    };
+
+    // Point to point, ordered, reliable byte messages. send may block until the peer receives.
+    struct transport
+    {
+        void *ctx;
+        bool (*send)(void *ctx, u32 peer, const void *data, u64 size);
+        bool (*recv)(void *ctx, u32 peer, std::vector<u8> *out); // Replaces out with the next message
+        void (*close)(void *ctx);
+    };
+
+    // Boid as it crosses the wire, fixed width so ranks built alike agree on it
+    struct boid_record
+    {
+        float position[3];
+        float velocity[3];
+        uint32_t species;
+        uint32_t pad;
+        uint64_t behaviours;
+    };
+
+    // Message to a neighbour each step: migrants, then ghosts
+    struct message_header
+    {
+        uint32_t num_migrants;
+        uint32_t num_ghosts;
+    };
+
+    // Per rank averages since the last report, passed down the chain of ranks to the last one
+    struct rank_stats
+    {
+        uint32_t rank;
+        uint32_t local_boids;
+        uint32_t ghosts;
+        uint32_t migrated;
+        double compute_ms;
+        double exchange_ms;
+    };
+
+    enum SIDE
+    {
+        SIDE_LEFT = 0,
+        SIDE_RIGHT = 1,
+    };
+
+    struct node
+    {
+        config cfg;
+        transport link;
+        float slab_min; // Owned x range, open towards -inf / +inf at the outer slabs
+        float slab_max;
+        std::vector<ecs::entity_handle> ghosts; // Received last step, replaced next step
+        std::vector<boid_record> outgoing[2];   // Indexed by SIDE
+        u32 num_migrants[2];
+        std::vector<u8> buffer;
+        std::vector<u8> received[2];
+        u32 steps;        // Since the last report
+        u32 migrated;     // Since the last report
+        double compute_ms;
+        double exchange_ms;
+    };
+
+    static inline double elapsed_ms(LARGE_INTEGER start, LARGE_INTEGER end)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return 1000.0 * (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+    }
+
+    // Neighbour slot of a peer, or -1 if the peer is not adjacent
+    static inline int side_of(u32 rank, u32 peer)
+    {
+        if (peer + 1 == rank)
+        {
+            return SIDE_LEFT;
+        }
+        if (peer == rank + 1)
+        {
+            return SIDE_RIGHT;
+        }
+        return -1;
+    }
+
+    /*---- Shared memory transport ----*/
+    // One single producer / single consumer byte ring per direction between neighbours, in a named
+    // mapping both processes open. Messages are a u64 length followed by the payload.
+#define SHM_RING_CAPACITY MEGABYTES(16)
+#define SHM_TIMEOUT_MS 30000
+
+    struct ring_header
+    {
+        volatile LONG64 head; // Bytes ever written
+        volatile LONG64 tail; // Bytes ever read
+    };
+
+    struct shm_ring
+    {
+        HANDLE mapping;
+        ring_header *header;
+        u8 *data;
+        HANDLE data_event;  // Set by the writer after head moves
+        HANDLE space_event; // Set by the reader after tail moves
+    };
+
+    struct shm_context
+    {
+        u32 rank;
+        shm_ring out[2]; // Indexed by SIDE
+        shm_ring in[2];
+    };
+
+    static bool open_ring(shm_ring *ring, const char *session, u32 from, u32 to)
+    {
+        char name[128];
+        snprintf(name, sizeof(name), "Local\\boidnode_%s_%u_%u", session, from, to);
+        const u64 size = sizeof(ring_header) + SHM_RING_CAPACITY;
+        // Whichever end opens the mapping first creates it zeroed, the other end attaches
+        ring->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, name);
+        if (!ring->mapping)
+        {
+            fprintf(stderr, "Distributed: could not create mapping %s\n", name);
+            return false;
+        }
+        ring->header = (ring_header *)MapViewOfFile(ring->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (!ring->header)
+        {
+            fprintf(stderr, "Distributed: could not map %s\n", name);
+            CloseHandle(ring->mapping);
+            ring->mapping = NULL;
+            return false;
+        }
+        ring->data = (u8 *)(ring->header + 1);
+        snprintf(name, sizeof(name), "Local\\boidnode_%s_%u_%u_data", session, from, to);
+        ring->data_event = CreateEventA(NULL, FALSE, FALSE, name);
+        snprintf(name, sizeof(name), "Local\\boidnode_%s_%u_%u_space", session, from, to);
+        ring->space_event = CreateEventA(NULL, FALSE, FALSE, name);
+        return ring->data_event && ring->space_event;
+    }
+
+    static void close_ring(shm_ring *ring)
+    {
+        if (ring->header)
+        {
+            UnmapViewOfFile(ring->header);
+        }
+        if (ring->mapping)
+        {
+            CloseHandle(ring->mapping);
+        }
+        if (ring->data_event)
+        {
+            CloseHandle(ring->data_event);
+        }
+        if (ring->space_event)
+        {
+            CloseHandle(ring->space_event);
+        }
+        *ring = {};
+    }
+
+    static bool ring_write(shm_ring *ring, const u8 *src, u64 size)
+    {
+        u32 waited_ms = 0;
+        while (size > 0)
+        {
+            const LONG64 head = ring->header->head;
+            const LONG64 tail = InterlockedCompareExchange64(&ring->header->tail, 0, 0);
+            const u64 space = SHM_RING_CAPACITY - (u64)(head - tail);
+            if (space == 0)
+            {
+                // Timed waits also cover a wakeup lost between the check and the wait
+                if (++waited_ms > SHM_TIMEOUT_MS)
+                {
+                    fprintf(stderr, "Distributed: timed out writing to a neighbour\n");
+                    return false;
+                }
+                WaitForSingleObject(ring->space_event, 1);
+                continue;
+            }
+            const u64 chunk = min(space, size);
+            const u64 offset = (u64)head % SHM_RING_CAPACITY;
+            const u64 first = min(chunk, SHM_RING_CAPACITY - offset);
+            memcpy(ring->data + offset, src, first);
+            memcpy(ring->data, src + first, chunk - first);
+            InterlockedExchange64(&ring->header->head, head + (LONG64)chunk); // Publishes the bytes
+            SetEvent(ring->data_event);
+            src += chunk;
+            size -= chunk;
+            waited_ms = 0;
+        }
+        return true;
+    }
+
+    static bool ring_read(shm_ring *ring, u8 *dst, u64 size)
+    {
+        u32 waited_ms = 0;
+        while (size > 0)
+        {
+            const LONG64 tail = ring->header->tail;
+            const LONG64 head = InterlockedCompareExchange64(&ring->header->head, 0, 0);
+            const u64 available = (u64)(head - tail);
+            if (available == 0)
+            {
+                if (++waited_ms > SHM_TIMEOUT_MS)
+                {
+                    fprintf(stderr, "Distributed: timed out reading from a neighbour\n");
+                    return false;
+                }
+                WaitForSingleObject(ring->data_event, 1);
+                continue;
+            }
+            const u64 chunk = min(available, size);
+            const u64 offset = (u64)tail % SHM_RING_CAPACITY;
+            const u64 first = min(chunk, SHM_RING_CAPACITY - offset);
+            memcpy(dst, ring->data + offset, first);
+            memcpy(dst + first, ring->data, chunk - first);
+            InterlockedExchange64(&ring->header->tail, tail + (LONG64)chunk); // Hands the space back
+            SetEvent(ring->space_event);
+            dst += chunk;
+            size -= chunk;
+            waited_ms = 0;
+        }
+        return true;
+    }
+
+    static bool shm_send(void *ctx, u32 peer, const void *data, u64 size)
+    {
+        shm_context *shm = (shm_context *)ctx;
+        const int side = side_of(shm->rank, peer);
+        if (side < 0)
+        {
+            return false;
+        }
+        return ring_write(&shm->out[side], (const u8 *)&size, sizeof(size)) && ring_write(&shm->out[side], (const u8 *)data, size);
+    }
+
+    static bool shm_recv(void *ctx, u32 peer, std::vector<u8> *out)
+    {
+        shm_context *shm = (shm_context *)ctx;
+        const int side = side_of(shm->rank, peer);
+        u64 size = 0;
+        if (side < 0 || !ring_read(&shm->in[side], (u8 *)&size, sizeof(size)))
+        {
+            return false;
+        }
+        out->resize(size);
+        return ring_read(&shm->in[side], out->data(), size);
+    }
+
+    static void shm_close(void *ctx)
+    {
+        shm_context *shm = (shm_context *)ctx;
+        for (u32 side = 0; side < 2; ++side)
+        {
+            close_ring(&shm->out[side]);
+            close_ring(&shm->in[side]);
+        }
+        free(shm);
+    }
+
+    static bool open_shared_memory(transport *link, const config *cfg)
+    {
+        shm_context *shm = (shm_context *)calloc(1, sizeof(shm_context));
+        shm->rank = cfg->rank;
+        bool ok = true;
+        if (cfg->rank > 0)
+        {
+            ok = ok && open_ring(&shm->out[SIDE_LEFT], cfg->session, cfg->rank, cfg->rank - 1);
+            ok = ok && open_ring(&shm->in[SIDE_LEFT], cfg->session, cfg->rank - 1, cfg->rank);
+        }
+        if (cfg->rank + 1 < cfg->num_ranks)
+        {
+            ok = ok && open_ring(&shm->out[SIDE_RIGHT], cfg->session, cfg->rank, cfg->rank + 1);
+            ok = ok && open_ring(&shm->in[SIDE_RIGHT], cfg->session, cfg->rank + 1, cfg->rank);
+        }
+        if (!ok)
+        {
+            shm_close(shm);
+            return false;
+        }
+        link->ctx = shm;
+        link->send = shm_send;
+        link->recv = shm_recv;
+        link->close = shm_close;
+        return true;
+    }
+
+    /*---- TCP transport ----*/
+    // One connection per neighbour on the loopback interface. Rank r listens on base_port + r for its
+    // right neighbour and connects to its left neighbour's port.
+#define TCP_CONNECT_ATTEMPTS 600 // 50 ms apart, gives the other processes 30 s to start
+
+    struct tcp_context
+    {
+        u32 rank;
+        SOCKET sockets[2]; // Indexed by SIDE
+    };
+
+    static bool tcp_send_all(SOCKET s, const u8 *data, u64 size)
+    {
+        while (size > 0)
+        {
+            const int chunk = (int)min(size, (u64)(1 << 30));
+            const int sent = send(s, (const char *)data, chunk, 0);
+            if (sent <= 0)
+            {
+                fprintf(stderr, "Distributed: send failed (%d)\n", WSAGetLastError());
+                return false;
+            }
+            data += sent;
+            size -= (u64)sent;
+        }
+        return true;
+    }
+
+    static bool tcp_recv_all(SOCKET s, u8 *data, u64 size)
+    {
+        while (size > 0)
+        {
+            const int chunk = (int)min(size, (u64)(1 << 30));
+            const int received = recv(s, (char *)data, chunk, 0);
+            if (received <= 0)
+            {
+                fprintf(stderr, "Distributed: receive failed (%d)\n", WSAGetLastError());
+                return false;
+            }
+            data += received;
+            size -= (u64)received;
+        }
+        return true;
+    }
+
+    static bool tcp_send(void *ctx, u32 peer, const void *data, u64 size)
+    {
+        tcp_context *tcp = (tcp_context *)ctx;
+        const int side = side_of(tcp->rank, peer);
+        if (side < 0)
+        {
+            return false;
+        }
+        return tcp_send_all(tcp->sockets[side], (const u8 *)&size, sizeof(size)) && tcp_send_all(tcp->sockets[side], (const u8 *)data, size);
+    }
+
+    static bool tcp_recv(void *ctx, u32 peer, std::vector<u8> *out)
+    {
+        tcp_context *tcp = (tcp_context *)ctx;
+        const int side = side_of(tcp->rank, peer);
+        u64 size = 0;
+        if (side < 0 || !tcp_recv_all(tcp->sockets[side], (u8 *)&size, sizeof(size)))
+        {
+            return false;
+        }
+        out->resize(size);
+        return tcp_recv_all(tcp->sockets[side], out->data(), size);
+    }
+
+    static void tcp_close(void *ctx)
+    {
+        tcp_context *tcp = (tcp_context *)ctx;
+        for (u32 side = 0; side < 2; ++side)
+        {
+            if (tcp->sockets[side] != INVALID_SOCKET)
+            {
+                closesocket(tcp->sockets[side]);
+            }
+        }
+        free(tcp);
+        WSACleanup();
+    }
+
+    static inline sockaddr_in loopback_address(u32 port)
+    {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((u_short)port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return address;
+    }
+
+    static bool open_tcp(transport *link, const config *cfg)
+    {
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+        {
+            fprintf(stderr, "Distributed: WSAStartup failed\n");
+            return false;
+        }
+        tcp_context *tcp = (tcp_context *)calloc(1, sizeof(tcp_context));
+        tcp->rank = cfg->rank;
+        tcp->sockets[SIDE_LEFT] = INVALID_SOCKET;
+        tcp->sockets[SIDE_RIGHT] = INVALID_SOCKET;
+
+        // Listen before connecting, the backlog holds the right neighbour's connection until accept
+        SOCKET listener = INVALID_SOCKET;
+        if (cfg->rank + 1 < cfg->num_ranks)
+        {
+            listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            sockaddr_in address = loopback_address(cfg->base_port + cfg->rank);
+            if (listener == INVALID_SOCKET || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 1) != 0)
+            {
+                fprintf(stderr, "Distributed: could not listen on port %u\n", cfg->base_port + cfg->rank);
+                if (listener != INVALID_SOCKET)
+                {
+                    closesocket(listener);
+                }
+                tcp_close(tcp);
+                return false;
+            }
+        }
+
+        if (cfg->rank > 0)
+        {
+            sockaddr_in address = loopback_address(cfg->base_port + cfg->rank - 1);
+            for (u32 attempt = 0; attempt < TCP_CONNECT_ATTEMPTS && tcp->sockets[SIDE_LEFT] == INVALID_SOCKET; ++attempt)
+            {
+                SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+                if (connect(s, (sockaddr *)&address, sizeof(address)) == 0)
+                {
+                    tcp->sockets[SIDE_LEFT] = s;
+                }
+                else
+                {
+                    closesocket(s);
+                    Sleep(50);
+                }
+            }
+        }
+
+        if (listener != INVALID_SOCKET)
+        {
+            tcp->sockets[SIDE_RIGHT] = accept(listener, NULL, NULL);
+            closesocket(listener);
+        }
+
+        if ((cfg->rank > 0 && tcp->sockets[SIDE_LEFT] == INVALID_SOCKET) ||
+            (cfg->rank + 1 < cfg->num_ranks && tcp->sockets[SIDE_RIGHT] == INVALID_SOCKET))
+        {
+            fprintf(stderr, "Distributed: could not connect to a neighbour\n");
+            tcp_close(tcp);
+            return false;
+        }
+
+        // Halo messages are small and latency bound
+        for (u32 side = 0; side < 2; ++side)
+        {
+            if (tcp->sockets[side] != INVALID_SOCKET)
+            {
+                BOOL no_delay = TRUE;
+                setsockopt(tcp->sockets[side], IPPROTO_TCP, TCP_NODELAY, (const char *)&no_delay, sizeof(no_delay));
+            }
+        }
+        link->ctx = tcp;
+        link->send = tcp_send;
+        link->recv = tcp_recv;
+        link->close = tcp_close;
+        return true;
+    }
+
+    /*---- MPI transport ----*/
+#ifdef BOIDNODE_MPI
+    static bool mpi_send(void *ctx, u32 peer, const void *data, u64 size)
+    {
+        return MPI_Send(data, (int)size, MPI_BYTE, (int)peer, 0, MPI_COMM_WORLD) == MPI_SUCCESS;
+    }
+
+    static bool mpi_recv(void *ctx, u32 peer, std::vector<u8> *out)
+    {
+        MPI_Status status;
+        int size = 0;
+        if (MPI_Probe((int)peer, 0, MPI_COMM_WORLD, &status) != MPI_SUCCESS || MPI_Get_count(&status, MPI_BYTE, &size) != MPI_SUCCESS)
+        {
+            return false;
+        }
+        out->resize((u64)size);
+        return MPI_Recv(out->data(), size, MPI_BYTE, (int)peer, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE) == MPI_SUCCESS;
+    }
+
+    static void mpi_close(void *ctx)
+    {
+        MPI_Finalize();
+    }
+
+    // Rank and rank count come from the MPI launcher and override the command line
+    static bool open_mpi(transport *link, config *cfg)
+    {
+        int rank = 0;
+        int num_ranks = 0;
+        if (MPI_Init(NULL, NULL) != MPI_SUCCESS)
+        {
+            return false;
+        }
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+        cfg->rank = (u32)rank;
+        cfg->num_ranks = (u32)num_ranks;
+        link->ctx = nullptr;
+        link->send = mpi_send;
+        link->recv = mpi_recv;
+        link->close = mpi_close;
+        return true;
+    }
+#endif
+
+    /*---- Setup ----*/
+    // Reads --ranks N --rank R --transport shm|tcp|mpi --session NAME --port P --report STEPS from the
+    // command line. Returns false, leaving distributed mode off, if --ranks is missing. --ranks 1 runs
+    // alone and only records the single rank baseline for the scaling report.
+    bool parse_args(const char *cmd_line, config *cfg)
+    {
+        *cfg = {};
+        cfg->kind = TRANSPORT_SHARED_MEMORY;
+        strncpy(cfg->session, "boids", sizeof(cfg->session) - 1);
+        cfg->base_port = 27500;
+        cfg->report_steps = 600;
+
+        char value[64];
+        for (const char *s = cmd_line ? strstr(cmd_line, "--") : nullptr; s; s = strstr(s + 2, "--"))
+        {
+            char name[32] = {};
+            value[0] = '\0';
+            if (sscanf(s + 2, "%31s %63s", name, value) < 1)
+            {
+                continue;
+            }
+            if (strcmp(name, "ranks") == 0)
+            {
+                cfg->num_ranks = (u32)strtoul(value, NULL, 10);
+            }
+            else if (strcmp(name, "rank") == 0)
+            {
+                cfg->rank = (u32)strtoul(value, NULL, 10);
+            }
+            else if (strcmp(name, "transport") == 0)
+            {
+                cfg->kind = strcmp(value, "tcp") == 0 ? TRANSPORT_TCP : strcmp(value, "mpi") == 0 ? TRANSPORT_MPI : TRANSPORT_SHARED_MEMORY;
+            }
+            else if (strcmp(name, "session") == 0)
+            {
+                strncpy(cfg->session, value, sizeof(cfg->session) - 1);
+            }
+            else if (strcmp(name, "port") == 0)
+            {
+                cfg->base_port = (u32)strtoul(value, NULL, 10);
+            }
+            else if (strcmp(name, "report") == 0)
+            {
+                cfg->report_steps = (u32)strtoul(value, NULL, 10);
+            }
+        }
+        if (cfg->kind == TRANSPORT_MPI)
+        {
+            return true; // The launcher decides the ranks
+        }
+        if (cfg->num_ranks < 1 || cfg->rank >= cfg->num_ranks)
+        {
+            cfg->num_ranks = 0;
+            return false;
+        }
+        return true;
+    }
+
+    // This rank's share of a population split evenly across ranks
+    static inline u32 share(const config *cfg, u32 total)
+    {
+        return total / cfg->num_ranks + (cfg->rank < total % cfg->num_ranks ? 1 : 0);
+    }
+
+    // Connects to the neighbours (num_ranks of 2 or more) and cuts [-extent, extent] into slabs aligned to cells of cell_size.
+    // Blocks until every neighbour is reachable. Returns false if the transport could not be opened.
+    bool init(node *n, const config *cfg, float extent, float cell_size)
+    {
+        ZoneScoped;
+        n->cfg = *cfg;
+        bool opened = false;
+        switch (cfg->kind)
+        {
+        case TRANSPORT_SHARED_MEMORY:
+            opened = open_shared_memory(&n->link, &n->cfg);
+            break;
+        case TRANSPORT_TCP:
+            opened = open_tcp(&n->link, &n->cfg);
+            break;
+        case TRANSPORT_MPI:
+#ifdef BOIDNODE_MPI
+            opened = open_mpi(&n->link, &n->cfg);
+#else
+            fprintf(stderr, "Distributed: built without BOIDNODE_MPI\n");
+#endif
+            break;
+        }
+        if (!opened)
+        {
+            n->cfg.num_ranks = 0;
+            return false;
+        }
+
+        // Boundaries snap to the hash grid so no cell straddles two ranks
+        const float cells = ceilf(2.0f * extent / cell_size);
+        const float cells_per_slab = fmaxf(1.0f, floorf(cells / (float)n->cfg.num_ranks));
+        const float grid_min = -0.5f * cells * cell_size;
+        n->slab_min = n->cfg.rank == 0 ? -FLT_MAX : grid_min + (float)n->cfg.rank * cells_per_slab * cell_size;
+        n->slab_max = n->cfg.rank + 1 == n->cfg.num_ranks ? FLT_MAX : grid_min + (float)(n->cfg.rank + 1) * cells_per_slab * cell_size;
+        printf("Distributed: rank %u of %u owns x in [%g, %g)\n", n->cfg.rank, n->cfg.num_ranks, n->slab_min, n->slab_max);
+        return true;
+    }
+
+    // Closes the transport. Ghosts still in sim are queued for removal, its own boids stay.
+    void shutdown(node *n, simulation::sim_data *sim)
+    {
+        for (u32 i = 0; i < n->ghosts.size(); ++i)
+        {
+            simulation::despawn_boid(sim, n->ghosts[i]);
+        }
+        if (n->cfg.num_ranks > 0 && n->link.close)
+        {
+            n->link.close(n->link.ctx);
+        }
+        *n = {};
+    }
+
+    // Re-places every boid with its x inside this rank's slab, clamped to [-extent, extent], and gives
+    // each rank its own seed. Called once after the initial population is spawned.
+    void scatter(node *n, simulation::sim_data *sim, float extent)
+    {
+        sim->seed ^= (u64)(n->cfg.rank + 1) << 32; // Entity ids repeat across ranks, their draws should not
+        const float lo = fmaxf(n->slab_min, -extent);
+        const float hi = fminf(n->slab_max, extent);
+        for (u32 row = 0; row < sim->num_entities; ++row)
+        {
+            const vec3 u = simulation::random_unit3(sim, row, rng::STREAM_PLACEMENT);
+            sim->positions[row].x = lo + u.x * (hi - lo);
+            sim->positions[row].y = u.y * 2.0f * extent - extent;
+            sim->positions[row].z = u.z * 2.0f * extent - extent;
+        }
+        sim->hash_stale = true;
+    }
+
+    /*---- Step ----*/
+    // Widest radius any behaviour searches, the halo has to cover it
+    static inline float halo_width(const simulation::sim_params *params)
+    {
+        const simulation::behaviour_weights *b = &params->behaviour;
+        return fmaxf(fmaxf(b->seek_radius, fmaxf(b->flee_radius, b->align_radius)), fmaxf(params->predator_radius, params->hunt_radius));
+    }
+
+    static inline boid_record make_record(const simulation::sim_data *sim, u32 row)
+    {
+        boid_record r = {};
+        r.position[0] = sim->positions[row].x;
+        r.position[1] = sim->positions[row].y;
+        r.position[2] = sim->positions[row].z;
+        r.velocity[0] = sim->velocities[row].x;
+        r.velocity[1] = sim->velocities[row].y;
+        r.velocity[2] = sim->velocities[row].z;
+        r.species = (uint32_t)sim->species[row];
+        r.behaviours = sim->behaviours[row];
+        return r;
+    }
+
+    // Sorts owned boids into migrants and ghosts for each neighbour and queues the migrants and last
+    // step's ghosts for removal. Runs before update_sim, whose step boundary removes them.
+    static void collect_outgoing(node *n, simulation::sim_data *sim)
+    {
+        ZoneScoped;
+        const bool has_left = n->cfg.rank > 0;
+        const bool has_right = n->cfg.rank + 1 < n->cfg.num_ranks;
+        const float halo = halo_width(&sim->params);
+        std::vector<boid_record> ghosts[2];
+        for (u32 side = 0; side < 2; ++side)
+        {
+            n->outgoing[side].clear();
+        }
+
+        for (u32 i = 0; i < n->ghosts.size(); ++i)
+        {
+            simulation::despawn_boid(sim, n->ghosts[i]);
+        }
+        n->ghosts.clear();
+
+        for (u32 row = 0; row < sim->num_entities; ++row)
+        {
+            if (sim->behaviours[row] & simulation::BOID_TYPE_GHOST)
+            {
+                continue;
+            }
+            const float x = sim->positions[row].x;
+            if (has_left && x < n->slab_min)
+            {
+                n->outgoing[SIDE_LEFT].push_back(make_record(sim, row));
+                simulation::despawn_boid(sim, ecs::handle_at(sim->world, sim->boids, row));
+                continue;
+            }
+            if (has_right && x >= n->slab_max)
+            {
+                n->outgoing[SIDE_RIGHT].push_back(make_record(sim, row));
+                simulation::despawn_boid(sim, ecs::handle_at(sim->world, sim->boids, row));
+                continue;
+            }
+            // A boid in a slab thinner than the halo is a ghost on both sides
+            if (has_left && x < n->slab_min + halo)
+            {
+                ghosts[SIDE_LEFT].push_back(make_record(sim, row));
+            }
+            if (has_right && x >= n->slab_max - halo)
+            {
+                ghosts[SIDE_RIGHT].push_back(make_record(sim, row));
+            }
+        }
+
+        for (u32 side = 0; side < 2; ++side)
+        {
+            n->num_migrants[side] = (u32)n->outgoing[side].size();
+            n->migrated += n->num_migrants[side];
+            n->outgoing[side].insert(n->outgoing[side].end(), ghosts[side].begin(), ghosts[side].end());
+        }
+    }
+
+    static bool send_side(node *n, u32 side)
+    {
+        const u32 peer = side == SIDE_LEFT ? n->cfg.rank - 1 : n->cfg.rank + 1;
+        message_header header = {n->num_migrants[side], (uint32_t)n->outgoing[side].size() - n->num_migrants[side]};
+        const u64 payload = sizeof(boid_record) * n->outgoing[side].size();
+        n->buffer.resize(sizeof(header) + payload);
+        memcpy(n->buffer.data(), &header, sizeof(header));
+        if (payload)
+        {
+            memcpy(n->buffer.data() + sizeof(header), n->outgoing[side].data(), payload);
+        }
+        return n->link.send(n->link.ctx, peer, n->buffer.data(), n->buffer.size());
+    }
+
+    static bool recv_side(node *n, u32 side)
+    {
+        const u32 peer = side == SIDE_LEFT ? n->cfg.rank - 1 : n->cfg.rank + 1;
+        return n->link.recv(n->link.ctx, peer, &n->received[side]);
+    }
+
+    // Swaps messages with both neighbours. Even ranks send first and odd ranks receive first, so a
+    // blocking send always has a receiver and the chain never deadlocks.
+    static bool exchange(node *n)
+    {
+        ZoneScoped;
+        const bool has_left = n->cfg.rank > 0;
+        const bool has_right = n->cfg.rank + 1 < n->cfg.num_ranks;
+        for (u32 side = 0; side < 2; ++side)
+        {
+            n->received[side].clear();
+        }
+        if (n->cfg.rank % 2 == 0)
+        {
+            if (has_right && !(send_side(n, SIDE_RIGHT) && recv_side(n, SIDE_RIGHT)))
+            {
+                return false;
+            }
+            if (has_left && !(send_side(n, SIDE_LEFT) && recv_side(n, SIDE_LEFT)))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            if (has_left && !(recv_side(n, SIDE_LEFT) && send_side(n, SIDE_LEFT)))
+            {
+                return false;
+            }
+            if (has_right && !(recv_side(n, SIDE_RIGHT) && send_side(n, SIDE_RIGHT)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Spawns the boids a neighbour sent: migrants become owned boids, ghosts are tracked for removal
+    static void accept_incoming(node *n, simulation::sim_data *sim)
+    {
+        ZoneScoped;
+        std::vector<vec3> positions;
+        std::vector<vec3> velocities;
+        std::vector<ecs::entity_handle> handles;
+        for (u32 side = 0; side < 2; ++side)
+        {
+            const std::vector<u8> *message = &n->received[side];
+            if (message->size() < sizeof(message_header))
+            {
+                continue;
+            }
+            message_header header;
+            memcpy(&header, message->data(), sizeof(header));
+            const u32 count = header.num_migrants + header.num_ghosts;
+            if (message->size() != sizeof(header) + sizeof(boid_record) * (u64)count)
+            {
+                fprintf(stderr, "Distributed: malformed message from a neighbour\n");
+                continue;
+            }
+            const boid_record *records = (const boid_record *)(message->data() + sizeof(header));
+
+            positions.resize(count);
+            velocities.resize(count);
+            handles.resize(count);
+            for (u32 i = 0; i < count; ++i)
+            {
+                positions[i] = {records[i].position[0], records[i].position[1], records[i].position[2]};
+                velocities[i] = {records[i].velocity[0], records[i].velocity[1], records[i].velocity[2]};
+            }
+            const u32 spawned = simulation::spawn_boids(sim, count, positions.data(), velocities.data(), handles.data());
+            const u32 first = (u32)sim->num_entities - spawned;
+            for (u32 i = 0; i < spawned; ++i)
+            {
+                sim->species[first + i] = records[i].species;
+                sim->behaviours[first + i] = i < header.num_migrants ? records[i].behaviours : (u64)simulation::BOID_TYPE_GHOST;
+                if (i >= header.num_migrants)
+                {
+                    n->ghosts.push_back(handles[i]);
+                }
+            }
+        }
+    }
+
+    // Prints the slowest rank's step time and appends it to scaling.csv. With the single rank runs in
+    // the same file, strong scaling efficiency is T1 / (N * TN) at the same total population and weak
+    // scaling efficiency is T1 / TN at the same population per rank. Every rank must call it together.
+    static bool report(node *n, const simulation::sim_data *sim)
+    {
+        ZoneScoped;
+        u32 local = 0;
+        for (u32 row = 0; row < sim->num_entities; ++row)
+        {
+            local += (sim->behaviours[row] & simulation::BOID_TYPE_GHOST) ? 0 : 1;
+        }
+        rank_stats own = {};
+        own.rank = n->cfg.rank;
+        own.local_boids = local;
+        own.ghosts = (uint32_t)n->ghosts.size();
+        own.migrated = n->migrated;
+        own.compute_ms = n->steps ? n->compute_ms / n->steps : 0.0;
+        own.exchange_ms = n->steps ? n->exchange_ms / n->steps : 0.0;
+        n->steps = 0;
+        n->migrated = 0;
+        n->compute_ms = 0.0;
+        n->exchange_ms = 0.0;
+
+        // Stats travel down the chain, each rank appending its own, so only neighbours talk
+        std::vector<u8> gathered;
+        if (n->cfg.rank > 0 && !n->link.recv(n->link.ctx, n->cfg.rank - 1, &gathered))
+        {
+            return false;
+        }
+        gathered.insert(gathered.end(), (const u8 *)&own, (const u8 *)(&own + 1));
+        if (n->cfg.rank + 1 < n->cfg.num_ranks)
+        {
+            return n->link.send(n->link.ctx, n->cfg.rank + 1, gathered.data(), gathered.size());
+        }
+
+        const rank_stats *stats = (const rank_stats *)gathered.data();
+        const u32 num_ranks = (u32)(gathered.size() / sizeof(rank_stats));
+        u64 total = 0;
+        double step_ms = 0.0;
+        double compute_ms = 0.0;
+        double exchange_ms = 0.0;
+        for (u32 r = 0; r < num_ranks; ++r)
+        {
+            total += stats[r].local_boids;
+            step_ms = fmax(step_ms, stats[r].compute_ms + stats[r].exchange_ms);
+            compute_ms = fmax(compute_ms, stats[r].compute_ms);
+            exchange_ms = fmax(exchange_ms, stats[r].exchange_ms);
+            printf("Distributed: rank %u  boids %u  ghosts %u  migrated %u  compute %.3f ms  exchange %.3f ms\n",
+                   stats[r].rank, stats[r].local_boids, stats[r].ghosts, stats[r].migrated, stats[r].compute_ms, stats[r].exchange_ms);
+        }
+
+        // Baselines are the latest single rank runs recorded at the matching populations
+        double strong_t1 = 0.0;
+        double weak_t1 = 0.0;
+        const u64 per_rank = total / num_ranks;
+        FILE *file = fopen("scaling.csv", "r");
+        if (file)
+        {
+            char line[256];
+            while (fgets(line, sizeof(line), file))
+            {
+                unsigned ranks = 0;
+                unsigned long long boids = 0;
+                double ms = 0.0;
+                if (sscanf(line, "%u,%llu,%lf", &ranks, &boids, &ms) != 3 || ranks != 1)
+                {
+                    continue;
+                }
+                // Migration keeps totals exact, but single rank baselines are often run at round numbers
+                if (boids * 100 >= total * 99 && boids * 100 <= total * 101)
+                {
+                    strong_t1 = ms;
+                }
+                if (boids * 100 >= per_rank * 95 && boids * 100 <= per_rank * 105)
+                {
+                    weak_t1 = ms;
+                }
+            }
+            fclose(file);
+        }
+        printf("Distributed: %u ranks  %llu boids  step %.3f ms (compute %.3f, exchange %.3f)\n",
+               num_ranks, (unsigned long long)total, step_ms, compute_ms, exchange_ms);
+        if (strong_t1 > 0.0 && step_ms > 0.0)
+        {
+            printf("Distributed: strong scaling %.2fx, efficiency %.0f%%\n", strong_t1 / step_ms, 100.0 * strong_t1 / (num_ranks * step_ms));
+        }
+        if (weak_t1 > 0.0 && step_ms > 0.0)
+        {
+            printf("Distributed: weak scaling efficiency %.0f%%\n", 100.0 * weak_t1 / step_ms);
+        }
+        if (strong_t1 == 0.0 && weak_t1 == 0.0)
+        {
+            printf("Distributed: no single rank baseline in scaling.csv, run with --ranks 1 to record one\n");
+        }
+
+        file = fopen("scaling.csv", "a");
+        if (file)
+        {
+            fprintf(file, "%u,%llu,%.4f,%.4f,%.4f\n", num_ranks, (unsigned long long)total, step_ms, compute_ms, exchange_ms);
+            fclose(file);
+        }
+        return true;
+    }
+
+    // Runs one distributed step: migration and halo exchange with the neighbours, then update_sim.
+    // Returns false if a neighbour could not be reached, the caller should fall back to update_sim.
+    bool step(node *n, simulation::sim_data *sim, float delta_time)
+    {
+        ZoneScoped;
+        LARGE_INTEGER exchange_start, exchange_end, compute_end;
+        QueryPerformanceCounter(&exchange_start);
+        collect_outgoing(n, sim);
+        if (!exchange(n))
+        {
+            return false;
+        }
+        accept_incoming(n, sim);
+        QueryPerformanceCounter(&exchange_end);
+
+        simulation::update_sim(sim, delta_time);
+        QueryPerformanceCounter(&compute_end);
+        n->exchange_ms += elapsed_ms(exchange_start, exchange_end);
+        n->compute_ms += elapsed_ms(exchange_end, compute_end);
+        n->steps++;
+
+        if (n->cfg.report_steps > 0 && n->steps >= n->cfg.report_steps)
+        {
+            return report(n, sim);
+        }
+        return true;
+    }
+
+    // Single rank baseline for the scaling report: times update_sim alone and records it in
+    // scaling.csv every report_steps steps, so later multi rank runs have something to compare with.
+    void record_baseline(node *n, simulation::sim_data *sim, float delta_time)
+    {
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        simulation::update_sim(sim, delta_time);
+        QueryPerformanceCounter(&end);
+        n->compute_ms += elapsed_ms(start, end);
+        n->steps++;
+        if (n->cfg.report_steps > 0 && n->steps >= n->cfg.report_steps)
+        {
+            const double step_ms = n->compute_ms / n->steps;
+            n->steps = 0;
+            n->compute_ms = 0.0;
+            FILE *file = fopen("scaling.csv", "a");
+            if (file)
+            {
+                fprintf(file, "1,%llu,%.4f,%.4f,0\n", (unsigned long long)sim->num_entities, step_ms, step_ms);
+                fclose(file);
+            }
+            printf("Distributed: baseline %llu boids  step %.3f ms\n", (unsigned long long)sim->num_entities, step_ms);
+        }
+    }
+}
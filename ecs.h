@@ -0,0 +1,700 @@
+#pragma once
+#include <windows.h>
+#include <vector>
+#include <unordered_map>
+#include "stdio.h"
+#include "string.h"
+#include "types.h"
+#include "memory_pool.h"
+#include "boid_thread.h"
+#include "tracy\public\tracy\Tracy.hpp"
+
+// Archetype based entity component system shared by the simulation and the node graph.
+//
+// Entities with the same component mask live in one archetype, which stores each component as its
+// own contiguous column (SoA). Columns reserve address space for max_rows up front and commit it in
+// chunks of ECS_CHUNK_ROWS as the archetype grows, so a column never moves: pointers into it stay
+// valid for the lifetime of the world and growing never copies. Despawning swaps the last row into
+// the hole, keeping every column dense.
+//
+// Structural changes (spawn, despawn, set_components) must happen on one thread and never while a
+// system is iterating. Reading and writing component data from systems is free of any locking.
+//
+// On NUMA machines each chunk of rows is committed on one node, round robin, and parallel systems
+// queue the rows of a chunk for that node's workers, so the kernel mostly reads local memory.
+namespace ecs
+{
+#define ECS_MAX_COMPONENTS 64
+#define ECS_MAX_ARCHETYPES 256
+#define ECS_CHUNK_ROWS 16384
+#define ECS_INVALID_INDEX 0xFFFFFFFF
+#define ECS_COMPONENT_BIT(id) ((ecs::component_mask)1 << (id))
+#define ECS_PAGE_SIZE 4096
+
+    // Where committed rows are placed when the thread pool spans several NUMA nodes
+    enum PLACEMENT
+    {
+        PLACEMENT_LOCAL,       // A chunk lives on the node whose workers process it
+        PLACEMENT_INTERLEAVED, // Pages alternate between nodes, for comparison
+    };
+
+    typedef u32 component_id;
+    typedef u64 component_mask;
+
+    // Generational handle. A despawned entity's index is reused, its generation is bumped so stale
+    // handles are detected. Generation 0 is never issued, so a zeroed handle is the null handle.
+    struct entity_handle
+    {
+        u32 index;
+        u32 generation;
+    };
+
+    struct component_info
+    {
+        char name[32];
+        u32 size;
+    };
+
+    struct archetype
+    {
+        component_mask mask;
+        u8 *columns[ECS_MAX_COMPONENTS]; // Indexed by component id, null when not part of the archetype
+        u32 *entity_indices;             // Row -> entity index, for fixing up records on swap-remove
+        u32 count;                       // Live rows
+        u32 committed_rows;              // Rows backed by committed memory in every column
+    };
+
+    struct entity_record
+    {
+        u32 archetype; // ECS_INVALID_INDEX while the index is free
+        u32 row;
+        u32 generation;
+    };
+
+    struct world
+    {
+        component_info components[ECS_MAX_COMPONENTS];
+        u32 num_components;
+
+        archetype archetypes[ECS_MAX_ARCHETYPES]; // Fixed, so archetype pointers stay valid
+        u32 num_archetypes;
+        std::unordered_map<component_mask, u32> archetype_lookup;
+
+        u32 max_rows; // Reserved capacity of every archetype
+        PLACEMENT placement;
+        std::vector<entity_record> records;
+        std::vector<u32> free_indices;
+    };
+
+    // View of a contiguous run of rows handed to a system
+    struct chunk_view
+    {
+        archetype *arch;
+        u32 start; // First row
+        u32 count;
+    };
+
+    typedef void (*system_func)(chunk_view *chunk, void *user_data, u32 thread_id, mpool::memory_pool *thread_memory);
+
+    static inline void *column(archetype *arch, component_id id)
+    {
+        return arch->columns[id];
+    }
+
+    template <typename T>
+    static inline T *column(archetype *arch, component_id id)
+    {
+        return (T *)arch->columns[id];
+    }
+
+    world *create_world(u32 max_rows_per_archetype)
+    {
+        world *w = new world();
+        w->num_components = 0;
+        w->num_archetypes = 0;
+        w->max_rows = max_rows_per_archetype;
+        w->placement = PLACEMENT_LOCAL;
+        return w;
+    }
+
+    void destroy_world(world *w)
+    {
+        if (!w)
+        {
+            return;
+        }
+        for (u32 a = 0; a < w->num_archetypes; ++a)
+        {
+            archetype *arch = &w->archetypes[a];
+            for (u32 c = 0; c < ECS_MAX_COMPONENTS; ++c)
+            {
+                if (arch->columns[c])
+                {
+                    VirtualFree(arch->columns[c], 0, MEM_RELEASE);
+                }
+            }
+            VirtualFree(arch->entity_indices, 0, MEM_RELEASE);
+        }
+        delete w;
+    }
+
+    // Registers a component type. Registering an existing name returns its id, so modules sharing a
+    // world can each register what they use without coordinating.
+    component_id register_component(world *w, const char *name, u32 size)
+    {
+        for (u32 i = 0; i < w->num_components; ++i)
+        {
+            if (strcmp(w->components[i].name, name) == 0)
+            {
+                if (w->components[i].size != size)
+                {
+                    fprintf(stderr, "ECS component %s registered with conflicting sizes\n", name);
+                }
+                return i;
+            }
+        }
+        if (w->num_components >= ECS_MAX_COMPONENTS)
+        {
+            fprintf(stderr, "ECS component limit reached, cannot register %s\n", name);
+            return ECS_INVALID_INDEX;
+        }
+        component_info *info = &w->components[w->num_components];
+        strncpy(info->name, name, sizeof(info->name) - 1);
+        info->name[sizeof(info->name) - 1] = 0;
+        info->size = size;
+        return w->num_components++;
+    }
+
+    static inline u8 *reserve_column(u32 max_rows, u32 size)
+    {
+        return (u8 *)VirtualAlloc(NULL, (SIZE_T)max_rows * size, MEM_RESERVE, PAGE_READWRITE);
+    }
+
+    // Finds the archetype storing exactly this mask, creating it on first use
+    archetype *get_archetype(world *w, component_mask mask)
+    {
+        auto it = w->archetype_lookup.find(mask);
+        if (it != w->archetype_lookup.end())
+        {
+            return &w->archetypes[it->second];
+        }
+        if (w->num_archetypes >= ECS_MAX_ARCHETYPES)
+        {
+            fprintf(stderr, "ECS archetype limit reached\n");
+            return nullptr;
+        }
+
+        u32 index = w->num_archetypes++;
+        archetype *arch = &w->archetypes[index];
+        memset(arch, 0, sizeof(archetype));
+        arch->mask = mask;
+        arch->entity_indices = (u32 *)reserve_column(w->max_rows, sizeof(u32));
+        for (u32 c = 0; c < w->num_components; ++c)
+        {
+            if (mask & ECS_COMPONENT_BIT(c))
+            {
+                arch->columns[c] = reserve_column(w->max_rows, w->components[c].size);
+            }
+        }
+        w->archetype_lookup[mask] = index;
+        return arch;
+    }
+
+    static inline u32 archetype_index(world *w, const archetype *arch)
+    {
+        return (u32)(arch - w->archetypes);
+    }
+
+    static inline u32 num_nodes()
+    {
+        return thread_pool::g_thread_pool ? thread_pool::g_thread_pool->num_nodes : 1;
+    }
+
+    // Pool node whose workers process a row, and which holds its chunk under PLACEMENT_LOCAL
+    static inline u32 row_node(u32 row)
+    {
+        return (row / ECS_CHUNK_ROWS) % num_nodes();
+    }
+
+    // Commits the bytes of one chunk of a column. Chunk starts are page aligned, as ECS_CHUNK_ROWS is a
+    // multiple of the page size.
+    static bool commit_chunk(const world *w, u8 *base, SIZE_T bytes, u32 chunk)
+    {
+        const u32 nodes = num_nodes();
+        if (nodes <= 1)
+        {
+            return VirtualAlloc(base, bytes, MEM_COMMIT, PAGE_READWRITE) != NULL;
+        }
+        const thread_pool::thread_pool *pool = thread_pool::g_thread_pool;
+        if (w->placement == PLACEMENT_LOCAL)
+        {
+            return VirtualAllocExNuma(GetCurrentProcess(), base, bytes, MEM_COMMIT, PAGE_READWRITE, pool->node_numbers[chunk % nodes]) != NULL;
+        }
+        for (SIZE_T offset = 0; offset < bytes; offset += ECS_PAGE_SIZE)
+        {
+            const u32 node = (u32)((uintptr_t)(base + offset) / ECS_PAGE_SIZE % nodes);
+            if (!VirtualAllocExNuma(GetCurrentProcess(), base + offset, min((SIZE_T)ECS_PAGE_SIZE, bytes - offset), MEM_COMMIT, PAGE_READWRITE, pool->node_numbers[node]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Commits the next chunk of every column. Returns false if the reservation is exhausted.
+    static bool grow_archetype(world *w, archetype *arch)
+    {
+        ZoneScoped;
+        if (arch->committed_rows >= w->max_rows)
+        {
+            return false;
+        }
+        u32 rows = min((u32)ECS_CHUNK_ROWS, w->max_rows - arch->committed_rows);
+        const u32 chunk = arch->committed_rows / ECS_CHUNK_ROWS;
+        bool ok = commit_chunk(w, (u8 *)(arch->entity_indices + arch->committed_rows), (SIZE_T)rows * sizeof(u32), chunk);
+        for (u32 c = 0; c < w->num_components && ok; ++c)
+        {
+            if (arch->columns[c])
+            {
+                u32 size = w->components[c].size;
+                ok = commit_chunk(w, arch->columns[c] + (SIZE_T)arch->committed_rows * size, (SIZE_T)rows * size, chunk);
+            }
+        }
+        if (!ok)
+        {
+            fprintf(stderr, "ECS failed to commit archetype storage\n");
+            return false;
+        }
+        arch->committed_rows += rows;
+        return true;
+    }
+
+    // Moves a reserved column to fresh storage committed under the world's placement
+    static u8 *replace_column(const world *w, u8 *old_column, u32 committed_rows, u32 count, u32 size)
+    {
+        u8 *column = reserve_column(w->max_rows, size);
+        if (!column)
+        {
+            return nullptr;
+        }
+        for (u32 row = 0; row < committed_rows; row += ECS_CHUNK_ROWS)
+        {
+            const u32 rows = min((u32)ECS_CHUNK_ROWS, committed_rows - row);
+            if (!commit_chunk(w, column + (SIZE_T)row * size, (SIZE_T)rows * size, row / ECS_CHUNK_ROWS))
+            {
+                VirtualFree(column, 0, MEM_RELEASE);
+                return nullptr;
+            }
+        }
+        memcpy(column, old_column, (SIZE_T)count * size);
+        VirtualFree(old_column, 0, MEM_RELEASE);
+        return column;
+    }
+
+    // Changes where rows are placed across NUMA nodes and moves every existing column to match. This
+    // breaks the rule that columns never move: every pointer into the world is stale afterwards and
+    // holders must refresh their views. Only meant for benchmarks, between steps.
+    void set_placement(world *w, PLACEMENT placement)
+    {
+        ZoneScoped;
+        w->placement = placement;
+        if (num_nodes() <= 1)
+        {
+            return;
+        }
+        for (u32 a = 0; a < w->num_archetypes; ++a)
+        {
+            archetype *arch = &w->archetypes[a];
+            if (arch->committed_rows == 0)
+            {
+                continue;
+            }
+            u8 *indices = replace_column(w, (u8 *)arch->entity_indices, arch->committed_rows, arch->count, sizeof(u32));
+            if (indices)
+            {
+                arch->entity_indices = (u32 *)indices;
+            }
+            for (u32 c = 0; c < w->num_components; ++c)
+            {
+                if (arch->columns[c])
+                {
+                    u8 *column = replace_column(w, arch->columns[c], arch->committed_rows, arch->count, w->components[c].size);
+                    if (column)
+                    {
+                        arch->columns[c] = column;
+                    }
+                }
+            }
+        }
+    }
+
+    // Appends a zeroed row for entity_index, returns the row or ECS_INVALID_INDEX when full
+    static u32 push_row(world *w, archetype *arch, u32 entity_index)
+    {
+        if (arch->count == arch->committed_rows && !grow_archetype(w, arch))
+        {
+            fprintf(stderr, "ECS archetype full (%u rows)\n", (unsigned)arch->count);
+            return ECS_INVALID_INDEX;
+        }
+        u32 row = arch->count++;
+        arch->entity_indices[row] = entity_index;
+        for (u32 c = 0; c < w->num_components; ++c)
+        {
+            if (arch->columns[c])
+            {
+                u32 size = w->components[c].size;
+                memset(arch->columns[c] + (SIZE_T)row * size, 0, size);
+            }
+        }
+        return row;
+    }
+
+    // Removes a row by moving the last row into it, keeping the columns dense
+    static void swap_remove_row(world *w, archetype *arch, u32 row)
+    {
+        u32 last = arch->count - 1;
+        if (row != last)
+        {
+            for (u32 c = 0; c < w->num_components; ++c)
+            {
+                if (arch->columns[c])
+                {
+                    u32 size = w->components[c].size;
+                    memcpy(arch->columns[c] + (SIZE_T)row * size, arch->columns[c] + (SIZE_T)last * size, size);
+                }
+            }
+            u32 moved = arch->entity_indices[last];
+            arch->entity_indices[row] = moved;
+            w->records[moved].row = row;
+        }
+        arch->count--;
+    }
+
+    static inline bool is_alive(const world *w, entity_handle e)
+    {
+        return e.index < w->records.size() &&
+               w->records[e.index].generation == e.generation &&
+               w->records[e.index].archetype != ECS_INVALID_INDEX;
+    }
+
+    entity_handle spawn(world *w, component_mask mask)
+    {
+        entity_handle handle = {};
+        archetype *arch = get_archetype(w, mask);
+        if (!arch)
+        {
+            return handle;
+        }
+
+        u32 index;
+        if (!w->free_indices.empty())
+        {
+            index = w->free_indices.back();
+            w->free_indices.pop_back();
+        }
+        else
+        {
+            index = (u32)w->records.size();
+            entity_record record = {ECS_INVALID_INDEX, 0, 1};
+            w->records.push_back(record);
+        }
+
+        u32 row = push_row(w, arch, index);
+        if (row == ECS_INVALID_INDEX)
+        {
+            w->free_indices.push_back(index);
+            return handle;
+        }
+        entity_record *record = &w->records[index];
+        record->archetype = archetype_index(w, arch);
+        record->row = row;
+
+        handle.index = index;
+        handle.generation = record->generation;
+        return handle;
+    }
+
+    // Spawns count entities into one archetype. Storage is committed once for the whole batch and
+    // each column is zeroed with a single memset. out_handles may be null. Returns the first new row,
+    // the batch occupies [first, first + spawned) where spawned is written to out_spawned.
+    u32 spawn_batch(world *w, component_mask mask, u32 count, entity_handle *out_handles, u32 *out_spawned)
+    {
+        ZoneScoped;
+        *out_spawned = 0;
+        archetype *arch = get_archetype(w, mask);
+        if (!arch || count == 0)
+        {
+            return arch ? arch->count : 0;
+        }
+
+        u32 first = arch->count;
+        if (count > w->max_rows - first)
+        {
+            fprintf(stderr, "ECS archetype full, spawning %u of %u\n", (unsigned)(w->max_rows - first), (unsigned)count);
+            count = w->max_rows - first;
+        }
+        while (arch->committed_rows < first + count)
+        {
+            if (!grow_archetype(w, arch))
+            {
+                count = arch->committed_rows - first;
+                break;
+            }
+        }
+
+        for (u32 c = 0; c < w->num_components; ++c)
+        {
+            if (arch->columns[c])
+            {
+                u32 size = w->components[c].size;
+                memset(arch->columns[c] + (SIZE_T)first * size, 0, (SIZE_T)count * size);
+            }
+        }
+
+        u32 arch_index = archetype_index(w, arch);
+        for (u32 i = 0; i < count; ++i)
+        {
+            u32 index;
+            if (!w->free_indices.empty())
+            {
+                index = w->free_indices.back();
+                w->free_indices.pop_back();
+            }
+            else
+            {
+                index = (u32)w->records.size();
+                entity_record record = {ECS_INVALID_INDEX, 0, 1};
+                w->records.push_back(record);
+            }
+            entity_record *record = &w->records[index];
+            record->archetype = arch_index;
+            record->row = first + i;
+            arch->entity_indices[first + i] = index;
+            if (out_handles)
+            {
+                out_handles[i].index = index;
+                out_handles[i].generation = record->generation;
+            }
+        }
+        arch->count += count;
+        *out_spawned = count;
+        return first;
+    }
+
+    // Handle of the entity currently stored in a row
+    static inline entity_handle handle_at(const world *w, const archetype *arch, u32 row)
+    {
+        entity_handle handle = {};
+        if (row < arch->count)
+        {
+            handle.index = arch->entity_indices[row];
+            handle.generation = w->records[handle.index].generation;
+        }
+        return handle;
+    }
+
+    bool despawn(world *w, entity_handle e)
+    {
+        if (!is_alive(w, e))
+        {
+            return false;
+        }
+        entity_record *record = &w->records[e.index];
+        swap_remove_row(w, &w->archetypes[record->archetype], record->row);
+        record->archetype = ECS_INVALID_INDEX;
+        record->generation++;
+        if (record->generation == 0)
+        {
+            record->generation = 1; // Skip the null generation on wrap
+        }
+        w->free_indices.push_back(e.index);
+        return true;
+    }
+
+    // Despawns every entity of an archetype. Committed storage is kept for reuse.
+    void clear_archetype(world *w, archetype *arch)
+    {
+        ZoneScoped;
+        for (u32 row = 0; row < arch->count; ++row)
+        {
+            u32 index = arch->entity_indices[row];
+            entity_record *record = &w->records[index];
+            record->archetype = ECS_INVALID_INDEX;
+            record->generation = record->generation + 1 ? record->generation + 1 : 1;
+            w->free_indices.push_back(index);
+        }
+        arch->count = 0;
+    }
+
+    // Moves an entity to the archetype for new_mask, keeping the components both masks share
+    bool set_components(world *w, entity_handle e, component_mask new_mask)
+    {
+        if (!is_alive(w, e))
+        {
+            return false;
+        }
+        entity_record *record = &w->records[e.index];
+        archetype *src = &w->archetypes[record->archetype];
+        if (src->mask == new_mask)
+        {
+            return true;
+        }
+        archetype *dst = get_archetype(w, new_mask);
+        if (!dst)
+        {
+            return false;
+        }
+        u32 dst_row = push_row(w, dst, e.index);
+        if (dst_row == ECS_INVALID_INDEX)
+        {
+            return false;
+        }
+
+        u32 src_row = record->row;
+        component_mask shared = src->mask & new_mask;
+        for (u32 c = 0; c < w->num_components; ++c)
+        {
+            if (shared & ECS_COMPONENT_BIT(c))
+            {
+                u32 size = w->components[c].size;
+                memcpy(dst->columns[c] + (SIZE_T)dst_row * size, src->columns[c] + (SIZE_T)src_row * size, size);
+            }
+        }
+        swap_remove_row(w, src, src_row);
+        record->archetype = archetype_index(w, dst);
+        record->row = dst_row;
+        return true;
+    }
+
+    static inline component_mask get_mask(const world *w, entity_handle e)
+    {
+        return is_alive(w, e) ? w->archetypes[w->records[e.index].archetype].mask : 0;
+    }
+
+    // Returns the entity's component, or null if the handle is stale or the entity lacks it.
+    // The pointer stays valid until the entity is despawned, moved by set_components, or another
+    // entity in its archetype is despawned.
+    static inline void *get_component(world *w, entity_handle e, component_id id)
+    {
+        if (!is_alive(w, e))
+        {
+            return nullptr;
+        }
+        const entity_record *record = &w->records[e.index];
+        u8 *col = w->archetypes[record->archetype].columns[id];
+        return col ? col + (SIZE_T)record->row * w->components[id].size : nullptr;
+    }
+
+    template <typename T>
+    static inline T *get(world *w, entity_handle e, component_id id)
+    {
+        return (T *)get_component(w, e, id);
+    }
+
+    /*------------------------------ Iteration ------------------------------*/
+    // Calls func serially for every archetype containing all required components
+    void for_each(world *w, component_mask required, system_func func, void *user_data)
+    {
+        ZoneScoped;
+        for (u32 a = 0; a < w->num_archetypes; ++a)
+        {
+            archetype *arch = &w->archetypes[a];
+            if ((arch->mask & required) == required && arch->count > 0)
+            {
+                chunk_view view = {arch, 0, arch->count};
+                func(&view, user_data, 0, nullptr);
+            }
+        }
+    }
+
+    struct system_task
+    {
+        system_func func;
+        void *user_data;
+        chunk_view view;
+    };
+
+    static void system_task_worker(void *data, u32 thread_id, mpool::memory_pool *thread_memory)
+    {
+        ZoneScoped;
+        system_task *task = (system_task *)data;
+        task->func(&task->view, task->user_data, thread_id, thread_memory);
+    }
+
+    // Splits the rows of the given archetypes into tasks of rows_per_task rows and runs them on the
+    // thread pool. Returns when every task has finished.
+    static void run_parallel(archetype **archs, u32 num_archs, system_func func, void *user_data, u32 rows_per_task)
+    {
+        ZoneScoped;
+        u32 total_rows = 0;
+        for (u32 a = 0; a < num_archs; ++a)
+        {
+            total_rows += archs[a]->count;
+        }
+        if (total_rows == 0)
+        {
+            return;
+        }
+
+        // The work queue is a fixed ring, never submit more tasks than it holds at once
+        u32 max_tasks = (u32)thread_pool::g_thread_pool->queue_size;
+        u32 task_budget = max_tasks > num_archs ? max_tasks - num_archs : 1;
+        rows_per_task = rows_per_task ? rows_per_task : ECS_CHUNK_ROWS;
+        if ((total_rows + rows_per_task - 1) / rows_per_task > task_budget)
+        {
+            rows_per_task = (total_rows + task_budget - 1) / task_budget;
+        }
+
+        mpool::memory_pool *memory = thread_pool::transient_memory();
+        const mpool::pool_mark mark = mpool::get_mark(memory);
+        system_task *tasks = mpool::scratch<system_task>(memory, max_tasks);
+        u32 num_tasks = 0;
+        for (u32 a = 0; a < num_archs; ++a)
+        {
+            for (u32 start = 0; start < archs[a]->count; start += rows_per_task)
+            {
+                system_task *task = &tasks[num_tasks++];
+                task->func = func;
+                task->user_data = user_data;
+                task->view.arch = archs[a];
+                task->view.start = start;
+                task->view.count = min(rows_per_task, archs[a]->count - start);
+
+                bool last = (a == num_archs - 1) && (start + rows_per_task >= archs[a]->count);
+                if (num_tasks == max_tasks || last)
+                {
+                    thread_pool::job job = {};
+                    for (u32 i = 0; i < num_tasks; ++i)
+                    {
+                        thread_pool::add_work_on_node(system_task_worker, &tasks[i], &job, row_node(tasks[i].view.start));
+                    }
+                    thread_pool::wait(&job);
+                    num_tasks = 0;
+                }
+            }
+        }
+        mpool::rewind(memory, mark);
+    }
+
+    // Runs func over one archetype in parallel
+    void parallel_for(archetype *arch, system_func func, void *user_data, u32 rows_per_task)
+    {
+        run_parallel(&arch, 1, func, user_data, rows_per_task);
+    }
+
+    // Runs func in parallel over every archetype containing all required components
+    void parallel_for_each(world *w, component_mask required, system_func func, void *user_data, u32 rows_per_task)
+    {
+        archetype *matching[ECS_MAX_ARCHETYPES];
+        u32 num_matching = 0;
+        for (u32 a = 0; a < w->num_archetypes; ++a)
+        {
+            archetype *arch = &w->archetypes[a];
+            if ((arch->mask & required) == required && arch->count > 0)
+            {
+                matching[num_matching++] = arch;
+            }
+        }
+        run_parallel(matching, num_matching, func, user_data, rows_per_task);
+    }
+}
@@ -21,6 +21,7 @@
 
 #include "math_linear.h"
 #include "camera.h"
+#include "gl_shaders.h"
 #include "tracy\public\tracy\Tracy.hpp"
 #include "tracy\public\tracy\TracyOpenGL.hpp"
 
@@ -78,6 +79,8 @@ namespace bgl
     std::vector<gl_mesh> g_meshes; // Store multiple meshes
     GLuint g_shaderProgram = 0;
     GLuint g_instanceProgram = 0;
+    GLuint g_instanceBuffer = 0;       // Persistent per-instance model matrices
+    u64 g_instanceBufferCapacity = 0;  // In instances
     // ---------- Global variables for OpenGL objects ----------
     // static GLuint g_shaderProgram = 0;
     // static GLuint g_VAO = 0;
@@ -127,74 +130,6 @@ namespace bgl
 
     // ---------- Internal helper functions ----------
 
-    // Compiles a shader of the given type from the provided source string.
-    static GLuint compile_shader(GLenum shaderType, const char *source)
-    {
-        GLuint shader = glCreateShader(shaderType);
-        if (!shader)
-        {
-            fprintf(stderr, "Failed to create shader.\n");
-            exit(-1);
-        }
-        glShaderSource(shader, 1, &source, NULL);
-        glCompileShader(shader);
-        GLint compiled = 0;
-        glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-        if (!compiled)
-        {
-            GLint logLength = 0;
-            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
-            char *log = (char *)malloc(logLength);
-            glGetShaderInfoLog(shader, logLength, &logLength, log);
-            fprintf(stderr, "Shader compile error: %s\n", log);
-            free(log);
-            exit(-1);
-        }
-        return shader;
-    }
-
-    // Links a vertex and fragment shader into a shader program.
-    static GLuint create_shader_program()
-    {
-        // Vertex shader: accepts 3-component positions and applies an MVP transformation.
-        uint32_t vertex_shader_len_bytes = 0;
-        char *vertex_shader_source = (char *)read_file("shaders\\basic_vertex.vert", &vertex_shader_len_bytes);
-        uint32_t fragment_shader_len_bytes = 0;
-        char *fragment_shader_source = (char *)read_file("shaders\\basic_fragment.frag", &fragment_shader_len_bytes);
-
-        GLuint vertShader = compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
-        GLuint fragShader = compile_shader(GL_FRAGMENT_SHADER, fragment_shader_source);
-
-        GLuint program = glCreateProgram();
-        if (!program)
-        {
-            fprintf(stderr, "Failed to create shader program.\n");
-            exit(-1);
-        }
-        glAttachShader(program, vertShader);
-        glAttachShader(program, fragShader);
-        glLinkProgram(program);
-
-        GLint linked = 0;
-        glGetProgramiv(program, GL_LINK_STATUS, &linked);
-        if (!linked)
-        {
-            GLint logLength = 0;
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
-            char *log = (char *)malloc(logLength);
-            glGetProgramInfoLog(program, logLength, &logLength, log);
-            fprintf(stderr, "Shader linking error: %s\n", log);
-            free(log);
-            exit(-1);
-        }
-        // Shaders can be detached and deleted after linking.
-        glDetachShader(program, vertShader);
-        glDetachShader(program, fragShader);
-        glDeleteShader(vertShader);
-        glDeleteShader(fragShader);
-        return program;
-    }
-
     // Function pointer for wglChoosePixelFormatARB
     PFNWGLCHOOSEPIXELFORMATARBPROC win_choose_pixel_format_arb = nullptr;
 
@@ -426,7 +361,8 @@ namespace bgl
     // Update SetupGLObjects to handle the larger UBO
     static void setup_gl_objects()
     {
-        g_shaderProgram = create_shader_program();
+        init_shader_cache();
+        load_program("shaders\\basic_vertex.vert", "shaders\\basic_fragment.frag", &g_shaderProgram);
         check_error("After shader program creation");
 
         // Create and bind the uniform buffer
@@ -515,26 +451,8 @@ namespace bgl
         glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(vertex),
                               (void *)(sizeof(vec4) * 2));
 
-        // Compile shaders
-        GLuint vert = compile_shader(GL_VERTEX_SHADER, LINE_VERT_SHADER);
-        GLuint frag = compile_shader(GL_FRAGMENT_SHADER, LINE_FRAG_SHADER);
-
-        g_lines.program = glCreateProgram();
-        glAttachShader(g_lines.program, vert);
-        glAttachShader(g_lines.program, frag);
-        glLinkProgram(g_lines.program);
-
-        // Cleanup shaders
-        glDeleteShader(vert);
-        glDeleteShader(frag);
-
-        GLint linked;
-        glGetProgramiv(g_lines.program, GL_LINK_STATUS, &linked);
-        if (!linked)
+        if (!load_program_source("line shader", LINE_VERT_SHADER, LINE_FRAG_SHADER, &g_lines.program))
         {
-            GLchar log[1024];
-            glGetProgramInfoLog(g_lines.program, sizeof(log), NULL, log);
-            fprintf(stderr, "Line shader link error: %s\n", log);
             return -1;
         }
 
@@ -813,6 +731,7 @@ namespace bgl
     void start_draw(u32 width, u32 height)
     {
         ZoneScoped;
+        poll_shader_reloads(); // Swap in edited shaders between frames
         glViewport(0, 0, width, height);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         // glEnable(GL_DEPTH_TEST);
@@ -902,47 +821,10 @@ namespace bgl
         glUseProgram(0);
     }
 
-    // Function to load instanced shaders
+    // Function to load instanced shaders. Reloaded by poll_shader_reloads when the files change.
     static void load_instanced_shaders()
     {
-        u32 vert_shader_size = 0;
-        char *vert_shader_source = (char *)read_file("shaders\\basic_vertex_instanced.vert", &vert_shader_size);
-        u32 frag_shader_size = 0;
-        char *frag_shader_source = (char *)read_file("shaders\\basic_fragment_instanced.frag", &frag_shader_size);
-        GLuint vertShader = compile_shader(GL_VERTEX_SHADER, vert_shader_source);
-        GLuint fragShader = compile_shader(GL_FRAGMENT_SHADER, frag_shader_source);
-
-        GLuint program = glCreateProgram();
-        if (!program)
-        {
-            fprintf(stderr, "Failed to create shader program.\n");
-            exit(-1);
-        }
-        glAttachShader(program, vertShader);
-        glAttachShader(program, fragShader);
-        glLinkProgram(program);
-
-        GLint linked = 0;
-        glGetProgramiv(program, GL_LINK_STATUS, &linked);
-        if (!linked)
-        {
-            GLint logLength = 0;
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
-            char *log = (char *)malloc(logLength);
-            glGetProgramInfoLog(program, logLength, &logLength, log);
-            fprintf(stderr, "Shader linking error: %s\n", log);
-            free(log);
-            exit(-1);
-        }
-
-        glDetachShader(program, vertShader);
-        glDetachShader(program, fragShader);
-        glDeleteShader(vertShader);
-        glDeleteShader(fragShader);
-
-        free(vert_shader_source);
-        free(frag_shader_source);
-        g_instanceProgram = program;
+        load_program("shaders\\basic_vertex_instanced.vert", "shaders\\basic_fragment_instanced.frag", &g_instanceProgram);
     }
 
     // Function to render instances
@@ -960,11 +842,19 @@ namespace bgl
         // Bind the mesh VAO
         glBindVertexArray(mesh->VAO);
 
-        // Create and bind a buffer for the model matrices
-        GLuint modelBuffer;
-        glGenBuffers(1, &modelBuffer);
-        glBindBuffer(GL_ARRAY_BUFFER, modelBuffer);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(mat4) * count, model_matrices, GL_STATIC_DRAW);
+        // The instance buffer persists across frames and grows geometrically with the instance count,
+        // so a changing population only reallocates it O(log n) times. Each frame uploads just the live range.
+        if (!g_instanceBuffer)
+        {
+            glGenBuffers(1, &g_instanceBuffer);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, g_instanceBuffer);
+        if (count > g_instanceBufferCapacity)
+        {
+            g_instanceBufferCapacity = max((u64)count, g_instanceBufferCapacity + g_instanceBufferCapacity / 2);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(mat4) * g_instanceBufferCapacity, NULL, GL_STREAM_DRAW);
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(mat4) * count, model_matrices);
 
         // Set up instanced attribute pointers for the model matrix
         for (int i = 0; i < 4; i++)
@@ -987,7 +877,6 @@ namespace bgl
 
         // Cleanup
         glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glDeleteBuffers(1, &modelBuffer); // TODO modelBuffer should not be created & deleted each frame, that's ridiculous.
         glBindVertexArray(0);
         glUseProgram(0);
     }
@@ -1025,6 +914,18 @@ namespace bgl
             glDeleteProgram(g_shaderProgram);
             g_shaderProgram = 0;
         }
+        if (g_instanceProgram)
+        {
+            glDeleteProgram(g_instanceProgram);
+            g_instanceProgram = 0;
+        }
+        shutdown_shader_cache();
+        if (g_instanceBuffer)
+        {
+            glDeleteBuffers(1, &g_instanceBuffer);
+            g_instanceBuffer = 0;
+            g_instanceBufferCapacity = 0;
+        }
         // Delete the OpenGL context and release the device context.
         if (g_hRC)
         {
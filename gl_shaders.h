@@ -0,0 +1,458 @@
+#pragma once
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "GL/glew.h"
+#include "types.h"
+#include "io.h"
+#include "tracy\public\tracy\Tracy.hpp"
+
+// Shader manager for the GL renderer.
+//
+// Programs are keyed by a hash of their sources and the driver, and their linked binaries are kept in
+// SHADER_CACHE_DIR via glGetProgramBinary, so a start with unchanged shaders skips compilation.
+//
+// Programs loaded from files are watched: an edited file is recompiled and relinked while the old
+// program keeps drawing. With ARB_parallel_shader_compile the driver links on its own threads and the
+// result is polled each frame; without it the relink happens synchronously on the frame that sees the
+// edit. A program that fails to compile or link is dropped and the last good one stays in use.
+namespace bgl
+{
+#define SHADER_CACHE_DIR "shader_cache"
+#define SHADER_CACHE_MAGIC 0x48535042 // "BPSH"
+#define SHADER_MAX_PROGRAMS 16
+#define SHADER_WATCH_DIR "shaders"
+
+    struct managed_program
+    {
+        const char *name;
+        const char *vert_path; // Null for programs built from embedded sources
+        const char *frag_path;
+        GLuint *target; // Receives every successfully linked program, the previous one is deleted
+        u64 hash;       // Of the sources *target was built from
+        FILETIME vert_time;
+        FILETIME frag_time;
+        bool check_files; // The watched directory changed since this program last looked
+
+        // Relink in flight
+        GLuint pending;
+        GLuint pending_vert;
+        GLuint pending_frag;
+        u64 pending_hash;
+    };
+
+    struct cached_binary_header
+    {
+        u32 magic;
+        GLenum format;
+        u32 length;
+        u32 reserved;
+        u64 hash;
+    };
+
+    static managed_program g_programs[SHADER_MAX_PROGRAMS];
+    static u32 g_num_programs = 0;
+    static u64 g_driver_hash = 0;  // Binaries are only valid for the driver that produced them
+    static bool g_binary_cache = false;
+    static bool g_parallel_link = false;
+    static HANDLE g_shader_watch = NULL;
+
+    // FNV-1a
+    static u64 hash_bytes(const void *data, size_t size, u64 hash)
+    {
+        const u8 *bytes = (const u8 *)data;
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001B3ull;
+        }
+        return hash;
+    }
+
+    static u64 hash_sources(const char *vert_source, const char *frag_source)
+    {
+        u64 hash = hash_bytes(vert_source, strlen(vert_source) + 1, g_driver_hash);
+        return hash_bytes(frag_source, strlen(frag_source) + 1, hash);
+    }
+
+    static FILETIME shader_write_time(const char *path)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+        GetFileAttributesExA(path, GetFileExInfoStandard, &attributes);
+        return attributes.ftLastWriteTime;
+    }
+
+    void init_shader_cache()
+    {
+        const char *strings[] = {(const char *)glGetString(GL_VENDOR), (const char *)glGetString(GL_RENDERER), (const char *)glGetString(GL_VERSION)};
+        g_driver_hash = 0xCBF29CE484222325ull;
+        for (u32 i = 0; i < 3; ++i)
+        {
+            if (strings[i])
+            {
+                g_driver_hash = hash_bytes(strings[i], strlen(strings[i]), g_driver_hash);
+            }
+        }
+
+        GLint num_formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+        g_binary_cache = GLEW_ARB_get_program_binary && num_formats > 0;
+        if (g_binary_cache)
+        {
+            CreateDirectoryA(SHADER_CACHE_DIR, NULL);
+        }
+        g_parallel_link = GLEW_ARB_parallel_shader_compile;
+        if (g_parallel_link)
+        {
+            glMaxShaderCompilerThreadsARB(0xFFFFFFFF); // Let the driver pick
+        }
+
+        g_shader_watch = FindFirstChangeNotificationA(SHADER_WATCH_DIR, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+        if (g_shader_watch == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Cannot watch %s, shader hot reload disabled\n", SHADER_WATCH_DIR);
+            g_shader_watch = NULL;
+        }
+    }
+
+    static void cache_path(u64 hash, char *path, size_t size)
+    {
+        snprintf(path, size, "%s\\%016llx.bin", SHADER_CACHE_DIR, (unsigned long long)hash);
+    }
+
+    // Returns a linked program from the binary cache, or 0 on a miss or a binary the driver rejects
+    static GLuint load_cached_program(u64 hash)
+    {
+        if (!g_binary_cache)
+        {
+            return 0;
+        }
+        char path[MAX_PATH];
+        cache_path(hash, path, sizeof(path));
+        u32 size = 0;
+        u8 *file = (u8 *)read_file(path, &size);
+        if (!file)
+        {
+            return 0;
+        }
+        size -= 1; // read_file counts its terminator
+        GLuint program = 0;
+        cached_binary_header header;
+        if (size >= sizeof(header))
+        {
+            memcpy(&header, file, sizeof(header));
+            if (header.magic == SHADER_CACHE_MAGIC && header.hash == hash && header.length == size - sizeof(header))
+            {
+                program = glCreateProgram();
+                glProgramBinary(program, header.format, file + sizeof(header), header.length);
+                GLint linked = 0;
+                glGetProgramiv(program, GL_LINK_STATUS, &linked);
+                if (!linked)
+                {
+                    glDeleteProgram(program);
+                    program = 0;
+                }
+            }
+        }
+        free(file);
+        return program;
+    }
+
+    static void store_cached_program(GLuint program, u64 hash)
+    {
+        if (!g_binary_cache)
+        {
+            return;
+        }
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+        {
+            return;
+        }
+        u8 *buffer = (u8 *)malloc(sizeof(cached_binary_header) + length);
+        cached_binary_header header = {SHADER_CACHE_MAGIC, 0, (u32)length, 0, hash};
+        glGetProgramBinary(program, length, NULL, &header.format, buffer + sizeof(header));
+        memcpy(buffer, &header, sizeof(header));
+
+        char path[MAX_PATH];
+        cache_path(hash, path, sizeof(path));
+        FILE *file = fopen(path, "wb");
+        if (file)
+        {
+            fwrite(buffer, 1, sizeof(header) + length, file);
+            fclose(file);
+        }
+        free(buffer);
+    }
+
+    // Issues the compile and link without querying any status, so a driver with parallel compilation
+    // does the work off this thread
+    static GLuint begin_link(const char *vert_source, const char *frag_source, GLuint *out_vert, GLuint *out_frag)
+    {
+        GLuint vert = glCreateShader(GL_VERTEX_SHADER);
+        GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(vert, 1, &vert_source, NULL);
+        glShaderSource(frag, 1, &frag_source, NULL);
+        glCompileShader(vert);
+        glCompileShader(frag);
+
+        GLuint program = glCreateProgram();
+        if (g_binary_cache)
+        {
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+        glAttachShader(program, vert);
+        glAttachShader(program, frag);
+        glLinkProgram(program);
+        *out_vert = vert;
+        *out_frag = frag;
+        return program;
+    }
+
+    static inline bool link_done(GLuint program)
+    {
+        if (!g_parallel_link)
+        {
+            return true;
+        }
+        GLint done = GL_FALSE;
+        glGetProgramiv(program, GL_COMPLETION_STATUS_ARB, &done);
+        return done == GL_TRUE;
+    }
+
+    static void print_shader_log(const char *name, GLuint shader)
+    {
+        GLint length = 0;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+        char *log = (char *)malloc(length + 1);
+        log[0] = '\0';
+        glGetShaderInfoLog(shader, length, NULL, log);
+        fprintf(stderr, "%s: shader compile error: %s\n", name, log);
+        free(log);
+    }
+
+    // Checks a finished link and releases its shaders. On failure the program is deleted and 0 returned.
+    static GLuint finish_link(const char *name, GLuint program, GLuint vert, GLuint frag)
+    {
+        GLint compiled = 0;
+        glGetShaderiv(vert, GL_COMPILE_STATUS, &compiled);
+        bool ok = compiled != 0;
+        if (!compiled)
+        {
+            print_shader_log(name, vert);
+        }
+        glGetShaderiv(frag, GL_COMPILE_STATUS, &compiled);
+        ok &= compiled != 0;
+        if (!compiled)
+        {
+            print_shader_log(name, frag);
+        }
+
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (ok && !linked)
+        {
+            GLint length = 0;
+            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+            char *log = (char *)malloc(length + 1);
+            log[0] = '\0';
+            glGetProgramInfoLog(program, length, NULL, log);
+            fprintf(stderr, "%s: shader linking error: %s\n", name, log);
+            free(log);
+        }
+        ok &= linked != 0;
+
+        glDetachShader(program, vert);
+        glDetachShader(program, frag);
+        glDeleteShader(vert);
+        glDeleteShader(frag);
+        if (!ok)
+        {
+            glDeleteProgram(program);
+            return 0;
+        }
+        return program;
+    }
+
+    // Installs a newly linked program, replacing (and deleting) the previous one
+    static void swap_program(managed_program *p, GLuint program, u64 hash)
+    {
+        if (*p->target)
+        {
+            glDeleteProgram(*p->target);
+        }
+        *p->target = program;
+        p->hash = hash;
+    }
+
+    // Builds a program from the cache or from source, synchronously. On failure *p->target is left as it was.
+    static bool build_program(managed_program *p, const char *vert_source, const char *frag_source)
+    {
+        ZoneScoped;
+        u64 hash = hash_sources(vert_source, frag_source);
+        GLuint program = load_cached_program(hash);
+        if (!program)
+        {
+            GLuint vert, frag;
+            program = begin_link(vert_source, frag_source, &vert, &frag);
+            program = finish_link(p->name, program, vert, frag);
+            if (!program)
+            {
+                return false;
+            }
+            store_cached_program(program, hash);
+        }
+        swap_program(p, program, hash);
+        return true;
+    }
+
+    static managed_program *add_program(const char *name, GLuint *target)
+    {
+        if (g_num_programs >= SHADER_MAX_PROGRAMS)
+        {
+            fprintf(stderr, "Too many shader programs, %s is not managed\n", name);
+            return nullptr;
+        }
+        managed_program *p = &g_programs[g_num_programs++];
+        *p = {};
+        p->name = name;
+        p->target = target;
+        return p;
+    }
+
+    // Loads a program from a vertex and fragment shader file into *target and watches both files.
+    // Returns false if it could not be built; *target then stays 0 until the files are fixed.
+    bool load_program(const char *vert_path, const char *frag_path, GLuint *target)
+    {
+        managed_program *p = add_program(vert_path, target);
+        if (!p)
+        {
+            return false;
+        }
+        p->vert_path = vert_path;
+        p->frag_path = frag_path;
+        p->vert_time = shader_write_time(vert_path);
+        p->frag_time = shader_write_time(frag_path);
+
+        u32 size = 0;
+        char *vert_source = (char *)read_file(vert_path, &size);
+        char *frag_source = (char *)read_file(frag_path, &size);
+        bool ok = vert_source && frag_source && build_program(p, vert_source, frag_source);
+        if (!vert_source || !frag_source)
+        {
+            fprintf(stderr, "Failed to read %s or %s\n", vert_path, frag_path);
+        }
+        free(vert_source);
+        free(frag_source);
+        return ok;
+    }
+
+    // Loads a program from embedded sources into *target. Cached like file programs, but never reloaded.
+    bool load_program_source(const char *name, const char *vert_source, const char *frag_source, GLuint *target)
+    {
+        managed_program *p = add_program(name, target);
+        return p && build_program(p, vert_source, frag_source);
+    }
+
+    // Starts a relink for a watched program whose files changed
+    static void begin_reload(managed_program *p)
+    {
+        u32 size = 0;
+        char *vert_source = (char *)read_file(p->vert_path, &size);
+        char *frag_source = (char *)read_file(p->frag_path, &size);
+        if (vert_source && frag_source)
+        {
+            u64 hash = hash_sources(vert_source, frag_source);
+            GLuint cached = hash != p->hash ? load_cached_program(hash) : 0;
+            if (cached)
+            {
+                swap_program(p, cached, hash);
+            }
+            else if (hash != p->hash)
+            {
+                p->pending = begin_link(vert_source, frag_source, &p->pending_vert, &p->pending_frag);
+                p->pending_hash = hash;
+            }
+        }
+        // A file mid-save may be missing or empty, the write that completes it triggers another reload
+        free(vert_source);
+        free(frag_source);
+    }
+
+    // Picks up shader edits and finished relinks. Call once per frame on the render thread; never waits
+    // for the driver when it compiles in parallel.
+    void poll_shader_reloads()
+    {
+        ZoneScoped;
+        bool files_changed = false;
+        if (g_shader_watch && WaitForSingleObject(g_shader_watch, 0) == WAIT_OBJECT_0)
+        {
+            FindNextChangeNotification(g_shader_watch);
+            files_changed = true;
+        }
+
+        for (u32 i = 0; i < g_num_programs; ++i)
+        {
+            managed_program *p = &g_programs[i];
+            p->check_files |= files_changed && p->vert_path;
+            if (p->pending)
+            {
+                if (!link_done(p->pending))
+                {
+                    continue; // Edits made meanwhile are looked at once this link is done
+                }
+                GLuint program = finish_link(p->name, p->pending, p->pending_vert, p->pending_frag);
+                if (program)
+                {
+                    store_cached_program(program, p->pending_hash);
+                    swap_program(p, program, p->pending_hash);
+                    printf("Reloaded %s\n", p->name);
+                }
+                else
+                {
+                    fprintf(stderr, "%s: keeping the last good program\n", p->name);
+                }
+                p->pending = 0;
+            }
+
+            if (!p->check_files)
+            {
+                continue;
+            }
+            p->check_files = false;
+            FILETIME vert_time = shader_write_time(p->vert_path);
+            FILETIME frag_time = shader_write_time(p->frag_path);
+            if (CompareFileTime(&vert_time, &p->vert_time) == 0 && CompareFileTime(&frag_time, &p->frag_time) == 0)
+            {
+                continue;
+            }
+            p->vert_time = vert_time;
+            p->frag_time = frag_time;
+            begin_reload(p);
+        }
+    }
+
+    // Deletes in-flight relinks and stops watching. The programs themselves belong to their owners.
+    void shutdown_shader_cache()
+    {
+        for (u32 i = 0; i < g_num_programs; ++i)
+        {
+            managed_program *p = &g_programs[i];
+            if (p->pending)
+            {
+                glDeleteShader(p->pending_vert);
+                glDeleteShader(p->pending_frag);
+                glDeleteProgram(p->pending);
+                p->pending = 0;
+            }
+        }
+        g_num_programs = 0;
+        if (g_shader_watch)
+        {
+            FindCloseChangeNotification(g_shader_watch);
+            g_shader_watch = NULL;
+        }
+    }
+}
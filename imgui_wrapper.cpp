@@ -45,6 +45,38 @@ void basic_ui(imgui_data *data)
     ImGui::SliderFloat("Boid Max Vel", &data->boid_max_vel, 0.0f, 1.0f);      // Edit 1 float using a slider from 0.0f to 1.0f
     ImGui::SliderFloat("Boid Max Acc", &data->boid_max_acc, 0.0f, 1.0f);      // Edit 1 float using a slider from 0.0f to 1.0f
 
+    data->save_snapshot = ImGui::Button("Save Snapshot");
+    ImGui::SameLine();
+    data->load_snapshot = ImGui::Button("Load Snapshot");
+    data->far_field_report = ImGui::Button("Far Field Report");
+    ImGui::SameLine();
+    data->numa_report = ImGui::Button("NUMA Report");
+    ImGui::SameLine();
+    data->memory_report = ImGui::Button("Memory Report");
+    ImGui::SameLine();
+    data->compact_report = ImGui::Button("Compact Report");
+    data->wake_report = ImGui::Button("Wake Report");
+    ImGui::SameLine();
+    data->verlet_report = ImGui::Button("Verlet Report");
+
+    data->toggle_recording = ImGui::Button(data->recording ? "Stop Recording" : "Record Trajectory");
+    if (data->recording)
+    {
+        ImGui::Text("%d frames, %d dropped, %.1fx", data->frames_recorded, data->frames_dropped, data->compression_ratio);
+    }
+
+    data->toggle_playback = ImGui::Button(data->playback ? "Stop Playback" : "Play Trajectory");
+    if (data->playback)
+    {
+        ImGui::SameLine();
+        ImGui::Checkbox("Playing", &data->playing);
+        data->seek = ImGui::SliderInt("Frame", &data->playback_frame, 0, data->playback_num_frames - 1);
+        data->prev_keyframe = ImGui::Button("<< Keyframe");
+        ImGui::SameLine();
+        data->next_keyframe = ImGui::Button("Keyframe >>");
+        ImGui::Text("Decode %.1f frames/s, %.1f MB/s, %d stalls", data->decode_fps, data->decode_mbps, data->playback_stalls);
+    }
+
     ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f * data->frame_time, 1.0f / data->frame_time);
     ImGui::End();
 }
@@ -6,6 +6,30 @@ struct imgui_data
     float boid_trail_len;
     float boid_max_vel;
     float boid_max_acc;
+    bool save_snapshot; // Set for one frame when the save button is pressed
+    bool load_snapshot; // Set for one frame when the load button is pressed
+    bool far_field_report; // Set for one frame when the report button is pressed
+    bool numa_report;      // Set for one frame when the NUMA report button is pressed
+    bool memory_report;    // Set for one frame when the memory report button is pressed
+    bool compact_report;   // Set for one frame when the compact report button is pressed
+    bool wake_report;      // Set for one frame when the wake report button is pressed
+    bool verlet_report;    // Set for one frame when the Verlet report button is pressed
+    bool toggle_recording; // Set for one frame when the record button is pressed
+    bool recording;        // Shown on the record button
+    int frames_recorded;
+    int frames_dropped;
+    float compression_ratio;
+    bool toggle_playback; // Set for one frame when the play button is pressed
+    bool playback;        // A trajectory drives the renderer instead of the sim
+    bool playing;         // Unticked to pause playback
+    bool seek;            // Set for one frame when the scrubber moves
+    bool prev_keyframe;
+    bool next_keyframe;
+    int playback_frame;
+    int playback_num_frames;
+    int playback_stalls;
+    float decode_fps;
+    float decode_mbps;
 };
 
 // Forward declarations for functions moved to imgui_wrapper.cpp
@@ -24,7 +24,12 @@
 
 #include "imgui_wrapper.h"
 
+#include "ecs.h"
 #include "simulation.h"
+#include "snapshot.h"
+#include "trajectory.h"
+#include "scene.h"
+#include "distributed.h"
 #include "memory_pool.h"
 
 #include "boid_thread.h"
@@ -176,7 +181,9 @@ static void calc_matrices_worker(void *data, u32 thread_id, mpool::memory_pool *
     }
 }
 
-static void calc_instance_matrices(mat4 *instance_matrices, simulation::sim_data *simulation_data)
+// Queues the matrix chunks under job, the caller waits on it. The chunk data comes from memory and must
+// stay there until the wait returns.
+static void calc_instance_matrices(mat4 *instance_matrices, simulation::sim_data *simulation_data, thread_pool::job *job, mpool::memory_pool *memory)
 {
     ZoneScoped;
 #if 1
@@ -191,9 +198,6 @@ static void calc_instance_matrices(mat4 *instance_matrices, simulation::sim_data
     const int MIN_ENTITIES_FOR_PARALLEL = 1000;
     const int MAX_CHUNKS = 512; // Maximum number of work chunks
 
-    static mpool::memory_pool mem = mpool::allocate(MEGABYTES(1)); // Allocate memory pool for thread data
-    mpool::reset(&mem);                                            // Reset the memory pool for thread data
-
     if (simulation_data->num_entities >= MIN_ENTITIES_FOR_PARALLEL && thread_pool::g_thread_pool != nullptr)
     {
         // Calculate how many chunks we need
@@ -207,7 +211,7 @@ static void calc_instance_matrices(mat4 *instance_matrices, simulation::sim_data
         }
 
         // Allocate data for each chunk
-        InstMatrixCalcData *chunk_data = (InstMatrixCalcData *)mpool::get_bytes(&mem, sizeof(InstMatrixCalcData) * num_chunks);
+        InstMatrixCalcData *chunk_data = mpool::scratch<InstMatrixCalcData>(memory, num_chunks);
 
         // malloc(sizeof(InstMatrixCalcData) * num_chunks);
 
@@ -229,15 +233,10 @@ static void calc_instance_matrices(mat4 *instance_matrices, simulation::sim_data
             chunk_data[i].end_idx = current_start + chunk_size;
 
             // Add work to the thread pool
-            thread_pool::add_work(calc_matrices_worker, &chunk_data[i]);
+            thread_pool::add_work(calc_matrices_worker, &chunk_data[i], job);
 
             current_start += chunk_size;
         }
-
-        // Wait for all work to complete
-        thread_pool::wait_for_completion();
-
-        // Clean up
         return;
     }
 #else
@@ -258,6 +257,84 @@ static void calc_instance_matrices(mat4 *instance_matrices, simulation::sim_data
 #endif
 }
 
+// Pipelined frames: the step for the next frame and the packing of its instance matrices run as one
+// pool job while the main thread submits the current frame. The two matrix buffers are the bounded
+// handoff: the renderer owns the front one, the step writes the back one, and the main thread finishes
+// the step before swapping, so the sim is never more than one frame ahead of what is on screen.
+struct frame_pipeline
+{
+    thread_pool::job job; // The in-flight step
+    simulation::sim_data *sim;
+    float dt;
+    bool in_flight;
+    u32 back; // Buffer the in-flight step writes
+    mat4 *matrices[2];
+    u64 capacity[2];
+    u64 count[2];
+};
+
+static mat4 *reserve_instance_matrices(mat4 *matrices, u64 *capacity, u64 count);
+
+static void pipeline_step_worker(void *data, u32 thread_id, mpool::memory_pool *thread_memory)
+{
+    ZoneScoped;
+    frame_pipeline *pipeline = (frame_pipeline *)data;
+    simulation::sim_data *sim = pipeline->sim;
+    const u32 back = pipeline->back;
+    simulation::advance_sim(sim, pipeline->dt);
+
+    thread_pool::job matrices_job = {};
+    pipeline->matrices[back] = reserve_instance_matrices(pipeline->matrices[back], &pipeline->capacity[back], sim->num_entities);
+    pipeline->count[back] = 0;
+    if (sim->num_entities > 0 && pipeline->capacity[back] >= sim->num_entities)
+    {
+        calc_instance_matrices(pipeline->matrices[back], sim, &matrices_job, thread_memory);
+        pipeline->count[back] = sim->num_entities;
+    }
+    simulation::refresh_hash(sim);
+    thread_pool::wait(&matrices_job);
+}
+
+// Starts stepping the sim into the back buffer. The sim belongs to the step until finish_step.
+static void kick_step(frame_pipeline *pipeline, float dt)
+{
+    pipeline->dt = dt;
+    pipeline->in_flight = true;
+    thread_pool::add_work(pipeline_step_worker, pipeline, &pipeline->job);
+}
+
+// Waits for the in-flight step and makes its matrices the front buffer
+static void finish_step(frame_pipeline *pipeline)
+{
+    ZoneScoped;
+    if (!pipeline->in_flight)
+    {
+        return;
+    }
+    thread_pool::wait(&pipeline->job);
+    pipeline->in_flight = false;
+    pipeline->back ^= 1;
+}
+
+// Instance matrices follow the live population. Growth is geometric so a varying flock rarely
+// reallocates, and the buffer is never shrunk.
+static mat4 *reserve_instance_matrices(mat4 *matrices, u64 *capacity, u64 count)
+{
+    if (count <= *capacity)
+    {
+        return matrices;
+    }
+    u64 new_capacity = max(count, *capacity + *capacity / 2);
+    mat4 *grown = (mat4 *)_aligned_realloc(matrices, sizeof(mat4) * new_capacity, 64);
+    if (!grown)
+    {
+        fprintf(stderr, "Error: Failed to grow instance matrices to %llu\n", (unsigned long long)new_capacity);
+        return matrices;
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
 // WinMain entry point.
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 {
@@ -269,7 +346,12 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 
     cam.distance = 1.0f;
 
-    Mesh bunny = read_mesh("meshes\\bunny.obj");
+    // Sim and render settings come from the scene file, which is watched for edits while running
+    scene::watcher scene_watcher = {};
+    scene::init_watcher(&scene_watcher, "scene.ini");
+    const scene::scene_config *scene_config = &scene_watcher.config;
+
+    Mesh bunny = read_mesh(scene_config->static_mesh);
 
     g_platform_data.hInstance = hInstance;
     platform::init_window(&g_platform_data, nCmdShow, window_class_name, window_title, g_win_width, g_win_height, WndProc);
@@ -277,7 +359,10 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     imgui_init(g_platform_data.hwnd);
     bgl::line_render_init(100000);
 
-    //  graph_context graph_context = init_im_nodes();
+    ecs::world *world = ecs::create_world(SIM_MAX_ENTITIES); // Shared by the simulation and the node graph
+    //  graph_context graph_context = init_im_nodes(world, &scene_config->params);
+    //  scene_watcher.params_hook = scene_params_hook; // Scene reloads reach the sim through the graph
+    //  scene_watcher.params_hook_user = &graph_context;
 
     // uint32_t bunny_id = vk_render_create_mesh(&bunny);
 
@@ -293,16 +378,59 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 
     bgl::gl_mesh *gl_bunny = bgl::add_mesh(&bunny, true);
 
-    Mesh cone = read_mesh("meshes\\cone.obj");
+    Mesh cone = read_mesh(scene_config->boid_mesh);
     bgl::gl_mesh *gl_cone = bgl::add_mesh(&cone, false);
 
-    u32 thread_fail = thread_pool::start_thread_pool(14, 256); // Start the thread pool with 4 threads
+    mpool::g_use_large_pages = scene_config->large_pages != 0; // Before the big pools are allocated
+    u32 thread_fail = thread_pool::start_thread_pool(scene_config->num_threads, scene_config->queue_size, scene_config->pin_threads != 0); // Start the thread pool
     if (thread_fail != 0)
     {
         printf("Thread pool failed to start\n\r");
         return -1;
     }
-    simulation::sim_data simulation_data = simulation::init_sim(100000, 5.f);
+
+    // Distributed mode splits the flock across processes by slab, each rank owning its share
+    distributed::config dist_config;
+    distributed::node dist_node = {};
+    const bool distributed_mode = distributed::parse_args(lpCmdLine, &dist_config);
+    if (distributed_mode && (dist_config.num_ranks > 1 || dist_config.kind == distributed::TRANSPORT_MPI))
+    {
+        if (!distributed::init(&dist_node, &dist_config, scene_config->spawn_extent, scene_config->params.cell_size))
+        {
+            fprintf(stderr, "Distributed: running as a single process\n");
+        }
+    }
+    else if (distributed_mode)
+    {
+        dist_node.cfg = dist_config; // One rank, records the scaling baseline
+    }
+    const bool multi_rank = dist_node.cfg.num_ranks > 1;
+    const u32 num_boids = multi_rank ? distributed::share(&dist_node.cfg, scene_config->num_boids) : scene_config->num_boids;
+    const u32 num_predators = multi_rank ? distributed::share(&dist_node.cfg, scene_config->num_predators) : scene_config->num_predators;
+
+    simulation::sim_data simulation_data = simulation::init_sim(world, num_boids, scene_config->spawn_extent);
+    simulation::publish_params(simulation_data.mailbox, &scene_config->params); // Adopted at the first step
+    scene::match_population(&simulation_data, simulation::SPECIES_PREDATOR, num_predators, scene_config->spawn_extent);
+    if (multi_rank)
+    {
+        distributed::scatter(&dist_node, &simulation_data, scene_config->spawn_extent);
+    }
+
+    // The static mesh doubles as collision geometry. The margin covers the avoid distance and the
+    // furthest a boid can look ahead.
+    bvh::bvh obstacle_bvh;
+    const float obstacle_margin = fmaxf(scene_config->params.mesh_avoid_distance,
+                                        scene_config->params.behaviour.max_vel * scene_config->params.mesh_lookahead);
+    sdf::sdf obstacle_sdf;
+    if (bvh::build(&obstacle_bvh, &bunny, obstacle_margin))
+    {
+        simulation_data.mesh_obstacle = &obstacle_bvh;
+        // Avoidance then costs two field samples per boid instead of BVH traversals
+        if (sdf::load_or_bake(&obstacle_sdf, &obstacle_bvh, &bunny, scene_config->static_mesh, obstacle_margin))
+        {
+            simulation_data.mesh_sdf = &obstacle_sdf;
+        }
+    }
 
     // register_new_mesh_node(&bunny, "Bunny Mesh");
     // init_mesh_node(&graph_context, &bunny, "Bunny Mesh");
@@ -313,7 +441,16 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     u64 last_time = start_time;
     float dt_last_ten_frames[10] = {};
     int current_frame_id = 0;
-    mpool::memory_pool transient_memory = mpool::allocate(MEGABYTES(50));
+    mpool::memory_pool transient_memory = mpool::allocate_large(MEGABYTES(50), "frame arena");
+    mat4 *instance_matrices = nullptr;
+    u64 instance_capacity = 0;
+    mat4 *draw_matrices = nullptr;            // Matrices of the last drawn frame, instance_matrices or a pipeline buffer
+    u64 instance_count = 0;                   // Matrices in draw_matrices
+    trajectory::recorder *recorder = nullptr; // Set while a trajectory is being recorded
+    trajectory::player *player = nullptr;     // Set while a trajectory is being played back
+    frame_pipeline pipeline = {};
+    pipeline.sim = &simulation_data;
+    bool pipelined = false; // The last step was kicked on the pipeline, its matrices are drawn from there
     bgl::load_instanced_shaders();
 
     while (!quit)
@@ -338,6 +475,9 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         }
 
 #endif
+        // Everything below may touch the sim until the next step is kicked
+        finish_step(&pipeline);
+
         static f32 dt = 1.0f / 60.f; // Initialize delta time
 
         if (dt < 0.016f)
@@ -358,8 +498,147 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         }
         ui_data.frame_time /= 10.f; // Update frame time in UI data
         // dt = 0.016f;                                  // Reset dt to a fixed value for simulation
-        simulation::update_sim(&simulation_data, dt); // Update simulation logic here
-        last_time = current_time;                     // Update last time for the next frame
+        if (ui_data.toggle_playback)
+        {
+            if (player)
+            {
+                trajectory::stop_playback(player);
+                player = nullptr;
+            }
+            else
+            {
+                trajectory::stop_recording(recorder); // Finish the file before reading it
+                recorder = nullptr;
+                ui_data.recording = false;
+                player = trajectory::start_playback("flock.trajectory", 4);
+                ui_data.playing = true;
+            }
+        }
+        ui_data.playback = player != nullptr;
+
+        // Instances come from the live sim, or from the recording while one is playing
+        simulation::sim_data *instance_source = &simulation_data;
+        pipelined = false;
+        simulation::sim_data playback_view = {};
+        if (player)
+        {
+            if (ui_data.seek)
+            {
+                trajectory::seek(player, (u32)ui_data.playback_frame);
+            }
+            if (ui_data.prev_keyframe || ui_data.next_keyframe)
+            {
+                trajectory::seek_keyframe(player, ui_data.next_keyframe ? 1 : -1);
+            }
+            player->playing = ui_data.playing;
+            const trajectory::decoded_frame *frame = trajectory::update_playback(player, dt);
+            ui_data.playing = player->playing;
+            ui_data.playback_frame = (int)player->playhead;
+            ui_data.playback_num_frames = (int)trajectory::num_frames(&player->file);
+            ui_data.playback_stalls = (int)player->stalls;
+            ui_data.decode_fps = player->decode_fps;
+            ui_data.decode_mbps = player->decode_mbps;
+
+            // Until the frame is decoded the previous matrices stay on screen
+            instance_source = nullptr;
+            if (frame)
+            {
+                playback_view.num_entities = frame->num_entities;
+                playback_view.positions = (vec4 *)frame->positions.data();
+                playback_view.velocities = (vec3 *)frame->velocities.data();
+                instance_source = &playback_view;
+            }
+        }
+        else
+        {
+            // Ranks must agree on the configuration, so distributed runs ignore edits to the scene file
+            if (dist_node.cfg.num_ranks <= 1)
+            {
+                scene::poll(&scene_watcher, &simulation_data); // Hot reload lands between steps
+            }
+            // Snapshots are taken and restored between steps
+            if (ui_data.save_snapshot)
+            {
+                snapshot::save_async(&simulation_data, "flock.snapshot");
+            }
+            if (ui_data.load_snapshot)
+            {
+                snapshot::load(&simulation_data, "flock.snapshot");
+            }
+            if (ui_data.far_field_report)
+            {
+                simulation::far_field_report(&simulation_data, 1000);
+            }
+            if (ui_data.numa_report)
+            {
+                simulation::numa_report(&simulation_data, 120);
+            }
+            if (ui_data.memory_report)
+            {
+                simulation::memory_report(&simulation_data, 120);
+            }
+            if (ui_data.compact_report)
+            {
+                simulation::compact_report(&simulation_data, 1000);
+            }
+            if (ui_data.wake_report)
+            {
+                thread_pool::wake_report(200);
+            }
+            if (ui_data.verlet_report)
+            {
+                simulation::verlet_report(&simulation_data, 240);
+            }
+            simulation_data.lod_focus = cam.position; // Steering of distant boids is evaluated less often
+            if (dist_node.cfg.num_ranks > 1)
+            {
+                // Ranks step in lockstep, so they all advance by the same fixed step
+                if (!distributed::step(&dist_node, &simulation_data, simulation_data.time_step))
+                {
+                    fprintf(stderr, "Distributed: lost a neighbour, continuing as a single process\n");
+                    distributed::shutdown(&dist_node, &simulation_data);
+                }
+            }
+            else if (distributed_mode)
+            {
+                distributed::record_baseline(&dist_node, &simulation_data, simulation_data.time_step);
+            }
+            else if (!scene_config->pipeline)
+            {
+                simulation::advance_sim(&simulation_data, dt); // The hash rebuild overlaps the matrices below
+            }
+
+            // Recording hands the finished step to the writer thread and never waits on disk
+            if (ui_data.toggle_recording)
+            {
+                if (recorder)
+                {
+                    trajectory::stop_recording(recorder);
+                    recorder = nullptr;
+                }
+                else
+                {
+                    recorder = trajectory::start_recording("flock.trajectory", 60);
+                }
+            }
+            if (recorder)
+            {
+                trajectory::record_frame(recorder, &simulation_data);
+                ui_data.frames_recorded = (int)recorder->frames_written;
+                ui_data.frames_dropped = (int)recorder->frames_dropped;
+                ui_data.compression_ratio = recorder->written_bytes ? (float)recorder->raw_bytes / (float)recorder->written_bytes : 0.0f;
+            }
+            ui_data.recording = recorder != nullptr;
+
+            // The finished step was recorded and drawn from the front buffer, the next one runs while
+            // this frame is submitted
+            if (!distributed_mode && scene_config->pipeline)
+            {
+                kick_step(&pipeline, dt);
+                pipelined = true;
+            }
+        }
+        last_time = current_time; // Update last time for the next frame
 
         // vk_render_set_mvp(const float mvp[16]);
         imgui_render(&ui_data);
@@ -368,11 +647,34 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         draw_grid(.5f);
         // debug_draw_spatial_hash(&simulation_data.search_hash, 0.5f, {0.0f, 1.f, 1.f});
         //  process_and_store_new_links(&graph_context);
-        //  update_links(&graph_context); // Update existing links
-        u32 nbytes_instances = sizeof(mat4) * simulation_data.num_entities;
-        mat4 *instance_matrices = (mat4 *)mpool::get_bytes(&transient_memory, nbytes_instances);
-
-        calc_instance_matrices(instance_matrices, &simulation_data);
+        //  evaluate_graph(&graph_context); // Propagate node edits downstream
+        //  publish_graph_params(&graph_context, &simulation_data); // Hand simulation nodes to the next step
+        // With no new frame from the pipeline, the sim or the player, the last drawn matrices stay on
+        // screen. Neither source writes them meanwhile: the pipeline only fills its back buffer.
+        thread_pool::job matrices_job = {};
+        if (pipelined)
+        {
+            const u32 front = pipeline.back ^ 1;
+            draw_matrices = pipeline.matrices[front];
+            instance_count = pipeline.count[front];
+        }
+        else if (instance_source)
+        {
+            instance_matrices = reserve_instance_matrices(instance_matrices, &instance_capacity, instance_source->num_entities);
+            instance_count = 0;
+            if (instance_source->num_entities > 0 && instance_capacity >= instance_source->num_entities)
+            {
+                calc_instance_matrices(instance_matrices, instance_source, &matrices_job, &transient_memory);
+                instance_count = instance_source->num_entities;
+            }
+            draw_matrices = instance_matrices;
+        }
+        // Both batches only read the stepped rows. The rebuild's own waits help drain the matrix chunks.
+        if (!pipelined)
+        {
+            simulation::refresh_hash(&simulation_data);
+        }
+        thread_pool::wait(&matrices_job);
 
         // vk_render_mesh(bunny_id);
         win_rect = platform::get_window_rectangle(&g_platform_data);
@@ -387,7 +689,10 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         bgl::draw_statics();
         bgl::render_lines();
 
-        bgl::render_instances(gl_cone, instance_matrices, simulation_data.num_entities);
+        if (instance_count > 0)
+        {
+            bgl::render_instances(gl_cone, draw_matrices, instance_count);
+        }
 
         imgui_end_draw();
 
@@ -396,10 +701,20 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         mpool::reset(&transient_memory); // Reset the memory pool for the next frame
         FrameMark;
     }
+    finish_step(&pipeline);
+    snapshot::wait_for_save();           // Let an in-flight snapshot finish writing
+    trajectory::stop_recording(recorder); // Flush the trajectory and write its index
+    trajectory::stop_playback(player);
+    scene::close_watcher(&scene_watcher);
+    distributed::shutdown(&dist_node, &simulation_data);
     thread_pool::shutdown_thread_pool(); // Stop the thread pool
     mpool::deallocate(&transient_memory);
+    _aligned_free(instance_matrices);
+    _aligned_free(pipeline.matrices[0]);
+    _aligned_free(pipeline.matrices[1]);
     bgl::cleanup();
     imgui_shutdown();
     simulation::free_sim(&simulation_data);
+    ecs::destroy_world(world);
     return 0;
 }
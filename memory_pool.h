@@ -1,29 +1,108 @@
 #ifndef MEMORY_POOL_H
 #define MEMORY_POOL_H
 
+#include <windows.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
 #include "types.h"
 
 #include "tracy\public\tracy\Tracy.hpp"
 #include "tracy\public\tracy\TracyOpenGL.hpp"
 
+#pragma comment(lib, "advapi32.lib")
+
 namespace mpool
 {
+    struct overflow_stack;
+
     // Structure to represent a memory pool
     typedef struct
     {
-        void *memory;        // Pointer to the allocated memory block
-        volatile u32 size;   // Total size of the memory pool in bytes
-        volatile u32 offset; // Current offset in the memory pool
+        void *memory;             // Pointer to the allocated memory block
+        volatile u32 size;        // Total size of the memory pool in bytes
+        volatile u32 offset;      // Current offset in the memory pool
+        u32 large_pages;          // Backed by large pages, released with VirtualFree
+        overflow_stack *overflow; // Heap buffers for scratch requests that do not fit, created on first use
     } memory_pool;
 
+    /*---- Large pages ----*/
+    // Big pools hit by random gathers (the spatial hash, the frame arena) can be backed by large
+    // pages, usually 2 MB, which cuts TLB misses. Windows only grants them to accounts holding the
+    // "Lock pages in memory" right, so allocate_large falls back to normal pages when they are
+    // unavailable. Pools are tracked so report_pools can show which ones got them.
+#define MPOOL_MAX_TRACKED 32
+
+    struct tracked_pool
+    {
+        const char *name;
+        void *memory;
+        u32 size;
+        u32 large_pages;
+    };
+
+    static bool g_use_large_pages = true; // Set before the pools are allocated
+    static tracked_pool g_tracked_pools[MPOOL_MAX_TRACKED];
+    static u32 g_num_tracked_pools = 0;
+
+    // Enables SeLockMemoryPrivilege for the process once. Returns the large page size, or 0 if large
+    // pages cannot be used.
+    static SIZE_T large_page_size()
+    {
+        static bool checked = false;
+        static SIZE_T page_size = 0;
+        if (checked)
+        {
+            return page_size;
+        }
+        checked = true;
+        const SIZE_T minimum = GetLargePageMinimum();
+        HANDLE token;
+        if (minimum == 0 || !OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        {
+            return 0;
+        }
+        TOKEN_PRIVILEGES privileges = {};
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        // AdjustTokenPrivileges succeeds without granting anything, the last error tells them apart
+        if (LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid) &&
+            AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS)
+        {
+            page_size = minimum;
+        }
+        CloseHandle(token);
+        return page_size;
+    }
+
+    static void track(const char *name, const memory_pool *pool)
+    {
+        if (g_num_tracked_pools < MPOOL_MAX_TRACKED)
+        {
+            g_tracked_pools[g_num_tracked_pools++] = {name, pool->memory, pool->size, pool->large_pages};
+        }
+    }
+
+    static void untrack(const void *memory)
+    {
+        for (u32 i = 0; i < g_num_tracked_pools; ++i)
+        {
+            if (g_tracked_pools[i].memory == memory)
+            {
+                g_tracked_pools[i] = g_tracked_pools[--g_num_tracked_pools];
+                return;
+            }
+        }
+    }
+
     // Function to allocate a memory pool
     memory_pool allocate(u32 size_bytes)
     {
         ZoneScoped;
         memory_pool pool;
+        pool.large_pages = 0;
+        pool.overflow = NULL;
         pool.memory = _aligned_malloc(size_bytes, 64); // Allocate memory
         if (!pool.memory)
         {
@@ -39,6 +118,47 @@ namespace mpool
         return pool;
     }
 
+    // Allocates a pool that is large page backed when large pages are enabled and available, and a
+    // normal pool otherwise. The size is rounded up to whole large pages. name shows in report_pools.
+    memory_pool allocate_large(u32 size_bytes, const char *name)
+    {
+        ZoneScoped;
+        const SIZE_T page_size = g_use_large_pages ? large_page_size() : 0;
+        const u64 rounded = page_size ? ((u64)size_bytes + page_size - 1) / page_size * page_size : 0;
+        if (page_size && size_bytes >= page_size && rounded <= 0xFFFFFFFF)
+        {
+            memory_pool pool = {};
+            pool.memory = VirtualAlloc(NULL, (SIZE_T)rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (pool.memory)
+            {
+                pool.size = (u32)rounded;
+                pool.large_pages = 1;
+                track(name, &pool);
+                return pool;
+            }
+            // Physical memory is fragmented, large pages come and go at runtime
+        }
+        memory_pool pool = allocate(size_bytes);
+        if (pool.memory)
+        {
+            track(name, &pool);
+        }
+        return pool;
+    }
+
+    // Prints every pool from allocate_large and whether it got large pages
+    void report_pools()
+    {
+        const SIZE_T page_size = large_page_size();
+        printf("Memory pools: large pages %s", !g_use_large_pages ? "disabled" : page_size ? "available" : "unavailable (needs the Lock pages in memory right)");
+        printf(page_size ? ", %llu KB\n" : "\n", (unsigned long long)(page_size / 1024));
+        for (u32 i = 0; i < g_num_tracked_pools; ++i)
+        {
+            const tracked_pool *p = &g_tracked_pools[i];
+            printf("  %-16s %8.1f MB  %s\n", p->name, p->size / (1024.0 * 1024.0), p->large_pages ? "large pages" : "normal pages");
+        }
+    }
+
     // Function to get a portion of memory from the pool
     void *get_bytes(memory_pool *pool, u32 bytes_to_get)
     {
@@ -64,12 +184,118 @@ namespace mpool
         return ptr;
     }
 
+    /*---- Scratch ----*/
+    // Scratch arrays that do not fit a pool come from heap buffers stacked on it. A buffer stays taken
+    // until the pool is rewound past it with rewind, then the next request reuses it, so a large
+    // flock allocates once rather than every item. An item run nested inside another's wait starts
+    // above the outer item's buffers and never shares one with it.
+    struct overflow_buffer
+    {
+        void *memory;
+        size_t size;
+    };
+
+    struct overflow_stack
+    {
+        overflow_buffer *buffers;
+        u32 capacity;
+        u32 used;
+    };
+
+    // Everything a pool has handed out up to a point, see get_mark and rewind
+    struct pool_mark
+    {
+        u32 offset;
+        u32 overflow_used;
+    };
+
+    static void *overflow_bytes(memory_pool *pool, size_t bytes)
+    {
+        if (!pool->overflow)
+        {
+            pool->overflow = (overflow_stack *)calloc(1, sizeof(overflow_stack));
+            if (!pool->overflow)
+            {
+                return NULL;
+            }
+        }
+        overflow_stack *stack = pool->overflow;
+        if (stack->used == stack->capacity)
+        {
+            const u32 capacity = stack->capacity ? stack->capacity * 2 : 4;
+            overflow_buffer *buffers = (overflow_buffer *)realloc(stack->buffers, sizeof(overflow_buffer) * capacity);
+            if (!buffers)
+            {
+                return NULL;
+            }
+            memset(buffers + stack->capacity, 0, sizeof(overflow_buffer) * (capacity - stack->capacity));
+            stack->buffers = buffers;
+            stack->capacity = capacity;
+        }
+        overflow_buffer *buffer = &stack->buffers[stack->used];
+        if (buffer->size < bytes)
+        {
+            _aligned_free(buffer->memory);
+            buffer->memory = _aligned_malloc(bytes, 64);
+            buffer->size = buffer->memory ? bytes : 0;
+            if (!buffer->memory)
+            {
+                return NULL;
+            }
+        }
+        stack->used++;
+        return buffer->memory;
+    }
+
+    // count elements of T from the pool, or from its overflow buffers when the pool is full. NULL only
+    // when the heap is exhausted too.
+    template <typename T>
+    static inline T *scratch(memory_pool *pool, u64 count)
+    {
+        const u64 bytes = sizeof(T) * count;
+        T *result = bytes <= 0xFFFFFFFF ? (T *)get_bytes(pool, (u32)bytes) : NULL;
+        return result || !pool ? result : (T *)overflow_bytes(pool, (size_t)bytes);
+    }
+
+    static inline pool_mark get_mark(const memory_pool *pool)
+    {
+        return {pool->offset, pool->overflow ? pool->overflow->used : 0};
+    }
+
+    // Releases everything handed out since mark was taken
+    static inline void rewind(memory_pool *pool, pool_mark mark)
+    {
+        pool->offset = mark.offset;
+        if (pool->overflow)
+        {
+            pool->overflow->used = mark.overflow_used;
+        }
+    }
+
     // Function to free the memory pool
     void deallocate(memory_pool *pool)
     {
+        if (pool && pool->overflow)
+        {
+            for (u32 i = 0; i < pool->overflow->capacity; ++i)
+            {
+                _aligned_free(pool->overflow->buffers[i].memory);
+            }
+            free(pool->overflow->buffers);
+            free(pool->overflow);
+            pool->overflow = NULL;
+        }
         if (pool && pool->memory)
         {
-            _aligned_free(pool->memory); // Free the allocated memory
+            untrack(pool->memory);
+            if (pool->large_pages)
+            {
+                VirtualFree(pool->memory, 0, MEM_RELEASE);
+            }
+            else
+            {
+                _aligned_free(pool->memory); // Free the allocated memory
+            }
             pool->memory = NULL;
             pool->size = 0;
             pool->offset = 0;
@@ -83,6 +309,10 @@ namespace mpool
         {
             pool->offset = 0; // Reset the offset to reuse the memory
         }
+        if (pool && pool->overflow)
+        {
+            pool->overflow->used = 0;
+        }
     }
 }
 #endif // MEMORY_POOL_H
\ No newline at end of file
@@ -12,6 +12,9 @@
 #include "types.h"
 #include <cassert>
 #include "gl_render.h"
+#include "boid_thread.h"
+#include "simulation.h"
+#include "ecs.h"
 
 /*------------------------------ Core Types ------------------------------*/
 // typedef enum NodeType
@@ -26,8 +29,23 @@ enum component_type
     COMPONENT_TYPE_TRANSFORM = 1 << 0,
     COMPONENT_TYPE_MESH = 1 << 1,
     COMPONENT_TYPE_VEC3 = 1 << 2,
+    COMPONENT_TYPE_EMITTER = 1 << 3,
+    COMPONENT_TYPE_BEHAVIOUR = 1 << 4,
+    COMPONENT_TYPE_ATTRACTOR = 1 << 5,
+    COMPONENT_TYPE_OBSTACLE = 1 << 6,
 };
 
+#define NUM_COMPONENT_TYPES 7
+
+// Index of a single component bit, used to address per-type tables
+static inline u32 component_slot(component_type type)
+{
+    return _tzcnt_u32((unsigned int)type);
+}
+
+// Components that are compiled into the simulation's kernel configuration
+#define SIM_NODE_COMPONENTS (COMPONENT_TYPE_EMITTER | COMPONENT_TYPE_BEHAVIOUR | COMPONENT_TYPE_ATTRACTOR | COMPONENT_TYPE_OBSTACLE)
+
 typedef struct Attribute
 {
     int id;              // Unique attribute ID
@@ -56,10 +74,8 @@ struct Vec3Component
     vec3 value;
 };
 
-#define MAX_NUM_NODES 64
-transform_component transform_data[MAX_NUM_NODES];
-MeshComponent mesh_data[MAX_NUM_NODES];
-Vec3Component vec3_data[MAX_NUM_NODES];
+// Node components live in the ECS world shared with the simulation. Each node is one ECS entity
+// whose archetype holds exactly the components in its node_entity::components mask.
 
 /**
  * @struct node_entity
@@ -83,8 +99,12 @@ Vec3Component vec3_data[MAX_NUM_NODES];
  * @var node_entity::editables
  * A 64-bit field representing the editable properties of the node.
  *
- * @var node_entity::attributes
- * A vector of integers representing additional attributes associated with the node.
+ * @var node_entity::entity
+ * Handle of the ECS entity holding the node's component data.
+ *
+ * @var node_entity::attr_ids
+ * Attribute IDs indexed by component slot and direction ([slot][0] input, [slot][1] output),
+ * -1 where the node exposes no such attribute.
  *
  * @var node_entity::name
  * A character array (up to 32 characters) representing the display name of the node.
@@ -96,8 +116,9 @@ typedef struct node_entity
     u64 ins;
     u64 outs;
     u64 editables;
+    ecs::entity_handle entity;
 
-    std::vector<int> attributes;
+    int attr_ids[NUM_COMPONENT_TYPES][2];
     // NodeType type;                  // Node type identifier
     char name[32]; // Display name
     // std::vector<int> attribute_ids; // I/O attributes
@@ -136,6 +157,16 @@ typedef struct NodeLink
  *
  * @var graph_context::next_link_id
  * A counter used to generate unique IDs for new links.
+ *
+ * @var graph_context::world
+ * ECS world holding the component data of every node, shared with the simulation.
+ *
+ * @var graph_context::component_ids
+ * ECS component id of each node component type, indexed by component_slot.
+ *
+ * The remaining members are evaluation state owned by evaluate_graph: the
+ * topological levels and link adjacency (rebuilt only when links change), the
+ * per-attribute dirty flags and the list of nodes edited since the last evaluation.
  */
 struct graph_context
 {
@@ -146,9 +177,57 @@ struct graph_context
     u32 next_node_id = 0;
     u32 next_attr_id = 0;
     u32 next_link_id = 0;
+
+    ecs::world *world = nullptr;
+    ecs::component_id component_ids[NUM_COMPONENT_TYPES];
+
+    // Evaluation state
+    std::vector<u32> dirty_nodes;      // Nodes edited since the last evaluation
+    std::vector<u8> attr_dirty;        // Per attribute: input holds stale data and must be pulled
+    std::vector<int> attr_in_link;     // Per attribute: index of the link feeding it, -1 if none
+    std::vector<u32> node_level;       // Longest path from a source node, nodes on one level are independent
+    std::vector<u32> out_link_offsets; // CSR offsets into out_links, one range per node
+    std::vector<u32> out_links;        // Link indices grouped by source node
+    std::vector<u32> node_visit_epoch; // Traversal marker, avoids clearing a visited array per evaluation
+    std::vector<u32> eval_nodes;       // Scratch: affected nodes of the current evaluation, sorted by level
+    std::vector<u32> level_offsets;    // Scratch: ranges of eval_nodes per level
+    u32 num_levels = 0;
+    u32 visit_epoch = 0;
+    bool topology_dirty = true; // Links changed since the last sort
+
+    // Simulation binding
+    simulation::sim_params sim_base_params; // The scene's settings, the graph's fields are layered over them
+    bool sim_params_dirty = false;          // A simulation node was evaluated since the last publish
 };
 
 /*------------------------------ Core Functions ------------------------------*/
+// Component data of an ECS entity by node component type, null if the entity lacks it
+template <typename T>
+static inline T *entity_component(graph_context *ctx, ecs::entity_handle entity, component_type type)
+{
+    return ecs::get<T>(ctx->world, entity, ctx->component_ids[component_slot(type)]);
+}
+
+template <typename T>
+static inline T *node_component(graph_context *ctx, u32 node_id, component_type type)
+{
+    return entity_component<T>(ctx, ctx->nodes[node_id].entity, type);
+}
+
+// Translates a node component mask into the matching ECS mask
+static inline ecs::component_mask node_ecs_mask(graph_context *ctx, u64 components)
+{
+    ecs::component_mask mask = 0;
+    for (u32 slot = 0; slot < NUM_COMPONENT_TYPES; slot++)
+    {
+        if (components & (1ull << slot))
+        {
+            mask |= ECS_COMPONENT_BIT(ctx->component_ids[slot]);
+        }
+    }
+    return mask;
+}
+
 // Initialize new attribute and add to lookup
 int create_attribute(graph_context *ctx, component_type type, bool is_input, u32 owner_id)
 {
@@ -158,12 +237,32 @@ int create_attribute(graph_context *ctx, component_type type, bool is_input, u32
     attr.is_input = is_input;
     attr.owner_id = owner_id;
     ctx->attributes.push_back(attr);
+    ctx->attr_dirty.push_back(0);
+    ctx->attr_in_link.push_back(-1);
     return attr.id; // &ctx->attr_lookup[attr.id];
 }
 
+// Queue a node for re-evaluation. Its outputs are pushed to everything downstream on the next evaluate_graph.
+void mark_node_dirty(graph_context *ctx, u32 node_id)
+{
+    ctx->dirty_nodes.push_back(node_id);
+}
+
+// Creates the input/output attributes a node exposes for one component type
+static void create_component_attributes(graph_context *ctx, node_entity *ent, component_type type, u64 in, u64 out)
+{
+    if (in & type)
+    {
+        ent->attr_ids[component_slot(type)][0] = create_attribute(ctx, type, true, ent->id);
+    }
+    if (out & type)
+    {
+        ent->attr_ids[component_slot(type)][1] = create_attribute(ctx, type, false, ent->id);
+    }
+}
+
 u32 init_node(graph_context *ctx, u64 components, const char *name, u64 in, u64 out, u64 editables)
 {
-    assert(ctx->next_node_id < MAX_NUM_NODES);
     node_entity ent = {};
     ent.components = components;
     ent.ins = in;
@@ -171,53 +270,61 @@ u32 init_node(graph_context *ctx, u64 components, const char *name, u64 in, u64
     ent.editables = editables;
     ent.id = ctx->next_node_id++;
     strncpy(ent.name, name, sizeof(ent.name));
+    memset(ent.attr_ids, 0xFF, sizeof(ent.attr_ids));
+    ent.entity = ecs::spawn(ctx->world, node_ecs_mask(ctx, components)); // Components start zeroed
 
     if (components & COMPONENT_TYPE_TRANSFORM)
     {
-        if (in & COMPONENT_TYPE_TRANSFORM)
-        {
-            int attr_id = create_attribute(ctx, COMPONENT_TYPE_TRANSFORM, true, ent.id);
-            ent.attributes.push_back(attr_id);
-        }
-        if (out & COMPONENT_TYPE_TRANSFORM)
-        {
-            int attr_id = create_attribute(ctx, COMPONENT_TYPE_TRANSFORM, false, ent.id);
-            ent.attributes.push_back(attr_id);
-        }
-        transform_data[ent.id].position = {0, 0, 0};
-        transform_data[ent.id].rotation = {0, 0, 0};
-        transform_data[ent.id].scale = {1, 1, 1};
+        create_component_attributes(ctx, &ent, COMPONENT_TYPE_TRANSFORM, in, out);
+        transform_component *tc = entity_component<transform_component>(ctx, ent.entity, COMPONENT_TYPE_TRANSFORM);
+        tc->position = {0, 0, 0};
+        tc->rotation = {0, 0, 0};
+        tc->scale = {1, 1, 1};
     }
     if (components & COMPONENT_TYPE_MESH)
     {
-        if (in & COMPONENT_TYPE_MESH)
-        {
-            int attr_id = create_attribute(ctx, COMPONENT_TYPE_MESH, true, ent.id);
-            ent.attributes.push_back(attr_id);
-        }
-        if (out & COMPONENT_TYPE_MESH)
-        {
-            int attr_id = create_attribute(ctx, COMPONENT_TYPE_MESH, false, ent.id);
-            ent.attributes.push_back(attr_id);
-        }
-        mesh_data[ent.id].mesh = nullptr;
-        mesh_data[ent.id].render_data = nullptr;
+        create_component_attributes(ctx, &ent, COMPONENT_TYPE_MESH, in, out);
+        MeshComponent *mc = entity_component<MeshComponent>(ctx, ent.entity, COMPONENT_TYPE_MESH);
+        mc->mesh = nullptr;
+        mc->render_data = nullptr;
     }
     if (components & COMPONENT_TYPE_VEC3)
     {
-        if (in & COMPONENT_TYPE_VEC3)
-        {
-            int attr_id = create_attribute(ctx, COMPONENT_TYPE_VEC3, true, ent.id);
-            ent.attributes.push_back(attr_id);
-        }
-        if (out & COMPONENT_TYPE_VEC3)
-        {
-            int attr_id = create_attribute(ctx, COMPONENT_TYPE_VEC3, false, ent.id);
-            ent.attributes.push_back(attr_id);
-        }
-        vec3_data[ent.id].value = {0, 0, 0};
+        create_component_attributes(ctx, &ent, COMPONENT_TYPE_VEC3, in, out);
+        entity_component<Vec3Component>(ctx, ent.entity, COMPONENT_TYPE_VEC3)->value = {0, 0, 0};
+    }
+    if (components & COMPONENT_TYPE_EMITTER)
+    {
+        create_component_attributes(ctx, &ent, COMPONENT_TYPE_EMITTER, in, out);
+        simulation::emitter *em = entity_component<simulation::emitter>(ctx, ent.entity, COMPONENT_TYPE_EMITTER);
+        em->position = {0, 0, 0};
+        em->radius = 0.5f;
+        em->rate = 100.0f;
+    }
+    if (components & COMPONENT_TYPE_BEHAVIOUR)
+    {
+        create_component_attributes(ctx, &ent, COMPONENT_TYPE_BEHAVIOUR, in, out);
+        *entity_component<simulation::behaviour_weights>(ctx, ent.entity, COMPONENT_TYPE_BEHAVIOUR) = simulation::default_params().behaviour;
+    }
+    if (components & COMPONENT_TYPE_ATTRACTOR)
+    {
+        create_component_attributes(ctx, &ent, COMPONENT_TYPE_ATTRACTOR, in, out);
+        simulation::attractor *attr = entity_component<simulation::attractor>(ctx, ent.entity, COMPONENT_TYPE_ATTRACTOR);
+        attr->position = {0, 0, 0};
+        attr->radius = 0.0f;
+        attr->strength = 0.1f;
+    }
+    if (components & COMPONENT_TYPE_OBSTACLE)
+    {
+        create_component_attributes(ctx, &ent, COMPONENT_TYPE_OBSTACLE, in, out);
+        simulation::obstacle *obs = entity_component<simulation::obstacle>(ctx, ent.entity, COMPONENT_TYPE_OBSTACLE);
+        obs->position = {0, 0, 0};
+        obs->radius = 0.5f;
+        obs->strength = 1.0f;
     }
     ctx->nodes.push_back(ent);
+    ctx->topology_dirty = true;
+    mark_node_dirty(ctx, ent.id); // Derived data (model matrices) is computed on first evaluation
     return ent.id;
 }
 
@@ -230,7 +337,7 @@ u32 init_vec3_node(graph_context *ctx, vec3 initial_pos)
     u64 outs = COMPONENT_TYPE_VEC3;
     u64 editables = COMPONENT_TYPE_VEC3;
     u32 node = init_node(ctx, components, "Vec3 Node", ins, outs, editables);
-    vec3_data[node].value = initial_pos;
+    node_component<Vec3Component>(ctx, node, COMPONENT_TYPE_VEC3)->value = initial_pos;
     return node;
 }
 
@@ -245,31 +352,49 @@ u32 init_mesh_node(graph_context *ctx, Mesh *mesh, const char *name)
 
     if (mesh)
     {
-        mesh_data[node].mesh = mesh;
-        mesh_data[node].render_data = bgl::add_mesh(mesh, false); // TODO this will be broken for now.
+        MeshComponent *mc = node_component<MeshComponent>(ctx, node, COMPONENT_TYPE_MESH);
+        mc->mesh = mesh;
+        mc->render_data = bgl::add_mesh(mesh, false); // TODO this will be broken for now.
     }
     return node;
 }
 
-void copy_attrib_data(Attribute *dst, Attribute *src)
+void copy_attrib_data(graph_context *ctx, Attribute *dst, Attribute *src)
 {
-
     // Initial data transfer
     if (src->type & COMPONENT_TYPE_TRANSFORM)
     {
-        memcpy(&transform_data[dst->owner_id], &transform_data[src->owner_id], sizeof(transform_component));
+        *node_component<transform_component>(ctx, dst->owner_id, COMPONENT_TYPE_TRANSFORM) = *node_component<transform_component>(ctx, src->owner_id, COMPONENT_TYPE_TRANSFORM);
     }
     if (src->type & COMPONENT_TYPE_MESH)
     {
-        memcpy(&mesh_data[dst->owner_id], &mesh_data[src->owner_id], sizeof(MeshComponent));
+        *node_component<MeshComponent>(ctx, dst->owner_id, COMPONENT_TYPE_MESH) = *node_component<MeshComponent>(ctx, src->owner_id, COMPONENT_TYPE_MESH);
+    }
+    if (!(src->type & COMPONENT_TYPE_VEC3))
+    {
+        return;
+    }
+
+    vec3 value = node_component<Vec3Component>(ctx, src->owner_id, COMPONENT_TYPE_VEC3)->value;
+    if (dst->type & COMPONENT_TYPE_TRANSFORM)
+    {
+        node_component<transform_component>(ctx, dst->owner_id, COMPONENT_TYPE_TRANSFORM)->position = value;
+    }
+    else if (dst->type & COMPONENT_TYPE_EMITTER)
+    {
+        node_component<simulation::emitter>(ctx, dst->owner_id, COMPONENT_TYPE_EMITTER)->position = value;
+    }
+    else if (dst->type & COMPONENT_TYPE_ATTRACTOR)
+    {
+        node_component<simulation::attractor>(ctx, dst->owner_id, COMPONENT_TYPE_ATTRACTOR)->position = value;
     }
-    if ((src->type & COMPONENT_TYPE_VEC3) && (dst->type & COMPONENT_TYPE_TRANSFORM))
+    else if (dst->type & COMPONENT_TYPE_OBSTACLE)
     {
-        memcpy(&transform_data[dst->owner_id], &vec3_data[src->owner_id], sizeof(vec3_data[src->owner_id]));
+        node_component<simulation::obstacle>(ctx, dst->owner_id, COMPONENT_TYPE_OBSTACLE)->position = value;
     }
-    else if (src->type & COMPONENT_TYPE_VEC3)
+    else
     {
-        memcpy(&vec3_data[dst->owner_id], &vec3_data[src->owner_id], sizeof(Vec3Component));
+        node_component<Vec3Component>(ctx, dst->owner_id, COMPONENT_TYPE_VEC3)->value = value;
     }
 }
 
@@ -283,6 +408,118 @@ bool are_attribute_types_compatible(Attribute *src, Attribute *dst)
     {
         return true;
     }
+    else if ((src->type & COMPONENT_TYPE_VEC3) &&
+             (dst->type & (COMPONENT_TYPE_EMITTER | COMPONENT_TYPE_ATTRACTOR | COMPONENT_TYPE_OBSTACLE)))
+    {
+        return true; // Drives the position
+    }
+    return false;
+}
+
+/*------------------------------ Topology ------------------------------*/
+// Rebuilds the link adjacency and assigns every node a level (longest path from a source node)
+// with Kahn's algorithm. Nodes sharing a level never depend on each other, so a level can be
+// evaluated in parallel once all lower levels are done. Returns false if the links contain a cycle.
+static bool sort_graph(graph_context *ctx)
+{
+    ZoneScoped;
+    const u32 num_nodes = (u32)ctx->nodes.size();
+    const u32 num_links = (u32)ctx->links.size();
+
+    ctx->out_link_offsets.assign(num_nodes + 1, 0);
+    ctx->out_links.resize(num_links);
+    ctx->attr_in_link.assign(ctx->attributes.size(), -1);
+    ctx->node_level.assign(num_nodes, 0);
+    ctx->node_visit_epoch.resize(num_nodes, 0);
+
+    std::vector<u32> in_degree(num_nodes, 0);
+    for (u32 i = 0; i < num_links; i++)
+    {
+        const Attribute *src = &ctx->attributes[ctx->links[i].start_attr_id];
+        const Attribute *dst = &ctx->attributes[ctx->links[i].end_attr_id];
+        ctx->out_link_offsets[src->owner_id + 1]++;
+        in_degree[dst->owner_id]++;
+        ctx->attr_in_link[dst->id] = (int)i;
+    }
+    for (u32 i = 0; i < num_nodes; i++)
+    {
+        ctx->out_link_offsets[i + 1] += ctx->out_link_offsets[i];
+    }
+
+    std::vector<u32> cursor(ctx->out_link_offsets.begin(), ctx->out_link_offsets.end() - 1);
+    for (u32 i = 0; i < num_links; i++)
+    {
+        u32 src_node = ctx->attributes[ctx->links[i].start_attr_id].owner_id;
+        ctx->out_links[cursor[src_node]++] = i;
+    }
+
+    // Kahn's algorithm, propagating levels along the way
+    std::vector<u32> queue;
+    queue.reserve(num_nodes);
+    for (u32 i = 0; i < num_nodes; i++)
+    {
+        if (in_degree[i] == 0)
+        {
+            queue.push_back(i);
+        }
+    }
+
+    ctx->num_levels = num_nodes ? 1 : 0;
+    for (u32 head = 0; head < queue.size(); head++)
+    {
+        u32 node = queue[head];
+        for (u32 j = ctx->out_link_offsets[node]; j < ctx->out_link_offsets[node + 1]; j++)
+        {
+            u32 next = ctx->attributes[ctx->links[ctx->out_links[j]].end_attr_id].owner_id;
+            if (ctx->node_level[next] < ctx->node_level[node] + 1)
+            {
+                ctx->node_level[next] = ctx->node_level[node] + 1;
+                if (ctx->node_level[next] + 1 > ctx->num_levels)
+                {
+                    ctx->num_levels = ctx->node_level[next] + 1;
+                }
+            }
+            if (--in_degree[next] == 0)
+            {
+                queue.push_back(next);
+            }
+        }
+    }
+
+    ctx->topology_dirty = false;
+    return queue.size() == num_nodes;
+}
+
+// Returns true if to_node is reachable from from_node by following links downstream.
+static bool is_downstream(graph_context *ctx, u32 from_node, u32 to_node)
+{
+    if (ctx->topology_dirty)
+    {
+        sort_graph(ctx);
+    }
+
+    u32 epoch = ++ctx->visit_epoch;
+    std::vector<u32> stack;
+    stack.push_back(from_node);
+    ctx->node_visit_epoch[from_node] = epoch;
+    while (!stack.empty())
+    {
+        u32 node = stack.back();
+        stack.pop_back();
+        if (node == to_node)
+        {
+            return true;
+        }
+        for (u32 j = ctx->out_link_offsets[node]; j < ctx->out_link_offsets[node + 1]; j++)
+        {
+            u32 next = ctx->attributes[ctx->links[ctx->out_links[j]].end_attr_id].owner_id;
+            if (ctx->node_visit_epoch[next] != epoch)
+            {
+                ctx->node_visit_epoch[next] = epoch;
+                stack.push_back(next);
+            }
+        }
+    }
     return false;
 }
 
@@ -299,41 +536,299 @@ bool create_link(graph_context *ctx, int output_attr, int input_attr)
         return false;
     }
 
+    // Reject links that would close a cycle, the evaluator needs a DAG
+    if (src->owner_id == dst->owner_id || is_downstream(ctx, dst->owner_id, src->owner_id))
+    {
+        return false;
+    }
+
+    // An input is fed by at most one link, a new connection replaces the old one
+    for (u32 i = 0; i < ctx->links.size(); i++)
+    {
+        if (ctx->links[i].end_attr_id == input_attr)
+        {
+            ctx->links.erase(ctx->links.begin() + i);
+            break;
+        }
+    }
+
     // Create link
     NodeLink link;
     link.id = ctx->next_link_id++;
     link.start_attr_id = output_attr;
     link.end_attr_id = input_attr;
     ctx->links.push_back(link);
+    ctx->topology_dirty = true;
 
-    copy_attrib_data(dst, src);
+    // The source is re-published on the next evaluation, which pulls its data across the new link
+    mark_node_dirty(ctx, src->owner_id);
 
     return true;
 }
 
-/*------------------------------ Update System ------------------------------*/
-void update_links(graph_context *ctx)
+/*------------------------------ Evaluation ------------------------------*/
+// Pulls every stale input of a node across its link and refreshes derived data.
+// Only writes components owned by the node itself, so nodes on one level can run concurrently.
+static void evaluate_node(graph_context *ctx, u32 node_id)
 {
-    for (auto &link : ctx->links)
+    node_entity *node = &ctx->nodes[node_id];
+    for (u32 slot = 0; slot < NUM_COMPONENT_TYPES; slot++)
     {
-        Attribute *src = &ctx->attributes[link.start_attr_id];
-        Attribute *dst = &ctx->attributes[link.end_attr_id];
+        int attr_id = node->attr_ids[slot][0]; // Only inputs are ever fed by a link
+        if (attr_id < 0 || !ctx->attr_dirty[attr_id])
+        {
+            continue;
+        }
+
+        int link_index = ctx->attr_in_link[attr_id];
+        if (link_index >= 0)
+        {
+            copy_attrib_data(ctx, &ctx->attributes[attr_id], &ctx->attributes[ctx->links[link_index].start_attr_id]);
+        }
+        ctx->attr_dirty[attr_id] = 0;
+    }
 
-        if (src && dst)
+    MeshComponent *mc = node_component<MeshComponent>(ctx, node_id, COMPONENT_TYPE_MESH);
+    if (mc && mc->render_data)
+    {
+        const transform_component *tc = node_component<transform_component>(ctx, node_id, COMPONENT_TYPE_TRANSFORM);
+        if (tc)
+        {
+            mc->render_data->model_matrix = matrix4::get_model_matrix(tc->position, tc->rotation, tc->scale);
+        }
+        else
         {
-            copy_attrib_data(dst, src);
+            mc->render_data->model_matrix = matrix4::identity();
         }
     }
 }
 
+struct node_eval_chunk
+{
+    graph_context *ctx;
+    const u32 *node_ids; // Nodes to evaluate, all on the same level
+    u32 count;
+};
+
+static void evaluate_nodes_worker(void *data, u32 thread_id, mpool::memory_pool *thread_memory)
+{
+    ZoneScoped;
+    node_eval_chunk *chunk = (node_eval_chunk *)data;
+    for (u32 i = 0; i < chunk->count; i++)
+    {
+        evaluate_node(chunk->ctx, chunk->node_ids[i]);
+    }
+}
+
+// Evaluates one level of the graph, spreading it over the thread pool when it is wide enough to pay for it.
+static void evaluate_level(graph_context *ctx, const u32 *node_ids, u32 count)
+{
+    ZoneScoped;
+    const u32 MIN_NODES_FOR_PARALLEL = 256;
+    const u32 MIN_NODES_PER_CHUNK = 64;
+
+    if (count < MIN_NODES_FOR_PARALLEL || thread_pool::g_thread_pool == nullptr)
+    {
+        for (u32 i = 0; i < count; i++)
+        {
+            evaluate_node(ctx, node_ids[i]);
+        }
+        return;
+    }
+
+    u32 num_chunks = min(thread_pool::g_thread_pool->num_threads * 4, count / MIN_NODES_PER_CHUNK);
+    mpool::memory_pool *memory = thread_pool::transient_memory();
+    const mpool::pool_mark mark = mpool::get_mark(memory);
+    node_eval_chunk *chunks = mpool::scratch<node_eval_chunk>(memory, num_chunks);
+
+    u32 base_chunk_size = count / num_chunks;
+    u32 remainder = count % num_chunks;
+    u32 current_start = 0;
+    thread_pool::job job = {};
+    for (u32 i = 0; i < num_chunks; i++)
+    {
+        u32 chunk_size = base_chunk_size + (i < remainder ? 1 : 0);
+        chunks[i].ctx = ctx;
+        chunks[i].node_ids = node_ids + current_start;
+        chunks[i].count = chunk_size;
+        thread_pool::add_work(evaluate_nodes_worker, &chunks[i], &job);
+        current_start += chunk_size;
+    }
+    thread_pool::wait(&job);
+    mpool::rewind(memory, mark);
+}
+
+/**
+ * @brief Propagates edits through the graph.
+ *
+ * Starting from the nodes queued with mark_node_dirty, walks downstream to collect every affected
+ * node and flags the input attributes whose source changed. Affected nodes are then evaluated level
+ * by level in topological order, so a chain settles within a single call regardless of link creation
+ * order. Untouched parts of the graph are never visited, and an idle graph returns immediately.
+ */
+void evaluate_graph(graph_context *ctx)
+{
+    if (ctx->dirty_nodes.empty())
+    {
+        return; // Nothing edited, nothing to do
+    }
+    ZoneScoped;
+
+    if (ctx->topology_dirty && !sort_graph(ctx))
+    {
+        fprintf(stderr, "Node graph contains a cycle, evaluation skipped\n");
+        ctx->dirty_nodes.clear();
+        return;
+    }
+
+    // Collect everything downstream of the edits, marking the inputs that need pulling
+    u32 epoch = ++ctx->visit_epoch;
+    std::vector<u32> &affected = ctx->eval_nodes;
+    affected.clear();
+    for (u32 i = 0; i < ctx->dirty_nodes.size(); i++)
+    {
+        u32 node = ctx->dirty_nodes[i];
+        if (ctx->node_visit_epoch[node] != epoch)
+        {
+            ctx->node_visit_epoch[node] = epoch;
+            affected.push_back(node);
+        }
+    }
+    for (u32 head = 0; head < affected.size(); head++)
+    {
+        u32 node = affected[head];
+        if (ctx->nodes[node].components & SIM_NODE_COMPONENTS)
+        {
+            ctx->sim_params_dirty = true;
+        }
+        for (u32 j = ctx->out_link_offsets[node]; j < ctx->out_link_offsets[node + 1]; j++)
+        {
+            const NodeLink *link = &ctx->links[ctx->out_links[j]];
+            ctx->attr_dirty[link->end_attr_id] = 1;
+            u32 next = ctx->attributes[link->end_attr_id].owner_id;
+            if (ctx->node_visit_epoch[next] != epoch)
+            {
+                ctx->node_visit_epoch[next] = epoch;
+                affected.push_back(next);
+            }
+        }
+    }
+
+    // Counting sort by level, each level only reads data finished by the levels before it
+    ctx->level_offsets.assign(ctx->num_levels + 1, 0);
+    for (u32 i = 0; i < affected.size(); i++)
+    {
+        ctx->level_offsets[ctx->node_level[affected[i]] + 1]++;
+    }
+    for (u32 l = 0; l < ctx->num_levels; l++)
+    {
+        ctx->level_offsets[l + 1] += ctx->level_offsets[l];
+    }
+    std::vector<u32> sorted(affected.size());
+    std::vector<u32> cursor(ctx->level_offsets.begin(), ctx->level_offsets.end() - 1);
+    for (u32 i = 0; i < affected.size(); i++)
+    {
+        sorted[cursor[ctx->node_level[affected[i]]]++] = affected[i];
+    }
+    affected.swap(sorted);
+
+    for (u32 l = 0; l < ctx->num_levels; l++)
+    {
+        u32 start = ctx->level_offsets[l];
+        u32 end = ctx->level_offsets[l + 1];
+        if (end > start)
+        {
+            evaluate_level(ctx, &affected[start], end - start);
+        }
+    }
+
+    ctx->dirty_nodes.clear();
+}
+
+/*------------------------------ Simulation Binding ------------------------------*/
+struct component_gather
+{
+    ecs::component_id id;
+    u32 size;
+    u8 *out;
+    u32 count;
+    u32 max;
+};
+
+// Appends the component column of each matching archetype to a fixed-size list
+static void gather_components_system(ecs::chunk_view *chunk, void *user_data, u32 thread_id, mpool::memory_pool *thread_memory)
+{
+    component_gather *gather = (component_gather *)user_data;
+    u32 n = min(chunk->count, gather->max - gather->count);
+    const u8 *src = (const u8 *)ecs::column(chunk->arch, gather->id) + (SIZE_T)chunk->start * gather->size;
+    memcpy(gather->out + (SIZE_T)gather->count * gather->size, src, (SIZE_T)n * gather->size);
+    gather->count += n;
+}
+
+static u32 gather_components(graph_context *ctx, component_type type, void *out, u32 size, u32 max)
+{
+    component_gather gather = {ctx->component_ids[component_slot(type)], size, (u8 *)out, 0, max};
+    ecs::for_each(ctx->world, ECS_COMPONENT_BIT(gather.id), gather_components_system, &gather);
+    return gather.count;
+}
+
+// Compiles every simulation node into one kernel configuration over the scene's settings. A
+// behaviour node replaces the scene's weights (if there are several, one of them is used), emitter,
+// attractor and obstacle nodes replace the scene's list of their kind. Kinds the graph has no nodes
+// of keep the scene's values. Reads the ECS columns directly, so cost scales with the number of
+// simulation nodes rather than the size of the graph.
+void compile_sim_params(graph_context *ctx, simulation::sim_params *out)
+{
+    ZoneScoped;
+    *out = ctx->sim_base_params;
+    gather_components(ctx, COMPONENT_TYPE_BEHAVIOUR, &out->behaviour, sizeof(simulation::behaviour_weights), 1);
+    // Gathering writes nothing when the graph has no nodes of the kind
+    if (u32 n = gather_components(ctx, COMPONENT_TYPE_EMITTER, out->emitters, sizeof(simulation::emitter), SIM_MAX_EMITTERS))
+    {
+        out->num_emitters = n;
+    }
+    if (u32 n = gather_components(ctx, COMPONENT_TYPE_ATTRACTOR, out->attractors, sizeof(simulation::attractor), SIM_MAX_ATTRACTORS))
+    {
+        out->num_attractors = n;
+    }
+    if (u32 n = gather_components(ctx, COMPONENT_TYPE_OBSTACLE, out->obstacles, sizeof(simulation::obstacle), SIM_MAX_OBSTACLES))
+    {
+        out->num_obstacles = n;
+    }
+}
+
+// Takes new scene settings. They reach the sim with the next publish, under the graph's fields.
+void set_sim_base_params(graph_context *ctx, const simulation::sim_params *params)
+{
+    ctx->sim_base_params = *params;
+    ctx->sim_params_dirty = true;
+}
+
+// scene::watcher params_hook for a graph_context
+static void scene_params_hook(void *user, const simulation::sim_params *params)
+{
+    set_sim_base_params((graph_context *)user, params);
+}
+
+// Publishes the compiled configuration if a simulation node changed. The simulation adopts it
+// at its next step boundary, so this can be called at any point in the frame.
+void publish_graph_params(graph_context *ctx, simulation::sim_data *sim)
+{
+    if (!ctx->sim_params_dirty)
+    {
+        return;
+    }
+    simulation::sim_params params;
+    compile_sim_params(ctx, &params);
+    simulation::publish_params(sim->mailbox, &params);
+    ctx->sim_params_dirty = false;
+}
+
 /*------------------------------ Link Processing ------------------------------*/
 // Unified function to handle both new link creation and data updates
 inline void process_and_store_new_links(graph_context *ctx)
 {
-    // First update existing connections
-    // update_links(ctx);
-
-    // Then process new links
+    // Process new links
     int start_node_id = -1, start_attr_id = -1, end_node_id = -1, end_attr_id = -1;
     if (ImNodes::IsLinkCreated(
             &start_node_id,
@@ -351,11 +846,11 @@ inline void process_and_store_new_links(graph_context *ctx)
         }
     }
 
-    // Optional: Second update to propagate new connection data
-    update_links(ctx);
+    // Propagate edits and new connections downstream
+    evaluate_graph(ctx);
 }
 
-graph_context init_im_nodes()
+graph_context init_im_nodes(ecs::world *world, const simulation::sim_params *scene_params)
 {
     ImNodes::CreateContext();
 
@@ -368,6 +863,16 @@ graph_context init_im_nodes()
     ctx.next_node_id = 0;
     ctx.next_attr_id = 0;
     ctx.next_link_id = 0;
+    ctx.sim_base_params = *scene_params;
+
+    ctx.world = world;
+    ctx.component_ids[component_slot(COMPONENT_TYPE_TRANSFORM)] = ecs::register_component(world, "transform", sizeof(transform_component));
+    ctx.component_ids[component_slot(COMPONENT_TYPE_MESH)] = ecs::register_component(world, "mesh", sizeof(MeshComponent));
+    ctx.component_ids[component_slot(COMPONENT_TYPE_VEC3)] = ecs::register_component(world, "vec3", sizeof(Vec3Component));
+    ctx.component_ids[component_slot(COMPONENT_TYPE_EMITTER)] = ecs::register_component(world, "emitter", sizeof(simulation::emitter));
+    ctx.component_ids[component_slot(COMPONENT_TYPE_BEHAVIOUR)] = ecs::register_component(world, "behaviour_weights", sizeof(simulation::behaviour_weights));
+    ctx.component_ids[component_slot(COMPONENT_TYPE_ATTRACTOR)] = ecs::register_component(world, "attractor", sizeof(simulation::attractor));
+    ctx.component_ids[component_slot(COMPONENT_TYPE_OBSTACLE)] = ecs::register_component(world, "obstacle", sizeof(simulation::obstacle));
 
     return ctx;
 }
@@ -425,6 +930,33 @@ node_creation_request show_canvas_context_menu()
             request.outs = COMPONENT_TYPE_TRANSFORM;
             request.editables = COMPONENT_TYPE_TRANSFORM;
         }
+        if (ImGui::MenuItem("Emitter Node"))
+        {
+            request.components = COMPONENT_TYPE_EMITTER;
+            request.position = ImGui::GetMousePos();
+            request.ins = COMPONENT_TYPE_EMITTER;
+            request.editables = COMPONENT_TYPE_EMITTER;
+        }
+        if (ImGui::MenuItem("Behaviour Node"))
+        {
+            request.components = COMPONENT_TYPE_BEHAVIOUR;
+            request.position = ImGui::GetMousePos();
+            request.editables = COMPONENT_TYPE_BEHAVIOUR;
+        }
+        if (ImGui::MenuItem("Attractor Node"))
+        {
+            request.components = COMPONENT_TYPE_ATTRACTOR;
+            request.position = ImGui::GetMousePos();
+            request.ins = COMPONENT_TYPE_ATTRACTOR;
+            request.editables = COMPONENT_TYPE_ATTRACTOR;
+        }
+        if (ImGui::MenuItem("Obstacle Node"))
+        {
+            request.components = COMPONENT_TYPE_OBSTACLE;
+            request.position = ImGui::GetMousePos();
+            request.ins = COMPONENT_TYPE_OBSTACLE;
+            request.editables = COMPONENT_TYPE_OBSTACLE;
+        }
         ImGui::EndPopup();
     }
 
@@ -433,16 +965,7 @@ node_creation_request show_canvas_context_menu()
 
 int get_node_attr_id(graph_context *ctx, node_entity *node, component_type type, bool is_input)
 {
-    for (int i = 0; i < node->attributes.size(); i++)
-    {
-        u32 attr_id = node->attributes[i];
-        Attribute *attr = &ctx->attributes[attr_id];
-        if (attr->type == type && attr->is_input == is_input)
-        {
-            return attr->id;
-        }
-    }
-    return -1; // Not found
+    return node->attr_ids[component_slot(type)][is_input ? 0 : 1]; // -1 if not found
 }
 
 /*------------------------------ Node Drawing ------------------------------*/
@@ -460,11 +983,16 @@ void draw_generic_node(graph_context *ctx, node_entity *node)
         if (node->editables & COMPONENT_TYPE_TRANSFORM)
         {
             // Transformation controls
+            transform_component *tc = node_component<transform_component>(ctx, node->id, COMPONENT_TYPE_TRANSFORM);
             ImGui::PushItemWidth(300.0f);
-            ImGui::InputFloat3("Location", &transform_data[node->id].position.x);
-            ImGui::InputFloat3("Rotation", &transform_data[node->id].rotation.x);
-            ImGui::InputFloat3("Scale", &transform_data[node->id].scale.x);
+            bool edited = ImGui::InputFloat3("Location", &tc->position.x);
+            edited |= ImGui::InputFloat3("Rotation", &tc->rotation.x);
+            edited |= ImGui::InputFloat3("Scale", &tc->scale.x);
             ImGui::PopItemWidth();
+            if (edited)
+            {
+                mark_node_dirty(ctx, node->id);
+            }
         }
         if (node->ins & COMPONENT_TYPE_TRANSFORM)
         {
@@ -521,10 +1049,104 @@ void draw_generic_node(graph_context *ctx, node_entity *node)
         if (node->editables & COMPONENT_TYPE_VEC3)
         {
             ImGui::PushItemWidth(300.0f);
-            ImGui::InputFloat3("Vec3 Value", &vec3_data[node->id].value.x);
+            if (ImGui::InputFloat3("Vec3 Value", &node_component<Vec3Component>(ctx, node->id, COMPONENT_TYPE_VEC3)->value.x))
+            {
+                mark_node_dirty(ctx, node->id);
+            }
             ImGui::PopItemWidth();
         }
     }
+    if (node->components & COMPONENT_TYPE_EMITTER)
+    {
+        if (node->ins & COMPONENT_TYPE_EMITTER)
+        {
+            int id = get_node_attr_id(ctx, node, COMPONENT_TYPE_EMITTER, true);
+            ImNodes::BeginInputAttribute(id);
+            ImGui::Text("Input Position");
+            ImNodes::EndInputAttribute();
+        }
+        if (node->editables & COMPONENT_TYPE_EMITTER)
+        {
+            simulation::emitter *em = node_component<simulation::emitter>(ctx, node->id, COMPONENT_TYPE_EMITTER);
+            ImGui::PushItemWidth(300.0f);
+            bool edited = ImGui::InputFloat3("Position", &em->position.x);
+            edited |= ImGui::InputFloat("Radius", &em->radius);
+            edited |= ImGui::InputFloat("Rate", &em->rate);
+            ImGui::PopItemWidth();
+            if (edited)
+            {
+                mark_node_dirty(ctx, node->id);
+            }
+        }
+    }
+    if (node->components & COMPONENT_TYPE_BEHAVIOUR)
+    {
+        if (node->editables & COMPONENT_TYPE_BEHAVIOUR)
+        {
+            simulation::behaviour_weights *bw = node_component<simulation::behaviour_weights>(ctx, node->id, COMPONENT_TYPE_BEHAVIOUR);
+            ImGui::PushItemWidth(300.0f);
+            bool edited = ImGui::InputFloat("Seek Radius", &bw->seek_radius);
+            edited |= ImGui::InputFloat("Flee Radius", &bw->flee_radius);
+            edited |= ImGui::InputFloat("Align Radius", &bw->align_radius);
+            edited |= ImGui::InputFloat("Seek Weight", &bw->seek_weight);
+            edited |= ImGui::InputFloat("Flee Weight", &bw->flee_weight);
+            edited |= ImGui::InputFloat("Align Weight", &bw->align_weight);
+            edited |= ImGui::InputFloat("Max Velocity", &bw->max_vel);
+            edited |= ImGui::InputFloat("Min Velocity", &bw->min_vel);
+            edited |= ImGui::InputFloat("Max Acceleration", &bw->max_acc);
+            ImGui::PopItemWidth();
+            if (edited)
+            {
+                mark_node_dirty(ctx, node->id);
+            }
+        }
+    }
+    if (node->components & COMPONENT_TYPE_ATTRACTOR)
+    {
+        if (node->ins & COMPONENT_TYPE_ATTRACTOR)
+        {
+            int id = get_node_attr_id(ctx, node, COMPONENT_TYPE_ATTRACTOR, true);
+            ImNodes::BeginInputAttribute(id);
+            ImGui::Text("Input Position");
+            ImNodes::EndInputAttribute();
+        }
+        if (node->editables & COMPONENT_TYPE_ATTRACTOR)
+        {
+            simulation::attractor *attr = node_component<simulation::attractor>(ctx, node->id, COMPONENT_TYPE_ATTRACTOR);
+            ImGui::PushItemWidth(300.0f);
+            bool edited = ImGui::InputFloat3("Position", &attr->position.x);
+            edited |= ImGui::InputFloat("Radius", &attr->radius);
+            edited |= ImGui::InputFloat("Strength", &attr->strength);
+            ImGui::PopItemWidth();
+            if (edited)
+            {
+                mark_node_dirty(ctx, node->id);
+            }
+        }
+    }
+    if (node->components & COMPONENT_TYPE_OBSTACLE)
+    {
+        if (node->ins & COMPONENT_TYPE_OBSTACLE)
+        {
+            int id = get_node_attr_id(ctx, node, COMPONENT_TYPE_OBSTACLE, true);
+            ImNodes::BeginInputAttribute(id);
+            ImGui::Text("Input Position");
+            ImNodes::EndInputAttribute();
+        }
+        if (node->editables & COMPONENT_TYPE_OBSTACLE)
+        {
+            simulation::obstacle *obs = node_component<simulation::obstacle>(ctx, node->id, COMPONENT_TYPE_OBSTACLE);
+            ImGui::PushItemWidth(300.0f);
+            bool edited = ImGui::InputFloat3("Position", &obs->position.x);
+            edited |= ImGui::InputFloat("Radius", &obs->radius);
+            edited |= ImGui::InputFloat("Strength", &obs->strength);
+            ImGui::PopItemWidth();
+            if (edited)
+            {
+                mark_node_dirty(ctx, node->id);
+            }
+        }
+    }
     ImNodes::EndNode();
 }
 
@@ -537,18 +1159,6 @@ void draw_node_editor(graph_context *ctx)
     for (auto &node : ctx->nodes)
     {
         draw_generic_node(ctx, &node);
-
-        if ((node.components & COMPONENT_TYPE_MESH) && (node.components & COMPONENT_TYPE_TRANSFORM))
-        {
-            mesh_data[node.id].render_data->model_matrix =
-                matrix4::get_model_matrix(transform_data[node.id].position,
-                                          transform_data[node.id].rotation,
-                                          transform_data[node.id].scale);
-        }
-        else if (node.components & COMPONENT_TYPE_MESH)
-        {
-            mesh_data[node.id].render_data->model_matrix = matrix4::identity();
-        }
     }
 
     // Draw all links
@@ -0,0 +1,111 @@
+#pragma once
+#include <immintrin.h>
+#include <stdint.h>
+#include "types.h"
+
+// Counter based random numbers (Philox4x32-10). A draw is a pure function of a key, derived from the
+// seed, and a 128-bit counter, here (entity id, step, stream, 0). Nothing is shared between draws, so
+// threads and SIMD lanes need no state and the same seed gives the same numbers on every platform
+// and thread count.
+//
+// Streams keep independent uses of one (entity, step) apart: placement, wander, emission and spawning
+// never see the same numbers.
+namespace rng
+{
+    enum STREAM
+    {
+        STREAM_PLACEMENT = 1,
+        STREAM_WANDER = 2,
+        STREAM_EMIT = 3,  // Emitter placement, counter word 3 numbers the step's emissions
+        STREAM_SPAWN = 4, // Boids spawned to match a target population
+    };
+
+    struct key
+    {
+        uint32_t k0;
+        uint32_t k1;
+    };
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+    static inline key make_key(u64 seed)
+    {
+        return {(uint32_t)seed, (uint32_t)(seed >> 32)};
+    }
+
+    /*---- Scalar ----*/
+    static inline void philox(const uint32_t counter[4], key k, uint32_t out[4])
+    {
+        uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+        uint32_t k0 = k.k0, k1 = k.k1;
+        for (u32 round = 0; round < PHILOX_ROUNDS; ++round)
+        {
+            const uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+            const uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+            const uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+            const uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+            c1 = (uint32_t)p1;
+            c3 = (uint32_t)p0;
+            c0 = n0;
+            c2 = n2;
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+    }
+
+    // Uniform in [0, 1), 24 bits of the draw
+    static inline float unit_float(uint32_t x)
+    {
+        return (float)(x >> 8) * (1.0f / 16777216.0f);
+    }
+
+    /*---- 8 wide ----*/
+    // Full 64-bit products of each 32-bit lane with m, split into high and low halves
+    static inline void mulhilo8(__m256i a, uint32_t m, __m256i *hi, __m256i *lo)
+    {
+        const __m256i mm = _mm256_set1_epi32((int)m);
+        const __m256i even = _mm256_mul_epu32(a, mm);                       // Lanes 0, 2, 4, 6
+        const __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), mm); // Lanes 1, 3, 5, 7
+        *lo = _mm256_mullo_epi32(a, mm);
+        *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+    }
+
+    // Eight independent draws, lane i using counter (c0[i], c1[i], c2[i], c3[i]). Matches philox lane
+    // for lane.
+    static inline void philox8(__m256i c0, __m256i c1, __m256i c2, __m256i c3, key k, __m256i out[4])
+    {
+        __m256i k0 = _mm256_set1_epi32((int)k.k0);
+        __m256i k1 = _mm256_set1_epi32((int)k.k1);
+        const __m256i w0 = _mm256_set1_epi32((int)PHILOX_W0);
+        const __m256i w1 = _mm256_set1_epi32((int)PHILOX_W1);
+        for (u32 round = 0; round < PHILOX_ROUNDS; ++round)
+        {
+            __m256i hi0, lo0, hi1, lo1;
+            mulhilo8(c0, PHILOX_M0, &hi0, &lo0);
+            mulhilo8(c2, PHILOX_M1, &hi1, &lo1);
+            c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), k0);
+            c1 = lo1;
+            c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), k1);
+            c3 = lo0;
+            k0 = _mm256_add_epi32(k0, w0);
+            k1 = _mm256_add_epi32(k1, w1);
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+    }
+
+    static inline __m256 unit_float8(__m256i x)
+    {
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(x, 8)), _mm256_set1_ps(1.0f / 16777216.0f));
+    }
+}
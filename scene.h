@@ -0,0 +1,499 @@
+#pragma once
+#include <windows.h>
+#include <stddef.h>
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "types.h"
+#include "io.h"
+#include "simulation.h"
+#include "tracy\public\tracy\Tracy.hpp"
+
+// Scene file: sim and render settings read from an INI file at startup instead of being compiled in.
+//
+//   [sim]        boids, predators, spawn_extent, cell_size, max_population, far_field_cells, compact_state,
+//                verlet_skin
+//   [behaviour]  the behaviour_weights fields (seek_radius, flee_radius, ...), wander_strength, wander_period
+//   [obstacle]   avoid_distance, lookahead, avoid_strength for the static mesh
+//   [lod]        distance, max_period, activity, target_ms
+//   [predators]  flee_radius, flee_weight, hunt_radius, hunt_weight, speed
+//   [threads]    count, queue_size, pin
+//   [memory]     large_pages
+//   [render]     boid_mesh, static_mesh, pipeline
+//
+// Repeat these sections once per element, up to the sim's limits:
+//   [emitter]          position = x, y, z, radius, rate
+//   [attractor]        position = x, y, z, radius, strength
+//   [sphere_obstacle]  position = x, y, z, radius, strength
+//
+// Keys missing from the file keep their defaults. ';' and '#' start comments.
+// The file is watched while the app runs and reloaded at step boundaries:
+//  - Behaviour and cell size changes go through the param mailbox. A new cell size rebuilds the spatial
+//    hash before the next step.
+//  - New boid and predator counts are reached by spawning or despawning.
+//  - Thread, memory and mesh settings only take effect on the next start.
+namespace scene
+{
+#define SCENE_MAX_PATH 260
+
+    struct scene_config
+    {
+        u32 num_boids;
+        u32 num_predators;
+        float spawn_extent; // Boids start uniformly in [-extent, extent]^3
+        u32 num_threads;
+        u32 queue_size;
+        u32 pin_threads; // Bind each worker to one processor of its NUMA node
+        u32 large_pages; // Back the spatial hash and frame arena with large pages when the OS allows
+        u32 pipeline;    // Step frame N+1 on the pool while frame N is submitted, one frame of latency
+        char boid_mesh[SCENE_MAX_PATH];
+        char static_mesh[SCENE_MAX_PATH];
+        simulation::sim_params params;
+    };
+
+    static inline scene_config default_config()
+    {
+        scene_config config = {};
+        config.num_boids = 100000;
+        config.spawn_extent = 5.f;
+        config.num_threads = 14;
+        config.queue_size = 256;
+        config.pin_threads = 1;
+        config.large_pages = 1;
+        strncpy(config.boid_mesh, "meshes\\cone.obj", sizeof(config.boid_mesh) - 1);
+        strncpy(config.static_mesh, "meshes\\bunny.obj", sizeof(config.static_mesh) - 1);
+        config.params = simulation::default_params();
+        return config;
+    }
+
+    /*---- Keys ----*/
+    enum key_type
+    {
+        KEY_U32,
+        KEY_FLOAT,
+        KEY_PATH,
+        KEY_VEC3, // x, y, z
+    };
+
+    struct key_desc
+    {
+        const char *section;
+        const char *name;
+        key_type type;
+        size_t offset; // Into scene_config, or into the current element of a list section
+    };
+
+    // A section that adds one element to a fixed array of the config each time it appears
+    struct list_desc
+    {
+        const char *section;
+        size_t count_offset; // u32 element count, into scene_config
+        size_t array_offset; // First element, into scene_config
+        size_t stride;
+        u32 capacity;
+    };
+
+#define SCENE_LIST(section, array, count, type, capacity) {section, offsetof(scene_config, count), offsetof(scene_config, array), sizeof(type), capacity}
+    static const list_desc g_lists[] = {
+        SCENE_LIST("emitter", params.emitters, params.num_emitters, simulation::emitter, SIM_MAX_EMITTERS),
+        SCENE_LIST("attractor", params.attractors, params.num_attractors, simulation::attractor, SIM_MAX_ATTRACTORS),
+        SCENE_LIST("sphere_obstacle", params.obstacles, params.num_obstacles, simulation::obstacle, SIM_MAX_OBSTACLES),
+    };
+#undef SCENE_LIST
+
+#define SCENE_KEY(section, name, type, member) {section, name, type, offsetof(scene_config, member)}
+    static const key_desc g_keys[] = {
+        SCENE_KEY("sim", "boids", KEY_U32, num_boids),
+        SCENE_KEY("sim", "predators", KEY_U32, num_predators),
+        SCENE_KEY("sim", "spawn_extent", KEY_FLOAT, spawn_extent),
+        SCENE_KEY("sim", "cell_size", KEY_FLOAT, params.cell_size),
+        SCENE_KEY("sim", "max_population", KEY_U32, params.max_population),
+        SCENE_KEY("sim", "far_field_cells", KEY_U32, params.far_field_cells),
+        SCENE_KEY("sim", "compact_state", KEY_U32, params.compact_state),
+        SCENE_KEY("sim", "verlet_skin", KEY_FLOAT, params.verlet_skin),
+        SCENE_KEY("behaviour", "seek_radius", KEY_FLOAT, params.behaviour.seek_radius),
+        SCENE_KEY("behaviour", "flee_radius", KEY_FLOAT, params.behaviour.flee_radius),
+        SCENE_KEY("behaviour", "align_radius", KEY_FLOAT, params.behaviour.align_radius),
+        SCENE_KEY("behaviour", "seek_weight", KEY_FLOAT, params.behaviour.seek_weight),
+        SCENE_KEY("behaviour", "flee_weight", KEY_FLOAT, params.behaviour.flee_weight),
+        SCENE_KEY("behaviour", "align_weight", KEY_FLOAT, params.behaviour.align_weight),
+        SCENE_KEY("behaviour", "max_vel", KEY_FLOAT, params.behaviour.max_vel),
+        SCENE_KEY("behaviour", "min_vel", KEY_FLOAT, params.behaviour.min_vel),
+        SCENE_KEY("behaviour", "max_acc", KEY_FLOAT, params.behaviour.max_acc),
+        SCENE_KEY("behaviour", "wander_strength", KEY_FLOAT, params.wander_strength),
+        SCENE_KEY("behaviour", "wander_period", KEY_U32, params.wander_period),
+        SCENE_KEY("obstacle", "avoid_distance", KEY_FLOAT, params.mesh_avoid_distance),
+        SCENE_KEY("obstacle", "lookahead", KEY_FLOAT, params.mesh_lookahead),
+        SCENE_KEY("obstacle", "avoid_strength", KEY_FLOAT, params.mesh_avoid_strength),
+        SCENE_KEY("lod", "distance", KEY_FLOAT, params.lod_distance),
+        SCENE_KEY("lod", "max_period", KEY_U32, params.lod_max_period),
+        SCENE_KEY("lod", "activity", KEY_FLOAT, params.lod_activity),
+        SCENE_KEY("lod", "target_ms", KEY_FLOAT, params.lod_target_ms),
+        SCENE_KEY("predators", "flee_radius", KEY_FLOAT, params.predator_radius),
+        SCENE_KEY("predators", "flee_weight", KEY_FLOAT, params.predator_flee_weight),
+        SCENE_KEY("predators", "hunt_radius", KEY_FLOAT, params.hunt_radius),
+        SCENE_KEY("predators", "hunt_weight", KEY_FLOAT, params.hunt_weight),
+        SCENE_KEY("predators", "speed", KEY_FLOAT, params.predator_speed),
+        SCENE_KEY("threads", "count", KEY_U32, num_threads),
+        SCENE_KEY("threads", "queue_size", KEY_U32, queue_size),
+        SCENE_KEY("threads", "pin", KEY_U32, pin_threads),
+        SCENE_KEY("memory", "large_pages", KEY_U32, large_pages),
+        SCENE_KEY("render", "pipeline", KEY_U32, pipeline),
+        SCENE_KEY("render", "boid_mesh", KEY_PATH, boid_mesh),
+        SCENE_KEY("render", "static_mesh", KEY_PATH, static_mesh),
+    };
+#undef SCENE_KEY
+
+#define SCENE_ITEM_KEY(section, name, type, element, member) {section, name, type, offsetof(element, member)}
+    static const key_desc g_item_keys[] = {
+        SCENE_ITEM_KEY("emitter", "position", KEY_VEC3, simulation::emitter, position),
+        SCENE_ITEM_KEY("emitter", "radius", KEY_FLOAT, simulation::emitter, radius),
+        SCENE_ITEM_KEY("emitter", "rate", KEY_FLOAT, simulation::emitter, rate),
+        SCENE_ITEM_KEY("attractor", "position", KEY_VEC3, simulation::attractor, position),
+        SCENE_ITEM_KEY("attractor", "radius", KEY_FLOAT, simulation::attractor, radius),
+        SCENE_ITEM_KEY("attractor", "strength", KEY_FLOAT, simulation::attractor, strength),
+        SCENE_ITEM_KEY("sphere_obstacle", "position", KEY_VEC3, simulation::obstacle, position),
+        SCENE_ITEM_KEY("sphere_obstacle", "radius", KEY_FLOAT, simulation::obstacle, radius),
+        SCENE_ITEM_KEY("sphere_obstacle", "strength", KEY_FLOAT, simulation::obstacle, strength),
+    };
+#undef SCENE_ITEM_KEY
+
+    // Trims leading and trailing whitespace in place
+    static char *trim(char *s)
+    {
+        while (*s == ' ' || *s == '\t')
+        {
+            ++s;
+        }
+        char *end = s + strlen(s);
+        while (end > s && (end[-1] == ' ' || end[-1] == '\t'))
+        {
+            *--end = '\0';
+        }
+        return s;
+    }
+
+    static const list_desc *find_list(const char *section)
+    {
+        for (u32 i = 0; i < sizeof(g_lists) / sizeof(g_lists[0]); ++i)
+        {
+            if (strcmp(g_lists[i].section, section) == 0)
+            {
+                return &g_lists[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Starts a new element of a list section. Returns false if the list is full.
+    static bool add_list_element(scene_config *config, const list_desc *list)
+    {
+        u32 *count = (u32 *)((u8 *)config + list->count_offset);
+        if (*count >= list->capacity)
+        {
+            return false;
+        }
+        memset((u8 *)config + list->array_offset + *count * list->stride, 0, list->stride);
+        (*count)++;
+        return true;
+    }
+
+    static bool set_key(scene_config *config, const char *section, const char *name, const char *value)
+    {
+        // Keys of a list section go to its newest element
+        const list_desc *list = find_list(section);
+        const key_desc *keys = list ? g_item_keys : g_keys;
+        const u32 num_keys = list ? sizeof(g_item_keys) / sizeof(g_item_keys[0]) : sizeof(g_keys) / sizeof(g_keys[0]);
+        u8 *base = (u8 *)config;
+        if (list)
+        {
+            const u32 count = *(u32 *)((u8 *)config + list->count_offset);
+            base += list->array_offset + (count - 1) * list->stride;
+        }
+        for (u32 i = 0; i < num_keys; ++i)
+        {
+            const key_desc *key = &keys[i];
+            if (strcmp(key->section, section) != 0 || strcmp(key->name, name) != 0)
+            {
+                continue;
+            }
+            u8 *field = base + key->offset;
+            char *end = nullptr;
+            switch (key->type)
+            {
+            case KEY_U32:
+                *(u32 *)field = (u32)strtoul(value, &end, 10);
+                break;
+            case KEY_FLOAT:
+                *(float *)field = strtof(value, &end);
+                break;
+            case KEY_PATH:
+                strncpy((char *)field, value, SCENE_MAX_PATH - 1);
+                return true;
+            case KEY_VEC3:
+            {
+                float *v = (float *)field;
+                const char *at = value;
+                for (u32 axis = 0; axis < 3; ++axis)
+                {
+                    v[axis] = strtof(at, &end);
+                    if (end == at)
+                    {
+                        return false;
+                    }
+                    while (*end == ' ' || *end == '\t' || (axis < 2 && *end == ','))
+                    {
+                        ++end;
+                    }
+                    at = end;
+                }
+                break;
+            }
+            }
+            return end && end != value && *end == '\0';
+        }
+        return false;
+    }
+
+    // Parses an INI scene file over the defaults. Returns false if the file cannot be read, in which
+    // case config is left at the defaults. Malformed lines are reported and skipped.
+    bool load(const char *path, scene_config *config)
+    {
+        ZoneScoped;
+        *config = default_config();
+        uint32_t size = 0;
+        char *text = (char *)read_file(path, &size);
+        if (!text)
+        {
+            return false;
+        }
+        normalize_line_endings(text);
+
+        char section[64] = "";
+        bool skip_section = false; // A list section past its capacity
+        u32 line_number = 0;
+        char *line = text;
+        while (line && *line)
+        {
+            char *next = strchr(line, '\n');
+            if (next)
+            {
+                *next++ = '\0';
+            }
+            ++line_number;
+
+            char *comment = strpbrk(line, ";#");
+            if (comment)
+            {
+                *comment = '\0';
+            }
+            char *s = trim(line);
+            if (*s == '[')
+            {
+                char *close = strchr(s, ']');
+                if (close)
+                {
+                    *close = '\0';
+                    strncpy(section, trim(s + 1), sizeof(section) - 1);
+                    const list_desc *list = find_list(section);
+                    skip_section = list && !add_list_element(config, list);
+                    if (skip_section)
+                    {
+                        fprintf(stderr, "%s:%u: more than %u [%s] sections, ignoring this one\n", path, line_number, list->capacity, section);
+                    }
+                }
+                else
+                {
+                    fprintf(stderr, "%s:%u: unterminated section\n", path, line_number);
+                }
+            }
+            else if (*s && !skip_section)
+            {
+                char *equals = strchr(s, '=');
+                if (!equals)
+                {
+                    fprintf(stderr, "%s:%u: expected key = value\n", path, line_number);
+                }
+                else
+                {
+                    *equals = '\0';
+                    char *name = trim(s);
+                    char *value = trim(equals + 1);
+                    if (!set_key(config, section, name, value))
+                    {
+                        fprintf(stderr, "%s:%u: unknown key or bad value [%s] %s\n", path, line_number, section, name);
+                    }
+                }
+            }
+            line = next;
+        }
+        free(text);
+
+        // Values the sim cannot run with fall back to the defaults
+        scene_config defaults = default_config();
+        if (config->params.cell_size <= 0.0f)
+        {
+            config->params.cell_size = defaults.params.cell_size;
+        }
+        if (config->num_threads == 0)
+        {
+            config->num_threads = defaults.num_threads;
+        }
+        if (config->queue_size == 0)
+        {
+            config->queue_size = defaults.queue_size;
+        }
+        config->num_boids = min(config->num_boids, (u32)SIM_MAX_ENTITIES);
+        config->num_predators = min(config->num_predators, (u32)SIM_MAX_ENTITIES - config->num_boids);
+        return true;
+    }
+
+    /*---- Hot reload ----*/
+    struct watcher
+    {
+        char path[SCENE_MAX_PATH];
+        HANDLE change; // Change notification on the file's directory
+        FILETIME last_write;
+        scene_config config; // Currently applied
+
+        // Set while a node graph authors part of the params. Reloaded params go to the hook instead of
+        // the mailbox, and the graph publishes them with its own fields on top.
+        void (*params_hook)(void *user, const simulation::sim_params *params);
+        void *params_hook_user;
+    };
+
+    static FILETIME last_write_time(const char *path)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+        GetFileAttributesExA(path, GetFileExInfoStandard, &attributes);
+        return attributes.ftLastWriteTime;
+    }
+
+    // Loads path (or the defaults if it is missing) and starts watching it for changes
+    void init_watcher(watcher *w, const char *path)
+    {
+        strncpy(w->path, path, sizeof(w->path) - 1);
+        if (!load(path, &w->config))
+        {
+            fprintf(stderr, "Scene file %s not found, using defaults\n", path);
+        }
+        w->last_write = last_write_time(path);
+
+        char directory[SCENE_MAX_PATH] = {};
+        strncpy(directory, path, sizeof(directory) - 1);
+        char *slash = strrchr(directory, '\\');
+        if (slash)
+        {
+            *slash = '\0';
+        }
+        else
+        {
+            strncpy(directory, ".", sizeof(directory) - 1);
+        }
+        w->change = FindFirstChangeNotificationA(directory, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+        if (w->change == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Cannot watch %s, hot reload disabled\n", directory);
+            w->change = NULL;
+        }
+    }
+
+    void close_watcher(watcher *w)
+    {
+        if (w->change)
+        {
+            FindCloseChangeNotification(w->change);
+            w->change = NULL;
+        }
+    }
+
+    // Spawns boids of a species at random in [-extent, extent]^3, or despawns its newest rows, until
+    // it has target members. Called between steps.
+    void match_population(simulation::sim_data *sim, u32 species, u32 target, float extent)
+    {
+        ZoneScoped;
+        u32 live = simulation::count_species(sim, species);
+        if (target > live)
+        {
+            // Spawned first so each position can be drawn from the new boid's entity id
+            const u32 spawned = simulation::spawn_species(sim, species, target - live, nullptr, nullptr);
+            for (u32 row = (u32)sim->num_entities - spawned; row < sim->num_entities; ++row)
+            {
+                const vec3 u = simulation::random_unit3(sim, row, rng::STREAM_SPAWN);
+                sim->positions[row].xyz = {u.x * 2.0f * extent - extent, u.y * 2.0f * extent - extent, u.z * 2.0f * extent - extent};
+                sim->velocities[row] = {.01f, 0, 0};
+            }
+        }
+        else if (target < live)
+        {
+            // Despawns the newest rows of the species, they are removed at the start of the next step
+            u32 excess = live - target;
+            for (u32 row = (u32)sim->num_entities; row-- > 0 && excess > 0;)
+            {
+                if (sim->species[row] == species)
+                {
+                    simulation::despawn_boid(sim, ecs::handle_at(sim->world, sim->boids, row));
+                    excess--;
+                }
+            }
+        }
+    }
+
+    // Brings the live sim in line with a new config. Called between steps.
+    static void apply(const watcher *w, const scene_config *config, simulation::sim_data *sim)
+    {
+        ZoneScoped;
+        const scene_config *previous = &w->config;
+        if (memcmp(&previous->params, &config->params, sizeof(config->params)) != 0)
+        {
+            if (w->params_hook)
+            {
+                w->params_hook(w->params_hook_user, &config->params);
+            }
+            else
+            {
+                simulation::publish_params(sim->mailbox, &config->params);
+            }
+        }
+
+        match_population(sim, simulation::SPECIES_PREY, config->num_boids, config->spawn_extent);
+        match_population(sim, simulation::SPECIES_PREDATOR, config->num_predators, config->spawn_extent);
+
+        if (previous->num_threads != config->num_threads || previous->queue_size != config->queue_size || previous->pin_threads != config->pin_threads ||
+            previous->large_pages != config->large_pages ||
+            strcmp(previous->boid_mesh, config->boid_mesh) != 0 || strcmp(previous->static_mesh, config->static_mesh) != 0)
+        {
+            fprintf(stderr, "Scene: thread, memory and mesh settings take effect on restart\n");
+        }
+    }
+
+    // Reloads and applies the scene file if it changed since the last poll. Never blocks; call at a
+    // step boundary. Returns true if a new config was applied.
+    bool poll(watcher *w, simulation::sim_data *sim)
+    {
+        if (!w->change || WaitForSingleObject(w->change, 0) != WAIT_OBJECT_0)
+        {
+            return false;
+        }
+        FindNextChangeNotification(w->change);
+
+        // The notification covers the whole directory, only act when this file was written
+        FILETIME write_time = last_write_time(w->path);
+        if (CompareFileTime(&write_time, &w->last_write) == 0)
+        {
+            return false;
+        }
+        w->last_write = write_time;
+
+        scene_config config;
+        if (!load(w->path, &config))
+        {
+            // Editors often write through a temporary, the next notification picks up the final file
+            return false;
+        }
+        apply(w, &config, sim);
+        w->config = config;
+        printf("Reloaded %s\n", w->path);
+        return true;
+    }
+}
@@ -0,0 +1,448 @@
+#pragma once
+#include <immintrin.h>
+#include <vector>
+#include "math.h"
+#include "stdio.h"
+#include "string.h"
+#include "types.h"
+#include "math_linear.h"
+#include "io.h"
+#include "bvh.h"
+#include "boid_thread.h"
+#include "tracy\public\tracy\Tracy.hpp"
+
+// Narrow band signed distance field of a mesh, baked from its BVH.
+//
+// Space around the mesh is cut into bricks of 8^3 voxels. Only bricks within band of the surface are
+// stored, each with its own 9^3 corner samples so a trilinear lookup never leaves the brick. Samples
+// are distances quantised to 16 bits over [-band, band]; negative is inside. Outside the stored
+// bricks the field reads as "far".
+//
+// Baking runs on the thread pool and is cached next to the mesh (<mesh>.sdf), keyed on a hash of the
+// mesh data and bake settings. The sign comes from the facing of the first triangle a ray hits, so it
+// is only reliable for closed meshes.
+namespace sdf
+{
+#define SDF_MAGIC 0x46445342 // "BSDF"
+#define SDF_VERSION 1
+#define SDF_BRICK 8                                      // Voxels per brick side
+#define SDF_BRICK_SIDE (SDF_BRICK + 1)                   // Samples per brick side
+#define SDF_BRICK_SAMPLES (SDF_BRICK_SIDE * SDF_BRICK_SIDE * SDF_BRICK_SIDE)
+#define SDF_NO_BRICK 0xFFFFFFFFu
+#define SDF_MAX_CELLS 512          // Voxels along the longest side, bounds the bake for large meshes
+#define SDF_VOXELS_PER_BAND 4      // Resolution relative to the band width
+#define SDF_BAKE_BRICKS_PER_TASK 8
+
+    struct sdf
+    {
+        float origin[3];
+        float voxel_size;
+        float inv_voxel_size;
+        float band;
+        u32 bricks_dim[3];
+        // Exact widths, the sampler gathers straight from these
+        std::vector<uint32_t> brick_index; // Per brick of the grid, SDF_NO_BRICK outside the band
+        std::vector<int16_t> samples;      // SDF_BRICK_SAMPLES per stored brick, plus one of padding
+    };
+
+    struct file_header
+    {
+        u32 magic;
+        u32 version;
+        u64 hash;
+        float origin[3];
+        float voxel_size;
+        float band;
+        u32 bricks_dim[3];
+        u32 num_bricks;
+    };
+
+    static inline int16_t quantise(const sdf *field, float d)
+    {
+        float q = fmaxf(-1.0f, fminf(1.0f, d / field->band));
+        return (int16_t)lrintf(q * 32767.0f);
+    }
+
+    /*---- Bake ----*/
+    struct bake_task
+    {
+        const bvh::bvh *tree;
+        sdf *field;
+        const u32 *bricks; // Grid coordinates of the stored bricks, 3 per brick
+        u32 first;
+        u32 count;
+    };
+
+    // Fills the samples of a run of bricks, 8 samples per BVH packet query
+    static void bake_worker(void *data, u32 thread_id, mpool::memory_pool *thread_memory)
+    {
+        ZoneScoped;
+        bake_task *task = (bake_task *)data;
+        const sdf *field = task->field;
+        const bvh::bvh *tree = task->tree;
+        // Skewed so rays rarely graze edges or run along faces
+        const vec3 dir = v3::normalize(vec3{0.5377f, 0.6411f, 0.5477f});
+        float diagonal = 0.0f;
+        for (u32 a = 0; a < 3; ++a)
+        {
+            float e = tree->bmax[a] - tree->bmin[a] + 2.0f * field->band;
+            diagonal += e * e;
+        }
+        diagonal = sqrtf(diagonal);
+
+        bvh::packet q = {};
+        bvh::sphere_hits spheres;
+        bvh::ray_hits rays;
+        for (u32 b = task->first; b < task->first + task->count; ++b)
+        {
+            const u32 *brick = &task->bricks[3 * b];
+            int16_t *out = &task->field->samples[(size_t)b * SDF_BRICK_SAMPLES];
+            for (u32 s = 0; s < SDF_BRICK_SAMPLES; s += 8)
+            {
+                q.count = min((u32)8, (u32)SDF_BRICK_SAMPLES - s);
+                for (u32 lane = 0; lane < q.count; ++lane)
+                {
+                    const u32 i = s + lane;
+                    const u32 local[3] = {i % SDF_BRICK_SIDE, (i / SDF_BRICK_SIDE) % SDF_BRICK_SIDE, i / (SDF_BRICK_SIDE * SDF_BRICK_SIDE)};
+                    q.x[lane] = field->origin[0] + (brick[0] * SDF_BRICK + local[0]) * field->voxel_size;
+                    q.y[lane] = field->origin[1] + (brick[1] * SDF_BRICK + local[1]) * field->voxel_size;
+                    q.z[lane] = field->origin[2] + (brick[2] * SDF_BRICK + local[2]) * field->voxel_size;
+                    q.dx[lane] = dir.x;
+                    q.dy[lane] = dir.y;
+                    q.dz[lane] = dir.z;
+                    q.limit[lane] = field->band;
+                }
+                bvh::query_spheres(tree, &q, &spheres);
+                for (u32 lane = 0; lane < q.count; ++lane)
+                {
+                    q.limit[lane] = diagonal;
+                }
+                bvh::query_rays(tree, &q, &rays);
+
+                for (u32 lane = 0; lane < q.count; ++lane)
+                {
+                    float d = ((spheres.hit_mask >> lane) & 1) ? sqrtf(spheres.dist_sq[lane]) : field->band;
+                    if ((rays.backface_mask >> lane) & 1)
+                    {
+                        d = -d;
+                    }
+                    out[s + lane] = quantise(field, d);
+                }
+            }
+        }
+    }
+
+    // Bakes the narrow band of tree's mesh. band is the largest distance callers need, voxels are
+    // a quarter of it unless that would exceed SDF_MAX_CELLS along the longest side.
+    bool bake(sdf *field, const bvh::bvh *tree, float band)
+    {
+        ZoneScoped;
+        *field = {};
+        if (tree->nodes.empty() || band <= 0.0f)
+        {
+            return false;
+        }
+        float longest = 0.0f;
+        for (u32 a = 0; a < 3; ++a)
+        {
+            longest = fmaxf(longest, tree->bmax[a] - tree->bmin[a] + 2.0f * band);
+        }
+        field->band = band;
+        field->voxel_size = fmaxf(band / SDF_VOXELS_PER_BAND, longest / SDF_MAX_CELLS);
+        field->inv_voxel_size = 1.0f / field->voxel_size;
+        for (u32 a = 0; a < 3; ++a)
+        {
+            field->origin[a] = tree->bmin[a] - band;
+            u32 cells = (u32)ceilf((tree->bmax[a] - tree->bmin[a] + 2.0f * band) * field->inv_voxel_size);
+            field->bricks_dim[a] = max((u32)1, (cells + SDF_BRICK - 1) / SDF_BRICK);
+        }
+
+        // Bricks within band of any leaf box, the same test the BVH occupancy grid uses
+        const float brick_size = field->voxel_size * SDF_BRICK;
+        const size_t num_grid_bricks = (size_t)field->bricks_dim[0] * field->bricks_dim[1] * field->bricks_dim[2];
+        field->brick_index.assign(num_grid_bricks, SDF_NO_BRICK);
+        std::vector<u8> touched(num_grid_bricks, 0);
+        for (const bvh::node &n : tree->nodes)
+        {
+            if (n.count == 0)
+            {
+                continue;
+            }
+            u32 lo[3], hi[3];
+            for (u32 a = 0; a < 3; ++a)
+            {
+                lo[a] = (u32)fmaxf((n.bmin[a] - band - field->origin[a]) / brick_size, 0.0f);
+                hi[a] = min((u32)fmaxf((n.bmax[a] + band - field->origin[a]) / brick_size, 0.0f), field->bricks_dim[a] - 1);
+            }
+            for (u32 z = lo[2]; z <= hi[2]; ++z)
+            {
+                for (u32 y = lo[1]; y <= hi[1]; ++y)
+                {
+                    memset(&touched[((size_t)z * field->bricks_dim[1] + y) * field->bricks_dim[0] + lo[0]], 1, hi[0] - lo[0] + 1);
+                }
+            }
+        }
+        std::vector<u32> bricks;
+        u32 num_bricks = 0;
+        for (u32 z = 0; z < field->bricks_dim[2]; ++z)
+        {
+            for (u32 y = 0; y < field->bricks_dim[1]; ++y)
+            {
+                for (u32 x = 0; x < field->bricks_dim[0]; ++x)
+                {
+                    size_t i = ((size_t)z * field->bricks_dim[1] + y) * field->bricks_dim[0] + x;
+                    if (touched[i])
+                    {
+                        field->brick_index[i] = num_bricks++;
+                        bricks.push_back(x);
+                        bricks.push_back(y);
+                        bricks.push_back(z);
+                    }
+                }
+            }
+        }
+        // The sampler gathers 32 bits per 16 bit sample, the padding keeps the last read in bounds
+        field->samples.resize((size_t)num_bricks * SDF_BRICK_SAMPLES + 1, 0);
+
+        std::vector<bake_task> tasks;
+        for (u32 first = 0; first < num_bricks; first += SDF_BAKE_BRICKS_PER_TASK)
+        {
+            bake_task task = {tree, field, bricks.data(), first, min((u32)SDF_BAKE_BRICKS_PER_TASK, num_bricks - first)};
+            tasks.push_back(task);
+        }
+        if (thread_pool::g_thread_pool)
+        {
+            const u32 batch = (u32)thread_pool::g_thread_pool->queue_size;
+            for (u32 start = 0; start < tasks.size(); start += batch)
+            {
+                thread_pool::job job = {};
+                for (u32 i = start; i < min(start + batch, (u32)tasks.size()); ++i)
+                {
+                    thread_pool::add_work(bake_worker, &tasks[i], &job);
+                }
+                thread_pool::wait(&job);
+            }
+        }
+        else
+        {
+            for (bake_task &task : tasks)
+            {
+                bake_worker(&task, 0, nullptr);
+            }
+        }
+        return true;
+    }
+
+    /*---- Cache ----*/
+    // FNV-1a
+    static u64 hash_bytes(const void *data, size_t size, u64 hash)
+    {
+        const u8 *bytes = (const u8 *)data;
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001B3ull;
+        }
+        return hash;
+    }
+
+    static u64 hash_mesh(const Mesh *mesh, float band)
+    {
+        u64 hash = 0xCBF29CE484222325ull;
+        const u32 version = SDF_VERSION;
+        hash = hash_bytes(&version, sizeof(version), hash);
+        hash = hash_bytes(&band, sizeof(band), hash);
+        hash = hash_bytes(mesh->vertices, sizeof(vertex) * mesh->vertexCount, hash);
+        if (mesh->indices)
+        {
+            hash = hash_bytes(mesh->indices, sizeof(unsigned int) * mesh->indexCount, hash);
+        }
+        return hash;
+    }
+
+    static bool read_cache(sdf *field, const char *path, u64 hash)
+    {
+        uint32_t size = 0;
+        u8 *file = (u8 *)read_file(path, &size);
+        if (!file)
+        {
+            return false;
+        }
+        bool ok = false;
+        file_header header;
+        if (size >= sizeof(header))
+        {
+            memcpy(&header, file, sizeof(header));
+            const size_t num_grid_bricks = (size_t)header.bricks_dim[0] * header.bricks_dim[1] * header.bricks_dim[2];
+            const size_t index_bytes = num_grid_bricks * sizeof(uint32_t);
+            const size_t sample_bytes = ((size_t)header.num_bricks * SDF_BRICK_SAMPLES + 1) * sizeof(int16_t);
+            if (header.magic == SDF_MAGIC && header.version == SDF_VERSION && header.hash == hash &&
+                size == sizeof(header) + index_bytes + sample_bytes)
+            {
+                memcpy(field->origin, header.origin, sizeof(field->origin));
+                field->voxel_size = header.voxel_size;
+                field->inv_voxel_size = 1.0f / header.voxel_size;
+                field->band = header.band;
+                memcpy(field->bricks_dim, header.bricks_dim, sizeof(field->bricks_dim));
+                field->brick_index.resize(num_grid_bricks);
+                field->samples.resize(sample_bytes / sizeof(int16_t));
+                memcpy(field->brick_index.data(), file + sizeof(header), index_bytes);
+                memcpy(field->samples.data(), file + sizeof(header) + index_bytes, sample_bytes);
+
+                // The gathers trust the index, a damaged file must not point them past the samples
+                ok = true;
+                for (size_t i = 0; i < num_grid_bricks && ok; ++i)
+                {
+                    const uint32_t brick = field->brick_index[i];
+                    ok = brick == SDF_NO_BRICK || brick < header.num_bricks;
+                }
+                if (!ok)
+                {
+                    fprintf(stderr, "SDF cache %s has brick indices out of range, rebaking\n", path);
+                    field->brick_index.clear();
+                    field->samples.clear();
+                }
+            }
+        }
+        free(file);
+        return ok;
+    }
+
+    static void write_cache(const sdf *field, const char *path, u64 hash)
+    {
+        file_header header = {};
+        header.magic = SDF_MAGIC;
+        header.version = SDF_VERSION;
+        header.hash = hash;
+        memcpy(header.origin, field->origin, sizeof(header.origin));
+        header.voxel_size = field->voxel_size;
+        header.band = field->band;
+        memcpy(header.bricks_dim, field->bricks_dim, sizeof(header.bricks_dim));
+        header.num_bricks = (u32)((field->samples.size() - 1) / SDF_BRICK_SAMPLES);
+
+        FILE *file = fopen(path, "wb");
+        if (!file)
+        {
+            fprintf(stderr, "Cannot write SDF cache %s\n", path);
+            return;
+        }
+        fwrite(&header, 1, sizeof(header), file);
+        fwrite(field->brick_index.data(), sizeof(uint32_t), field->brick_index.size(), file);
+        fwrite(field->samples.data(), sizeof(int16_t), field->samples.size(), file);
+        fclose(file);
+    }
+
+    // Reads the field for mesh from <mesh_path>.sdf, or bakes it from tree and writes the cache
+    bool load_or_bake(sdf *field, const bvh::bvh *tree, const Mesh *mesh, const char *mesh_path, float band)
+    {
+        ZoneScoped;
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s.sdf", mesh_path);
+        const u64 hash = hash_mesh(mesh, band);
+        if (read_cache(field, path, hash))
+        {
+            return true;
+        }
+        if (!bake(field, tree, band))
+        {
+            return false;
+        }
+        write_cache(field, path, hash);
+        return true;
+    }
+
+    /*---- Sampling ----*/
+    struct samples8
+    {
+        alignas(32) float dist[8];
+        alignas(32) float gx[8]; // Gradient, not normalised
+        alignas(32) float gy[8];
+        alignas(32) float gz[8];
+        u32 valid_mask; // Lanes inside a stored brick, the rest are far from the mesh
+    };
+
+    static inline __m256 lerp8(__m256 a, __m256 b, __m256 t)
+    {
+        return _mm256_fmadd_ps(t, _mm256_sub_ps(b, a), a);
+    }
+
+    // Distance and gradient at 8 points, one trilinear lookup each
+    void sample(const sdf *field, const float *x, const float *y, const float *z, u32 count, samples8 *out)
+    {
+        out->valid_mask = 0;
+        if (field->samples.size() <= 1)
+        {
+            return;
+        }
+        const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)count), lane);
+        const __m256 inv_voxel = _mm256_set1_ps(field->inv_voxel_size);
+
+        // Voxel coordinates, range checked against the brick grid
+        const __m256 lx = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x), _mm256_set1_ps(field->origin[0])), inv_voxel);
+        const __m256 ly = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(y), _mm256_set1_ps(field->origin[1])), inv_voxel);
+        const __m256 lz = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(z), _mm256_set1_ps(field->origin[2])), inv_voxel);
+        const __m256 flx = _mm256_floor_ps(lx), fly = _mm256_floor_ps(ly), flz = _mm256_floor_ps(lz);
+        const __m256 zero = _mm256_setzero_ps();
+        __m256 in_range = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(flx, zero, _CMP_GE_OQ), _mm256_cmp_ps(fly, zero, _CMP_GE_OQ)), _mm256_cmp_ps(flz, zero, _CMP_GE_OQ));
+        in_range = _mm256_and_ps(in_range, _mm256_cmp_ps(flx, _mm256_set1_ps((float)(field->bricks_dim[0] * SDF_BRICK)), _CMP_LT_OQ));
+        in_range = _mm256_and_ps(in_range, _mm256_cmp_ps(fly, _mm256_set1_ps((float)(field->bricks_dim[1] * SDF_BRICK)), _CMP_LT_OQ));
+        in_range = _mm256_and_ps(in_range, _mm256_cmp_ps(flz, _mm256_set1_ps((float)(field->bricks_dim[2] * SDF_BRICK)), _CMP_LT_OQ));
+        valid = _mm256_and_si256(valid, _mm256_castps_si256(in_range));
+        if (!_mm256_movemask_ps(_mm256_castsi256_ps(valid)))
+        {
+            return;
+        }
+
+        // Lanes out of range look up brick 0 and are masked off afterwards
+        const __m256i ix = _mm256_and_si256(_mm256_cvttps_epi32(flx), valid);
+        const __m256i iy = _mm256_and_si256(_mm256_cvttps_epi32(fly), valid);
+        const __m256i iz = _mm256_and_si256(_mm256_cvttps_epi32(flz), valid);
+        const __m256i brick_lin = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(iz, 3), _mm256_set1_epi32((int)field->bricks_dim[1])),
+                                                                                         _mm256_srli_epi32(iy, 3)),
+                                                                        _mm256_set1_epi32((int)field->bricks_dim[0])),
+                                                   _mm256_srli_epi32(ix, 3));
+        __m256i brick = _mm256_i32gather_epi32((const int *)field->brick_index.data(), brick_lin, 4);
+        valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(brick, _mm256_set1_epi32(-1)), valid);
+        out->valid_mask = (u32)_mm256_movemask_ps(_mm256_castsi256_ps(valid));
+        if (!out->valid_mask)
+        {
+            return;
+        }
+        brick = _mm256_and_si256(brick, valid);
+
+        const __m256i seven = _mm256_set1_epi32(SDF_BRICK - 1);
+        const __m256i local = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(iz, seven), _mm256_set1_epi32(SDF_BRICK_SIDE)),
+                                                                                   _mm256_and_si256(iy, seven)),
+                                                                  _mm256_set1_epi32(SDF_BRICK_SIDE)),
+                                               _mm256_and_si256(ix, seven));
+        const __m256i base = _mm256_add_epi32(_mm256_mullo_epi32(brick, _mm256_set1_epi32(SDF_BRICK_SAMPLES)), local);
+
+        // 16 bit samples through 32 bit gathers, sign extended from the low half
+        const int16_t *samples = field->samples.data();
+        const __m256 scale = _mm256_set1_ps(field->band / 32767.0f);
+        auto corner = [&](int offset)
+        {
+            __m256i v = _mm256_i32gather_epi32((const int *)samples, _mm256_add_epi32(base, _mm256_set1_epi32(offset)), 2);
+            v = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+            return _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale);
+        };
+        const int sy = SDF_BRICK_SIDE, sz = SDF_BRICK_SIDE * SDF_BRICK_SIDE;
+        const __m256 c000 = corner(0), c100 = corner(1), c010 = corner(sy), c110 = corner(sy + 1);
+        const __m256 c001 = corner(sz), c101 = corner(sz + 1), c011 = corner(sz + sy), c111 = corner(sz + sy + 1);
+
+        const __m256 fx = _mm256_sub_ps(lx, flx), fy = _mm256_sub_ps(ly, fly), fz = _mm256_sub_ps(lz, flz);
+        const __m256 x00 = lerp8(c000, c100, fx), x10 = lerp8(c010, c110, fx);
+        const __m256 x01 = lerp8(c001, c101, fx), x11 = lerp8(c011, c111, fx);
+        const __m256 y0 = lerp8(x00, x10, fy), y1 = lerp8(x01, x11, fy);
+        _mm256_store_ps(out->dist, lerp8(y0, y1, fz));
+
+        // Derivatives of the trilinear interpolant, per voxel scaled to per unit
+        const __m256 dx = lerp8(lerp8(_mm256_sub_ps(c100, c000), _mm256_sub_ps(c110, c010), fy), lerp8(_mm256_sub_ps(c101, c001), _mm256_sub_ps(c111, c011), fy), fz);
+        const __m256 dy = lerp8(_mm256_sub_ps(x10, x00), _mm256_sub_ps(x11, x01), fz);
+        const __m256 dz = _mm256_sub_ps(y1, y0);
+        _mm256_store_ps(out->gx, _mm256_mul_ps(dx, inv_voxel));
+        _mm256_store_ps(out->gy, _mm256_mul_ps(dy, inv_voxel));
+        _mm256_store_ps(out->gz, _mm256_mul_ps(dz, inv_voxel));
+    }
+}
@@ -7,31 +7,236 @@
 #include "string.h"
 #include "spatial_hash.h"
 #include "boid_thread.h"
+#include "ecs.h"
+#include "bvh.h"
+#include "sdf.h"
+#include "rng.h"
 #include "tracy\public\tracy\Tracy.hpp"
 
 namespace simulation
 {
 
-    enum SIM_COMPONENT_TYPES
-    {
-        SIM_COMPONENT_SPATIAL = 1 << 0,
-        SIM_COMPONENT_BOID = 1 << 1,
-        SIM_COMPONENT_PLANE = 1 << 2,
-    };
-
     enum BOID_TYPES
     {
         BOID_TYPE_SEEK = 1 << 0,
         BOID_TYPE_FLEE = 1 << 1,
         BOID_TYPE_ALIGN = 1 << 2,
         BOID_TYPE_COPLANAR = 1 << 3,
+        BOID_TYPE_AVOID_MESH = 1 << 4,
+        BOID_TYPE_FLEE_PREDATORS = 1 << 5,
+        BOID_TYPE_HUNT = 1 << 6,
+        BOID_TYPE_GHOST = 1 << 7, // Copy of a boid owned by another process, seen as a neighbour but never steered
+        BOID_TYPE_WANDER = 1 << 8,
+    };
+
+    // Species 0 is the main flock. Flocking behaviours only see boids of the same species.
+    enum SPECIES
+    {
+        SPECIES_PREY = 0,
+        SPECIES_PREDATOR = 1,
+    };
+
+#define SIM_MAX_SPECIES 4
+#define BOID_DEFAULT_BEHAVIOURS (BOID_TYPE_SEEK | BOID_TYPE_FLEE | BOID_TYPE_ALIGN | BOID_TYPE_AVOID_MESH | BOID_TYPE_FLEE_PREDATORS | BOID_TYPE_WANDER)
+#define PREDATOR_DEFAULT_BEHAVIOURS (BOID_TYPE_SEEK | BOID_TYPE_FLEE | BOID_TYPE_ALIGN | BOID_TYPE_AVOID_MESH | BOID_TYPE_HUNT | BOID_TYPE_WANDER)
+
+#define SIM_MAX_EMITTERS 8
+#define SIM_MAX_ATTRACTORS 8
+#define SIM_MAX_OBSTACLES 16
+
+    struct emitter
+    {
+        vec3 position;
+        float radius; // Boids are re-emitted uniformly inside this sphere
+        float rate;   // Boids per second
+    };
+
+    struct attractor
+    {
+        vec3 position;
+        float radius;   // Influence radius, <= 0 means unbounded
+        float strength; // Acceleration towards the attractor
+    };
+
+    struct obstacle
+    {
+        vec3 position;
+        float radius;   // Boids are pushed out of this sphere
+        float strength; // Repulsion at the surface, scales linearly to zero at 2 * radius
+    };
+
+    struct behaviour_weights
+    {
+        float seek_radius;
+        float flee_radius;
+        float align_radius;
+        float seek_weight;
+        float flee_weight;
+        float align_weight;
+        float max_vel;
+        float min_vel;
+        float max_acc;
     };
 
-    static float g_max_vel = 0.5f;
-    static float g_min_vel = 0.15f;
-    static float g_max_acc = 0.25f;
+    // Kernel configuration. Compiled from the node graph (or left at defaults) and
+    // handed to the simulation through a param_mailbox, never written mid-step.
+    struct sim_params
+    {
+        behaviour_weights behaviour;
+        float cell_size;
+
+        emitter emitters[SIM_MAX_EMITTERS];
+        attractor attractors[SIM_MAX_ATTRACTORS];
+        obstacle obstacles[SIM_MAX_OBSTACLES];
+        u32 num_emitters;
+        u32 num_attractors;
+        u32 num_obstacles;
+        u32 max_population; // Emitters spawn new boids below this, above it they recycle existing ones. 0 = never spawn
+
+        // Obstacle mesh avoidance, for boids with BOID_TYPE_AVOID_MESH
+        float mesh_avoid_distance; // Boids closer than this to the mesh are pushed away from it
+        float mesh_lookahead;      // Seconds of travel checked for a hit ahead of each boid
+        float mesh_avoid_strength; // Acceleration at the surface, scales linearly to zero at the limits above
+
+        // Level of detail: a boid's steering is evaluated every period-th step and integrated from the
+        // cached acceleration in between. The period grows with distance from the camera.
+        float lod_distance;  // Distance per extra step of period, 0 evaluates every boid every step
+        u32 lod_max_period;  // Upper bound on the period
+        float lod_activity;  // Boids steering harder than this fraction of max_acc are evaluated every step
+        float lod_target_ms; // If > 0, lod_distance is scaled down while the kernel runs over this budget
 
-    static float g_cell_size = .25f;
+        // Far field: seek and align take boids within this many cells (per axis) individually and
+        // farther cells as one aggregate each. Raised to cover flee_radius. 0 = exact everywhere
+        u32 far_field_cells;
+
+        // Compact state: neighbour gathers read 16 byte records built with the hash (positions as 16-bit
+        // fixed point within their cell, velocities as fp16) instead of 32 bytes of float rows. 0 = off
+        u32 compact_state;
+
+        // Verlet lists: prey keep the rows within search radius + verlet_skin as their neighbour list,
+        // and the hash and lists are rebuilt only once some boid has moved more than half the skin.
+        // Needs far_field_cells = 0. 0 = search the hash every step
+        float verlet_skin;
+
+        // Wander: boids with BOID_TYPE_WANDER steer towards a random direction that drifts to a new one
+        // every wander_period steps. 0 strength = off
+        float wander_strength;
+        u32 wander_period;
+
+        // Predators and prey
+        float predator_radius;      // Boids with BOID_TYPE_FLEE_PREDATORS flee predators within this
+        float predator_flee_weight;
+        float hunt_radius;          // Boids with BOID_TYPE_HUNT chase the nearest prey within this
+        float hunt_weight;
+        float predator_speed;       // Predator max_vel as a multiple of the flock's
+    };
+
+    static inline sim_params default_params()
+    {
+        sim_params params = {};
+        params.behaviour.seek_radius = 0.25f;
+        params.behaviour.flee_radius = 0.15f;
+        params.behaviour.align_radius = 0.25f;
+        params.behaviour.seek_weight = 1.0f;
+        params.behaviour.flee_weight = 1.0f;
+        params.behaviour.align_weight = 1.0f;
+        params.behaviour.max_vel = 0.5f;
+        params.behaviour.min_vel = 0.15f;
+        params.behaviour.max_acc = 0.25f;
+        params.cell_size = .25f;
+        params.mesh_avoid_distance = 0.1f;
+        params.mesh_lookahead = 0.5f;
+        params.mesh_avoid_strength = 1.0f;
+        params.lod_distance = 0.0f;
+        params.lod_max_period = 8;
+        params.lod_activity = 0.75f;
+        params.lod_target_ms = 0.0f;
+        params.predator_radius = 0.5f;
+        params.predator_flee_weight = 2.0f;
+        params.hunt_radius = 0.75f;
+        params.hunt_weight = 1.5f;
+        params.predator_speed = 1.25f;
+        params.wander_strength = 0.0f;
+        params.wander_period = 30;
+        params.verlet_skin = 0.0f;
+        return params;
+    }
+
+    // Lock-free triple buffer carrying sim_params from a single producer (the node graph / UI)
+    // to the simulation. The producer never blocks and the simulation only picks up complete
+    // parameter sets, at the start of a step.
+    struct param_mailbox
+    {
+        sim_params slots[3];
+        u32 write_index;      // Slot owned by the producer
+        u32 read_index;       // Slot owned by the simulation
+        volatile LONG shared; // Slot in flight, PARAM_MAILBOX_FRESH set while unread
+    };
+
+#define PARAM_MAILBOX_FRESH 4
+
+    static inline void init_mailbox(param_mailbox *mailbox)
+    {
+        mailbox->write_index = 0;
+        mailbox->shared = 1;
+        mailbox->read_index = 2;
+    }
+
+    // Producer side: copy the params in and swap them into the shared slot.
+    static inline void publish_params(param_mailbox *mailbox, const sim_params *params)
+    {
+        mailbox->slots[mailbox->write_index] = *params;
+        MemoryBarrier();
+        LONG previous = InterlockedExchange(&mailbox->shared, (LONG)mailbox->write_index | PARAM_MAILBOX_FRESH);
+        mailbox->write_index = previous & 3;
+    }
+
+    // Consumer side: returns true and fills out_params if new params were published since the last call.
+    static inline bool consume_params(param_mailbox *mailbox, sim_params *out_params)
+    {
+        if (!(mailbox->shared & PARAM_MAILBOX_FRESH))
+        {
+            return false;
+        }
+        LONG previous = InterlockedExchange(&mailbox->shared, (LONG)mailbox->read_index);
+        mailbox->read_index = previous & 3;
+        *out_params = mailbox->slots[mailbox->read_index];
+        return true;
+    }
+
+#define SIM_DEFAULT_SEED 0x2545F491
+
+    // Component ids of the flock in the shared ECS world
+    struct sim_components
+    {
+        ecs::component_id position;  // vec4
+        ecs::component_id velocity;  // vec3
+        ecs::component_id behaviour; // u64, BOID_TYPES mask
+        ecs::component_id acceleration; // vec3, last evaluated steering, reused between LOD updates
+        ecs::component_id species;      // u32, SPECIES
+    };
+
+    // Spatial index over the boids of one species other than the main flock. Hash results are
+    // indices into rows. These populations are small, so cross-species queries against them are cheap.
+    struct species_index
+    {
+        spatial_hash::spatial_hash hash;
+        std::vector<vec4> positions;
+        std::vector<u32> rows;
+    };
+
+    // Neighbour view of a boid in compact state. The position is the containing hash cell, 10 bits per
+    // axis, plus a 16-bit fixed point offset within it; the velocity is fp16.
+#define COMPACT_MAX_CELLS 1024
+    struct alignas(16) compact_boid
+    {
+        uint16_t offset[3];   // Position within the cell, in 1/65536ths of a cell
+        uint16_t velocity[3]; // fp16
+        uint32_t key;         // Cell x | y << 10 | z << 20 | species << 30
+    };
+
+    // Upper bound on boids. Only address space is reserved for it, memory is committed as the flock grows.
+#define SIM_MAX_ENTITIES (1 << 24)
 
     struct sim_data
     {
@@ -42,41 +247,279 @@ namespace simulation
         int num_iterations; // Number of iterations to run in the simulation
         // Add more members as needed
 
-        u64 num_entities;
-        u64 *components; // Array of entity IDs
+        // Boids live in one archetype of the ECS world. Its columns never move, so these pointers stay
+        // valid as boids are spawned and despawned. Row i of each column is boid i, and neighbour ids
+        // returned by the spatial hash are rows.
+        ecs::world *world;
+        ecs::archetype *boids;
+        ecs::component_mask boid_mask;
+        sim_components ids;
+        u64 num_entities; // Live boids, mirrors boids->count
         u64 *behaviours;
         vec4 *positions;  // Array of entity positions
         vec3 *velocities; // Array of entity velocities
+        vec3 *accelerations; // Cached steering per boid
+        u32 *species;        // SPECIES per boid
+        bool hash_stale;  // Boids were spawned or despawned since the spatial hash was built
+        bool species_stale; // Only the species indices need rebuilding, Verlet lists cover the main hash
+        u32 population_epoch; // Bumped whenever rows are added, removed or reordered
+        std::vector<ecs::entity_handle> pending_despawns; // Removed at the next step boundary
+
+        sim_params params;      // Active kernel configuration, only replaced between steps
+        param_mailbox *mailbox; // Pending configuration from the node graph / UI
+        float emit_accumulator; // Fractional boids owed by emitters
+        u32 emit_cursor;        // Next boid to recycle through an emitter
+        u64 seed;               // Keys the counter based draws: placement, wander, emission, spawning
+
+        spatial_hash::spatial_hash search_hash; // Every boid
+        species_index species_indices[SIM_MAX_SPECIES]; // Species 1 and up, rebuilt with search_hash
+        const bvh::bvh *mesh_obstacle; // Optional collision mesh, owned by the caller
+        const sdf::sdf *mesh_sdf;      // Optional distance field of mesh_obstacle, replaces its queries
 
-        spatial_hash::spatial_hash search_hash;
+        // Verlet lists in CSR form: the neighbours of row i are verlet_neighbours[verlet_offsets[i]] up to
+        // verlet_offsets[i + 1]. Built with search_hash, empty for species other than prey.
+        std::vector<u32> verlet_offsets;
+        std::vector<u32> verlet_neighbours;
+        std::vector<vec3> verlet_anchors; // Positions the lists were built from
+        std::vector<std::vector<u32>> verlet_task_neighbours; // Per-task search results, kept for their capacity
+        bool verlet_valid;
+        float verlet_radius;               // Search radius + skin the lists cover
+        u32 verlet_epoch;                  // population_epoch the lists were built for
+        volatile LONG verlet_max_move_sq;  // Float bits of the largest squared move since the build
+        u32 verlet_builds;                 // Statistics for verlet_report
+
+        compact_boid *compact;   // Row i is boid i, rebuilt with search_hash while params.compact_state is set
+        u32 compact_capacity;
+        bool compact_valid;      // False when compact state is off or the grid is too large to encode
+        vec4 compact_origin;     // Grid origin and cell size the records are relative to
+        float compact_cell_size;
+
+        vec3 lod_focus;   // Camera position, set by the caller before each step
+        float lod_scale;  // Applied to lod_distance, lowered by the cost controller when over budget
+        float lod_step;   // Effective distance per period step for the current step, 0 = LOD off
+        u32 lod_frame;    // Step counter that staggers updates across rows
+        float kernel_ms;  // Cost of the last kernel run
         // void *search_memory_pool;
     };
+    // Entity ids of 8 rows from first, the last row repeated past end. Draws are keyed on these, so a
+    // boid keeps its numbers when despawns move it to another row.
+    static inline __m256i entity_ids8(const sim_data *data, u32 first, u32 end)
+    {
+        alignas(32) uint32_t ids[8];
+        for (u32 lane = 0; lane < 8; ++lane)
+        {
+            ids[lane] = data->boids->entity_indices[min(first + lane, end - 1)];
+        }
+        return _mm256_load_si256((const __m256i *)ids);
+    }
+
+    struct placement_task
+    {
+        sim_data *data;
+        float extents;
+        u32 start;
+        u32 end;
+    };
+
+    static void placement_worker(void *task_data, u32 thread_id, mpool::memory_pool *transient_memory)
+    {
+        ZoneScoped;
+        placement_task *task = (placement_task *)task_data;
+        sim_data *data = task->data;
+        const rng::key key = rng::make_key(data->seed);
+        const __m256 scale = _mm256_set1_ps(2.0f * task->extents);
+        const __m256 offset = _mm256_set1_ps(-task->extents);
+        for (u32 first = task->start; first < task->end; first += 8)
+        {
+            __m256i bits[4];
+            rng::philox8(entity_ids8(data, first, task->end), _mm256_setzero_si256(), _mm256_set1_epi32(rng::STREAM_PLACEMENT), _mm256_setzero_si256(), key, bits);
+            alignas(32) float xyz[3][8];
+            for (u32 axis = 0; axis < 3; ++axis)
+            {
+                _mm256_store_ps(xyz[axis], _mm256_fmadd_ps(rng::unit_float8(bits[axis]), scale, offset));
+            }
+            for (u32 lane = 0; lane < 8 && first + lane < task->end; ++lane)
+            {
+                const u32 i = first + lane;
+                data->positions[i] = {xyz[0][lane], xyz[1][lane], xyz[2][lane], 1.0f};
+                data->behaviours[i] = BOID_DEFAULT_BEHAVIOURS;
+                data->velocities[i] = {.01f, 0, 0};
+            }
+        }
+    }
+
+    // Places every boid uniformly in [-extents, extents]^3. Each position depends only on the seed and
+    // the boid's entity id, so the result is the same whatever the thread count.
     static inline void
     distribute_boids_random(float extents, sim_data *data)
     {
+        ZoneScoped;
+        const u32 num_rows = (u32)data->num_entities;
+        if (num_rows == 0)
+        {
+            return;
+        }
+        const u32 num_tasks = min(max(thread_pool::g_thread_pool->num_threads * 4, (u32)1), (u32)thread_pool::g_thread_pool->queue_size);
+        const u32 rows_per_task = ((num_rows + num_tasks - 1) / num_tasks + 7) & ~7u;
+        std::vector<placement_task> tasks;
+        for (u32 start = 0; start < num_rows; start += rows_per_task)
+        {
+            tasks.push_back({data, extents, start, min(start + rows_per_task, num_rows)});
+        }
+        thread_pool::job job = {};
+        for (u32 i = 0; i < tasks.size(); ++i)
+        {
+            thread_pool::add_work(placement_worker, &tasks[i], &job);
+        }
+        thread_pool::wait(&job);
+    }
+
+    // Wander steering for rows [start_id, end_id): per boid value noise, a random direction drawn every
+    // wander_period steps and blended linearly into the next, so the steering drifts instead of jittering
+    static void wander_block(const sim_data *data, u32 start_id, u32 end_id, vec3 *out)
+    {
+        ZoneScoped;
+        const rng::key key = rng::make_key(data->seed);
+        const u32 period = max(data->params.wander_period, (u32)1);
+        const u32 step = (u32)data->num_iterations;
+        const __m256i knot = _mm256_set1_epi32((int)(step / period));
+        const __m256i next_knot = _mm256_set1_epi32((int)(step / period + 1));
+        const __m256i stream = _mm256_set1_epi32(rng::STREAM_WANDER);
+        const __m256 blend = _mm256_set1_ps((float)(step % period) / (float)period);
+        const __m256 scale = _mm256_set1_ps(2.0f * data->params.wander_strength);
+        const __m256 offset = _mm256_set1_ps(-data->params.wander_strength);
+        for (u32 first = start_id; first < end_id; first += 8)
+        {
+            const __m256i ids = entity_ids8(data, first, end_id);
+            __m256i from[4], to[4];
+            rng::philox8(ids, knot, stream, _mm256_setzero_si256(), key, from);
+            rng::philox8(ids, next_knot, stream, _mm256_setzero_si256(), key, to);
+            alignas(32) float xyz[3][8];
+            for (u32 axis = 0; axis < 3; ++axis)
+            {
+                const __m256 a = rng::unit_float8(from[axis]);
+                const __m256 b = rng::unit_float8(to[axis]);
+                const __m256 u = _mm256_fmadd_ps(_mm256_sub_ps(b, a), blend, a);
+                _mm256_store_ps(xyz[axis], _mm256_fmadd_ps(u, scale, offset));
+            }
+            for (u32 lane = 0; lane < 8 && first + lane < end_id; ++lane)
+            {
+                out[first + lane - start_id] = {xyz[0][lane], xyz[1][lane], xyz[2][lane]};
+            }
+        }
+    }
+
+    // Refreshes the flat views of the boid archetype after its population changed
+    static inline void sync_boid_columns(sim_data *data)
+    {
+        data->num_entities = data->boids->count;
+        data->population_epoch++;
+        data->positions = ecs::column<vec4>(data->boids, data->ids.position);
+        data->velocities = ecs::column<vec3>(data->boids, data->ids.velocity);
+        data->behaviours = ecs::column<u64>(data->boids, data->ids.behaviour);
+        data->accelerations = ecs::column<vec3>(data->boids, data->ids.acceleration);
+        data->species = ecs::column<u32>(data->boids, data->ids.species);
+    }
 
-        for (u32 i = 0; i < data->num_entities; ++i)
+    // Appends count zeroed boid rows in one batch, returns the first new row and writes the number
+    // actually spawned (less than count only if the flock hit SIM_MAX_ENTITIES) to out_spawned.
+    static u32 spawn_rows(sim_data *data, u32 count, ecs::entity_handle *out_handles, u32 *out_spawned)
+    {
+        u32 first = ecs::spawn_batch(data->world, data->boid_mask, count, out_handles, out_spawned);
+        if (*out_spawned)
         {
-            // Assign components to the entity
-            data->components[i] = SIM_COMPONENT_SPATIAL | SIM_COMPONENT_BOID;
+            sync_boid_columns(data);
+            data->hash_stale = true;
+        }
+        return first;
+    }
 
-            // Generate random positions within the extents
-            data->positions[i].x = ((float)rand() / RAND_MAX) * 2.0f * extents - extents;
-            data->positions[i].y = ((float)rand() / RAND_MAX) * 2.0f * extents - extents;
-            data->positions[i].z = ((float)rand() / RAND_MAX) * 2.0f * extents - extents;
-            data->positions[i].w = 1.0f;                                             // ((float)rand() / RAND_MAX) * 2.0f * extents - extents;
-            data->behaviours[i] = BOID_TYPE_SEEK | BOID_TYPE_FLEE | BOID_TYPE_ALIGN; // Assign behaviours to the entity
-            // Initialize velocities to zero
-            data->velocities[i] = {.01f, 0, 0};
-            // data->velocities[i] =
-            //     {2.0f * ((float)rand() / RAND_MAX) - 1.0f,
-            //      2.0f * ((float)rand() / RAND_MAX) - 1.0f,
-            //      2.0f * ((float)rand() / RAND_MAX) - 1.0f};
-            // data->velocities[i] = v3::normalize(data->velocities[i]) * g_min_vel; // Normalize and scale to min velocity
+    // Spawns count prey with the default behaviours. positions and velocities may be null, in which
+    // case boids start at the origin and at rest. Handles are written to out_handles if it is not null.
+    // Returns the number spawned. Must be called between steps, never during update_sim.
+    u32 spawn_boids(sim_data *data, u32 count, const vec3 *positions, const vec3 *velocities, ecs::entity_handle *out_handles)
+    {
+        ZoneScoped;
+        u32 spawned;
+        u32 first = spawn_rows(data, count, out_handles, &spawned);
+        for (u32 i = 0; i < spawned; ++i)
+        {
+            u32 row = first + i;
+            if (positions)
+            {
+                data->positions[row].xyz = positions[i];
+            }
+            data->positions[row].w = 1.0f;
+            if (velocities)
+            {
+                data->velocities[row] = velocities[i];
+            }
+            data->behaviours[row] = BOID_DEFAULT_BEHAVIOURS;
+        }
+        return spawned;
+    }
+
+    // Spawns count boids of a species with its default behaviours, see spawn_boids
+    u32 spawn_species(sim_data *data, u32 species, u32 count, const vec3 *positions, const vec3 *velocities)
+    {
+        u32 spawned = spawn_boids(data, count, positions, velocities, nullptr);
+        for (u32 row = (u32)data->num_entities - spawned; row < data->num_entities; ++row)
+        {
+            data->species[row] = species;
+            data->behaviours[row] = species == SPECIES_PREY ? BOID_DEFAULT_BEHAVIOURS : PREDATOR_DEFAULT_BEHAVIOURS;
         }
+        return spawned;
     }
 
-    sim_data init_sim(u64 num_entities, float radius)
+    // Live boids of a species, including any queued for despawn
+    u32 count_species(const sim_data *data, u32 species)
+    {
+        u32 count = 0;
+        for (u32 row = 0; row < data->num_entities; ++row)
+        {
+            count += data->species[row] == species;
+        }
+        return count;
+    }
+
+    ecs::entity_handle spawn_boid(sim_data *data, vec3 position, vec3 velocity)
+    {
+        ecs::entity_handle handle = {};
+        spawn_boids(data, 1, &position, &velocity, &handle);
+        return handle;
+    }
+
+    // Queues a boid for removal. It stays live, and keeps its row, until the next step boundary, so row
+    // indices held for the current frame (hash results, instance matrices) stay valid. Can be called at
+    // any point outside the kernel; stale or repeated handles are ignored.
+    void despawn_boid(sim_data *data, ecs::entity_handle handle)
+    {
+        data->pending_despawns.push_back(handle);
+    }
+
+    // Step boundary: removes queued boids. Each removal swap-removes, so compaction costs one row move
+    // per despawned boid regardless of population.
+    static void flush_despawns(sim_data *data)
+    {
+        if (data->pending_despawns.empty())
+        {
+            return;
+        }
+        ZoneScoped;
+        u32 removed = 0;
+        for (u32 i = 0; i < data->pending_despawns.size(); ++i)
+        {
+            removed += ecs::despawn(data->world, data->pending_despawns[i]) ? 1 : 0;
+        }
+        data->pending_despawns.clear();
+        if (removed)
+        {
+            sync_boid_columns(data);
+            data->hash_stale = true;
+        }
+    }
+
+    sim_data init_sim(ecs::world *world, u64 num_entities, float radius)
     {
 #if 0
         bool test_result = spatial_hash::test(); // Test the spatial hash function
@@ -90,41 +533,185 @@ namespace simulation
         data.time_step = 0.016f; // 60 FPS
         data.current_time = 0.0f;
         data.num_iterations = 0;
-        data.num_entities = num_entities;
-        data.components = (u64 *)malloc(sizeof(u64) * num_entities);
-        data.behaviours = (u64 *)malloc(sizeof(u64) * num_entities);
-        data.positions = (vec4 *)malloc(sizeof(vec4) * num_entities);
-        data.velocities = (vec3 *)malloc(sizeof(vec3) * num_entities);
-        // data.search_memory_pool = malloc(sizeof(vec3) * num_entities); // Allocate memory for the search pool
-        memset(data.velocities, 0, sizeof(vec3) * num_entities); // Initialize velocities to zero
-        memset(data.components, 0, sizeof(u64) * num_entities);  // Initialize components to zero
-        memset(data.behaviours, 0, sizeof(u64) * num_entities);  // Initialize behaviours to zero
-        memset(data.positions, 0, sizeof(vec4) * num_entities);  // Initialize positions to zero
-
-        distribute_boids_random(radius, &data);                                           // Distribute boids randomly in the simulation space
-        spatial_hash::init(&data.search_hash, g_cell_size, num_entities, data.positions); // Initialize the spatial hash with the positions
+        data.seed = SIM_DEFAULT_SEED;
+        data.lod_scale = 1.0f;
+
+        data.world = world;
+        data.ids.position = ecs::register_component(world, "position", sizeof(vec4));
+        data.ids.velocity = ecs::register_component(world, "velocity", sizeof(vec3));
+        data.ids.behaviour = ecs::register_component(world, "behaviour", sizeof(u64));
+        data.ids.acceleration = ecs::register_component(world, "acceleration", sizeof(vec3));
+        data.ids.species = ecs::register_component(world, "species", sizeof(u32));
+        data.boid_mask = ECS_COMPONENT_BIT(data.ids.position) | ECS_COMPONENT_BIT(data.ids.velocity) | ECS_COMPONENT_BIT(data.ids.behaviour) |
+                         ECS_COMPONENT_BIT(data.ids.acceleration) | ECS_COMPONENT_BIT(data.ids.species);
+        data.boids = ecs::get_archetype(world, data.boid_mask);
+        sync_boid_columns(&data);
+        spawn_boids(&data, (u32)num_entities, nullptr, nullptr, nullptr);
+
+        data.params = default_params();
+        data.mailbox = (param_mailbox *)malloc(sizeof(param_mailbox));
+        init_mailbox(data.mailbox);
+
+        distribute_boids_random(radius, &data);                                                         // Distribute boids randomly in the simulation space
+        spatial_hash::init(&data.search_hash, data.params.cell_size, data.num_entities, data.positions); // Initialize the spatial hash with the positions
 
         return data;
     }
 
+    // Frees the simulation's own resources. Boids belong to the world and are released with it.
     void free_sim(sim_data *data)
     {
-        free(data->components);
-        free(data->behaviours);
-        free(data->positions);
-        data->components = NULL;
+        free(data->mailbox);
+        spatial_hash::release(&data->search_hash);
+        _aligned_free(data->compact);
+        data->compact = nullptr;
+        data->compact_capacity = 0;
+        data->compact_valid = false;
+        data->verlet_offsets = std::vector<u32>();
+        data->verlet_neighbours = std::vector<u32>();
+        data->verlet_anchors = std::vector<vec3>();
+        data->verlet_task_neighbours = std::vector<std::vector<u32>>();
+        data->verlet_valid = false;
+        for (u32 s = 0; s < SIM_MAX_SPECIES; ++s)
+        {
+            spatial_hash::release(&data->species_indices[s].hash);
+        }
+        data->pending_despawns.clear();
         data->behaviours = NULL;
         data->positions = NULL;
+        data->velocities = NULL;
+        data->mailbox = NULL;
+    }
+
+    /*---- Compact state ----*/
+    static inline compact_boid encode_compact(const sim_data *data, float inv_cell_size, vec4 position, vec3 velocity, u32 species)
+    {
+        compact_boid b;
+        const float cell[3] = {(position.x - data->compact_origin.x) * inv_cell_size,
+                               (position.y - data->compact_origin.y) * inv_cell_size,
+                               (position.z - data->compact_origin.z) * inv_cell_size};
+        b.key = (uint32_t)(species & 3) << 30;
+        for (u32 axis = 0; axis < 3; ++axis)
+        {
+            const u32 c = min((u32)fmaxf(cell[axis], 0.0f), (u32)COMPACT_MAX_CELLS - 1);
+            b.offset[axis] = (uint16_t)min((u32)((cell[axis] - (float)c) * 65536.0f), (u32)65535);
+            b.key |= (uint32_t)c << (10 * axis);
+        }
+        uint16_t halves[8];
+        _mm_storeu_si128((__m128i *)halves, _mm_cvtps_ph(_mm_setr_ps(velocity.x, velocity.y, velocity.z, 0.0f), _MM_FROUND_TO_NEAREST_INT));
+        b.velocity[0] = halves[0];
+        b.velocity[1] = halves[1];
+        b.velocity[2] = halves[2];
+        return b;
+    }
+
+    static inline vec3 compact_position(const sim_data *data, const compact_boid *b)
+    {
+        const __m128i record = _mm_load_si128((const __m128i *)b);
+        const __m128i cell = _mm_and_si128(_mm_srlv_epi32(_mm_set1_epi32((int)b->key), _mm_setr_epi32(0, 10, 20, 30)),
+                                           _mm_set1_epi32(COMPACT_MAX_CELLS - 1));
+        const __m128 offset = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(record)); // Lane 3 is velocity x, unused
+        const __m128 cell_size = _mm_set1_ps(data->compact_cell_size);
+        // Cell corner and offset are summed separately, their sum would lose bits in far cells
+        __m128 p = _mm_add_ps(_mm_loadu_ps(&data->compact_origin.x), _mm_mul_ps(_mm_cvtepi32_ps(cell), cell_size));
+        p = _mm_add_ps(p, _mm_mul_ps(offset, _mm_mul_ps(cell_size, _mm_set1_ps(1.0f / 65536.0f))));
+        float out[4];
+        _mm_storeu_ps(out, p);
+        return {out[0], out[1], out[2]};
+    }
+
+    static inline vec3 compact_velocity(const compact_boid *b)
+    {
+        float out[4];
+        _mm_storeu_ps(out, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)b->velocity))); // Lane 3 is the key, unused
+        return {out[0], out[1], out[2]};
+    }
+
+    struct compact_task
+    {
+        sim_data *data;
+        u32 start;
+        u32 end;
+    };
+
+    static void compact_worker(void *task_data, u32 thread_id, mpool::memory_pool *transient_memory)
+    {
+        ZoneScoped;
+        compact_task *task = (compact_task *)task_data;
+        sim_data *data = task->data;
+        const float inv_cell_size = 1.0f / data->compact_cell_size;
+        for (u32 row = task->start; row < task->end; ++row)
+        {
+            data->compact[row] = encode_compact(data, inv_cell_size, data->positions[row], data->velocities[row], data->species[row]);
+        }
     }
 
+    // Encodes every row against the search hash grid. Call right after the hash is rebuilt.
+    static void build_compact(sim_data *data)
+    {
+        ZoneScoped;
+        data->compact_valid = false;
+        const spatial_hash::spatial_hash *hash = &data->search_hash;
+        if (!data->params.compact_state || data->num_entities == 0 || hash->num_positions != data->num_entities)
+        {
+            return;
+        }
+        if (hash->grid_size_x + 1 >= COMPACT_MAX_CELLS || hash->grid_size_y + 1 >= COMPACT_MAX_CELLS || hash->grid_size_z + 1 >= COMPACT_MAX_CELLS)
+        {
+            static bool warned = false;
+            if (!warned)
+            {
+                fprintf(stderr, "Compact state: grid exceeds %u cells per axis, using float state\n", COMPACT_MAX_CELLS - 1);
+                warned = true;
+            }
+            return;
+        }
+        if (data->compact_capacity < data->num_entities)
+        {
+            _aligned_free(data->compact);
+            data->compact_capacity = (u32)max(data->num_entities, (u64)data->compact_capacity * 3 / 2);
+            data->compact = (compact_boid *)_aligned_malloc(sizeof(compact_boid) * data->compact_capacity, 64);
+            if (!data->compact)
+            {
+                data->compact_capacity = 0;
+                return;
+            }
+        }
+        data->compact_origin = hash->domain_min;
+        data->compact_cell_size = hash->cell_size;
+
+        const u32 num_rows = (u32)data->num_entities;
+        const u32 num_tasks = min(max(thread_pool::g_thread_pool->num_threads * 4, (u32)1), (u32)thread_pool::g_thread_pool->queue_size);
+        const u32 rows_per_task = (num_rows + num_tasks - 1) / num_tasks;
+        mpool::memory_pool *memory = thread_pool::transient_memory();
+        const mpool::pool_mark mark = mpool::get_mark(memory);
+        compact_task *tasks = mpool::scratch<compact_task>(memory, num_tasks);
+        thread_pool::job job = {};
+        u32 task_count = 0;
+        for (u32 start = 0; start < num_rows; start += rows_per_task)
+        {
+            tasks[task_count] = {data, start, min(start + rows_per_task, num_rows)};
+            thread_pool::add_work(compact_worker, &tasks[task_count++], &job);
+        }
+        thread_pool::wait(&job);
+        mpool::rewind(memory, mark);
+        data->compact_valid = true;
+    }
+
+    // COMPACT reads neighbours from data->compact instead of the float rows
+    template <bool COMPACT>
     static inline void boid_process_neighbors(
         u64 entity_id,
         const sim_data *data,
+        u32 own_species,
         u32 num_neighbours,
         const u32 *neighbour_ids,
         float seek_radius,
         float flee_radius,
         float align_radius,
+        const spatial_hash::cell_aggregate *aggregates,
+        const u32 *far_cells,
+        u32 num_far_cells,
         vec3 *seek_result,
         vec3 *flee_result,
         vec3 *align_result)
@@ -153,11 +740,13 @@ namespace simulation
             // Prefetch next neighbor data to reduce cache misses
             const u32 neighbor_idx = neighbour_ids[i];
 
-            // Skip self-comparison
-            if (neighbor_idx == entity_id)
+            // Skip self-comparison, flocking only sees the boid's own species
+            const compact_boid *compact = COMPACT ? &data->compact[neighbor_idx] : nullptr;
+            const u32 neighbour_species = COMPACT ? (u32)(compact->key >> 30) : data->species[neighbor_idx];
+            if (neighbor_idx == entity_id || neighbour_species != own_species)
                 continue;
 
-            const vec3 neighbour_position = data->positions[neighbor_idx].xyz;
+            const vec3 neighbour_position = COMPACT ? compact_position(data, compact) : data->positions[neighbor_idx].xyz;
             const vec3 difference = neighbour_position - current_position;
             const float distance_squared = v3::dot(difference, difference);
 
@@ -180,12 +769,36 @@ namespace simulation
             // Calculate align behavior
             if (distance_squared > 0 && distance_squared < align_radius_sq)
             {
-                const vec3 neighbour_velocity = data->velocities[neighbor_idx];
+                const vec3 neighbour_velocity = COMPACT ? compact_velocity(compact) : data->velocities[neighbor_idx];
                 align_acc = align_acc + neighbour_velocity;
                 num_align_neighbours++;
             }
         }
 
+        // Far cells contribute as if all their boids sat at the cell centroid
+        for (u32 c = 0; c < num_far_cells; ++c)
+        {
+            const spatial_hash::cell_aggregate *agg = &aggregates[far_cells[c]];
+            if (agg->count == 0)
+            {
+                continue; // Only other species in the cell
+            }
+            const vec3 sum = {agg->sum_x, agg->sum_y, agg->sum_z};
+            const float count = (float)agg->count;
+            const vec3 difference = sum * (1.0f / count) - current_position;
+            const float distance_squared = v3::dot(difference, difference);
+            if (distance_squared < seek_radius_sq)
+            {
+                seek_acc = seek_acc + difference * count;
+                num_seek_neighbours += agg->count;
+            }
+            if (distance_squared < align_radius_sq)
+            {
+                align_acc = align_acc + vec3{agg->vel_x, agg->vel_y, agg->vel_z};
+                num_align_neighbours += agg->count;
+            }
+        }
+
         // Finalize results with safe division
         if (num_seek_neighbours > 0)
         {
@@ -215,133 +828,787 @@ namespace simulation
         }
     }
 
+    // Mesh avoidance for one packet from BVH queries: a sphere query pushes away from the closest
+    // surface, a ray along the velocity turns boids before they reach it
+    static void bvh_avoidance(const bvh::bvh *tree, bvh::packet *q, float radius, float lookahead, float strength, vec3 *push)
+    {
+        bvh::sphere_hits spheres;
+        bvh::ray_hits rays;
+        bvh::query_rays(tree, q, &rays);
+        for (u32 lane = 0; lane < q->count; ++lane)
+        {
+            q->limit[lane] = radius;
+        }
+        bvh::query_spheres(tree, q, &spheres);
+
+        for (u32 lane = 0; lane < q->count; ++lane)
+        {
+            push[lane] = {0.0f, 0.0f, 0.0f};
+            if ((spheres.hit_mask >> lane) & 1)
+            {
+                const float dist = sqrtf(spheres.dist_sq[lane]);
+                const vec3 away = {q->x[lane] - spheres.cx[lane], q->y[lane] - spheres.cy[lane], q->z[lane] - spheres.cz[lane]};
+                if (dist > 0.0f)
+                {
+                    push[lane] = push[lane] + away * (strength * (1.0f - dist / radius) / dist);
+                }
+            }
+            if (((rays.hit_mask >> lane) & 1) && lookahead > 0.0f)
+            {
+                const vec3 normal = {rays.nx[lane], rays.ny[lane], rays.nz[lane]};
+                push[lane] = push[lane] + normal * (strength * (1.0f - rays.t[lane] / lookahead));
+            }
+        }
+    }
+
+    static inline vec3 sdf_push(const sdf::samples8 *s, u32 lane, float radius, float strength)
+    {
+        const vec3 gradient = {s->gx[lane], s->gy[lane], s->gz[lane]};
+        const float length = sqrtf(v3::sq_mag(gradient));
+        if (!((s->valid_mask >> lane) & 1) || s->dist[lane] >= radius || length <= 0.0f)
+        {
+            return {0.0f, 0.0f, 0.0f};
+        }
+        // Inside the mesh the push keeps growing, up to twice the surface strength
+        return gradient * (strength * fminf(1.0f - s->dist[lane] / radius, 2.0f) / length);
+    }
+
+    // Mesh avoidance for one packet from the baked distance field: one sample at the boid and one
+    // at its lookahead point, each pushing along the field's gradient
+    static void sdf_avoidance(const sdf::sdf *field, const bvh::packet *q, float radius, float strength, vec3 *push)
+    {
+        sdf::samples8 here, ahead;
+        alignas(32) float ax[8], ay[8], az[8];
+        for (u32 lane = 0; lane < q->count; ++lane)
+        {
+            ax[lane] = q->x[lane] + q->dx[lane] * q->limit[lane];
+            ay[lane] = q->y[lane] + q->dy[lane] * q->limit[lane];
+            az[lane] = q->z[lane] + q->dz[lane] * q->limit[lane];
+        }
+        sdf::sample(field, q->x, q->y, q->z, q->count, &here);
+        sdf::sample(field, ax, ay, az, q->count, &ahead);
+        for (u32 lane = 0; lane < q->count; ++lane)
+        {
+            push[lane] = sdf_push(&here, lane, radius, strength) + sdf_push(&ahead, lane, radius, strength);
+        }
+    }
+
+    // Steering away from the obstacle mesh for rows [start_id, end_id), written to out[row - start_id].
+    // Rows not due this step (see mark_due_rows) are skipped. Boids outside the mesh's occupancy grid get zero without a query, the rest are handled in packets
+    // of 8, through the distance field when one was baked and the BVH otherwise.
+    static void mesh_avoidance_block(const sim_data *data, u32 start_id, u32 end_id, const u8 *due, vec3 *out)
+    {
+        ZoneScoped;
+        const bvh::bvh *tree = data->mesh_obstacle;
+        const sdf::sdf *field = data->mesh_sdf;
+        // Beyond the build margin the occupancy grid would miss boids, and beyond the band the field
+        // reads as far, so queries stop there
+        const float radius = fminf(data->params.mesh_avoid_distance, field ? field->band : tree->margin);
+        const float lookahead = data->params.mesh_lookahead;
+        const float strength = data->params.mesh_avoid_strength;
+
+        bvh::packet q = {};
+        u32 rows[8];
+        vec3 push[8];
+        for (u32 i = start_id; i <= end_id; ++i)
+        {
+            if (i < end_id)
+            {
+                out[i - start_id] = {0.0f, 0.0f, 0.0f};
+                const vec3 p = data->positions[i].xyz;
+                if ((data->behaviours[i] & BOID_TYPE_AVOID_MESH) && (!due || due[i - start_id]) && bvh::near_geometry(tree, p))
+                {
+                    const vec3 v = data->velocities[i];
+                    const float speed = sqrtf(v3::sq_mag(v));
+                    rows[q.count] = i;
+                    q.x[q.count] = p.x;
+                    q.y[q.count] = p.y;
+                    q.z[q.count] = p.z;
+                    q.dx[q.count] = v.x;
+                    q.dy[q.count] = v.y;
+                    q.dz[q.count] = v.z;
+                    q.limit[q.count] = speed > 0.0f ? fminf(lookahead, tree->margin / speed) : 0.0f;
+                    ++q.count;
+                }
+            }
+            if (q.count == 8 || (i == end_id && q.count > 0))
+            {
+                if (field)
+                {
+                    sdf_avoidance(field, &q, radius, strength, push);
+                }
+                else
+                {
+                    bvh_avoidance(tree, &q, radius, lookahead, strength, push);
+                }
+                for (u32 lane = 0; lane < q.count; ++lane)
+                {
+                    out[rows[lane] - start_id] = push[lane];
+                }
+                q.count = 0;
+            }
+        }
+    }
+
+    // Flees every predator within radius, closer ones weighted more, as flee does within the flock.
+    // Only the predator indices are searched. indices needs room for every boid.
+    static vec3 flee_predators(const sim_data *data, vec4 position, float radius, u32 *indices)
+    {
+        vec3 result = {0.0f, 0.0f, 0.0f};
+        u32 num_predators = 0;
+        const float radius_sq = radius * radius;
+        for (u32 s = SPECIES_PREDATOR; s < SIM_MAX_SPECIES; ++s)
+        {
+            const species_index *index = &data->species_indices[s];
+            if (index->rows.empty())
+            {
+                continue;
+            }
+            u32 count = 0;
+            spatial_hash::search(&index->hash, position, radius, indices, &count);
+            for (u32 k = 0; k < count; ++k)
+            {
+                const vec3 away = position.xyz - index->positions[indices[k]].xyz;
+                const float distance_squared = v3::dot(away, away);
+                if (distance_squared > 0.0f)
+                {
+                    result = result + away * (radius_sq / (distance_squared + 0.0001f));
+                    num_predators++;
+                }
+            }
+        }
+        return num_predators > 0 ? result * (1.0f / (float)num_predators) : result;
+    }
+
+    // Unit direction to the nearest prey within radius, zero if there is none. While Verlet lists are
+    // kept the hash holds positions up to half the skin old, so it is searched that much wider.
+    static vec3 hunt_prey(const sim_data *data, vec4 position, float radius, u32 *indices)
+    {
+        u32 count = 0;
+        const float slack = data->verlet_valid ? data->params.verlet_skin : 0.0f;
+        spatial_hash::search(&data->search_hash, position, radius + slack, indices, &count);
+        const float radius_sq = radius * radius;
+        float best = FLT_MAX;
+        vec3 direction = {0.0f, 0.0f, 0.0f};
+        for (u32 k = 0; k < count; ++k)
+        {
+            const u32 row = indices[k];
+            if (data->species[row] != SPECIES_PREY)
+            {
+                continue;
+            }
+            const vec3 difference = data->positions[row].xyz - position.xyz;
+            const float distance_squared = v3::dot(difference, difference);
+            if (distance_squared > 0.0f && distance_squared < best && distance_squared < radius_sq)
+            {
+                best = distance_squared;
+                direction = difference * (1.0f / sqrtf(distance_squared));
+            }
+        }
+        return direction;
+    }
+
+    // Marks the rows of [start_id, end_id) whose steering is evaluated this step. A boid's period grows
+    // by one every lod_step away from the focus. Its phase is its row, so boids with the same period
+    // are spread evenly over the steps. Boids that were steering hard keep updating every step.
+    static void mark_due_rows(const sim_data *data, u32 start_id, u32 end_id, u8 *due)
+    {
+        ZoneScoped;
+        const float inv_step = 1.0f / data->lod_step;
+        const u32 max_period = max(data->params.lod_max_period, (u32)1);
+        const float active_acc = data->params.lod_activity * data->params.behaviour.max_acc;
+        const float active_sq = active_acc * active_acc;
+        for (u32 i = start_id; i < end_id; ++i)
+        {
+            const float dist = sqrtf(v3::sq_mag(data->positions[i].xyz - data->lod_focus));
+            u32 period = min((u32)1 + (u32)(dist * inv_step), max_period);
+            if (v3::sq_mag(data->accelerations[i]) > active_sq)
+            {
+                period = 1;
+            }
+            due[i - start_id] = (data->lod_frame + i) % period == 0;
+        }
+    }
+
+    /*---- Verlet lists ----*/
+    // Positive floats order like their bit patterns, so the largest move is kept with an integer CAS
+    static inline void raise_max_move(sim_data *data, float moved_sq)
+    {
+        uint32_t bits;
+        memcpy(&bits, &moved_sq, sizeof(bits));
+        LONG seen = data->verlet_max_move_sq;
+        while ((LONG)bits > seen)
+        {
+            const LONG previous = InterlockedCompareExchange(&data->verlet_max_move_sq, (LONG)bits, seen);
+            if (previous == seen)
+            {
+                break;
+            }
+            seen = previous;
+        }
+    }
+
+    static inline float max_move_sq(const sim_data *data)
+    {
+        const uint32_t bits = (uint32_t)data->verlet_max_move_sq;
+        float moved_sq;
+        memcpy(&moved_sq, &bits, sizeof(moved_sq));
+        return moved_sq;
+    }
+
+    // True while the lists still hold every neighbour within the search radius: built for the current
+    // rows, with radius + skin covering the current radii, and no boid has moved half the skin since
+    static bool verlet_lists_hold(const sim_data *data)
+    {
+        const float skin = data->params.verlet_skin;
+        if (!data->verlet_valid || skin <= 0.0f || data->params.far_field_cells != 0 || data->verlet_epoch != data->population_epoch)
+        {
+            return false;
+        }
+        const behaviour_weights *b = &data->params.behaviour;
+        const float radius = fmaxf(b->seek_radius, fmaxf(b->flee_radius, b->align_radius));
+        return radius + skin <= data->verlet_radius && max_move_sq(data) <= 0.25f * skin * skin;
+    }
+
+    struct verlet_task
+    {
+        sim_data *data;
+        u32 start;
+        u32 end;
+        std::vector<u32> *neighbours; // The task's rows' lists, back to back
+        u32 base;                     // Offset of the task's first list in verlet_neighbours
+    };
+
+    static void verlet_search_worker(void *task_data, u32 thread_id, mpool::memory_pool *transient_memory)
+    {
+        ZoneScoped;
+        verlet_task *task = (verlet_task *)task_data;
+        sim_data *data = task->data;
+        u32 *found = mpool::scratch<u32>(transient_memory, data->num_entities);
+        task->neighbours->clear();
+        for (u32 row = task->start; row < task->end; ++row)
+        {
+            u32 count = 0;
+            if (data->species[row] == SPECIES_PREY)
+            {
+                spatial_hash::search(&data->search_hash, data->positions[row], data->verlet_radius, found, &count);
+                task->neighbours->insert(task->neighbours->end(), found, found + count);
+            }
+            data->verlet_offsets[row] = count; // Turned into an offset by verlet_pack_worker
+            data->verlet_anchors[row] = data->positions[row].xyz;
+        }
+    }
+
+    static void verlet_pack_worker(void *task_data, u32 thread_id, mpool::memory_pool *transient_memory)
+    {
+        ZoneScoped;
+        verlet_task *task = (verlet_task *)task_data;
+        sim_data *data = task->data;
+        u32 offset = task->base;
+        for (u32 row = task->start; row < task->end; ++row)
+        {
+            const u32 count = data->verlet_offsets[row];
+            data->verlet_offsets[row] = offset;
+            offset += count;
+        }
+        if (!task->neighbours->empty())
+        {
+            memcpy(data->verlet_neighbours.data() + task->base, task->neighbours->data(), sizeof(u32) * task->neighbours->size());
+        }
+    }
+
+    // Builds the lists from the freshly built hash: every task searches its rows into its own buffer,
+    // then the buffers are packed back to back
+    static void build_verlet_lists(sim_data *data)
+    {
+        ZoneScoped;
+        data->verlet_valid = false;
+        const float skin = data->params.verlet_skin;
+        const u32 num_rows = (u32)data->num_entities;
+        if (skin <= 0.0f || data->params.far_field_cells != 0 || num_rows == 0 || data->search_hash.num_positions != num_rows)
+        {
+            return;
+        }
+        const behaviour_weights *b = &data->params.behaviour;
+        data->verlet_radius = fmaxf(b->seek_radius, fmaxf(b->flee_radius, b->align_radius)) + skin;
+        data->verlet_offsets.resize(num_rows + 1);
+        data->verlet_anchors.resize(num_rows);
+
+        const u32 num_tasks = min(max(thread_pool::g_thread_pool->num_threads * 4, (u32)1), (u32)thread_pool::g_thread_pool->queue_size);
+        const u32 rows_per_task = (num_rows + num_tasks - 1) / num_tasks;
+        if (data->verlet_task_neighbours.size() < num_tasks)
+        {
+            data->verlet_task_neighbours.resize(num_tasks);
+        }
+        mpool::memory_pool *memory = thread_pool::transient_memory();
+        const mpool::pool_mark mark = mpool::get_mark(memory);
+        verlet_task *tasks = mpool::scratch<verlet_task>(memory, num_tasks);
+        u32 used = 0;
+        for (u32 start = 0; start < num_rows; start += rows_per_task)
+        {
+            verlet_task *task = &tasks[used];
+            task->data = data;
+            task->start = start;
+            task->end = min(start + rows_per_task, num_rows);
+            task->neighbours = &data->verlet_task_neighbours[used++];
+        }
+        thread_pool::job search_job = {};
+        for (u32 i = 0; i < used; ++i)
+        {
+            thread_pool::add_work(verlet_search_worker, &tasks[i], &search_job);
+        }
+        thread_pool::wait(&search_job);
+
+        u64 total = 0;
+        for (u32 i = 0; i < used; ++i)
+        {
+            tasks[i].base = (u32)total;
+            total += tasks[i].neighbours->size();
+        }
+        if (total > 0xFFFFFFFF)
+        {
+            fprintf(stderr, "Verlet lists: %llu neighbours overflow the offsets, searching every step\n", (unsigned long long)total);
+            mpool::rewind(memory, mark);
+            return;
+        }
+        data->verlet_neighbours.resize((size_t)total);
+        thread_pool::job pack_job = {};
+        for (u32 i = 0; i < used; ++i)
+        {
+            thread_pool::add_work(verlet_pack_worker, &tasks[i], &pack_job);
+        }
+        thread_pool::wait(&pack_job);
+        mpool::rewind(memory, mark);
+        data->verlet_offsets[num_rows] = (u32)total;
+
+        data->verlet_epoch = data->population_epoch;
+        data->verlet_max_move_sq = 0;
+        data->verlet_builds++;
+        data->verlet_valid = true;
+    }
+
     void update_sim_block(simulation::sim_data *data, float delta_time, u32 start_id, u32 end_id, mpool::memory_pool *transient_memory)
     {
         ZoneScoped;
 
-        // Pre-compute constants to avoid redundant calculations
-        const float seek_radius = 0.25f;
-        const float flee_radius = 0.15f;
-        const float align_radius = 0.25f;
-        const float min_vel_sq = g_min_vel * g_min_vel;
-        u32 *search_indices_start = (u32 *)mpool::get_bytes(transient_memory, sizeof(u32) * data->num_entities); // Allocate memory for search indices
+        // Pull the kernel configuration into locals once per block
+        const sim_params *params = &data->params;
+        const float seek_radius = params->behaviour.seek_radius;
+        const float flee_radius = params->behaviour.flee_radius;
+        const float align_radius = params->behaviour.align_radius;
+        const float seek_weight = params->behaviour.seek_weight;
+        const float flee_weight = params->behaviour.flee_weight;
+        const float align_weight = params->behaviour.align_weight;
+        const float max_vel = params->behaviour.max_vel;
+        const float min_vel = params->behaviour.min_vel;
+        const float max_acc = params->behaviour.max_acc;
+        const float min_vel_sq = min_vel * min_vel;
+        const float search_radius = fmaxf(seek_radius, fmaxf(flee_radius, align_radius));
+        const u32 num_attractors = params->num_attractors;
+        const u32 num_obstacles = params->num_obstacles;
+        const float predator_radius = params->predator_radius;
+        const float predator_flee_weight = params->predator_flee_weight;
+        const float hunt_radius = params->hunt_radius;
+        const float hunt_weight = params->hunt_weight;
+        const float predator_speed = params->predator_speed;
+        // A search can in the worst case return every boid. The thread's transient pool covers typical
+        // populations, larger flocks spill into the pool's overflow buffers.
+        u32 *search_indices_start = mpool::scratch<u32>(transient_memory, data->num_entities);
+
+        // Far field only pays off once the search reaches past the exact cells. Flee is never aggregated.
+        u32 *far_cells = nullptr;
+        u32 max_far_cells = 0;
+        const float hash_cell_size = data->search_hash.cell_size;
+        const u32 far_field_cells = params->far_field_cells ? max(params->far_field_cells, (u32)ceilf(flee_radius / hash_cell_size)) : 0;
+        const u32 reach = (u32)ceilf(search_radius / hash_cell_size);
+        if (far_field_cells > 0 && reach > far_field_cells && data->search_hash.aggregates_valid)
+        {
+            max_far_cells = (2 * reach + 1) * (2 * reach + 1) * (2 * reach + 1);
+            far_cells = mpool::scratch<u32>(transient_memory, max_far_cells);
+        }
+
+        u8 *due = nullptr;
+        if (data->lod_step > 0.0f)
+        {
+            due = mpool::scratch<u8>(transient_memory, end_id - start_id);
+            mark_due_rows(data, start_id, end_id, due);
+        }
+
+        vec3 *mesh_avoidance = nullptr;
+        if (data->mesh_obstacle && data->params.mesh_avoid_strength != 0.0f)
+        {
+            mesh_avoidance = mpool::scratch<vec3>(transient_memory, end_id - start_id);
+            mesh_avoidance_block(data, start_id, end_id, due, mesh_avoidance);
+        }
+
+        vec3 *wander = nullptr;
+        if (data->params.wander_strength != 0.0f)
+        {
+            wander = mpool::scratch<vec3>(transient_memory, end_id - start_id);
+            wander_block(data, start_id, end_id, wander);
+        }
 
         // First pass: Calculate all forces and update velocities
         // This improves cache locality by processing all entities before updating positions
         for (u32 i = start_id; i < end_id; ++i)
         {
-            const u64 entity_components = data->components[i];
-
-            // Skip entities without required components
-            if (!(entity_components & SIM_COMPONENT_SPATIAL))
-                continue;
-
             const u64 entity_behaviours = data->behaviours[i];
 
             // Skip processing if no behaviors are active
-            const u64 behavior_mask = BOID_TYPE_SEEK | BOID_TYPE_FLEE | BOID_TYPE_ALIGN;
+            const u64 behavior_mask = BOID_TYPE_SEEK | BOID_TYPE_FLEE | BOID_TYPE_ALIGN | BOID_TYPE_FLEE_PREDATORS | BOID_TYPE_HUNT | BOID_TYPE_WANDER;
             if (!(entity_behaviours & behavior_mask))
                 continue;
 
-            // Get spatial hash neighbors only once for all behaviors
-            u32 search_count = 0;
-            // u32 *search_indices = (u32 *)data->search_memory_pool;
-            // Prefetch entity position data
-            const vec4 current_position = data->positions[i];
-            u32 *search_indices = search_indices_start;
-            spatial_hash::search(&data->search_hash, current_position, seek_radius, search_indices, &search_count);
-
-            // Temporary storage for behavior results
-            vec3 seek_result = {0.0f, 0.0f, 0.0f};
-            vec3 flee_result = {0.0f, 0.0f, 0.0f};
-            vec3 align_result = {0.0f, 0.0f, 0.0f};
-
-            // Process all neighbors in a single pass if any behavior is active
-            if (entity_behaviours & behavior_mask)
-            {
-                boid_process_neighbors(
-                    i,
-                    data,
-                    search_count,
-                    search_indices,
-                    seek_radius,
-                    flee_radius,
-                    align_radius,
-                    &seek_result,
-                    &flee_result,
-                    &align_result);
-            }
-
-            // Calculate final acceleration based on active behaviors
+            // Level of detail: between updates a boid integrates its cached acceleration
             vec3 acceleration = {0.0f, 0.0f, 0.0f};
-
-            if (entity_behaviours & BOID_TYPE_SEEK)
+            if (due && !due[i - start_id])
             {
-                acceleration = acceleration + seek_result;
+                acceleration = data->accelerations[i];
             }
-
-            if (entity_behaviours & BOID_TYPE_FLEE)
+            else
             {
-                acceleration = acceleration + flee_result; // Already negated in the process function
-            }
+                // Get spatial hash neighbors only once for all behaviors
+                u32 search_count = 0;
+                // u32 *search_indices = (u32 *)data->search_memory_pool;
+                // Prefetch entity position data
+                const vec4 current_position = data->positions[i];
+                u32 *search_indices = search_indices_start;
+                u32 num_far_cells = 0;
+                const u32 own_species = data->species[i];
+                if (own_species != SPECIES_PREY && own_species < SIM_MAX_SPECIES)
+                {
+                    // Other species flock within their own index, its results map back to rows
+                    const species_index *index = &data->species_indices[own_species];
+                    spatial_hash::search(&index->hash, current_position, search_radius, search_indices, &search_count);
+                    for (u32 k = 0; k < search_count; ++k)
+                    {
+                        search_indices[k] = index->rows[search_indices[k]];
+                    }
+                }
+                else if (far_cells)
+                {
+                    spatial_hash::search_split(&data->search_hash, current_position, search_radius, far_field_cells,
+                                               search_indices, &search_count, far_cells, &num_far_cells, max_far_cells);
+                }
+                else if (data->verlet_valid)
+                {
+                    // Nobody has moved half the skin since the build, so the list still holds every
+                    // boid within search_radius
+                    const u32 first = data->verlet_offsets[i];
+                    search_indices = data->verlet_neighbours.data() + first;
+                    search_count = data->verlet_offsets[i + 1] - first;
+                }
+                else
+                {
+                    spatial_hash::search(&data->search_hash, current_position, search_radius, search_indices, &search_count);
+                }
 
-            if (entity_behaviours & BOID_TYPE_ALIGN)
-            {
-                acceleration = acceleration + align_result;
-            }
+                // Temporary storage for behavior results
+                vec3 seek_result = {0.0f, 0.0f, 0.0f};
+                vec3 flee_result = {0.0f, 0.0f, 0.0f};
+                vec3 align_result = {0.0f, 0.0f, 0.0f};
+
+                // Process all neighbors in a single pass if any behavior is active
+                if (entity_behaviours & behavior_mask)
+                {
+                    (data->compact_valid ? boid_process_neighbors<true> : boid_process_neighbors<false>)(
+                        i,
+                        data,
+                        own_species,
+                        search_count,
+                        search_indices,
+                        seek_radius,
+                        flee_radius,
+                        align_radius,
+                        data->search_hash.aggregates,
+                        far_cells,
+                        num_far_cells,
+                        &seek_result,
+                        &flee_result,
+                        &align_result);
+                }
+
+                // Calculate final acceleration based on active behaviors
+                if (entity_behaviours & BOID_TYPE_SEEK)
+                {
+                    acceleration = acceleration + seek_result * seek_weight;
+                }
+
+                if (entity_behaviours & BOID_TYPE_FLEE)
+                {
+                    acceleration = acceleration + flee_result * flee_weight; // Already negated in the process function
+                }
+
+                if (entity_behaviours & BOID_TYPE_ALIGN)
+                {
+                    acceleration = acceleration + align_result * align_weight;
+                }
+
+                // Attractors pull towards their centre while inside their radius
+                for (u32 a = 0; a < num_attractors; ++a)
+                {
+                    const attractor *attr = &params->attractors[a];
+                    const vec3 to_attractor = attr->position - current_position.xyz;
+                    const float dist_sq = v3::sq_mag(to_attractor);
+                    if (attr->radius <= 0.0f || dist_sq < attr->radius * attr->radius)
+                    {
+                        acceleration = acceleration + v3::normalize(to_attractor) * attr->strength;
+                    }
+                }
+
+                // Obstacles push out, strongest at the surface and fading to zero at twice the radius
+                for (u32 o = 0; o < num_obstacles; ++o)
+                {
+                    const obstacle *obs = &params->obstacles[o];
+                    const vec3 away = current_position.xyz - obs->position;
+                    const float dist_sq = v3::sq_mag(away);
+                    const float falloff_radius = 2.0f * obs->radius;
+                    if (dist_sq < falloff_radius * falloff_radius && dist_sq > 0.0f)
+                    {
+                        const float dist = sqrtf(dist_sq);
+                        const float falloff = fminf(1.0f, 2.0f - dist / obs->radius);
+                        acceleration = acceleration + away * (obs->strength * falloff / dist);
+                    }
+                }
 
-            // Apply acceleration limits and update velocity
-            acceleration = v3::clamp(acceleration, g_max_acc); // Clamp acceleration to max value
+                // Cross-species behaviours, each searching only the species it reacts to
+                if (entity_behaviours & BOID_TYPE_FLEE_PREDATORS)
+                {
+                    acceleration = acceleration + flee_predators(data, current_position, predator_radius, search_indices_start) * predator_flee_weight;
+                }
+                if (entity_behaviours & BOID_TYPE_HUNT)
+                {
+                    acceleration = acceleration + hunt_prey(data, current_position, hunt_radius, search_indices_start) * hunt_weight;
+                }
+
+                if (mesh_avoidance && (entity_behaviours & BOID_TYPE_AVOID_MESH))
+                {
+                    acceleration = acceleration + mesh_avoidance[i - start_id];
+                }
+
+                if (wander && (entity_behaviours & BOID_TYPE_WANDER))
+                {
+                    acceleration = acceleration + wander[i - start_id];
+                }
+
+                // Apply acceleration limits and update velocity
+                acceleration = v3::clamp(acceleration, max_acc); // Clamp acceleration to max value
+                data->accelerations[i] = acceleration;
+            }
 
             // Update velocity with acceleration
             data->velocities[i] = data->velocities[i] + acceleration * delta_time;
-            data->velocities[i] = v3::clamp(data->velocities[i], g_max_vel); // Clamp velocity to max value
+            const float boid_max_vel = data->species[i] == SPECIES_PREY ? max_vel : max_vel * predator_speed;
+            data->velocities[i] = v3::clamp(data->velocities[i], boid_max_vel); // Clamp velocity to max value
 
             // Ensure minimum velocity
             if (v3::sq_mag(data->velocities[i]) < min_vel_sq)
             {
-                data->velocities[i] = v3::normalize(data->velocities[i]) * g_min_vel;
+                data->velocities[i] = v3::normalize(data->velocities[i]) * min_vel;
             }
         }
 
         // Second pass: Update positions
         // This gives better cache coherence by separating reads and writes
+        float moved_sq = 0.0f;
         for (u32 i = start_id; i < end_id; ++i)
         {
             // Update position based on velocity
             data->positions[i].xyz = data->positions[i].xyz + data->velocities[i] * delta_time;
+            if (data->verlet_valid)
+            {
+                moved_sq = fmaxf(moved_sq, v3::sq_mag(data->positions[i].xyz - data->verlet_anchors[i]));
+            }
+        }
+        if (data->verlet_valid)
+        {
+            raise_max_move(data, moved_sq);
         }
     }
 
-    struct sim_thread_data
+    // ECS system running the boid kernel over a run of rows
+    void sim_system(ecs::chunk_view *chunk, void *user_data, u32 thread_id, mpool::memory_pool *transient_memory)
     {
-        // Thread data structure for parallel processing
-        sim_data *data;  // Pointer to the simulation data
-        u32 start_index; // Start index for the thread's work
-        u32 end_index;   // End index for the thread's work
-    };
+        ZoneScoped;
+        sim_data *data = (sim_data *)user_data;
+        update_sim_block(
+            data,
+            data->time_step,
+            chunk->start,
+            chunk->start + chunk->count,
+            transient_memory);
+    }
+
+    // Three uniform draws in [0, 1) for the boid in row at the current step, a pure function of the
+    // seed, its entity id, the step, stream and draw. draw tells several draws of one boid apart.
+    static inline vec3 random_unit3(const sim_data *data, u32 row, rng::STREAM stream, u32 draw = 0)
+    {
+        const uint32_t counter[4] = {data->boids->entity_indices[row], (uint32_t)data->num_iterations, (uint32_t)stream, draw};
+        uint32_t bits[4];
+        rng::philox(counter, rng::make_key(data->seed), bits);
+        return {rng::unit_float(bits[0]), rng::unit_float(bits[1]), rng::unit_float(bits[2])};
+    }
 
-    void sim_work_func(void *data, u32 id, mpool::memory_pool *transient_memory)
+    // Places a boid at a uniformly random point in the emitter sphere, heading outwards. emission
+    // numbers the step's emissions, so a boid recycled twice in one step lands in two places.
+    static inline void emit_boid(sim_data *data, const emitter *em, u32 row, float speed, u32 emission)
     {
+        // Direction uniform on the sphere, radius by the cube root so the volume is covered evenly
+        const vec3 u = random_unit3(data, row, rng::STREAM_EMIT, emission);
+        const float z = u.x * 2.0f - 1.0f;
+        const float ring = sqrtf(fmaxf(1.0f - z * z, 0.0f));
+        const float angle = PI(2.0f) * u.y;
+        const vec3 direction = {ring * cosf(angle), ring * sinf(angle), z};
+
+        data->positions[row].xyz = em->position + direction * (cbrtf(u.z) * em->radius);
+        data->velocities[row] = direction * speed;
+    }
 
+    // Runs the active emitters. Below max_population they spawn new boids (one batch per emitter and
+    // step), at the cap they recycle existing boids in round-robin order, teleporting them into the
+    // emitter sphere.
+    static void apply_emitters(sim_data *data, float delta_time)
+    {
         ZoneScoped;
-        sim_thread_data *thread_data = (sim_thread_data *)data;
-        update_sim_block(
-            thread_data->data,
-            thread_data->data->time_step,
-            thread_data->start_index,
-            thread_data->end_index,
-            transient_memory);
+        const sim_params *params = &data->params;
+        u32 emission = 0; // Keys the draws, see emit_boid
+        for (u32 e = 0; e < params->num_emitters; ++e)
+        {
+            const emitter *em = &params->emitters[e];
+            data->emit_accumulator += em->rate * delta_time;
+            u32 owed = (u32)data->emit_accumulator;
+            data->emit_accumulator -= (float)owed;
+
+            u32 room = params->max_population > data->num_entities ? params->max_population - (u32)data->num_entities : 0;
+            u32 spawned = 0;
+            if (room > 0 && owed > 0)
+            {
+                spawned = spawn_boids(data, min(owed, room), nullptr, nullptr, nullptr);
+                for (u32 row = (u32)data->num_entities - spawned; row < data->num_entities; ++row)
+                {
+                    emit_boid(data, em, row, params->behaviour.min_vel, emission++);
+                }
+            }
+
+            for (u32 i = spawned; i < owed && data->num_entities > 0; ++i)
+            {
+                emit_boid(data, em, data->emit_cursor++ % data->num_entities, params->behaviour.min_vel, emission++);
+            }
+            if (spawned < owed && data->num_entities > 0)
+            {
+                data->hash_stale = true; // Teleported boids are outside any Verlet list
+            }
+        }
+        if (params->num_emitters == 0)
+        {
+            data->emit_accumulator = 0.0f;
+        }
     }
 
-    void update_sim(sim_data *data, float delta_time)
+    // Step boundary: adopt any parameters published since the last step. Nothing is in flight here,
+    // so the swap needs no locks.
+    static void apply_pending_params(sim_data *data)
+    {
+        ZoneScoped;
+        float previous_cell_size = data->params.cell_size;
+        if (!consume_params(data->mailbox, &data->params))
+        {
+            return;
+        }
+        if (data->params.cell_size <= 0.0f)
+        {
+            data->params.cell_size = previous_cell_size;
+        }
+        // The hash grid is laid out for one cell size, a new one needs a rebuild before the kernel runs
+        if (data->params.cell_size != previous_cell_size)
+        {
+            data->hash_stale = true;
+        }
+    }
+
+    // Species other than the main flock are gathered into their own, much smaller, hashes
+    static void rebuild_species_indices(sim_data *data)
+    {
+        for (u32 s = SPECIES_PREDATOR; s < SIM_MAX_SPECIES; ++s)
+        {
+            data->species_indices[s].positions.clear();
+            data->species_indices[s].rows.clear();
+        }
+        for (u32 row = 0; row < data->num_entities; ++row)
+        {
+            const u32 species = data->species[row];
+            if (species != SPECIES_PREY && species < SIM_MAX_SPECIES)
+            {
+                data->species_indices[species].positions.push_back(data->positions[row]);
+                data->species_indices[species].rows.push_back(row);
+            }
+        }
+        for (u32 s = SPECIES_PREDATOR; s < SIM_MAX_SPECIES; ++s)
+        {
+            species_index *index = &data->species_indices[s];
+            if (!index->rows.empty() || index->hash.num_positions > 0)
+            {
+                spatial_hash::rebuild(&index->hash, data->params.cell_size, (u32)index->rows.size(), index->positions.data());
+            }
+        }
+    }
+
+    // Rebuilds the spatial hash over the current rows, with cell aggregates when the far field is on
+    static void rebuild_search_hash(sim_data *data)
+    {
+        spatial_hash::rebuild(&data->search_hash, data->params.cell_size, data->num_entities, data->positions);
+        rebuild_species_indices(data);
+        if (data->params.far_field_cells > 0)
+        {
+            // Only prey take the far field, the other species flock within their own indices
+            spatial_hash::build_aggregates(&data->search_hash, data->velocities, data->species, SPECIES_PREY);
+        }
+        build_compact(data);
+        build_verlet_lists(data);
+    }
+
+    // Rebuilds the hash if rows moved since it was built, or only the species indices while Verlet
+    // lists stand in for the main hash
+    void refresh_hash(sim_data *data)
+    {
+        ZoneScoped;
+        if (data->hash_stale)
+        {
+            rebuild_search_hash(data);
+            data->hash_stale = false;
+            data->species_stale = false;
+        }
+        else if (data->species_stale)
+        {
+            rebuild_species_indices(data);
+            data->species_stale = false;
+        }
+    }
+
+    // Steps the sim but leaves the trailing hash rebuild to the caller, who can overlap it with other
+    // work that only reads the stepped rows. Call refresh_hash before querying the hash.
+    void advance_sim(sim_data *data, float delta_time)
     {
         ZoneScoped;
+        apply_pending_params(data);
+        flush_despawns(data);
+        apply_emitters(data, data->time_step);
+
+        // Spawns and despawns since the last step moved rows, the hash has to index the current ones.
+        // New radii can outgrow the Verlet lists just the same.
+        if (data->verlet_valid && !verlet_lists_hold(data))
+        {
+            data->hash_stale = true;
+        }
+        refresh_hash(data);
+
         // Update simulation logic here
         data->current_time += delta_time;
         data->num_iterations++;
-        static mpool::memory_pool thread_data = mpool::allocate(MEGABYTES(1)); // Allocate memory pool for transient data
-        mpool::reset(&thread_data);                                            // Reset the memory pool for thread data
+        if (data->num_entities == 0)
+        {
+            return;
+        }
 
         // More fine-grained work distribution for better thread utilization
         const u32 hw_threads = thread_pool::g_thread_pool->num_threads;
@@ -350,58 +1617,332 @@ namespace simulation
         const u32 tasks_per_thread = 12;      // Create multiple smaller tasks per thread for better load balancing
         const u32 min_entities_per_task = 48; // Even smaller chunks for more parallel work
 
-        // Calculate maximum num_work_orders that won't exceed memory pool
-        const u32 max_tasks = thread_data.size / sizeof(sim_thread_data);
+        // Ensure we don't divide into too-small chunks
+        u32 num_entities_per_order = (u32)data->num_entities / (hw_threads * tasks_per_thread);
+        if (num_entities_per_order < min_entities_per_task)
+        {
+            num_entities_per_order = min_entities_per_task;
+        }
+
+        data->lod_step = data->params.lod_distance * data->lod_scale;
+        data->lod_frame++;
 
-        // Calculate initial work orders based on hardware threads
-        u32 num_work_orders = hw_threads * tasks_per_thread;
+        // Run the kernel as a parallel system over the boid archetype
+        LARGE_INTEGER kernel_start, kernel_end, frequency;
+        QueryPerformanceCounter(&kernel_start);
+        ecs::parallel_for(data->boids, sim_system, data, num_entities_per_order);
+        QueryPerformanceCounter(&kernel_end);
+        QueryPerformanceFrequency(&frequency);
+        data->kernel_ms = (float)(1000.0 * (double)(kernel_end.QuadPart - kernel_start.QuadPart) / (double)frequency.QuadPart);
 
-        // Don't create more tasks than we have memory for
-        num_work_orders = num_work_orders > max_tasks ? max_tasks : num_work_orders;
+        // Cost controller: shrink the LOD distance while over budget, recover towards the configured
+        // quality while under it. Bounded per step so one slow frame cannot collapse the quality.
+        if (data->params.lod_target_ms > 0.0f && data->params.lod_distance > 0.0f && data->kernel_ms > 0.0f)
+        {
+            const float ratio = fminf(fmaxf(data->params.lod_target_ms / data->kernel_ms, 0.9f), 1.05f);
+            data->lod_scale = fminf(fmaxf(data->lod_scale * ratio, 1.0f / 64.0f), 1.0f);
+        }
 
-        // Ensure we don't divide into too-small chunks
-        u32 num_entities_per_order = data->num_entities / num_work_orders;
-        if (num_entities_per_order < min_entities_per_task)
+        // The spatial hash now indexes old positions. While the Verlet lists hold it is kept, and only
+        // the compact records, which must match the rows exactly, are dropped.
+        if (verlet_lists_hold(data))
+        {
+            data->species_stale = true;
+            data->compact_valid = false;
+        }
+        else
+        {
+            data->hash_stale = true;
+        }
+    }
+
+    void update_sim(sim_data *data, float delta_time)
+    {
+        ZoneScoped;
+        advance_sim(data, delta_time);
+        refresh_hash(data); // Rebuild the spatial hash with new positions
+    }
+
+    // Times num_steps steps with each chunk of rows on the node whose workers run it, then with pages
+    // interleaved over every node, and restores local placement. Advances the sim. Call between steps.
+    void numa_report(sim_data *data, u32 num_steps)
+    {
+        ZoneScoped;
+        if (ecs::num_nodes() <= 1)
+        {
+            printf("NUMA report: the thread pool spans one node, nothing to compare\n");
+            return;
+        }
+        const ecs::PLACEMENT placements[2] = {ecs::PLACEMENT_LOCAL, ecs::PLACEMENT_INTERLEAVED};
+        const char *names[2] = {"local", "interleaved"};
+        LARGE_INTEGER frequency, start, end;
+        QueryPerformanceFrequency(&frequency);
+        for (u32 p = 0; p < 2; ++p)
         {
-            // Adjust work orders to ensure each has at least min_entities_per_task
-            num_work_orders = data->num_entities / min_entities_per_task;
-            if (num_work_orders == 0)
-                num_work_orders = 1; // Handle case with very few entities
-            num_entities_per_order = data->num_entities / num_work_orders;
+            // Placement moves the columns, the views and the hash have to follow
+            ecs::set_placement(data->world, placements[p]);
+            sync_boid_columns(data);
+            data->hash_stale = true;
+
+            double kernel_ms = 0.0;
+            QueryPerformanceCounter(&start);
+            for (u32 i = 0; i < num_steps; ++i)
+            {
+                update_sim(data, data->time_step);
+                kernel_ms += data->kernel_ms;
+            }
+            QueryPerformanceCounter(&end);
+            const double step_ms = 1000.0 * (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart / num_steps;
+            printf("NUMA report: %-11s %.3f ms per step, kernel %.3f ms (%u nodes, %llu boids)\n",
+                   names[p], step_ms, kernel_ms / num_steps, ecs::num_nodes(), (unsigned long long)data->num_entities);
+        }
+        ecs::set_placement(data->world, ecs::PLACEMENT_LOCAL);
+        sync_boid_columns(data);
+        data->hash_stale = true;
+    }
+
+    // Lists the large page pools, then times num_steps steps with the spatial hash pool on large pages
+    // and on normal pages. Advances the sim. Call between steps.
+    void memory_report(sim_data *data, u32 num_steps)
+    {
+        ZoneScoped;
+        mpool::report_pools();
+        if (!mpool::g_use_large_pages || mpool::large_page_size() == 0)
+        {
+            return;
+        }
+        const char *names[2] = {"large pages", "normal pages"};
+        for (u32 mode = 0; mode < 2; ++mode)
+        {
+            // Dropping the pool makes the next rebuild allocate it again under the current setting
+            mpool::g_use_large_pages = mode == 0;
+            mpool::deallocate(&data->search_hash.pool);
+            data->hash_stale = true;
+
+            double kernel_ms = 0.0;
+            for (u32 i = 0; i < num_steps; ++i)
+            {
+                update_sim(data, data->time_step);
+                kernel_ms += data->kernel_ms;
+            }
+            printf("Memory report: spatial hash on %-12s kernel %.3f ms per step\n", names[mode], kernel_ms / num_steps);
         }
+        mpool::g_use_large_pages = true;
+        mpool::deallocate(&data->search_hash.pool);
+        data->hash_stale = true;
+    }
 
-        // Reset work queue using lock-free implementation
-        thread_pool::reset_work();
+    // Times num_steps steps searching the hash every step, then num_steps with Verlet lists (the
+    // configured skin, or VERLET_REPORT_SKIN when none is set), and prints how often the lists were
+    // rebuilt and the speedup. Advances the sim. Call between steps.
+#define VERLET_REPORT_SKIN 0.05f
+    void verlet_report(sim_data *data, u32 num_steps)
+    {
+        ZoneScoped;
+        if (data->params.far_field_cells != 0)
+        {
+            printf("Verlet report: lists need far_field_cells = 0\n");
+            return;
+        }
+        const float configured = data->params.verlet_skin;
+        const float skins[2] = {0.0f, configured > 0.0f ? configured : VERLET_REPORT_SKIN};
+        LARGE_INTEGER frequency, start, end;
+        QueryPerformanceFrequency(&frequency);
+        double step_ms[2] = {};
+        for (u32 mode = 0; mode < 2; ++mode)
+        {
+            data->params.verlet_skin = skins[mode];
+            data->hash_stale = true;
+            const u32 builds_before = data->verlet_builds;
+            double kernel_ms = 0.0;
+            QueryPerformanceCounter(&start);
+            for (u32 i = 0; i < num_steps; ++i)
+            {
+                update_sim(data, data->time_step);
+                kernel_ms += data->kernel_ms;
+            }
+            QueryPerformanceCounter(&end);
+            step_ms[mode] = 1000.0 * (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart / num_steps;
+            if (mode == 0)
+            {
+                printf("Verlet report: hash search  %.3f ms per step, kernel %.3f ms (%llu boids)\n",
+                       step_ms[mode], kernel_ms / num_steps, (unsigned long long)data->num_entities);
+            }
+            else
+            {
+                const u32 builds = data->verlet_builds - builds_before;
+                const double lists_per_boid = data->num_entities ? (double)data->verlet_neighbours.size() / (double)data->num_entities : 0.0;
+                printf("Verlet report: skin %.3f    %.3f ms per step, kernel %.3f ms, rebuilt every %.1f steps, %.1f neighbours listed per boid\n",
+                       skins[mode], step_ms[mode], kernel_ms / num_steps, builds ? (double)num_steps / builds : (double)num_steps, lists_per_boid);
+            }
+        }
+        printf("Verlet report: speedup %.2fx\n", step_ms[1] > 0.0 ? step_ms[0] / step_ms[1] : 0.0);
+        data->params.verlet_skin = configured;
+        data->hash_stale = true;
+    }
+
+    // Compares compact state against the float path on num_samples boids spread over the flock: the
+    // position and velocity round trip over every row, and the relative error of each behaviour.
+    // Call between steps.
+    void compact_report(sim_data *data, u32 num_samples)
+    {
+        ZoneScoped;
+        const u32 previous = data->params.compact_state;
+        data->params.compact_state = 1;
+        build_compact(data);
+        data->params.compact_state = previous;
+        if (!data->compact_valid)
+        {
+            printf("Compact report: nothing to compare, the flock is empty or the grid too large\n");
+            return;
+        }
 
-        // We'll prepare all the task data first before submitting any work
-        sim_thread_data *thread_data_array = (sim_thread_data *)mpool::get_bytes(
-            &thread_data, sizeof(sim_thread_data) * num_work_orders);
+        float max_position_error = 0.0f;
+        float max_velocity_error = 0.0f;
+        for (u32 row = 0; row < data->num_entities; ++row)
+        {
+            const vec3 dp = compact_position(data, &data->compact[row]) - data->positions[row].xyz;
+            const vec3 dv = compact_velocity(&data->compact[row]) - data->velocities[row];
+            max_position_error = fmaxf(max_position_error, sqrtf(v3::sq_mag(dp)));
+            max_velocity_error = fmaxf(max_velocity_error, sqrtf(v3::sq_mag(dv)));
+        }
 
-        // Prepare all tasks without synchronization
-        for (u32 i = 0; i < num_work_orders; i++)
+        const behaviour_weights *b = &data->params.behaviour;
+        const float search_radius = fmaxf(b->seek_radius, fmaxf(b->flee_radius, b->align_radius));
+        num_samples = min(num_samples, (u32)data->num_entities);
+        std::vector<u32> indices(data->num_entities);
+        double error_sum[3] = {};
+        float error_max[3] = {};
+        u32 measured[3] = {};
+        for (u32 s = 0; s < num_samples; ++s)
         {
-            // Calculate the range for this chunk with improved work distribution
-            u32 start_idx = i * num_entities_per_order;
-            u32 end_idx = (i == num_work_orders - 1) ? data->num_entities : (i + 1) * num_entities_per_order;
+            const u32 row = (u32)((u64)s * data->num_entities / num_samples);
+            u32 count = 0;
+            spatial_hash::search(&data->search_hash, data->positions[row], search_radius, indices.data(), &count);
+            vec3 exact[3] = {};
+            vec3 compact[3] = {};
+            boid_process_neighbors<false>(row, data, data->species[row], count, indices.data(), b->seek_radius, b->flee_radius, b->align_radius,
+                                          nullptr, nullptr, 0, &exact[0], &exact[1], &exact[2]);
+            boid_process_neighbors<true>(row, data, data->species[row], count, indices.data(), b->seek_radius, b->flee_radius, b->align_radius,
+                                         nullptr, nullptr, 0, &compact[0], &compact[1], &compact[2]);
+            for (u32 k = 0; k < 3; ++k)
+            {
+                const float magnitude = sqrtf(v3::sq_mag(exact[k]));
+                if (magnitude > 1e-6f)
+                {
+                    const float error = sqrtf(v3::sq_mag(compact[k] - exact[k])) / magnitude;
+                    error_sum[k] += error;
+                    error_max[k] = fmaxf(error_max[k], error);
+                    measured[k]++;
+                }
+            }
+        }
 
-            thread_data_array[i].data = data;
-            thread_data_array[i].start_index = start_idx;
-            thread_data_array[i].end_index = end_idx;
+        printf("Compact report: %u bytes gathered per neighbour, %u in float state\n",
+               (u32)sizeof(compact_boid), (u32)(sizeof(vec4) + sizeof(vec3) + sizeof(u32)));
+        printf("Compact report: max round trip error, position %.3g, velocity %.3g\n", max_position_error, max_velocity_error);
+        const char *names[3] = {"seek", "flee", "align"};
+        for (u32 k = 0; k < 3; ++k)
+        {
+            printf("Compact report: %-5s relative error mean %.3g, max %.3g over %u boids\n",
+                   names[k], measured[k] ? error_sum[k] / measured[k] : 0.0, error_max[k], measured[k]);
         }
+        if (!previous)
+        {
+            data->compact_valid = false;
+        }
+    }
+
+    // Prints the error and cost of the far field against exact search for a range of near-cell
+    // cut-offs, measured on num_samples boids spread over the flock. Call between steps.
+    void far_field_report(sim_data *data, u32 num_samples)
+    {
+        ZoneScoped;
+        const behaviour_weights *b = &data->params.behaviour;
+        const float search_radius = fmaxf(b->seek_radius, fmaxf(b->flee_radius, b->align_radius));
+        const float cell_size = data->search_hash.cell_size;
+        const u32 reach = (u32)ceilf(search_radius / cell_size);
 
-        // Submit all work using the lock-free queue
-        for (u32 i = 0; i < num_work_orders; i++)
+        // Only prey take the far field in the kernel, so only prey are sampled
+        std::vector<u32> prey_rows;
+        for (u32 row = 0; row < data->num_entities; ++row)
         {
-            // Use lock-free queue to add work items
-            thread_pool::add_work(sim_work_func, &thread_data_array[i]);
+            if (data->species[row] == SPECIES_PREY)
+            {
+                prey_rows.push_back(row);
+            }
+        }
+        num_samples = min(num_samples, (u32)prey_rows.size());
+        if (num_samples == 0 || reach < 2)
+        {
+            printf("Far field report: nothing to compare, the search covers %u cell(s)\n", reach);
+            return;
+        }
+        if (!data->search_hash.aggregates_valid)
+        {
+            spatial_hash::build_aggregates(&data->search_hash, data->velocities, data->species, SPECIES_PREY);
         }
 
-        thread_pool::wait_for_completion();
-        // More efficient main thread participation with adaptive waiting
-        static mpool::memory_pool main_thread_memory = mpool::allocate(MEGABYTES(1));
-        mpool::reset(&main_thread_memory);
+        std::vector<u32> indices(data->num_entities);
+        std::vector<u32> far_cells((2 * reach + 1) * (2 * reach + 1) * (2 * reach + 1));
+        std::vector<vec3> exact_seek(num_samples), exact_align(num_samples);
+        LARGE_INTEGER frequency, t0, t1;
+        QueryPerformanceFrequency(&frequency);
+        const u32 stride = (u32)prey_rows.size() / num_samples;
 
-        // Rebuild the spatial hash with new positions
-        spatial_hash::rebuild(&data->search_hash, g_cell_size, data->num_entities, data->positions);
+        printf("Far field report: %u boids, search radius %.3f (%u cells)\n", num_samples, search_radius, reach);
+        printf("  near cells | us/boid | seek error | align error\n");
+        const u32 min_near = (u32)ceilf(b->flee_radius / cell_size);
+        for (u32 near_cells = 0; near_cells <= reach; ++near_cells)
+        {
+            // 0 is the exact baseline, cut-offs below the flee radius are not used by the kernel
+            if (near_cells > 0 && near_cells < max(min_near, (u32)1))
+            {
+                continue;
+            }
+            double seek_error = 0.0, seek_norm = 0.0, align_error = 0.0, align_norm = 0.0;
+            QueryPerformanceCounter(&t0);
+            for (u32 s = 0; s < num_samples; ++s)
+            {
+                const u32 row = prey_rows[s * stride];
+                u32 count = 0, num_far = 0;
+                if (near_cells == 0)
+                {
+                    spatial_hash::search(&data->search_hash, data->positions[row], search_radius, indices.data(), &count);
+                }
+                else
+                {
+                    spatial_hash::search_split(&data->search_hash, data->positions[row], search_radius, near_cells,
+                                               indices.data(), &count, far_cells.data(), &num_far, (u32)far_cells.size());
+                }
+                vec3 seek = {0.0f, 0.0f, 0.0f}, flee = {0.0f, 0.0f, 0.0f}, align = {0.0f, 0.0f, 0.0f};
+                boid_process_neighbors<false>(row, data, data->species[row], count, indices.data(), b->seek_radius, b->flee_radius, b->align_radius,
+                                              data->search_hash.aggregates, far_cells.data(), num_far, &seek, &flee, &align);
+                if (near_cells == 0)
+                {
+                    exact_seek[s] = seek;
+                    exact_align[s] = align;
+                }
+                else
+                {
+                    seek_error += sqrtf(v3::sq_mag(seek - exact_seek[s]));
+                    seek_norm += sqrtf(v3::sq_mag(exact_seek[s]));
+                    align_error += sqrtf(v3::sq_mag(align - exact_align[s]));
+                    align_norm += sqrtf(v3::sq_mag(exact_align[s]));
+                }
+            }
+            QueryPerformanceCounter(&t1);
+            const double us = 1e6 * (double)(t1.QuadPart - t0.QuadPart) / (double)frequency.QuadPart / num_samples;
+            if (near_cells == 0)
+            {
+                printf("       exact | %7.2f |          - |           -\n", us);
+            }
+            else
+            {
+                printf("  %10u | %7.2f | %9.2f%% | %10.2f%%\n", near_cells, us,
+                       seek_norm > 0.0 ? 100.0 * seek_error / seek_norm : 0.0,
+                       align_norm > 0.0 ? 100.0 * align_error / align_norm : 0.0);
+            }
+        }
     }
 };
\ No newline at end of file
@@ -0,0 +1,393 @@
+#pragma once
+#include <windows.h>
+#include "stdio.h"
+#include "string.h"
+#include "types.h"
+#include "simulation.h"
+#include "boid_thread.h"
+#include "tracy\public\tracy\Tracy.hpp"
+
+// Binary snapshots of the full simulation state.
+//
+// A snapshot is a fixed header followed by one blob per boid column. Blobs start on page boundaries
+// and hold the column exactly as it is laid out in memory, so loading is a bounds check followed by
+// straight copies out of a read-only file mapping, no parsing. Saving copies the columns into a
+// staging image on the calling thread (fast, parallel) and hands the image to a background thread
+// that writes it out, so the simulation only stalls for the copy.
+//
+// Both save and load must be called between steps.
+namespace snapshot
+{
+#define SNAPSHOT_MAGIC 0x504E5342 // "BSNP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_ALIGNMENT 4096
+
+    enum blob_id
+    {
+        BLOB_POSITIONS,
+        BLOB_VELOCITIES,
+        BLOB_BEHAVIOURS,
+        BLOB_SPECIES,
+        NUM_BLOBS
+    };
+
+    struct blob_entry
+    {
+        u32 id;
+        u32 element_size;
+        u64 offset; // From the start of the file, SNAPSHOT_ALIGNMENT aligned
+        u64 size;
+    };
+
+    struct file_header
+    {
+        u32 magic;
+        u32 version;
+        u32 header_size; // sizeof(file_header) of the writer, must match
+        u32 params_size; // sizeof(sim_params) of the writer, must match
+        u64 num_entities;
+        u64 file_size;
+
+        float current_time;
+        int num_iterations;
+        float emit_accumulator;
+        u32 emit_cursor;
+        u32 num_blobs;
+        u64 seed;
+
+        simulation::sim_params params;
+        blob_entry blobs[NUM_BLOBS];
+    };
+
+    struct writer
+    {
+        HANDLE thread;
+        volatile LONG busy; // A save is in flight, the image belongs to the writer thread
+        volatile LONG ok;   // Result of the last save
+        u8 *image;
+        u64 image_size;
+        char path[MAX_PATH];
+    };
+
+    writer g_writer = {};
+
+    /*------------------------------ Parallel copy ------------------------------*/
+    struct copy_job
+    {
+        u8 *dst;
+        const u8 *src;
+        u64 size;
+    };
+
+    static void copy_worker(void *data, u32 thread_id, mpool::memory_pool *thread_memory)
+    {
+        ZoneScoped;
+        copy_job *job = (copy_job *)data;
+        memcpy(job->dst, job->src, job->size);
+    }
+
+    // Copies the regions on the thread pool in pieces of at least 4 MB. Blocks until done.
+    static void parallel_copy(const copy_job *regions, u32 num_regions)
+    {
+        ZoneScoped;
+        const u64 MIN_PIECE = MEGABYTES(4);
+        u64 total = 0;
+        for (u32 r = 0; r < num_regions; ++r)
+        {
+            total += regions[r].size;
+        }
+        u32 max_jobs = max((u32)thread_pool::g_thread_pool->queue_size, num_regions + 1) - num_regions;
+        u64 piece = max(MIN_PIECE, (total + max_jobs - 1) / max_jobs);
+
+        mpool::memory_pool *memory = thread_pool::transient_memory();
+        const mpool::pool_mark mark = mpool::get_mark(memory);
+        copy_job *jobs = mpool::scratch<copy_job>(memory, max_jobs + num_regions);
+        u32 num_jobs = 0;
+        for (u32 r = 0; r < num_regions; ++r)
+        {
+            for (u64 offset = 0; offset < regions[r].size; offset += piece)
+            {
+                copy_job *job = &jobs[num_jobs++];
+                job->dst = regions[r].dst + offset;
+                job->src = regions[r].src + offset;
+                job->size = min(piece, regions[r].size - offset);
+            }
+        }
+
+        // A one-off stall between steps rather than per-frame work: it yields to frame batches but still
+        // runs ahead of queued background work such as trajectory compression
+        thread_pool::job job = {};
+        job.priority = thread_pool::PRIORITY_NORMAL;
+        for (u32 i = 0; i < num_jobs; ++i)
+        {
+            thread_pool::add_work(copy_worker, &jobs[i], &job);
+        }
+        thread_pool::wait(&job);
+        mpool::rewind(memory, mark);
+    }
+
+    static inline u64 align_up(u64 value, u64 alignment)
+    {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    // Fills in the blob table for a given population and returns the file size
+    static u64 layout_blobs(file_header *header, u64 num_entities)
+    {
+        const u32 element_sizes[NUM_BLOBS] = {sizeof(vec4), sizeof(vec3), sizeof(u64), sizeof(u32)};
+        u64 offset = align_up(sizeof(file_header), SNAPSHOT_ALIGNMENT);
+        for (u32 b = 0; b < NUM_BLOBS; ++b)
+        {
+            header->blobs[b].id = b;
+            header->blobs[b].element_size = element_sizes[b];
+            header->blobs[b].offset = offset;
+            header->blobs[b].size = num_entities * element_sizes[b];
+            offset = align_up(offset + header->blobs[b].size, SNAPSHOT_ALIGNMENT);
+        }
+        header->num_blobs = NUM_BLOBS;
+        return offset;
+    }
+
+    static inline void *blob_column(simulation::sim_data *data, u32 id)
+    {
+        switch (id)
+        {
+        case BLOB_POSITIONS:
+            return data->positions;
+        case BLOB_VELOCITIES:
+            return data->velocities;
+        case BLOB_BEHAVIOURS:
+            return data->behaviours;
+        case BLOB_SPECIES:
+            return data->species;
+        }
+        return nullptr;
+    }
+
+    /*------------------------------ Save ------------------------------*/
+    static DWORD WINAPI writer_thread(LPVOID param)
+    {
+        writer *w = (writer *)param;
+
+        // Write next to the target and rename over it, so a crash never leaves a torn snapshot behind
+        char temp_path[MAX_PATH + 4];
+        snprintf(temp_path, sizeof(temp_path), "%s.tmp", w->path);
+
+        bool ok = false;
+        HANDLE file = CreateFileA(temp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            ok = true;
+            const u64 MAX_WRITE = MEGABYTES(64);
+            for (u64 offset = 0; offset < w->image_size && ok; offset += MAX_WRITE)
+            {
+                DWORD to_write = (DWORD)min(MAX_WRITE, w->image_size - offset);
+                DWORD written = 0;
+                ok = WriteFile(file, w->image + offset, to_write, &written, NULL) && written == to_write;
+            }
+            CloseHandle(file);
+            ok = ok && MoveFileExA(temp_path, w->path, MOVEFILE_REPLACE_EXISTING);
+        }
+        if (!ok)
+        {
+            fprintf(stderr, "Failed to write snapshot %s (error %lu)\n", w->path, GetLastError());
+            DeleteFileA(temp_path);
+        }
+
+        _aligned_free(w->image);
+        w->image = nullptr;
+        InterlockedExchange(&w->ok, ok ? 1 : 0);
+        InterlockedExchange(&w->busy, 0);
+        return 0;
+    }
+
+    // Blocks until the in-flight save (if any) has been written. Returns the result of the last save.
+    bool wait_for_save()
+    {
+        if (g_writer.thread)
+        {
+            WaitForSingleObject(g_writer.thread, INFINITE);
+            CloseHandle(g_writer.thread);
+            g_writer.thread = NULL;
+        }
+        return g_writer.ok != 0;
+    }
+
+    // Captures the simulation state and writes it to path on a background thread. Returns false if the
+    // capture failed. Only one save is in flight at a time, a new save waits for the previous one.
+    bool save_async(simulation::sim_data *data, const char *path)
+    {
+        ZoneScoped;
+        wait_for_save();
+
+        file_header header = {};
+        header.magic = SNAPSHOT_MAGIC;
+        header.version = SNAPSHOT_VERSION;
+        header.header_size = sizeof(file_header);
+        header.params_size = sizeof(simulation::sim_params);
+        header.num_entities = data->num_entities;
+        header.current_time = data->current_time;
+        header.num_iterations = data->num_iterations;
+        header.emit_accumulator = data->emit_accumulator;
+        header.emit_cursor = data->emit_cursor;
+        header.seed = data->seed;
+        header.params = data->params;
+        header.file_size = layout_blobs(&header, data->num_entities);
+
+        u8 *image = (u8 *)_aligned_malloc(header.file_size, SNAPSHOT_ALIGNMENT);
+        if (!image)
+        {
+            fprintf(stderr, "Failed to allocate %llu bytes for snapshot\n", (unsigned long long)header.file_size);
+            return false;
+        }
+        memset(image, 0, align_up(sizeof(file_header), SNAPSHOT_ALIGNMENT));
+        memcpy(image, &header, sizeof(file_header));
+
+        copy_job regions[NUM_BLOBS];
+        for (u32 b = 0; b < NUM_BLOBS; ++b)
+        {
+            regions[b].dst = image + header.blobs[b].offset;
+            regions[b].src = (const u8 *)blob_column(data, b);
+            regions[b].size = header.blobs[b].size;
+            // Zero the alignment padding after each blob so files are reproducible
+            u64 padded = align_up(header.blobs[b].offset + header.blobs[b].size, SNAPSHOT_ALIGNMENT);
+            memset(image + header.blobs[b].offset + header.blobs[b].size, 0, padded - header.blobs[b].offset - header.blobs[b].size);
+        }
+        parallel_copy(regions, NUM_BLOBS);
+
+        g_writer.image = image;
+        g_writer.image_size = header.file_size;
+        strncpy(g_writer.path, path, sizeof(g_writer.path) - 1);
+        g_writer.path[sizeof(g_writer.path) - 1] = 0;
+        g_writer.busy = 1;
+        g_writer.thread = CreateThread(NULL, 0, writer_thread, &g_writer, 0, NULL);
+        if (!g_writer.thread)
+        {
+            fprintf(stderr, "Failed to start snapshot writer thread\n");
+            _aligned_free(image);
+            g_writer.image = nullptr;
+            g_writer.busy = 0;
+            return false;
+        }
+        return true;
+    }
+
+    /*------------------------------ Load ------------------------------*/
+    static bool validate_header(const file_header *header, u64 file_size)
+    {
+        if (header->magic != SNAPSHOT_MAGIC)
+        {
+            fprintf(stderr, "Not a snapshot file\n");
+            return false;
+        }
+        if (header->version != SNAPSHOT_VERSION)
+        {
+            fprintf(stderr, "Unsupported snapshot version %u (expected %u)\n", header->version, SNAPSHOT_VERSION);
+            return false;
+        }
+        if (header->header_size != sizeof(file_header) || header->params_size != sizeof(simulation::sim_params) ||
+            header->num_blobs != NUM_BLOBS)
+        {
+            fprintf(stderr, "Snapshot layout does not match this build\n");
+            return false;
+        }
+        if (header->file_size != file_size || header->num_entities > SIM_MAX_ENTITIES)
+        {
+            fprintf(stderr, "Snapshot is truncated or corrupt\n");
+            return false;
+        }
+
+        file_header expected = *header;
+        layout_blobs(&expected, header->num_entities);
+        for (u32 b = 0; b < NUM_BLOBS; ++b)
+        {
+            const blob_entry *blob = &header->blobs[b];
+            if (blob->id != b || blob->element_size != expected.blobs[b].element_size ||
+                blob->offset != expected.blobs[b].offset || blob->size != expected.blobs[b].size ||
+                blob->offset + blob->size > file_size)
+            {
+                fprintf(stderr, "Snapshot blob %u is corrupt\n", b);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Replaces the simulation state with the snapshot at path. The file is mapped read-only and its
+    // blobs are copied in parallel straight into the boid columns. A file that fails validation leaves
+    // the state untouched.
+    bool load(simulation::sim_data *data, const char *path)
+    {
+        ZoneScoped;
+        wait_for_save(); // Never read a file that is still being written
+
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Failed to open snapshot %s\n", path);
+            return false;
+        }
+        LARGE_INTEGER file_size = {};
+        GetFileSizeEx(file, &file_size);
+        if ((u64)file_size.QuadPart < sizeof(file_header))
+        {
+            fprintf(stderr, "Snapshot %s is too small\n", path);
+            CloseHandle(file);
+            return false;
+        }
+
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        const u8 *view = mapping ? (const u8 *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!view)
+        {
+            fprintf(stderr, "Failed to map snapshot %s\n", path);
+            if (mapping)
+            {
+                CloseHandle(mapping);
+            }
+            CloseHandle(file);
+            return false;
+        }
+
+        const file_header *header = (const file_header *)view;
+        bool ok = validate_header(header, (u64)file_size.QuadPart);
+        if (ok)
+        {
+            // Replace the population in one batch, then fill the columns from the mapping
+            ecs::clear_archetype(data->world, data->boids);
+            data->pending_despawns.clear();
+            u32 spawned = 0;
+            ecs::spawn_batch(data->world, data->boid_mask, (u32)header->num_entities, nullptr, &spawned);
+            simulation::sync_boid_columns(data);
+            ok = spawned == header->num_entities;
+            if (ok)
+            {
+                copy_job regions[NUM_BLOBS];
+                for (u32 b = 0; b < NUM_BLOBS; ++b)
+                {
+                    regions[b].dst = (u8 *)blob_column(data, b);
+                    regions[b].src = view + header->blobs[b].offset;
+                    regions[b].size = header->blobs[b].size;
+                }
+                parallel_copy(regions, NUM_BLOBS);
+
+                data->params = header->params;
+                data->current_time = header->current_time;
+                data->num_iterations = header->num_iterations;
+                data->emit_accumulator = header->emit_accumulator;
+                data->emit_cursor = header->emit_cursor;
+                data->seed = header->seed;
+            }
+            else
+            {
+                fprintf(stderr, "Could not allocate %llu boids for snapshot\n", (unsigned long long)header->num_entities);
+            }
+            data->hash_stale = true;
+        }
+
+        UnmapViewOfFile(view);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return ok;
+    }
+}
@@ -20,6 +20,16 @@
 // #define aligned_free(ptr) _aligned_free(ptr)
 namespace spatial_hash
 {
+    const u64 MAX_CELLS = 1 << 24; // Grid cells a build may use, coarser grids beyond it
+
+    // Per-cell summary used for far-field interactions
+    struct cell_aggregate
+    {
+        float sum_x, sum_y, sum_z; // Summed positions
+        u32 count;
+        float vel_x, vel_y, vel_z; // Summed velocities
+        float padding;
+    };
 
     // Spatial hash structure updated to support an arbitrary domain.
     typedef struct spatial_hash
@@ -41,6 +51,10 @@ namespace spatial_hash
         vec4 domain_min; // Minimum coordinate across all positions.
         vec4 domain_max; // Maximum coordinate across all positions.
         mpool::memory_pool pool;
+        // Cell summaries, filled by build_aggregates and invalidated by every build
+        cell_aggregate *aggregates;
+        u32 aggregates_capacity;
+        bool aggregates_valid;
     } spatial_hash;
 
     // Thread data structure for parallel computing of domain
@@ -230,12 +244,11 @@ namespace spatial_hash
             return compute_domain(num_positions, positions, out_min, out_max);
         }
 
-        // Use a std::vector so its buffer stays alive until we exit the function.
-        // *** scoped buffer lives until this function returns ***
-        static mpool::memory_pool thread_memory_pool = mpool::allocate(sizeof(compute_cell_assigments_thread_data) * actual_threads * 2);
-        mpool::reset(&thread_memory_pool);
-        compute_domain_thread_data *tdata = (compute_domain_thread_data *)mpool::get_bytes(&thread_memory_pool, sizeof(compute_domain_thread_data) * actual_threads);
+        mpool::memory_pool *memory = thread_pool::transient_memory();
+        const mpool::pool_mark mark = mpool::get_mark(memory);
+        compute_domain_thread_data *tdata = mpool::scratch<compute_domain_thread_data>(memory, actual_threads);
 
+        thread_pool::job job = {};
         for (u32 i = 0; i < actual_threads; ++i)
         {
             tdata[i].positions = positions;
@@ -243,11 +256,11 @@ namespace spatial_hash
             tdata[i].end_index = (i == actual_threads - 1)
                                      ? num_positions
                                      : (i + 1) * (num_positions / actual_threads);
-            thread_pool::add_work(compute_domain_thread_worker, &tdata[i]);
+            thread_pool::add_work(compute_domain_thread_worker, &tdata[i], &job);
         }
 
         // This must *really* wait for all threads to finish their work.
-        thread_pool::wait_for_completion();
+        thread_pool::wait(&job);
 
         // Reduce the per-thread mins/maxes into the final out_min/out_max.
         *out_min = tdata[0].local_min;
@@ -261,8 +274,7 @@ namespace spatial_hash
             out_max->y = max(out_max->y, tdata[i].local_max.y);
             out_max->z = max(out_max->z, tdata[i].local_max.z);
         }
-
-        // No free needed—vector memory is only released when we exit the function
+        mpool::rewind(memory, mark);
         return 1;
     }
 
@@ -273,10 +285,11 @@ namespace spatial_hash
         const float cell_size_multiplier = 2.0f; // Can be tuned based on density of objects
         h->cell_size = max_radius * cell_size_multiplier;
 
-        // Compute grid sizes along each axis based on the adjusted cell size
-        h->grid_size_x = (u32)(ceilf((h->domain_max.x - h->domain_min.x) / h->cell_size));
-        h->grid_size_y = (u32)(ceilf((h->domain_max.y - h->domain_min.y) / h->cell_size));
-        h->grid_size_z = (u32)(ceilf((h->domain_max.z - h->domain_min.z) / h->cell_size));
+        // Compute grid sizes along each axis based on the adjusted cell size. A flat axis (one boid, or
+        // several sharing a coordinate) still gets one cell, or the grid_size - 1 clamps wrap around.
+        h->grid_size_x = max((u32)(ceilf((h->domain_max.x - h->domain_min.x) / h->cell_size)), 1u);
+        h->grid_size_y = max((u32)(ceilf((h->domain_max.y - h->domain_min.y) / h->cell_size)), 1u);
+        h->grid_size_z = max((u32)(ceilf((h->domain_max.z - h->domain_min.z) / h->cell_size)), 1u);
     }
 
     // Compute 3D Hilbert index for 21-bit input coordinates (max 2097152 per axis)
@@ -398,7 +411,7 @@ namespace spatial_hash
         {
 
             u32 cell_id = thread_data->cell_vals[i];
-            u32 offset = InterlockedDecrement(&thread_data->cell_counts[cell_id]) + 1;
+            u32 offset = InterlockedDecrement(&thread_data->cell_counts[cell_id]);
             u32 start = thread_data->hash->cell_start[cell_id];
             thread_data->temp_position_x[start + offset] = thread_data->hash->position_x[i];
             thread_data->temp_position_y[start + offset] = thread_data->hash->position_y[i];
@@ -449,6 +462,7 @@ namespace spatial_hash
 
         u32 num_jobs = 64; // thread_pool::g_thread_pool->num_threads;
         compute_cell_countsvals_thread_data *count_job_datas = (compute_cell_countsvals_thread_data *)mpool::get_bytes(&hash->pool, sizeof(compute_cell_countsvals_thread_data) * num_jobs);
+        thread_pool::job count_job = {};
         for (int i = 0; i < num_jobs; ++i)
         {
             count_job_datas[i].hash = hash;
@@ -457,10 +471,10 @@ namespace spatial_hash
             count_job_datas[i].start_index = i * (num_positions / num_jobs);
             count_job_datas[i].end_index = (i == num_jobs - 1) ? (num_positions) : (i + 1) * (num_positions / num_jobs);
             count_job_datas[i].num_positions = num_positions;
-            thread_pool::add_work(bin_positions_countsvals_worker, &count_job_datas[i]);
+            thread_pool::add_work(bin_positions_countsvals_worker, &count_job_datas[i], &count_job);
         }
 
-        thread_pool::wait_for_completion();
+        thread_pool::wait(&count_job);
 
         for (int i = 0; i < num_cells; ++i)
         {
@@ -473,7 +487,7 @@ namespace spatial_hash
             {
 
                 u32 cell_id = cell_vals[i];
-                u32 offset = InterlockedDecrement(&cell_counts[cell_id]) + 1;
+                u32 offset = InterlockedDecrement(&cell_counts[cell_id]); // Fills the cell's slots count - 1 down to 0
                 u32 start = hash->cell_start[cell_id];
                 temp_position_x[start + offset] = hash->position_x[i];
                 temp_position_y[start + offset] = hash->position_y[i];
@@ -488,11 +502,66 @@ namespace spatial_hash
         std::swap(hash->original_ids, temp_original_ids);
     }
 
+    // Worst case pool usage of one build: the SoA positions and ids twice (binning is out of place),
+    // the per-position cell values, three per-cell arrays and the binning jobs, plus alignment slack.
+    static inline u64 required_pool_bytes(u32 num_positions, u32 num_cells)
+    {
+        return (u64)num_positions * (8 * sizeof(float) + sizeof(u32)) +
+               (u64)num_cells * 3 * sizeof(u32) +
+               64 * sizeof(compute_cell_countsvals_thread_data) +
+               KILOBYTES(4);
+    }
+
+    // Grows the pool when a build would not fit. Growth is geometric, so a steadily growing
+    // population reallocates O(log n) times and a shrinking one never does.
+    static inline bool reserve_pool(spatial_hash *hash, u64 required_bytes)
+    {
+        if (hash->pool.memory && hash->pool.size >= required_bytes)
+        {
+            return true;
+        }
+        u64 new_size = hash->pool.size + hash->pool.size / 2;
+        new_size = max(new_size, required_bytes);
+        new_size = min(new_size, (u64)0xFFFFF000); // Pool offsets are 32 bit
+        if (new_size < required_bytes)
+        {
+            fprintf(stderr, "Error: Spatial hash needs %llu bytes, more than a pool can hold\n", (unsigned long long)required_bytes);
+            return false;
+        }
+        mpool::deallocate(&hash->pool);
+        hash->pool = mpool::allocate_large((u32)new_size, "spatial hash");
+        return hash->pool.memory != NULL;
+    }
+
     static inline void build(spatial_hash *hash, float cell_size, u32 num_positions, const vec4 *initial_positions)
     {
         ZoneScoped;
         hash->cell_size = cell_size;
         hash->num_positions = num_positions;
+        hash->aggregates_valid = false;
+        if (num_positions == 0)
+        {
+            hash->grid_size_x = hash->grid_size_y = hash->grid_size_z = 0;
+            return; // Searches of an empty hash return nothing
+        }
+
+        // Size the grid first so the pool can grow before anything is carved from it
+        compute_domain_mt(num_positions, initial_positions, &hash->domain_min, &hash->domain_max);
+        set_grid_sizes(hash, cell_size);
+        // set_grid_sizes gives a flat or single boid population one cell per flat axis. A population
+        // spread far apart could instead need more cells than the u32 cell index reaches, so coarsen
+        // the grid until it fits; searches then only scan more boids per cell.
+        while ((u64)hash->grid_size_x * hash->grid_size_y * hash->grid_size_z > MAX_CELLS)
+        {
+            cell_size *= 2.0f;
+            set_grid_sizes(hash, cell_size);
+        }
+        u32 num_cells = calc_num_cells(hash, hash->grid_size_x, hash->grid_size_y, hash->grid_size_z);
+        if (!reserve_pool(hash, required_pool_bytes(num_positions, num_cells)))
+        {
+            hash->num_positions = 0;
+            return;
+        }
 
         hash->position_x = (float *)mpool::get_bytes(&hash->pool, sizeof(float) * num_positions);
         hash->position_y = (float *)mpool::get_bytes(&hash->pool, sizeof(float) * num_positions);
@@ -508,11 +577,6 @@ namespace spatial_hash
             hash->position_z[i] = initial_positions[i].z;
             hash->original_ids[i] = i;
         }
-        compute_domain_mt(num_positions, initial_positions, &hash->domain_min, &hash->domain_max);
-
-        // Compute grid sizes along each axis.
-        set_grid_sizes(hash, cell_size);
-        u32 num_cells = calc_num_cells(hash, hash->grid_size_x, hash->grid_size_y, hash->grid_size_z);
 
         // Allocate arrays for cell boundaries.
         hash->cell_start = (u32 *)mpool::get_bytes(&hash->pool, sizeof(u32) * num_cells);
@@ -554,16 +618,26 @@ namespace spatial_hash
     // The domain is computed automatically from the provided positions.
     static inline void init(spatial_hash *hash, float cell_size, u32 num_positions, const vec4 *initial_positions)
     {
-        if (!hash || cell_size <= 0.0f || num_positions == 0 || !initial_positions)
+        if (!hash || cell_size <= 0.0f || (num_positions > 0 && !initial_positions))
         {
             fprintf(stderr, "Error: Invalid parameters for spatial hash initialization\n");
             return;
         }
 
-        hash->pool = mpool::allocate(MEGABYTES(500)); // Allocate memory pool for the hash.
+        hash->pool = {}; // Sized by the first build and grown with the population
         build(hash, cell_size, num_positions, initial_positions);
     }
 
+    static inline void release(spatial_hash *hash)
+    {
+        mpool::deallocate(&hash->pool);
+        free(hash->aggregates);
+        hash->aggregates = nullptr;
+        hash->aggregates_capacity = 0;
+        hash->aggregates_valid = false;
+        hash->num_positions = 0;
+    }
+
     static inline void search(const spatial_hash *hash, vec4 position, float radius, u32 *result_indices, u32 *result_count)
     {
         if (!hash || !result_indices || !result_count || radius <= 0.0f)
@@ -573,6 +647,10 @@ namespace spatial_hash
         }
 
         *result_count = 0;
+        if (hash->num_positions == 0)
+        {
+            return;
+        }
 
         // Pre-compute these values once to avoid repeated calculations
         const float radius_sq = radius * radius;
@@ -741,6 +819,175 @@ namespace spatial_hash
         }
     }
 
+    /*---- Far field ----*/
+    struct aggregate_thread_data
+    {
+        spatial_hash *hash;
+        const vec3 *velocities; // Indexed by original id
+        const u32 *species;     // Indexed by original id, nullptr aggregates every boid
+        u32 only_species;
+        u32 start_cell;
+        u32 end_cell;
+    };
+
+    static void aggregate_worker(void *data, u32 thread_id, mpool::memory_pool *thread_memory)
+    {
+        ZoneScoped;
+        aggregate_thread_data *job = (aggregate_thread_data *)data;
+        const spatial_hash *hash = job->hash;
+        for (u32 c = job->start_cell; c < job->end_cell; ++c)
+        {
+            cell_aggregate agg = {};
+            const u32 start = hash->cell_start[c];
+            if (start != 0xFFFFFFFF)
+            {
+                const u32 end = hash->cell_end[c];
+                for (u32 i = start; i < end; ++i)
+                {
+                    const u32 id = hash->original_ids[i];
+                    if (job->species && job->species[id] != job->only_species)
+                    {
+                        continue;
+                    }
+                    const vec3 v = job->velocities[id];
+                    agg.count++;
+                    agg.sum_x += hash->position_x[i];
+                    agg.sum_y += hash->position_y[i];
+                    agg.sum_z += hash->position_z[i];
+                    agg.vel_x += v.x;
+                    agg.vel_y += v.y;
+                    agg.vel_z += v.z;
+                }
+            }
+            hash->aggregates[c] = agg;
+        }
+    }
+
+    // Fills the per-cell count, summed position and summed velocity for the current build. Call after
+    // every build that far-field searches will use; velocities are indexed like the built positions.
+    // With species set only boids of only_species are summed, cells without any keep a zero count.
+    static inline void build_aggregates(spatial_hash *hash, const vec3 *velocities, const u32 *species = nullptr, u32 only_species = 0)
+    {
+        ZoneScoped;
+        hash->aggregates_valid = false;
+        if (hash->num_positions == 0)
+        {
+            return;
+        }
+        const u32 num_cells = calc_num_cells(hash, hash->grid_size_x, hash->grid_size_y, hash->grid_size_z);
+        if (hash->aggregates_capacity < num_cells)
+        {
+            free(hash->aggregates);
+            hash->aggregates_capacity = num_cells + num_cells / 2;
+            hash->aggregates = (cell_aggregate *)malloc(sizeof(cell_aggregate) * hash->aggregates_capacity);
+            if (!hash->aggregates)
+            {
+                fprintf(stderr, "Error: Memory allocation failed for cell aggregates\n");
+                hash->aggregates_capacity = 0;
+                return;
+            }
+        }
+
+        const u32 num_jobs = min((u32)64, (u32)thread_pool::g_thread_pool->queue_size);
+        aggregate_thread_data jobs[64];
+        thread_pool::job job = {};
+        for (u32 i = 0; i < num_jobs; ++i)
+        {
+            jobs[i].hash = hash;
+            jobs[i].velocities = velocities;
+            jobs[i].species = species;
+            jobs[i].only_species = only_species;
+            jobs[i].start_cell = i * (num_cells / num_jobs);
+            jobs[i].end_cell = (i == num_jobs - 1) ? num_cells : (i + 1) * (num_cells / num_jobs);
+            thread_pool::add_work(aggregate_worker, &jobs[i], &job);
+        }
+        thread_pool::wait(&job);
+        hash->aggregates_valid = true;
+    }
+
+    // Search split into an exact near field and an aggregated far field. Boids in cells at most
+    // near_cells away (per axis) from the query cell are returned individually if within radius, as
+    // search does. Non-empty cells beyond that which overlap the radius are returned as cell indices,
+    // for the caller to use their aggregates; far_count stops at max_far. Needs build_aggregates.
+    static inline void search_split(const spatial_hash *hash, vec4 position, float radius, u32 near_cells,
+                                    u32 *result_indices, u32 *result_count, u32 *far_cells, u32 *far_count, u32 max_far)
+    {
+        *result_count = 0;
+        *far_count = 0;
+        if (hash->num_positions == 0 || radius <= 0.0f)
+        {
+            return;
+        }
+        const float radius_sq = radius * radius;
+        const float inv_cell_size = 1.0f / hash->cell_size;
+        const uivec3 centre = get_cell_coordinates(hash, position);
+        const int reach = (int)ceilf(radius * inv_cell_size);
+        const int min_x = max((int)centre.x - reach, 0), max_x = min((int)centre.x + reach, (int)hash->grid_size_x - 1);
+        const int min_y = max((int)centre.y - reach, 0), max_y = min((int)centre.y + reach, (int)hash->grid_size_y - 1);
+        const int min_z = max((int)centre.z - reach, 0), max_z = min((int)centre.z + reach, (int)hash->grid_size_z - 1);
+
+        const __m256 radius_squared = _mm256_set1_ps(radius_sq);
+        const __m256 pos_x_vec = _mm256_set1_ps(position.x);
+        const __m256 pos_y_vec = _mm256_set1_ps(position.y);
+        const __m256 pos_z_vec = _mm256_set1_ps(position.z);
+
+        for (int z = min_z; z <= max_z; ++z)
+        {
+            for (int y = min_y; y <= max_y; ++y)
+            {
+                for (int x = min_x; x <= max_x; ++x)
+                {
+                    const u32 cell_index = get_cell_index(hash, {(u32)x, (u32)y, (u32)z});
+                    const u32 start = hash->cell_start[cell_index];
+                    if (start == 0xFFFFFFFF)
+                        continue;
+                    const u32 end = hash->cell_end[cell_index];
+
+                    const int dx = abs(x - (int)centre.x), dy = abs(y - (int)centre.y), dz = abs(z - (int)centre.z);
+                    if (max(dx, max(dy, dz)) > (int)near_cells)
+                    {
+                        // Far: keep the cell if its box comes within radius
+                        const float lo_x = hash->domain_min.x + x * hash->cell_size, lo_y = hash->domain_min.y + y * hash->cell_size, lo_z = hash->domain_min.z + z * hash->cell_size;
+                        const float ex = fmaxf(fmaxf(lo_x - position.x, position.x - (lo_x + hash->cell_size)), 0.0f);
+                        const float ey = fmaxf(fmaxf(lo_y - position.y, position.y - (lo_y + hash->cell_size)), 0.0f);
+                        const float ez = fmaxf(fmaxf(lo_z - position.z, position.z - (lo_z + hash->cell_size)), 0.0f);
+                        if (ex * ex + ey * ey + ez * ez <= radius_sq && *far_count < max_far)
+                        {
+                            far_cells[(*far_count)++] = cell_index;
+                        }
+                        continue;
+                    }
+
+                    // Near: exact, as in search
+                    u32 i = start;
+                    for (; i + 8 <= end; i += 8)
+                    {
+                        const __m256 ddx = _mm256_sub_ps(_mm256_loadu_ps(&hash->position_x[i]), pos_x_vec);
+                        const __m256 ddy = _mm256_sub_ps(_mm256_loadu_ps(&hash->position_y[i]), pos_y_vec);
+                        const __m256 ddz = _mm256_sub_ps(_mm256_loadu_ps(&hash->position_z[i]), pos_z_vec);
+                        const __m256 dist_sq = _mm256_fmadd_ps(ddx, ddx, _mm256_fmadd_ps(ddy, ddy, _mm256_mul_ps(ddz, ddz)));
+                        u32 mask_bits = (u32)_mm256_movemask_ps(_mm256_cmp_ps(dist_sq, radius_squared, _CMP_LE_OQ));
+                        while (mask_bits)
+                        {
+                            result_indices[(*result_count)++] = hash->original_ids[i + _tzcnt_u32(mask_bits)];
+                            mask_bits &= mask_bits - 1;
+                        }
+                    }
+                    for (; i < end; ++i)
+                    {
+                        const float ddx = hash->position_x[i] - position.x;
+                        const float ddy = hash->position_y[i] - position.y;
+                        const float ddz = hash->position_z[i] - position.z;
+                        if (ddx * ddx + ddy * ddy + ddz * ddz <= radius_sq)
+                        {
+                            result_indices[(*result_count)++] = hash->original_ids[i];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
     // Corrected the brute-force validation logic in the test function to ensure proper comparison of distances.
     static inline int test()
     {
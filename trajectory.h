@@ -0,0 +1,1275 @@
+#pragma once
+#include <windows.h>
+#include <vector>
+#include <algorithm>
+#include <float.h>
+#include "stdio.h"
+#include "string.h"
+#include "types.h"
+#include "math_linear.h"
+#include "simulation.h"
+#include "boid_thread.h"
+#include "tracy\public\tracy\Tracy.hpp"
+
+// Streaming trajectory recorder and reader.
+//
+// Every recorded frame stores the position and velocity of every boid, quantised to 16 bits per axis:
+// positions relative to the bounding box of the group's keyframe, velocities relative to a symmetric
+// range. Boids are stored in the cell order of their keyframe position (Morton order of the quantised
+// coordinates), and that order is kept until the next keyframe.
+//  - Keyframes delta-encode each boid against its predecessor in cell order, so neighbours in space give
+//    small deltas. They also store the row of each boid so the reader can restore row order.
+//  - Other frames delta-encode each boid against itself in the previous frame.
+// Deltas are zigzagged, split into byte planes and compressed in independent blocks with an order-0 rANS
+// coder, so blocks can be decoded in parallel.
+//
+// The recorder never blocks the simulation: record_frame copies the frame into one of two slots and a
+// task on the pool's background lane encodes and writes it. If both slots are busy the frame is dropped
+// and counted.
+//
+// File layout: file_header, then one frame_header + payload per frame, then the frame index and a
+// footer. The index gives random access by keyframe; a file without a footer (e.g. after a crash) is
+// indexed by walking the frame headers.
+namespace trajectory
+{
+#define TRAJECTORY_MAGIC 0x4A525442       // "BTRJ"
+#define TRAJECTORY_FRAME_MAGIC 0x4D524642 // "BFRM"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_BLOCK_SIZE KILOBYTES(64) // Bytes of one plane coded as one independent block
+#define TRAJECTORY_BOX_MARGIN 0.25f         // Keyframe box is grown by this fraction so boids stay inside longer
+
+    enum frame_flags
+    {
+        FRAME_KEYFRAME = 1 << 0,
+    };
+
+    // Planes of one frame: 6 channels (position xyz, velocity xyz) x 2 bytes, keyframes add 4 bytes of row id
+#define TRAJECTORY_CHANNELS 6
+#define TRAJECTORY_DELTA_PLANES (TRAJECTORY_CHANNELS * 2)
+#define TRAJECTORY_KEY_PLANES (TRAJECTORY_DELTA_PLANES + 4)
+
+    struct file_header
+    {
+        u32 magic;
+        u32 version;
+        u32 keyframe_interval;
+        u32 reserved;
+    };
+
+    struct frame_header
+    {
+        u32 magic;
+        u32 flags;
+        u32 frame;
+        u32 num_entities;
+        float time;
+        float box_min[3];   // position = box_min + q / box_scale
+        float box_scale[3];
+        float vel_range;    // velocity = (q - 32768) * vel_range / 32767
+        u32 payload_size;
+    };
+
+    struct index_entry
+    {
+        u64 offset; // Of the frame_header
+        u32 frame;
+        u32 flags;
+    };
+
+    struct file_footer
+    {
+        u64 index_offset;
+        u32 num_frames;
+        u32 magic;
+    };
+
+    /*------------------------------ rANS ------------------------------*/
+    // Order-0 byte rANS with 12 bit probabilities and byte-wise renormalisation
+#define RANS_PROB_BITS 12
+#define RANS_PROB_SCALE (1 << RANS_PROB_BITS)
+#define RANS_L (1u << 23)
+
+    enum block_mode
+    {
+        BLOCK_RAW = 0,      // Stored as is
+        BLOCK_CONSTANT = 1, // Every byte has one value
+        BLOCK_RANS = 2,     // Sparse frequency table followed by the rANS stream
+    };
+
+    struct rans_table
+    {
+        u32 freq[256];
+        u32 cum[257];
+    };
+
+    // Scales a histogram to sum to RANS_PROB_SCALE, keeping every present symbol at least 1
+    static void normalise_freqs(const u32 *counts, u32 total, rans_table *table)
+    {
+        u32 sum = 0;
+        u32 largest = 0;
+        for (u32 s = 0; s < 256; ++s)
+        {
+            u32 f = counts[s] ? max(1u, (u32)(((u64)counts[s] * RANS_PROB_SCALE) / total)) : 0;
+            table->freq[s] = f;
+            sum += f;
+            if (f > table->freq[largest])
+            {
+                largest = s;
+            }
+        }
+        // Rounding leaves the sum slightly off. The most frequent symbol absorbs a deficit, an excess from
+        // rare symbols bumped to 1 is taken one at a time from whichever symbol is currently largest.
+        if (sum <= RANS_PROB_SCALE)
+        {
+            table->freq[largest] += RANS_PROB_SCALE - sum;
+        }
+        while (sum > RANS_PROB_SCALE)
+        {
+            for (u32 s = 0; s < 256; ++s)
+            {
+                if (table->freq[s] > table->freq[largest])
+                {
+                    largest = s;
+                }
+            }
+            table->freq[largest]--;
+            sum--;
+        }
+        table->cum[0] = 0;
+        for (u32 s = 0; s < 256; ++s)
+        {
+            table->cum[s + 1] = table->cum[s] + table->freq[s];
+        }
+    }
+
+    // Encodes one block, appending it to out. Picks the smallest of the three block modes.
+    static void encode_block(const u8 *data, u32 n, std::vector<u8> *out)
+    {
+        u32 counts[256] = {};
+        for (u32 i = 0; i < n; ++i)
+        {
+            counts[data[i]]++;
+        }
+        u32 num_symbols = 0;
+        for (u32 s = 0; s < 256; ++s)
+        {
+            num_symbols += counts[s] ? 1 : 0;
+        }
+
+        if (num_symbols <= 1)
+        {
+            out->push_back(BLOCK_CONSTANT);
+            out->push_back(n ? data[0] : 0);
+            return;
+        }
+
+        rans_table table;
+        normalise_freqs(counts, n, &table);
+
+        // rANS encodes back to front. A symbol never costs more than 12 bits, so 2n bytes always fit.
+        std::vector<u8> stream(2 * (size_t)n + 16);
+        u8 *end = stream.data() + stream.size();
+        u8 *ptr = end;
+        u32 x = RANS_L;
+        for (u32 i = n; i-- > 0;)
+        {
+            u32 f = table.freq[data[i]];
+            u32 x_max = ((RANS_L >> RANS_PROB_BITS) << 8) * f;
+            while (x >= x_max)
+            {
+                *--ptr = (u8)(x & 0xFF);
+                x >>= 8;
+            }
+            x = ((x / f) << RANS_PROB_BITS) + (x % f) + table.cum[data[i]];
+        }
+        ptr -= 4;
+        memcpy(ptr, &x, 4);
+        u32 stream_size = (u32)(end - ptr);
+
+        u32 table_size = 2 + num_symbols * 3;
+        if (1 + table_size + 4 + stream_size >= 1 + n)
+        {
+            out->push_back(BLOCK_RAW);
+            out->insert(out->end(), data, data + n);
+            return;
+        }
+
+        out->push_back(BLOCK_RANS);
+        out->push_back((u8)(num_symbols & 0xFF));
+        out->push_back((u8)(num_symbols >> 8));
+        for (u32 s = 0; s < 256; ++s)
+        {
+            if (table.freq[s])
+            {
+                out->push_back((u8)s);
+                out->push_back((u8)(table.freq[s] & 0xFF));
+                out->push_back((u8)(table.freq[s] >> 8));
+            }
+        }
+        u8 size_bytes[4];
+        memcpy(size_bytes, &stream_size, 4);
+        out->insert(out->end(), size_bytes, size_bytes + 4);
+        out->insert(out->end(), ptr, end);
+    }
+
+    // Decodes one block of n bytes. Returns false if the block is malformed.
+    static bool decode_block(const u8 *block, u32 block_size, u8 *out, u32 n)
+    {
+        if (block_size < 1)
+        {
+            return false;
+        }
+        const u8 *end = block + block_size;
+        switch (block[0])
+        {
+        case BLOCK_RAW:
+            if (block_size != 1 + n)
+            {
+                return false;
+            }
+            memcpy(out, block + 1, n);
+            return true;
+        case BLOCK_CONSTANT:
+            if (block_size != 2)
+            {
+                return false;
+            }
+            memset(out, block[1], n);
+            return true;
+        case BLOCK_RANS:
+            break;
+        default:
+            return false;
+        }
+
+        const u8 *ptr = block + 1;
+        if (end - ptr < 2)
+        {
+            return false;
+        }
+        u32 num_symbols = ptr[0] | (ptr[1] << 8);
+        ptr += 2;
+        if (num_symbols > 256 || end - ptr < (ptrdiff_t)(num_symbols * 3 + 4))
+        {
+            return false;
+        }
+
+        rans_table table = {};
+        for (u32 i = 0; i < num_symbols; ++i, ptr += 3)
+        {
+            table.freq[ptr[0]] = ptr[1] | (ptr[2] << 8);
+        }
+        table.cum[0] = 0;
+        u8 slot_to_symbol[RANS_PROB_SCALE];
+        for (u32 s = 0; s < 256; ++s)
+        {
+            table.cum[s + 1] = table.cum[s] + table.freq[s];
+            if (table.cum[s + 1] > RANS_PROB_SCALE)
+            {
+                return false;
+            }
+            memset(slot_to_symbol + table.cum[s], (int)s, table.freq[s]);
+        }
+        if (table.cum[256] != RANS_PROB_SCALE)
+        {
+            return false;
+        }
+
+        u32 stream_size;
+        memcpy(&stream_size, ptr, 4);
+        ptr += 4;
+        if (stream_size < 4 || (u64)(end - ptr) != stream_size)
+        {
+            return false;
+        }
+        u32 x;
+        memcpy(&x, ptr, 4);
+        ptr += 4;
+        for (u32 i = 0; i < n; ++i)
+        {
+            u32 slot = x & (RANS_PROB_SCALE - 1);
+            u8 s = slot_to_symbol[slot];
+            out[i] = s;
+            x = table.freq[s] * (x >> RANS_PROB_BITS) + slot - table.cum[s];
+            while (x < RANS_L)
+            {
+                if (ptr >= end)
+                {
+                    return false;
+                }
+                x = (x << 8) | *ptr++;
+            }
+        }
+        return true;
+    }
+
+    // Payload: block count, the size of every block, then the blocks. Each plane of n bytes is cut
+    // into TRAJECTORY_BLOCK_SIZE blocks so a decoder can spread one frame over several threads.
+    static inline u32 blocks_per_plane(u32 n)
+    {
+        return (n + TRAJECTORY_BLOCK_SIZE - 1) / TRAJECTORY_BLOCK_SIZE;
+    }
+
+    static void encode_planes(const u8 *planes, u32 num_planes, u32 n, std::vector<u8> *out)
+    {
+        ZoneScoped;
+        u32 num_blocks = num_planes * blocks_per_plane(n);
+        out->clear();
+        out->resize(4 + 4 * (size_t)num_blocks);
+        memcpy(out->data(), &num_blocks, 4);
+        u32 block = 0;
+        for (u32 p = 0; p < num_planes; ++p)
+        {
+            for (u32 start = 0; start < n; start += TRAJECTORY_BLOCK_SIZE, ++block)
+            {
+                size_t before = out->size();
+                encode_block(planes + (size_t)p * n + start, min((u32)TRAJECTORY_BLOCK_SIZE, n - start), out);
+                u32 block_size = (u32)(out->size() - before);
+                memcpy(out->data() + 4 + 4 * (size_t)block, &block_size, 4);
+            }
+        }
+    }
+
+    /*------------------------------ Quantisation ------------------------------*/
+    static inline u16 zigzag(u16 delta)
+    {
+        int16_t d = (int16_t)delta;
+        return (u16)((d << 1) ^ (d >> 15));
+    }
+
+    static inline u16 unzigzag(u16 z)
+    {
+        return (u16)((z >> 1) ^ (u16)(0 - (z & 1)));
+    }
+
+    // Spreads the low 7 bits of v three apart
+    static inline u32 part1by2_7(u32 v)
+    {
+        v &= 0x7F;
+        v = (v | (v << 8)) & 0x0F00F;
+        v = (v | (v << 4)) & 0x0C30C3;
+        v = (v | (v << 2)) & 0x249249;
+        return v;
+    }
+
+    // Morton code of the top 7 bits per axis, i.e. the boid's cell in a 128^3 grid over the box
+    static inline u32 cell_key(u16 qx, u16 qy, u16 qz)
+    {
+        return part1by2_7(qx >> 9) | (part1by2_7(qy >> 9) << 1) | (part1by2_7(qz >> 9) << 2);
+    }
+
+    static inline u16 quantise_velocity(float v, float inv_range)
+    {
+        float q = v * inv_range * 32767.0f + 32768.0f;
+        return (u16)fminf(fmaxf(q + 0.5f, 0.0f), 65535.0f);
+    }
+
+    /*------------------------------ Recorder ------------------------------*/
+    struct frame_slot
+    {
+        volatile LONG full; // Owned by the writer while set
+        u32 frame;
+        u32 num_entities;
+        u32 population_epoch;
+        float time;
+        std::vector<vec4> positions;
+        std::vector<vec3> velocities;
+    };
+
+    struct recorder
+    {
+        HANDLE file;
+        thread_pool::job job;   // The writer task, on the background lane
+        volatile LONG writing;  // Set while a writer task is queued or running, so there is at most one
+
+        frame_slot slots[2];
+        u32 write_slot; // Next slot record_frame fills
+        u32 keyframe_interval;
+        u32 next_frame;
+
+        // Writer state
+        u32 read_slot;
+        u64 file_offset;
+        u32 frames_since_keyframe;
+        u32 last_num_entities;
+        u32 last_epoch;
+        frame_header key; // Quantisation reference of the current group
+        std::vector<u32> order;   // Rows in cell order, fixed for a keyframe group
+        std::vector<u16> prev;    // Previous frame's quantised channels in cell order, channel-major
+        std::vector<u16> current; // Scratch, same layout as prev
+        std::vector<u8> planes;
+        std::vector<u8> payload;
+        std::vector<u64> sort_keys;
+        std::vector<index_entry> index;
+
+        // Stats, read by the main thread
+        volatile LONG frames_written;
+        volatile LONG frames_dropped;
+        volatile LONG64 raw_bytes;     // What the frames would take unquantised
+        volatile LONG64 written_bytes; // What was written
+    };
+
+    static bool write_bytes(recorder *rec, const void *data, u64 size)
+    {
+        const u8 *bytes = (const u8 *)data;
+        while (size > 0)
+        {
+            DWORD chunk = (DWORD)min(size, (u64)MEGABYTES(64));
+            DWORD written = 0;
+            if (!WriteFile(rec->file, bytes, chunk, &written, NULL) || written != chunk)
+            {
+                return false;
+            }
+            bytes += chunk;
+            size -= chunk;
+            rec->file_offset += chunk;
+        }
+        return true;
+    }
+
+    // Quantises a frame against the current keyframe box, in keyframe cell order. Returns false if a
+    // boid left the box or outran the velocity range, in which case a new keyframe is needed.
+    static bool quantise_frame(recorder *rec, const frame_slot *slot)
+    {
+        const u32 n = slot->num_entities;
+        const frame_header *key = &rec->key;
+        const float inv_vel_range = 1.0f / key->vel_range;
+        u16 *c = rec->current.data();
+        for (u32 i = 0; i < n; ++i)
+        {
+            u32 row = rec->order[i];
+            const vec4 p = slot->positions[row];
+            const vec3 v = slot->velocities[row];
+            float qx = (p.x - key->box_min[0]) * key->box_scale[0] + 0.5f;
+            float qy = (p.y - key->box_min[1]) * key->box_scale[1] + 0.5f;
+            float qz = (p.z - key->box_min[2]) * key->box_scale[2] + 0.5f;
+            if (qx < 0.0f || qy < 0.0f || qz < 0.0f || qx >= 65536.0f || qy >= 65536.0f || qz >= 65536.0f ||
+                fabsf(v.x) > key->vel_range || fabsf(v.y) > key->vel_range || fabsf(v.z) > key->vel_range)
+            {
+                return false;
+            }
+            c[0 * (size_t)n + i] = (u16)qx;
+            c[1 * (size_t)n + i] = (u16)qy;
+            c[2 * (size_t)n + i] = (u16)qz;
+            c[3 * (size_t)n + i] = quantise_velocity(v.x, inv_vel_range);
+            c[4 * (size_t)n + i] = quantise_velocity(v.y, inv_vel_range);
+            c[5 * (size_t)n + i] = quantise_velocity(v.z, inv_vel_range);
+        }
+        return true;
+    }
+
+    // Starts a new group: fits the box and velocity range to the frame, sorts boids into cell order
+    // and quantises them.
+    static void begin_keyframe(recorder *rec, const frame_slot *slot)
+    {
+        ZoneScoped;
+        const u32 n = slot->num_entities;
+        vec3 lo = {FLT_MAX, FLT_MAX, FLT_MAX};
+        vec3 hi = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        float vmax = 0.0f;
+        for (u32 i = 0; i < n; ++i)
+        {
+            const vec4 p = slot->positions[i];
+            const vec3 v = slot->velocities[i];
+            lo = {fminf(lo.x, p.x), fminf(lo.y, p.y), fminf(lo.z, p.z)};
+            hi = {fmaxf(hi.x, p.x), fmaxf(hi.y, p.y), fmaxf(hi.z, p.z)};
+            vmax = fmaxf(vmax, fmaxf(fabsf(v.x), fmaxf(fabsf(v.y), fabsf(v.z))));
+        }
+        if (n == 0)
+        {
+            lo = {0, 0, 0};
+            hi = {0, 0, 0};
+        }
+
+        frame_header *key = &rec->key;
+        const float lo_a[3] = {lo.x, lo.y, lo.z};
+        const float hi_a[3] = {hi.x, hi.y, hi.z};
+        for (u32 a = 0; a < 3; ++a)
+        {
+            float extent = fmaxf(hi_a[a] - lo_a[a], 1e-3f);
+            float margin = extent * TRAJECTORY_BOX_MARGIN;
+            key->box_min[a] = lo_a[a] - margin;
+            key->box_scale[a] = 65535.0f / (extent + 2.0f * margin);
+        }
+        key->vel_range = fmaxf(vmax * (1.0f + TRAJECTORY_BOX_MARGIN), 1e-6f);
+
+        // Cell order: sort rows by the Morton code of their quantised cell
+        rec->order.resize(n);
+        rec->sort_keys.resize(n);
+        for (u32 i = 0; i < n; ++i)
+        {
+            const vec4 p = slot->positions[i];
+            u16 qx = (u16)((p.x - key->box_min[0]) * key->box_scale[0] + 0.5f);
+            u16 qy = (u16)((p.y - key->box_min[1]) * key->box_scale[1] + 0.5f);
+            u16 qz = (u16)((p.z - key->box_min[2]) * key->box_scale[2] + 0.5f);
+            rec->sort_keys[i] = ((u64)cell_key(qx, qy, qz) << 32) | i;
+        }
+        std::sort(rec->sort_keys.begin(), rec->sort_keys.end());
+        for (u32 i = 0; i < n; ++i)
+        {
+            rec->order[i] = (u32)rec->sort_keys[i];
+        }
+
+        rec->current.resize((size_t)n * TRAJECTORY_CHANNELS);
+        rec->prev.resize((size_t)n * TRAJECTORY_CHANNELS);
+        quantise_frame(rec, slot); // Fits by construction
+    }
+
+    static void encode_frame(recorder *rec, const frame_slot *slot)
+    {
+        ZoneScoped;
+        const u32 n = slot->num_entities;
+        bool keyframe = rec->index.empty() ||
+                        rec->frames_since_keyframe + 1 >= rec->keyframe_interval ||
+                        n != rec->last_num_entities ||
+                        slot->population_epoch != rec->last_epoch; // Rows were reshuffled by spawn/despawn
+        if (!keyframe)
+        {
+            keyframe = !quantise_frame(rec, slot);
+        }
+        if (keyframe)
+        {
+            begin_keyframe(rec, slot);
+        }
+
+        // Deltas: keyframes against the previous boid in cell order, other frames against the previous frame
+        const u32 num_planes = keyframe ? TRAJECTORY_KEY_PLANES : TRAJECTORY_DELTA_PLANES;
+        rec->planes.resize((size_t)num_planes * n);
+        u8 *planes = rec->planes.data();
+        for (u32 c = 0; c < TRAJECTORY_CHANNELS; ++c)
+        {
+            const u16 *cur = rec->current.data() + (size_t)c * n;
+            const u16 *prev = rec->prev.data() + (size_t)c * n;
+            u8 *lo_plane = planes + (size_t)(2 * c) * n;
+            u8 *hi_plane = planes + (size_t)(2 * c + 1) * n;
+            for (u32 i = 0; i < n; ++i)
+            {
+                u16 reference = keyframe ? (i ? cur[i - 1] : 0) : prev[i];
+                u16 z = zigzag((u16)(cur[i] - reference));
+                lo_plane[i] = (u8)(z & 0xFF);
+                hi_plane[i] = (u8)(z >> 8);
+            }
+        }
+        if (keyframe)
+        {
+            for (u32 b = 0; b < 4; ++b)
+            {
+                u8 *plane = planes + (size_t)(TRAJECTORY_DELTA_PLANES + b) * n;
+                for (u32 i = 0; i < n; ++i)
+                {
+                    plane[i] = (u8)(rec->order[i] >> (8 * b));
+                }
+            }
+        }
+        rec->prev.swap(rec->current);
+
+        encode_planes(planes, num_planes, n, &rec->payload);
+
+        frame_header header = rec->key;
+        header.magic = TRAJECTORY_FRAME_MAGIC;
+        header.flags = keyframe ? FRAME_KEYFRAME : 0;
+        header.frame = slot->frame;
+        header.num_entities = n;
+        header.time = slot->time;
+        header.payload_size = (u32)rec->payload.size();
+
+        index_entry entry = {rec->file_offset, header.frame, header.flags};
+        if (!write_bytes(rec, &header, sizeof(header)) || !write_bytes(rec, rec->payload.data(), rec->payload.size()))
+        {
+            fprintf(stderr, "Trajectory write failed (error %lu)\n", GetLastError());
+            return;
+        }
+        rec->index.push_back(entry);
+
+        rec->frames_since_keyframe = keyframe ? 0 : rec->frames_since_keyframe + 1;
+        rec->last_num_entities = n;
+        rec->last_epoch = slot->population_epoch;
+        InterlockedIncrement(&rec->frames_written);
+        InterlockedAdd64(&rec->raw_bytes, (LONG64)n * (sizeof(vec4) + sizeof(vec3)));
+        InterlockedAdd64(&rec->written_bytes, (LONG64)(sizeof(header) + rec->payload.size()));
+    }
+
+    // Encodes full slots in order until none are left. Frames are delta encoded against each other, so
+    // only one writer runs at a time.
+    static void writer_worker(void *param, u32 thread_id, mpool::memory_pool *thread_memory)
+    {
+        ZoneScoped;
+        recorder *rec = (recorder *)param;
+        for (;;)
+        {
+            frame_slot *slot = &rec->slots[rec->read_slot];
+            if (slot->full)
+            {
+                encode_frame(rec, slot);
+                InterlockedExchange(&slot->full, 0);
+                rec->read_slot ^= 1;
+                continue;
+            }
+            InterlockedExchange(&rec->writing, 0);
+            // record_frame may have filled a slot after the check above and still seen writing set
+            if (!rec->slots[rec->read_slot].full || InterlockedCompareExchange(&rec->writing, 1, 0) != 0)
+            {
+                return;
+            }
+        }
+    }
+
+    static void schedule_writer(recorder *rec)
+    {
+        if (InterlockedCompareExchange(&rec->writing, 1, 0) == 0)
+        {
+            thread_pool::add_work(writer_worker, rec, &rec->job);
+        }
+    }
+
+    // Opens path for writing. Returns null on failure.
+    recorder *start_recording(const char *path, u32 keyframe_interval)
+    {
+        HANDLE file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Failed to create trajectory %s\n", path);
+            return nullptr;
+        }
+
+        recorder *rec = new recorder();
+        rec->file = file;
+        rec->keyframe_interval = max(keyframe_interval, 1u);
+        rec->job.priority = thread_pool::PRIORITY_BACKGROUND;
+
+        file_header header = {TRAJECTORY_MAGIC, TRAJECTORY_VERSION, rec->keyframe_interval, 0};
+        write_bytes(rec, &header, sizeof(header));
+        return rec;
+    }
+
+    // Hands the current frame to the writer. Never waits: if the writer is still busy with both slots
+    // the frame is dropped and counted in frames_dropped. Call between steps.
+    void record_frame(recorder *rec, const simulation::sim_data *sim)
+    {
+        ZoneScoped;
+        u32 frame = rec->next_frame++;
+        frame_slot *slot = &rec->slots[rec->write_slot];
+        if (slot->full)
+        {
+            InterlockedIncrement(&rec->frames_dropped);
+            return;
+        }
+
+        const u32 n = (u32)sim->num_entities;
+        slot->frame = frame;
+        slot->num_entities = n;
+        slot->population_epoch = sim->population_epoch;
+        slot->time = sim->current_time;
+        slot->positions.resize(n);
+        slot->velocities.resize(n);
+        memcpy(slot->positions.data(), sim->positions, sizeof(vec4) * n);
+        memcpy(slot->velocities.data(), sim->velocities, sizeof(vec3) * n);
+
+        InterlockedExchange(&slot->full, 1);
+        rec->write_slot ^= 1;
+        schedule_writer(rec);
+    }
+
+    // Flushes pending frames, writes the frame index and closes the file
+    void stop_recording(recorder *rec)
+    {
+        if (!rec)
+        {
+            return;
+        }
+        thread_pool::wait(&rec->job);
+
+        file_footer footer = {rec->file_offset, (u32)rec->index.size(), TRAJECTORY_MAGIC};
+        write_bytes(rec, rec->index.data(), sizeof(index_entry) * rec->index.size());
+        write_bytes(rec, &footer, sizeof(footer));
+        CloseHandle(rec->file);
+        delete rec;
+    }
+
+    /*------------------------------ Reader ------------------------------*/
+    struct reader
+    {
+        HANDLE file;
+        HANDLE mapping;
+        const u8 *view;
+        u64 size;
+        u32 keyframe_interval;
+        std::vector<index_entry> frames; // Every frame, in order
+    };
+
+    // Decoded state of one frame. Positions and velocities are in the recording's row order.
+    struct frame_state
+    {
+        u32 frame; // Index into reader::frames, ECS_INVALID_INDEX before the first decode
+        u32 num_entities;
+        float time;
+        std::vector<u32> order;   // Rows in cell order, from the group's keyframe
+        std::vector<u16> values;  // Quantised channels in cell order, channel-major
+        std::vector<u8> planes;   // Scratch
+        std::vector<vec4> positions;
+        std::vector<vec3> velocities;
+    };
+
+    static inline const frame_header *frame_at(const reader *r, u32 index)
+    {
+        return (const frame_header *)(r->view + r->frames[index].offset);
+    }
+
+    // Builds the frame table by walking frame headers, for files whose recorder never wrote a footer
+    static void scan_frames(reader *r)
+    {
+        u64 offset = sizeof(file_header);
+        while (offset + sizeof(frame_header) <= r->size)
+        {
+            const frame_header *header = (const frame_header *)(r->view + offset);
+            if (header->magic != TRAJECTORY_FRAME_MAGIC || offset + sizeof(frame_header) + header->payload_size > r->size)
+            {
+                break;
+            }
+            index_entry entry = {offset, header->frame, header->flags};
+            r->frames.push_back(entry);
+            offset += sizeof(frame_header) + header->payload_size;
+        }
+    }
+
+    // True when every entry of the footer's index points at a whole frame before the index. Entries are
+    // trusted by frame_at and the decoder, so a damaged or edited index is rebuilt with scan_frames.
+    static bool valid_index(const reader *r, const index_entry *entries, u32 count, u64 index_offset)
+    {
+        for (u32 i = 0; i < count; ++i)
+        {
+            const u64 offset = entries[i].offset;
+            if (offset < sizeof(file_header) || offset > index_offset || index_offset - offset < sizeof(frame_header))
+            {
+                return false;
+            }
+            const frame_header *header = (const frame_header *)(r->view + offset);
+            if (header->magic != TRAJECTORY_FRAME_MAGIC || header->payload_size > index_offset - offset - sizeof(frame_header))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Maps a recorded trajectory read-only. Returns false if it cannot be opened or is not a trajectory.
+    bool open_reader(reader *r, const char *path)
+    {
+        *r = {};
+        r->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+        if (r->file == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Failed to open trajectory %s\n", path);
+            return false;
+        }
+        LARGE_INTEGER size = {};
+        GetFileSizeEx(r->file, &size);
+        r->size = (u64)size.QuadPart;
+        r->mapping = r->size >= sizeof(file_header) ? CreateFileMappingA(r->file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+        r->view = r->mapping ? (const u8 *)MapViewOfFile(r->mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        const file_header *header = (const file_header *)r->view;
+        if (!r->view || header->magic != TRAJECTORY_MAGIC || header->version != TRAJECTORY_VERSION)
+        {
+            fprintf(stderr, "%s is not a readable trajectory\n", path);
+            if (r->view)
+            {
+                UnmapViewOfFile(r->view);
+            }
+            if (r->mapping)
+            {
+                CloseHandle(r->mapping);
+            }
+            CloseHandle(r->file);
+            *r = {};
+            return false;
+        }
+        r->keyframe_interval = header->keyframe_interval;
+
+        // Prefer the index written on close, fall back to walking the frames
+        const file_footer *footer = (const file_footer *)(r->view + r->size - sizeof(file_footer));
+        const index_entry *entries = nullptr;
+        if (r->size >= sizeof(file_header) + sizeof(file_footer) && footer->magic == TRAJECTORY_MAGIC &&
+            footer->index_offset <= r->size - sizeof(file_footer) &&
+            (u64)footer->num_frames * sizeof(index_entry) == r->size - sizeof(file_footer) - footer->index_offset)
+        {
+            entries = (const index_entry *)(r->view + footer->index_offset);
+        }
+        if (entries && valid_index(r, entries, footer->num_frames, footer->index_offset))
+        {
+            r->frames.assign(entries, entries + footer->num_frames);
+        }
+        else
+        {
+            if (entries)
+            {
+                fprintf(stderr, "%s has a damaged frame index, scanning the frames\n", path);
+            }
+            scan_frames(r);
+        }
+        return true;
+    }
+
+    void close_reader(reader *r)
+    {
+        if (r->view)
+        {
+            UnmapViewOfFile(r->view);
+            CloseHandle(r->mapping);
+            CloseHandle(r->file);
+        }
+        *r = {};
+    }
+
+    static inline u32 num_frames(const reader *r)
+    {
+        return (u32)r->frames.size();
+    }
+
+    // Index of the keyframe that starts the group containing frame
+    u32 keyframe_for(const reader *r, u32 frame)
+    {
+        while (frame > 0 && !(r->frames[frame].flags & FRAME_KEYFRAME))
+        {
+            --frame;
+        }
+        return frame;
+    }
+
+    // Decompresses every block of a frame into state->planes
+    static bool decode_planes(const frame_header *header, frame_state *state)
+    {
+        ZoneScoped;
+        const u32 n = header->num_entities;
+        const u32 num_planes = (header->flags & FRAME_KEYFRAME) ? TRAJECTORY_KEY_PLANES : TRAJECTORY_DELTA_PLANES;
+        const u8 *payload = (const u8 *)(header + 1);
+        const u8 *payload_end = payload + header->payload_size;
+        u32 num_blocks;
+        if (header->payload_size < 4)
+        {
+            return false;
+        }
+        memcpy(&num_blocks, payload, 4);
+        if (num_blocks != num_planes * blocks_per_plane(n) || header->payload_size < 4 + 4 * (u64)num_blocks)
+        {
+            return false;
+        }
+
+        state->planes.resize((size_t)num_planes * n);
+        const u8 *block = payload + 4 + 4 * (size_t)num_blocks;
+        u32 b = 0;
+        for (u32 p = 0; p < num_planes; ++p)
+        {
+            for (u32 start = 0; start < n; start += TRAJECTORY_BLOCK_SIZE, ++b)
+            {
+                u32 block_size;
+                memcpy(&block_size, payload + 4 + 4 * (size_t)b, 4);
+                if (block + block_size > payload_end ||
+                    !decode_block(block, block_size, state->planes.data() + (size_t)p * n + start, min((u32)TRAJECTORY_BLOCK_SIZE, n - start)))
+                {
+                    return false;
+                }
+                block += block_size;
+            }
+        }
+        return true;
+    }
+
+    // Applies one decoded frame on top of state (which must hold the previous frame unless this is a keyframe)
+    static bool apply_frame(const frame_header *header, frame_state *state)
+    {
+        ZoneScoped;
+        const u32 n = header->num_entities;
+        const bool keyframe = (header->flags & FRAME_KEYFRAME) != 0;
+        if (!keyframe && n != state->num_entities)
+        {
+            return false;
+        }
+        if (!decode_planes(header, state))
+        {
+            return false;
+        }
+
+        const u8 *planes = state->planes.data();
+        if (keyframe)
+        {
+            state->order.resize(n);
+            state->values.resize((size_t)n * TRAJECTORY_CHANNELS);
+            for (u32 i = 0; i < n; ++i)
+            {
+                u32 row = 0;
+                for (u32 b = 0; b < 4; ++b)
+                {
+                    row |= (u32)planes[(size_t)(TRAJECTORY_DELTA_PLANES + b) * n + i] << (8 * b);
+                }
+                if (row >= n)
+                {
+                    return false;
+                }
+                state->order[i] = row;
+            }
+        }
+
+        for (u32 c = 0; c < TRAJECTORY_CHANNELS; ++c)
+        {
+            u16 *values = state->values.data() + (size_t)c * n;
+            const u8 *lo_plane = planes + (size_t)(2 * c) * n;
+            const u8 *hi_plane = planes + (size_t)(2 * c + 1) * n;
+            u16 running = 0;
+            for (u32 i = 0; i < n; ++i)
+            {
+                u16 delta = unzigzag((u16)(lo_plane[i] | (hi_plane[i] << 8)));
+                if (keyframe)
+                {
+                    running = (u16)(running + delta);
+                    values[i] = running;
+                }
+                else
+                {
+                    values[i] = (u16)(values[i] + delta);
+                }
+            }
+        }
+
+        // Dequantise back into row order
+        state->num_entities = n;
+        state->time = header->time;
+        state->positions.resize(n);
+        state->velocities.resize(n);
+        const u16 *v = state->values.data();
+        const float vel_scale = header->vel_range / 32767.0f;
+        for (u32 i = 0; i < n; ++i)
+        {
+            u32 row = state->order[i];
+            state->positions[row] = {header->box_min[0] + v[0 * (size_t)n + i] / header->box_scale[0],
+                                     header->box_min[1] + v[1 * (size_t)n + i] / header->box_scale[1],
+                                     header->box_min[2] + v[2 * (size_t)n + i] / header->box_scale[2],
+                                     1.0f};
+            state->velocities[row] = {((float)v[3 * (size_t)n + i] - 32768.0f) * vel_scale,
+                                      ((float)v[4 * (size_t)n + i] - 32768.0f) * vel_scale,
+                                      ((float)v[5 * (size_t)n + i] - 32768.0f) * vel_scale};
+        }
+        return true;
+    }
+
+    // Decodes frame into state. Stepping forward one frame at a time is incremental, any other
+    // target decodes forward from the keyframe of its group.
+    bool decode_frame(const reader *r, u32 frame, frame_state *state)
+    {
+        ZoneScoped;
+        if (frame >= r->frames.size())
+        {
+            return false;
+        }
+        u32 start = keyframe_for(r, frame);
+        if (state->frame != ECS_INVALID_INDEX && state->frame < frame && state->frame >= start)
+        {
+            start = state->frame + 1; // Continue from the frame already decoded
+        }
+        for (u32 f = start; f <= frame; ++f)
+        {
+            if (!apply_frame(frame_at(r, f), state))
+            {
+                fprintf(stderr, "Trajectory frame %u is corrupt\n", f);
+                state->frame = ECS_INVALID_INDEX;
+                return false;
+            }
+        }
+        state->frame = frame;
+        return true;
+    }
+
+    static inline void init_frame_state(frame_state *state)
+    {
+        *state = {};
+        state->frame = ECS_INVALID_INDEX;
+    }
+
+    /*------------------------------ Playback ------------------------------*/
+    // Plays a recorded trajectory back in place of the live sim. Decoder threads work ahead of the
+    // playhead one keyframe group at a time (frames inside a group depend on each other, groups do
+    // not), filling a ring of decoded frames. The playhead only moves onto frames that are ready, so a
+    // slow disk or decoder stalls playback instead of tearing it.
+#define PLAYBACK_MEMORY_BUDGET MEGABYTES(512) // Upper bound on the decoded frame ring
+#define PLAYBACK_MIN_RING 4
+#define PLAYBACK_MAX_RING 120
+
+    struct decoded_frame
+    {
+        u32 frame;    // ECS_INVALID_INDEX while empty or being written
+        bool writing; // A decoder owns the slot
+        u32 num_entities;
+        float time;
+        std::vector<vec4> positions;
+        std::vector<vec3> velocities;
+    };
+
+    struct player
+    {
+        reader file;
+        std::vector<u32> keyframes; // Frame index of every keyframe, i.e. the first frame of every group
+
+        SRWLOCK lock; // Guards everything below
+        CONDITION_VARIABLE changed;
+        decoded_frame *ring;
+        u32 ring_size;
+        u32 playhead;   // Frame on screen
+        u32 generation; // Bumped on seek, decoders drop groups from older generations
+        u32 next_group; // Next group a decoder picks up
+        bool stop;
+
+        bool playing;
+        float speed;
+        double play_time; // Recording time the playhead is chasing
+
+        HANDLE *threads;
+        u32 num_threads;
+
+        // Throughput, summed over decoders
+        u64 frames_decoded;
+        u64 bytes_decoded; // Compressed bytes read
+        u64 decode_ticks;
+        u32 stalls; // Updates where the next frame was due but not decoded yet
+
+        // Rates over the last second, written by update_playback
+        u64 window_start;
+        u64 window_frames;
+        u64 window_bytes;
+        float decode_fps;
+        float decode_mbps; // Compressed MB/s
+    };
+
+    static inline float frame_time(const player *p, u32 frame)
+    {
+        return frame_at(&p->file, frame)->time;
+    }
+
+    static inline u64 ticks_now()
+    {
+        LARGE_INTEGER t;
+        QueryPerformanceCounter(&t);
+        return (u64)t.QuadPart;
+    }
+
+    static inline u32 group_of(const player *p, u32 frame)
+    {
+        return (u32)(std::upper_bound(p->keyframes.begin(), p->keyframes.end(), frame) - p->keyframes.begin()) - 1;
+    }
+
+    static DWORD WINAPI decoder_thread(LPVOID param)
+    {
+        player *p = (player *)param;
+        frame_state state;
+        init_frame_state(&state);
+
+        AcquireSRWLockExclusive(&p->lock);
+        while (!p->stop)
+        {
+            if (p->next_group >= p->keyframes.size() || p->keyframes[p->next_group] >= p->playhead + p->ring_size)
+            {
+                SleepConditionVariableSRW(&p->changed, &p->lock, INFINITE, 0);
+                continue;
+            }
+            const u32 generation = p->generation;
+            const u32 group = p->next_group++;
+            const u32 first = p->keyframes[group];
+            const u32 last = group + 1 < p->keyframes.size() ? p->keyframes[group + 1] : num_frames(&p->file);
+
+            for (u32 f = first; f < last; ++f)
+            {
+                decoded_frame *slot = &p->ring[f % p->ring_size];
+                while (!p->stop && generation == p->generation && (f >= p->playhead + p->ring_size || slot->writing))
+                {
+                    SleepConditionVariableSRW(&p->changed, &p->lock, INFINITE, 0);
+                }
+                if (p->stop || generation != p->generation)
+                {
+                    break;
+                }
+                // Frames behind the playhead are still decoded, the rest of the group is delta-coded on them
+                const bool store = f >= p->playhead && slot->frame != f;
+                if (store)
+                {
+                    slot->writing = true;
+                    slot->frame = ECS_INVALID_INDEX;
+                }
+                ReleaseSRWLockExclusive(&p->lock);
+
+                u64 start = ticks_now();
+                const frame_header *header = frame_at(&p->file, f);
+                bool ok = apply_frame(header, &state);
+                if (ok && store)
+                {
+                    // apply_frame rewrites positions and velocities in full, so the buffers can be traded
+                    slot->positions.swap(state.positions);
+                    slot->velocities.swap(state.velocities);
+                    slot->num_entities = state.num_entities;
+                    slot->time = state.time;
+                }
+                u64 elapsed = ticks_now() - start;
+
+                AcquireSRWLockExclusive(&p->lock);
+                if (store)
+                {
+                    slot->writing = false;
+                    slot->frame = ok ? f : ECS_INVALID_INDEX;
+                }
+                p->frames_decoded++;
+                p->bytes_decoded += sizeof(frame_header) + header->payload_size;
+                p->decode_ticks += elapsed;
+                WakeAllConditionVariable(&p->changed);
+                if (!ok)
+                {
+                    fprintf(stderr, "Trajectory frame %u is corrupt, playback stops there\n", f);
+                    break;
+                }
+            }
+        }
+        ReleaseSRWLockExclusive(&p->lock);
+        return 0;
+    }
+
+    // Opens a recording for playback with num_decoders decoder threads. Returns null on failure.
+    player *start_playback(const char *path, u32 num_decoders)
+    {
+        player *p = new player();
+        if (!open_reader(&p->file, path) || num_frames(&p->file) == 0 || !(p->file.frames[0].flags & FRAME_KEYFRAME))
+        {
+            fprintf(stderr, "Nothing to play back in %s\n", path);
+            close_reader(&p->file);
+            delete p;
+            return nullptr;
+        }
+        u32 max_entities = 0;
+        for (u32 f = 0; f < num_frames(&p->file); ++f)
+        {
+            if (p->file.frames[f].flags & FRAME_KEYFRAME)
+            {
+                p->keyframes.push_back(f);
+            }
+            max_entities = max(max_entities, frame_at(&p->file, f)->num_entities);
+        }
+
+        u64 frame_bytes = max((u64)max_entities * (sizeof(vec4) + sizeof(vec3)), (u64)1);
+        p->ring_size = (u32)min(max((u64)PLAYBACK_MEMORY_BUDGET / frame_bytes, (u64)PLAYBACK_MIN_RING), (u64)PLAYBACK_MAX_RING);
+        p->ring = new decoded_frame[p->ring_size];
+        for (u32 i = 0; i < p->ring_size; ++i)
+        {
+            p->ring[i].frame = ECS_INVALID_INDEX;
+        }
+        InitializeSRWLock(&p->lock);
+        InitializeConditionVariable(&p->changed);
+        p->speed = 1.0f;
+        p->playing = true;
+        p->play_time = frame_time(p, 0);
+        p->window_start = ticks_now();
+
+        p->num_threads = max(num_decoders, 1u);
+        p->threads = new HANDLE[p->num_threads];
+        for (u32 i = 0; i < p->num_threads; ++i)
+        {
+            p->threads[i] = CreateThread(NULL, 0, decoder_thread, p, 0, NULL);
+        }
+        return p;
+    }
+
+    void stop_playback(player *p)
+    {
+        if (!p)
+        {
+            return;
+        }
+        AcquireSRWLockExclusive(&p->lock);
+        p->stop = true;
+        WakeAllConditionVariable(&p->changed);
+        ReleaseSRWLockExclusive(&p->lock);
+        for (u32 i = 0; i < p->num_threads; ++i)
+        {
+            if (p->threads[i])
+            {
+                WaitForSingleObject(p->threads[i], INFINITE);
+                CloseHandle(p->threads[i]);
+            }
+        }
+        delete[] p->threads;
+        delete[] p->ring;
+        close_reader(&p->file);
+        delete p;
+    }
+
+    // Moves the playhead to frame. Decoding restarts from the keyframe of its group.
+    void seek(player *p, u32 frame)
+    {
+        frame = min(frame, num_frames(&p->file) - 1);
+        AcquireSRWLockExclusive(&p->lock);
+        p->playhead = frame;
+        p->play_time = frame_time(p, frame);
+        p->generation++;
+        p->next_group = group_of(p, frame);
+        WakeAllConditionVariable(&p->changed);
+        ReleaseSRWLockExclusive(&p->lock);
+    }
+
+    // Seeks to the keyframe step groups away from the playhead's group (step < 0 goes back)
+    void seek_keyframe(player *p, int step)
+    {
+        int group = (int)group_of(p, p->playhead) + step;
+        group = max(0, min(group, (int)p->keyframes.size() - 1));
+        seek(p, p->keyframes[group]);
+    }
+
+    // Advances the playhead by dt of recording time and returns the frame to draw, or null if it is
+    // not decoded yet. The frame stays valid until the next update_playback or seek.
+    const decoded_frame *update_playback(player *p, float dt)
+    {
+        ZoneScoped;
+        const u32 count = num_frames(&p->file);
+        AcquireSRWLockExclusive(&p->lock);
+        if (p->playing)
+        {
+            p->play_time += dt * p->speed;
+            u32 moved = 0;
+            while (p->playhead + 1 < count && frame_time(p, p->playhead + 1) <= p->play_time)
+            {
+                const decoded_frame *next = &p->ring[(p->playhead + 1) % p->ring_size];
+                if (next->frame != p->playhead + 1)
+                {
+                    // Hold on the current frame rather than run the clock ahead of the decoders
+                    p->stalls++;
+                    p->play_time = frame_time(p, p->playhead + 1);
+                    break;
+                }
+                p->playhead++;
+                moved++;
+            }
+            if (p->playhead + 1 >= count)
+            {
+                p->playing = false;
+            }
+            if (moved)
+            {
+                WakeAllConditionVariable(&p->changed);
+            }
+        }
+        const decoded_frame *slot = &p->ring[p->playhead % p->ring_size];
+        const decoded_frame *result = slot->frame == p->playhead ? slot : nullptr;
+
+        u64 frequency = 1;
+        LARGE_INTEGER f;
+        if (QueryPerformanceFrequency(&f))
+        {
+            frequency = (u64)f.QuadPart;
+        }
+        u64 now = ticks_now();
+        if (now - p->window_start >= frequency)
+        {
+            double seconds = (double)(now - p->window_start) / (double)frequency;
+            p->decode_fps = (float)((p->frames_decoded - p->window_frames) / seconds);
+            p->decode_mbps = (float)((p->bytes_decoded - p->window_bytes) / seconds / MEGABYTES(1));
+            p->window_start = now;
+            p->window_frames = p->frames_decoded;
+            p->window_bytes = p->bytes_decoded;
+        }
+        ReleaseSRWLockExclusive(&p->lock);
+        return result;
+    }
+}